@@ -0,0 +1,172 @@
+/*
+ * Region allocator for memory that lives as long as a session or one
+ * of its transactions.
+ *
+ * An arena hands out memory from large blocks by moving an offset, and
+ * only frees all of it at once: either everything allocated after a
+ * mark (the end of a transaction) or the whole arena (the end of the
+ * session). The arena itself lives at the start of its first block.
+ *
+ * Freed blocks are kept in a cache of the process, up to
+ * ARENA_CACHE_SIZE bytes, and reused by the next arenas. Each worker
+ * is a single-threaded process with its own cache, so sessions of the
+ * same size take the blocks of earlier sessions and, once the cache
+ * is warm, never call malloc.
+ */
+
+#include "arena.h"
+
+#include <stdlib.h>
+
+#define ARENA_BLOCK_SIZE 16384          // minimum size of a block
+#define ARENA_ALIGN 16                  // alignment of all allocations
+#define ARENA_CACHE_SIZE (8 << 20)      // bytes of free blocks kept for reuse
+#define ARENA_CACHE_SCAN 8              // free blocks looked at before calling malloc
+
+#define ALIGN(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define BLOCK_HEADER ALIGN(sizeof(struct arena_block))
+#define BLOCK_DATA(b) ((char *)(b) + BLOCK_HEADER)
+
+struct arena_block {
+    struct arena_block *next;  // previous block of the arena, or next free block
+    size_t size;               // bytes available after the header
+};
+
+struct arena {
+    struct arena_block *block;  // block allocations are taken from
+    size_t used;                // bytes used in that block
+};
+
+static struct arena_block *free_blocks = NULL;
+static size_t free_size = 0;
+
+/** Internal function that returns a block of at least size bytes, from
+ *  the cache if one is large enough without being twice as large.
+ */
+static struct arena_block *get_block(size_t size) {
+    struct arena_block **p = &free_blocks, *b;
+
+    for (int i = 0; *p && i < ARENA_CACHE_SCAN; i++, p = &(*p)->next) {
+        if ((*p)->size >= size && (*p)->size / 2 <= size) {
+            b = *p;
+            *p = b->next;
+            free_size -= b->size;
+            return b;
+        }
+    }
+
+    if (!(b = malloc(BLOCK_HEADER + size)))
+        return NULL;
+    b->size = size;
+    return b;
+}
+
+/** Internal function that gives a block back to the cache, or frees
+ *  it if the cache is full.
+ */
+static void put_block(struct arena_block *b) {
+    if (free_size + b->size > ARENA_CACHE_SIZE) {
+        free(b);
+        return;
+    }
+    b->next = free_blocks;
+    free_blocks = b;
+    free_size += b->size;
+}
+
+/** Creates an empty arena.
+ *
+ *  Parameters: size: bytes expected to be allocated from the arena;
+ *                    they are allocated from the first block, and
+ *                    more blocks are only added beyond that.
+ *
+ *  Returns: the new arena, or NULL if out of memory.
+ */
+arena_t arena_create(size_t size) {
+    size_t header = ALIGN(sizeof(struct arena));
+    size = ALIGN(header + size);
+    struct arena_block *b = get_block(size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE);
+    if (!b)
+        return NULL;
+
+    b->next = NULL;
+    arena_t arena = (arena_t)BLOCK_DATA(b);
+    arena->block = b;
+    arena->used = header;
+    return arena;
+}
+
+/** Frees an arena and all memory allocated from it.
+ *
+ *  Parameters: arena: arena created by arena_create.
+ */
+void arena_destroy(arena_t arena) {
+    struct arena_block *b = arena->block;
+    while (b) {
+        // the arena is in the last block of the list
+        struct arena_block *next = b->next;
+        put_block(b);
+        b = next;
+    }
+}
+
+/** Allocates memory from an arena. The memory is aligned for any type,
+ *  and cannot be freed on its own (see arena_release).
+ *
+ *  Parameters: arena: arena created by arena_create.
+ *              size: number of bytes.
+ *
+ *  Returns: the memory, or NULL if out of memory.
+ */
+void *arena_alloc(arena_t arena, size_t size) {
+    size = ALIGN(size);
+    if (arena->used + size > arena->block->size) {
+        struct arena_block *b = get_block(size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE);
+        if (!b)
+            return NULL;
+        b->next = arena->block;
+        arena->block = b;
+        arena->used = 0;
+    }
+
+    void *p = BLOCK_DATA(arena->block) + arena->used;
+    arena->used += size;
+    return p;
+}
+
+/** Copies a string into an arena.
+ *
+ *  Returns: the copy, or NULL if out of memory.
+ */
+char *arena_strdup(arena_t arena, const char *str) {
+    size_t size = strlen(str) + 1;
+    char *copy = arena_alloc(arena, size);
+    if (copy)
+        memcpy(copy, str, size);
+    return copy;
+}
+
+/** Returns the current position of an arena, to free what is allocated
+ *  after it with arena_release.
+ *
+ *  Parameters: arena: arena created by arena_create.
+ */
+struct arena_mark arena_mark(arena_t arena) {
+    struct arena_mark mark = { arena->block, arena->used };
+    return mark;
+}
+
+/** Frees all memory allocated from an arena after a mark. Marks taken
+ *  after this one become invalid.
+ *
+ *  Parameters: arena: arena created by arena_create.
+ *              mark: position returned by arena_mark.
+ */
+void arena_release(arena_t arena, struct arena_mark mark) {
+    while (arena->block != mark.block) {
+        struct arena_block *b = arena->block;
+        arena->block = b->next;
+        put_block(b);
+    }
+    arena->used = mark.used;
+}
@@ -0,0 +1,28 @@
+/*
+ * Region allocator for memory that lives as long as a session or one
+ * of its transactions.
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <string.h>
+
+typedef struct arena *arena_t;
+
+/** Position in an arena, returned by arena_mark. Memory allocated
+ *  after it is freed by arena_release.
+ */
+struct arena_mark {
+    struct arena_block *block;
+    size_t used;
+};
+
+arena_t arena_create(size_t size);
+void arena_destroy(arena_t arena);
+void *arena_alloc(arena_t arena, size_t size);
+char *arena_strdup(arena_t arena, const char *str);
+struct arena_mark arena_mark(arena_t arena);
+void arena_release(arena_t arena, struct arena_mark mark);
+
+#endif
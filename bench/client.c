@@ -0,0 +1,144 @@
+/*
+ * Minimal blocking client connection used by the load generators.
+ */
+
+#include "client.h"
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/** Connects to a server.
+ *
+ *  Parameters: c: connection to be initialized.
+ *              host: name or address of the server.
+ *              port: port number or service name.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+int client_connect(struct client *c, const char *host, const char *port) {
+    struct addrinfo hints, *res, *p;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0)
+        return -1;
+
+    c->fd = -1;
+    c->start = c->end = 0;
+    for (p = res; p && c->fd < 0; p = p->ai_next) {
+        if ((c->fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+            continue;
+        if (connect(c->fd, p->ai_addr, p->ai_addrlen) < 0) {
+            close(c->fd);
+            c->fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (c->fd < 0)
+        return -1;
+
+    // commands are sent whole, Nagle's algorithm would only add latency
+    int yes = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    return 0;
+}
+
+void client_close(struct client *c) {
+    if (c->fd >= 0)
+        close(c->fd);
+    c->fd = -1;
+}
+
+/** Sends all bytes of a buffer.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+int client_send(struct client *c, const char *data, size_t size) {
+    while (size) {
+        ssize_t rv = send(c->fd, data, size, MSG_NOSIGNAL);
+        if (rv <= 0)
+            return -1;
+        data += rv;
+        size -= rv;
+    }
+    return 0;
+}
+
+/** Reads a line from the server, including its terminator. Lines
+ *  longer than max - 1 bytes are returned in parts.
+ *
+ *  Returns: the number of bytes in the line, or -1 if the connection
+ *           was closed or failed.
+ */
+int client_line(struct client *c, char *line, size_t max) {
+    for (;;) {
+        char *eol = memchr(c->buf + c->start, '\n', c->end - c->start);
+        size_t length = eol ? (size_t)(eol - (c->buf + c->start)) + 1 : c->end - c->start;
+        if (length > max - 1)
+            length = max - 1;
+
+        if (eol || length == max - 1) {
+            memcpy(line, c->buf + c->start, length);
+            line[length] = '\0';
+            c->start += length;
+            return length;
+        }
+
+        if (c->start == c->end)
+            c->start = c->end = 0;
+        else if (c->end == CLIENT_BUFFER_SIZE) {
+            memmove(c->buf, c->buf + c->start, c->end - c->start);
+            c->end -= c->start;
+            c->start = 0;
+        }
+        ssize_t rv = recv(c->fd, c->buf + c->end, CLIENT_BUFFER_SIZE - c->end, 0);
+        if (rv <= 0)
+            return -1;
+        c->end += rv;
+    }
+}
+
+/** Reads a reply and checks that it starts with the expected prefix
+ *  (such as "250" or "+OK"). Continuation lines of SMTP replies are
+ *  skipped.
+ *
+ *  Returns: 0 if the reply matches, -1 otherwise.
+ */
+int client_expect(struct client *c, const char *prefix) {
+    char line[1024];
+    do {
+        if (client_line(c, line, sizeof(line)) < 0)
+            return -1;
+    } while (line[0] >= '0' && line[0] <= '9' && line[3] == '-');
+
+    if (strncmp(line, prefix, strlen(prefix)) != 0) {
+        fprintf(stderr, "unexpected reply: %s", line);
+        return -1;
+    }
+    return 0;
+}
+
+/** Reads the lines of a multi-line POP3 reply, after its status line,
+ *  up to the termination line.
+ *
+ *  Returns: the number of bytes read, or -1 on error.
+ */
+long client_multiline(struct client *c) {
+    char line[1024];
+    long total = 0;
+    int length, line_start = 1;
+
+    while ((length = client_line(c, line, sizeof(line))) > 0) {
+        if (line_start && strcmp(line, ".\r\n") == 0)
+            return total;
+        total += length;
+        line_start = line[length - 1] == '\n';
+    }
+    return -1;
+}
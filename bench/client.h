@@ -0,0 +1,26 @@
+/*
+ * Minimal blocking client connection used by the load generators.
+ */
+
+#ifndef _BENCH_CLIENT_H_
+#define _BENCH_CLIENT_H_
+
+#include <string.h>
+
+#define CLIENT_BUFFER_SIZE 65536
+
+struct client {
+    int fd;
+    size_t start;  // offset of the first byte not returned yet
+    size_t end;    // offset right after the last byte received
+    char buf[CLIENT_BUFFER_SIZE];
+};
+
+int client_connect(struct client *c, const char *host, const char *port);
+void client_close(struct client *c);
+int client_send(struct client *c, const char *data, size_t size);
+int client_line(struct client *c, char *line, size_t max);
+int client_expect(struct client *c, const char *prefix);
+long client_multiline(struct client *c);
+
+#endif
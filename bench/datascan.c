@@ -0,0 +1,207 @@
+/*
+ * Microbenchmark for the DATA scanner. Compares scanning whole
+ * receive chunks with the previous approach of handling message
+ * contents one line at a time (find the line-feed, copy the line,
+ * check for the end marker and for a bare line-feed, then store it).
+ * Also measures storing the same contents received with BDAT, which
+ * only adds the dots, after checking it on a few inputs with bare
+ * carriage returns and line-feeds.
+ *
+ * Usage: bench/datascan [megabytes]
+ */
+
+#include "../datascan.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define CHUNK_SIZE 65536
+#define MAX_LINE_LENGTH 1024
+
+static char *output;
+static size_t output_used;
+static int bare_found;  // a line without CRLF, which smtpd rejects
+
+/** Stores data in the output buffer, standing in for the spool file.
+ */
+static void store(void *arg, const char *data, size_t size) {
+    memcpy(output + output_used, data, size);
+    output_used += size;
+}
+
+/** Creates a message with lines of random length, some of them
+ *  starting with a dot, followed by the end marker.
+ */
+static char *create_message(size_t size, size_t *message_size) {
+    char *message = malloc(size + 8);
+    size_t used = 0;
+
+    srand(1);
+    while (used + MAX_LINE_LENGTH < size) {
+        int length = rand() % 100;
+        if (rand() % 50 == 0) {
+            // lines starting with a dot are dot-stuffed by the client
+            message[used++] = '.';
+            message[used++] = '.';
+        }
+        for (int i = 0; i < length; i++)
+            message[used++] = 'a' + rand() % 26;
+        message[used++] = '\r';
+        message[used++] = '\n';
+    }
+    memcpy(message + used, ".\r\n", 3);
+    *message_size = used + 3;
+    return message;
+}
+
+/** Handles the message one line at a time, like the previous DATA
+ *  path did with sb_read_line.
+ */
+static void scan_lines(const char *message, size_t size) {
+    char line[MAX_LINE_LENGTH + 1];
+    const char *pos = message, *end = message + size;
+
+    while (pos < end) {
+        const char *eos = memchr(pos, '\n', end - pos);
+        size_t length = eos ? (size_t)(eos - pos + 1) : (size_t)(end - pos);
+        if (length > MAX_LINE_LENGTH)
+            length = MAX_LINE_LENGTH;
+        memcpy(line, pos, length);
+        line[length] = '\0';
+        pos += length;
+
+        if (length == 3 && strcmp(line, ".\r\n") == 0)
+            break;
+        if (line[length - 1] == '\n' && !(length > 1 && line[length - 2] == '\r'))
+            bare_found = 1;
+        store(NULL, line, length);
+    }
+}
+
+/** Handles the message in receive-sized chunks with the scanner.
+ */
+static void scan_chunks(const char *message, size_t size) {
+    struct data_scanner ds;
+    size_t pos = 0;
+
+    data_scan_init(&ds);
+    while (pos < size && !data_scan_done(&ds)) {
+        size_t chunk = size - pos < CHUNK_SIZE ? size - pos : CHUNK_SIZE;
+        pos += data_scan(&ds, message + pos, chunk, store, NULL);
+    }
+    bare_found = data_scan_flags(&ds) != 0;
+}
+
+/** Handles the contents of the message, without the end marker, in
+ *  receive-sized chunks as BDAT chunks.
+ */
+static void stuff_chunks(const char *message, size_t size) {
+    struct data_stuffer st;
+
+    data_stuff_init(&st);
+    for (size_t pos = 0; pos < size - 3; pos += CHUNK_SIZE) {
+        size_t chunk = size - 3 - pos < CHUNK_SIZE ? size - 3 - pos : CHUNK_SIZE;
+        data_stuff(&st, message + pos, chunk, store, NULL);
+    }
+    data_stuff_finish(&st, store, NULL);
+}
+
+/** Stuffs data one byte at a time, as the reference for check_stuff:
+ *  a dot gets an extra one at the start of the message or after CRLF.
+ */
+static size_t stuff_bytes(const char *data, size_t size, char *out) {
+    size_t used = 0;
+
+    for (size_t i = 0; i < size; i++) {
+        if (data[i] == '.' && (i == 0 || (i > 1 && data[i - 2] == '\r' && data[i - 1] == '\n')))
+            out[used++] = '.';
+        out[used++] = data[i];
+    }
+    return used;
+}
+
+/** Checks the stuffer on inputs with bare CRs and LFs before a dot,
+ *  split in two chunks at every position, alone and after a prefix
+ *  long enough for the vector versions of the scanner.
+ *
+ *  Returns: 0 if all outputs match the reference, or -1.
+ */
+static int check_stuff(void) {
+    static const char *const cases[] = {
+        "\r\r.",      "\n\r\r\r.b",  "a\r\r.\r\n",  "x\r.\r\n",
+        "\n.\r\n", ".a\r\n.b", "\r\n..\r\n", "\r\r\n.\r\r.",
+    };
+    char input[128], expected[256];
+
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        for (int prefix = 0; prefix <= 40; prefix += 40) {
+            size_t size = prefix + strlen(cases[c]);
+            memset(input, 'a', prefix);
+            memcpy(input + prefix, cases[c], size - prefix);
+            size_t expected_size = stuff_bytes(input, size, expected);
+
+            for (size_t split = 0; split <= size; split++) {
+                struct data_stuffer st;
+                output_used = 0;
+                data_stuff_init(&st);
+                data_stuff(&st, input, split, store, NULL);
+                data_stuff(&st, input + split, size - split, store, NULL);
+                if (output_used != expected_size || memcmp(output, expected, expected_size) != 0) {
+                    fprintf(stderr, "datascan: case %zu (prefix %d) split at %zu stuffed wrongly\n", c, prefix, split);
+                    return -1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Runs one of the approaches a few times and reports the best
+ *  throughput.
+ */
+static size_t run(const char *name, void (*scan)(const char *, size_t), const char *message, size_t size) {
+    double best = 0;
+    for (int i = 0; i < 5; i++) {
+        output_used = 0;
+        double start = now();
+        scan(message, size);
+        double elapsed = now() - start;
+        if (!best || elapsed < best)
+            best = elapsed;
+    }
+    printf("%-8s %8.1f MB/s\n", name, size / best / 1e6);
+    return output_used;
+}
+
+int main(int argc, char *argv[]) {
+    size_t megabytes = argc > 1 ? strtoul(argv[1], NULL, 10) : 64;
+    size_t size;
+    char *message = create_message(megabytes << 20, &size);
+    output = malloc(size * 2);
+
+    size_t lines_size = run("lines", scan_lines, message, size);
+    char *expected = malloc(lines_size);
+    memcpy(expected, output, lines_size);
+
+    size_t chunks_size = run("chunks", scan_chunks, message, size);
+    if (chunks_size != lines_size || memcmp(expected, output, lines_size) != 0 || bare_found) {
+        fprintf(stderr, "datascan: outputs differ\n");
+        return 1;
+    }
+
+    if (check_stuff() < 0)
+        return 1;
+    run("bdat", stuff_chunks, message, size);
+
+    free(expected);
+    free(output);
+    free(message);
+    return 0;
+}
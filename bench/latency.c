@@ -0,0 +1,84 @@
+/*
+ * Latency samples collected by the benchmarks, and their report.
+ *
+ * All samples are kept (one double per operation), so percentiles are
+ * exact instead of approximated by buckets.
+ */
+
+#include "latency.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/** Returns the current time in seconds, from a monotonic clock.
+ */
+double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void latency_init(struct latency *lat) {
+    lat->samples = NULL;
+    lat->count = lat->size = 0;
+}
+
+/** Adds the duration of one operation.
+ */
+void latency_add(struct latency *lat, double seconds) {
+    if (lat->count == lat->size) {
+        lat->size = lat->size * 2 + 1024;
+        lat->samples = realloc(lat->samples, lat->size * sizeof(double));
+    }
+    lat->samples[lat->count++] = seconds;
+}
+
+/** Adds all samples of another set, typically from another thread.
+ */
+void latency_merge(struct latency *into, const struct latency *from) {
+    for (size_t i = 0; i < from->count; i++)
+        latency_add(into, from->samples[i]);
+}
+
+static int compare_samples(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/** Internal function that returns a percentile of sorted samples, in
+ *  microseconds.
+ */
+static double percentile(const struct latency *lat, double p) {
+    size_t rank = (size_t)(lat->count * p);
+    if (rank >= lat->count)
+        rank = lat->count - 1;
+    return lat->samples[rank] * 1e6;
+}
+
+/** Prints the throughput and latency percentiles of a benchmark.
+ *
+ *  Parameters: name: name of the benchmark.
+ *              lat: durations of all operations (sorted by this call).
+ *              elapsed: wall-clock time of the whole run, in seconds.
+ *              bytes: bytes transferred during the run, or 0 to not
+ *                     report a data rate.
+ */
+void latency_report(const char *name, struct latency *lat, double elapsed, double bytes) {
+    if (!lat->count) {
+        printf("%-24s no operations completed\n", name);
+        return;
+    }
+
+    qsort(lat->samples, lat->count, sizeof(double), compare_samples);
+    printf("%-24s %10.0f ops/s", name, lat->count / elapsed);
+    if (bytes)
+        printf(" %8.1f MB/s", bytes / elapsed / 1e6);
+    printf("  p50 %8.1f us  p99 %8.1f us  p999 %8.1f us\n",
+           percentile(lat, 0.5), percentile(lat, 0.99), percentile(lat, 0.999));
+}
+
+void latency_free(struct latency *lat) {
+    free(lat->samples);
+    latency_init(lat);
+}
@@ -0,0 +1,24 @@
+/*
+ * Latency samples collected by the benchmarks, and their report.
+ */
+
+#ifndef _BENCH_LATENCY_H_
+#define _BENCH_LATENCY_H_
+
+#include <string.h>
+
+struct latency {
+    double *samples;  // in seconds
+    size_t count;
+    size_t size;
+};
+
+double bench_now(void);
+
+void latency_init(struct latency *lat);
+void latency_add(struct latency *lat, double seconds);
+void latency_merge(struct latency *into, const struct latency *from);
+void latency_report(const char *name, struct latency *lat, double elapsed, double bytes);
+void latency_free(struct latency *lat);
+
+#endif
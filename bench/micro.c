@@ -0,0 +1,225 @@
+/*
+ * Microbenchmarks for the building blocks of the servers: reading
+ * lines from a socket buffer, checking users, allocating the memory of
+ * sessions, session timeouts, and saving and loading mailboxes with
+ * each storage backend. Runs in a temporary directory with its own
+ * users.txt and mail store.
+ *
+ * Usage: bench/micro [scale]
+ */
+
+#include "../arena.h"
+#include "../socketbuffer.h"
+#include "../timer.h"
+#include "../user.h"
+#include "latency.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define USER_COUNT 10000
+#define LINE_COUNT 1000000
+#define TIMER_COUNT 100000  // sessions with a timeout
+
+static int scale = 1;
+
+/** Prints the rate and the average time of an operation.
+ */
+static void report(const char *name, long ops, double elapsed) {
+    printf("%-24s %12.0f ops/s %10.1f ns/op\n", name, ops / elapsed, elapsed * 1e9 / ops);
+}
+
+/** Sends LINE_COUNT lines of typical command length to a socket.
+ */
+static void *send_lines(void *arg) {
+    int fd = *(int *)arg;
+    char block[65536];
+    const char *line = "RCPT TO:<someone@example.com>\r\n";
+    size_t length = strlen(line), used = 0;
+    long sent = 0;
+
+    while (used + length <= sizeof(block)) {
+        memcpy(block + used, line, length);
+        used += length;
+    }
+    for (long total = (long)LINE_COUNT * scale; sent < total; sent += used / length) {
+        size_t size = sent + (long)(used / length) > total ? (total - sent) * length : used;
+        for (size_t off = 0; off < size;) {
+            ssize_t rv = send(fd, block + off, size - off, 0);
+            if (rv <= 0)
+                return NULL;
+            off += rv;
+        }
+    }
+    shutdown(fd, SHUT_WR);
+    return NULL;
+}
+
+static void bench_read_line(void) {
+    int fds[2];
+    pthread_t thread;
+    char line[1025];
+    long lines = 0;
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    pthread_create(&thread, NULL, send_lines, &fds[1]);
+
+    socket_buffer_t sb = sb_create(fds[0], 1024, NULL);
+    double start = bench_now();
+    while (sb_read_line(sb, line) > 0)
+        lines++;
+    report("sb_read_line", lines, bench_now() - start);
+
+    pthread_join(thread, NULL);
+    sb_destroy(sb);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void write_users(void) {
+    FILE *f = fopen("users.txt", "w");
+    for (int i = 0; i < USER_COUNT; i++)
+        fprintf(f, "bench%d@example.com bench\n", i);
+    fclose(f);
+}
+
+static void bench_valid_user(void) {
+    char name[64];
+    long ops = 100000L * scale, found = 0;
+
+    double start = bench_now();
+    for (long i = 0; i < ops; i++) {
+        // half of the lookups are for unknown users
+        snprintf(name, sizeof(name), "bench%ld@example.com", (i * 7919) % (USER_COUNT * 2));
+        found += is_valid_user(name, i % 4 ? NULL : "bench");
+    }
+    report("is_valid_user", ops, bench_now() - start);
+    if (!found)
+        fprintf(stderr, "micro: no user found\n");
+}
+
+/** Allocates and frees what an SMTP session with one transaction
+ *  needs, from malloc or from an arena.
+ */
+static void bench_session_memory(int use_arena) {
+    long ops = 1000000L * scale;
+    double start = bench_now();
+
+    for (long i = 0; i < ops; i++) {
+        arena_t arena = use_arena ? arena_create(sb_memory_size(1024) + 4096) : NULL;
+        socket_buffer_t sb = sb_create(-1, 1024, arena);
+        user_list_t users = create_user_list();
+        for (int j = 0; j < 3; j++)
+            add_user_to_list(&users, "someone@example.com", arena);
+        destroy_user_list(users);
+        sb_destroy(sb);
+        if (arena)
+            arena_destroy(arena);
+    }
+    report(use_arena ? "session memory arena" : "session memory malloc", ops, bench_now() - start);
+}
+
+/** Restarts the timeouts of many sessions, as each command arrives,
+ *  then lets the wheel run until all of them expire.
+ */
+static void bench_timers(void) {
+    static struct timer_wheel wheel;
+    struct timer *timers = calloc(TIMER_COUNT, sizeof(struct timer));
+    long ops = 10000000L * scale, expired = 0;
+    uint64_t now = 0;
+
+    timer_wheel_init(&wheel, now);
+    double start = bench_now();
+    for (long i = 0; i < ops; i++) {
+        if (i % TIMER_COUNT == 0)
+            now++;
+        timer_add(&wheel, &timers[(i * 7919) % TIMER_COUNT], now + 60 + i % 300);
+    }
+    report("timer_add", ops, bench_now() - start);
+
+    start = bench_now();
+    while (wheel.count)
+        while (timer_expire(&wheel, now += 1))
+            expired++;
+    report("timer_expire", expired, bench_now() - start);
+    free(timers);
+}
+
+/** Saves messages into a mailbox, then loads the mailbox repeatedly.
+ */
+static void bench_storage(const char *storage, const char *username) {
+    char name[64];
+    long messages = 1000L * scale, loads = 200L * scale;
+    user_list_t users = create_user_list();
+    add_user_to_list(&users, username, NULL);
+
+    FILE *f = fopen("message.tmp", "w");
+    fprintf(f, "Subject: bench\r\n\r\n");
+    for (int i = 0; i < 50; i++)
+        fprintf(f, "%078d\r\n", i);
+    fclose(f);
+
+    set_mail_storage(storage);
+    double start = bench_now();
+    for (long i = 0; i < messages; i++)
+        if (save_user_mail("message.tmp", 18, users))
+            fprintf(stderr, "micro: could not save message\n");
+    snprintf(name, sizeof(name), "save_user_mail %s", storage);
+    report(name, messages, bench_now() - start);
+
+    start = bench_now();
+    for (long i = 0; i < loads; i++)
+        destroy_mail_list(load_user_mail(username, NULL));
+    snprintf(name, sizeof(name), "load_user_mail %s", storage);
+    report(name, loads, bench_now() - start);
+
+    // what popd does instead for a mailbox that didn't change since
+    unsigned int count;
+    size_t size;
+    start = bench_now();
+    for (long i = 0; i < loads * 1000; i++)
+        if (get_mail_summary(username, &count, &size) == -1 || count != messages)
+            fprintf(stderr, "micro: no summary\n");
+    snprintf(name, sizeof(name), "get_mail_summary %s", storage);
+    report(name, loads * 1000, bench_now() - start);
+
+    destroy_user_list(users);
+    unlink("message.tmp");
+}
+
+int main(int argc, char *argv[]) {
+    char dir[] = "/tmp/mailbench.XXXXXX";
+    char command[64];
+
+    if (argc > 1)
+        scale = atoi(argv[1]) > 0 ? atoi(argv[1]) : 1;
+    if (!mkdtemp(dir) || chdir(dir) == -1) {
+        perror("micro");
+        return 1;
+    }
+
+    write_users();
+    if (load_user_directory() == -1) {
+        fprintf(stderr, "micro: could not load users\n");
+        return 1;
+    }
+    if (open_mail_summaries() == -1) {
+        fprintf(stderr, "micro: could not open mailbox summaries\n");
+        return 1;
+    }
+
+    bench_read_line();
+    bench_valid_user();
+    bench_session_memory(0);
+    bench_session_memory(1);
+    bench_timers();
+    bench_storage("files", "bench1@example.com");
+    bench_storage("segments", "bench2@example.com");
+    bench_storage("compressed", "bench3@example.com");
+
+    snprintf(command, sizeof(command), "rm -rf %s", dir);
+    return system(command) == 0 ? 0 : 1;
+}
@@ -0,0 +1,155 @@
+/*
+ * POP3 load generator. Each thread repeatedly logs in to one of the
+ * bench<N>@example.com mailboxes (password "bench"), and runs STAT,
+ * LIST, RETR and DELE for its messages. The session ends with RSET
+ * and QUIT, so the mailboxes keep their messages for the next cycle;
+ * they are expected to be populated before (by bench/smtpload).
+ *
+ * Usage: bench/popload [-c connections] [-n cycles] [-m messages]
+ *                      [-u users] host port
+ */
+
+#include "client.h"
+#include "latency.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static const char *host, *port;
+static int cycles = 20, max_messages = 20, users = 16;
+
+struct worker {
+    pthread_t thread;
+    int id;
+    int failed;
+    long bytes;                // received with RETR
+    struct latency cycle_lat;  // whole sessions
+    struct latency retr_lat;   // RETR of a single message
+};
+
+/** Runs one session, from the greeting to QUIT, returning 0 on success
+ *  or -1 on error.
+ */
+static int run_cycle(struct worker *w, struct client *c, int user) {
+    char command[128], line[1024];
+    int length, count;
+    long bytes;
+
+    if (client_connect(c, host, port) == -1 || client_expect(c, "+OK") == -1)
+        return -1;
+
+    length = sprintf(command, "USER bench%d@example.com\r\n", user);
+    if (client_send(c, command, length) == -1 || client_expect(c, "+OK") == -1)
+        return -1;
+    if (client_send(c, "PASS bench\r\n", 12) == -1 || client_expect(c, "+OK") == -1)
+        return -1;
+
+    if (client_send(c, "STAT\r\n", 6) == -1 || client_line(c, line, sizeof(line)) < 0 ||
+        sscanf(line, "+OK %d", &count) != 1)
+        return -1;
+    if (count > max_messages)
+        count = max_messages;
+
+    if (client_send(c, "LIST\r\n", 6) == -1 || client_expect(c, "+OK") == -1 ||
+        client_multiline(c) == -1)
+        return -1;
+
+    for (int i = 1; i <= count; i++) {
+        double start = bench_now();
+        length = sprintf(command, "RETR %d\r\n", i);
+        if (client_send(c, command, length) == -1 || client_expect(c, "+OK") == -1 ||
+            (bytes = client_multiline(c)) == -1)
+            return -1;
+        latency_add(&w->retr_lat, bench_now() - start);
+        w->bytes += bytes;
+    }
+
+    for (int i = 1; i <= count; i++) {
+        length = sprintf(command, "DELE %d\r\n", i);
+        if (client_send(c, command, length) == -1 || client_expect(c, "+OK") == -1)
+            return -1;
+    }
+
+    if (client_send(c, "RSET\r\n", 6) == -1 || client_expect(c, "+OK") == -1 ||
+        client_send(c, "QUIT\r\n", 6) == -1 || client_expect(c, "+OK") == -1)
+        return -1;
+    return 0;
+}
+
+static void *run(void *arg) {
+    struct worker *w = arg;
+    struct client *c = malloc(sizeof(struct client));
+
+    for (int i = 0; i < cycles; i++) {
+        double start = bench_now();
+        if (run_cycle(w, c, (w->id + i) % users) == -1)
+            w->failed++;
+        else
+            latency_add(&w->cycle_lat, bench_now() - start);
+        client_close(c);
+    }
+
+    free(c);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int connections = 8, opt, failed = 0;
+    long bytes = 0;
+
+    while ((opt = getopt(argc, argv, "c:n:m:u:")) != -1) {
+        switch (opt) {
+        case 'c': connections = atoi(optarg); break;
+        case 'n': cycles = atoi(optarg); break;
+        case 'm': max_messages = atoi(optarg); break;
+        case 'u': users = atoi(optarg); break;
+        default: goto usage;
+        }
+    }
+    if (optind + 2 != argc || connections < 1 || users < 1)
+        goto usage;
+    host = argv[optind];
+    port = argv[optind + 1];
+
+    struct worker *workers = calloc(connections, sizeof(struct worker));
+    double start = bench_now();
+    for (int i = 0; i < connections; i++) {
+        workers[i].id = i;
+        latency_init(&workers[i].cycle_lat);
+        latency_init(&workers[i].retr_lat);
+        pthread_create(&workers[i].thread, NULL, run, &workers[i]);
+    }
+
+    struct latency cycle_total, retr_total;
+    latency_init(&cycle_total);
+    latency_init(&retr_total);
+    for (int i = 0; i < connections; i++) {
+        pthread_join(workers[i].thread, NULL);
+        latency_merge(&cycle_total, &workers[i].cycle_lat);
+        latency_merge(&retr_total, &workers[i].retr_lat);
+        latency_free(&workers[i].cycle_lat);
+        latency_free(&workers[i].retr_lat);
+        failed += workers[i].failed;
+        bytes += workers[i].bytes;
+    }
+    double elapsed = bench_now() - start;
+
+    printf("pop3: %d connections, %d sessions, up to %d messages each\n",
+           connections, connections * cycles, max_messages);
+    latency_report("pop3 session", &cycle_total, elapsed, 0);
+    latency_report("pop3 RETR", &retr_total, elapsed, bytes);
+    if (failed)
+        printf("pop3: %d sessions failed\n", failed);
+
+    latency_free(&cycle_total);
+    latency_free(&retr_total);
+    free(workers);
+    return failed ? 1 : 0;
+
+usage:
+    fprintf(stderr, "Usage: %s [-c connections] [-n cycles] [-m messages] [-u users] host port\n",
+            argv[0]);
+    return 1;
+}
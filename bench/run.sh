@@ -0,0 +1,32 @@
+#!/bin/sh
+#
+# Runs the load generators against smtpd and popd, started in a
+# temporary directory with bench<N>@example.com users. Server options
+# (such as "-m fork" or "-s segments") are taken from SERVER_ARGS, and
+# load options from SMTP_ARGS and POP_ARGS.
+#
+# Usage: bench/run.sh
+
+BENCH=$(cd "$(dirname "$0")" && pwd)
+ROOT=$(dirname "$BENCH")
+SMTP_PORT=${SMTP_PORT:-12525}
+POP_PORT=${POP_PORT:-12110}
+USERS=16
+
+DIR=$(mktemp -d /tmp/mailbench.XXXXXX) || exit 1
+i=0
+while [ $i -lt $USERS ]; do
+    echo "bench$i@example.com bench" >> "$DIR/users.txt"
+    i=$((i + 1))
+done
+
+cd "$DIR" || exit 1
+"$ROOT/smtpd" $SERVER_ARGS "$SMTP_PORT" > /dev/null &
+SMTPD=$!
+"$ROOT/popd" $SERVER_ARGS "$POP_PORT" > /dev/null &
+POPD=$!
+trap 'kill $SMTPD $POPD 2> /dev/null; wait; rm -rf "$DIR"' EXIT
+sleep 1
+
+"$BENCH/smtpload" -u $USERS $SMTP_ARGS localhost "$SMTP_PORT" &&
+    "$BENCH/popload" -u $USERS $POP_ARGS localhost "$POP_PORT"
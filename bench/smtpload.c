@@ -0,0 +1,158 @@
+/*
+ * SMTP load generator. Each thread opens a connection and delivers a
+ * number of messages, measuring the time of each transaction from
+ * MAIL to the reply to the end of the message.
+ *
+ * Recipients are bench<N>@example.com, for N from 0 to users - 1, so
+ * the server's users.txt must list them (see bench/run.sh).
+ *
+ * With -b, messages are sent as a single BDAT chunk instead of with
+ * DATA.
+ *
+ * Usage: bench/smtpload [-c connections] [-n messages] [-s size]
+ *                       [-r recipients] [-u users] [-b] host port
+ */
+
+#include "client.h"
+#include "latency.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static const char *host, *port;
+static int messages = 100, message_size = 4096, recipients = 1, users = 16, bdat;
+static char *message;  // contents sent after DATA, with the end marker
+static size_t message_length;
+
+struct worker {
+    pthread_t thread;
+    int id;
+    int failed;
+    struct latency lat;
+};
+
+/** Creates the message contents: a header, then lines of text up to
+ *  the configured size, then the end marker.
+ */
+static void create_message(void) {
+    message = malloc(message_size + 128);
+    message_length = sprintf(message, "Subject: bench\r\n\r\n");
+    while (message_length + 80 < (size_t)message_size) {
+        memset(message + message_length, 'x', 78);
+        memcpy(message + message_length + 78, "\r\n", 2);
+        message_length += 80;
+    }
+    message_length += sprintf(message + message_length, ".\r\n");
+}
+
+/** Delivers one message, returning 0 on success or -1 on error.
+ */
+static int deliver(struct client *c, int first_user) {
+    char command[128];
+    int length;
+
+    length = sprintf(command, "MAIL FROM:<load@example.com>\r\n");
+    if (client_send(c, command, length) == -1 || client_expect(c, "250") == -1)
+        return -1;
+    for (int i = 0; i < recipients; i++) {
+        length = sprintf(command, "RCPT TO:<bench%d@example.com>\r\n", (first_user + i) % users);
+        if (client_send(c, command, length) == -1 || client_expect(c, "250") == -1)
+            return -1;
+    }
+    if (bdat) {
+        // the same contents, without the end marker
+        length = sprintf(command, "BDAT %zu LAST\r\n", message_length - 3);
+        if (client_send(c, command, length) == -1 || client_send(c, message, message_length - 3) == -1 ||
+            client_expect(c, "250") == -1)
+            return -1;
+        return 0;
+    }
+    if (client_send(c, "DATA\r\n", 6) == -1 || client_expect(c, "354") == -1)
+        return -1;
+    if (client_send(c, message, message_length) == -1 || client_expect(c, "250") == -1)
+        return -1;
+    return 0;
+}
+
+static void *run(void *arg) {
+    struct worker *w = arg;
+    struct client *c = malloc(sizeof(struct client));
+
+    if (client_connect(c, host, port) == -1 || client_expect(c, "220") == -1 ||
+        client_send(c, "HELO bench\r\n", 12) == -1 || client_expect(c, "250") == -1) {
+        w->failed = messages;
+        free(c);
+        return NULL;
+    }
+
+    for (int i = 0; i < messages; i++) {
+        double start = bench_now();
+        if (deliver(c, w->id * messages + i) == -1) {
+            w->failed = messages - i;
+            break;
+        }
+        latency_add(&w->lat, bench_now() - start);
+    }
+
+    client_send(c, "QUIT\r\n", 6);
+    client_close(c);
+    free(c);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int connections = 8, opt, failed = 0;
+
+    while ((opt = getopt(argc, argv, "c:n:s:r:u:b")) != -1) {
+        switch (opt) {
+        case 'c': connections = atoi(optarg); break;
+        case 'n': messages = atoi(optarg); break;
+        case 's': message_size = atoi(optarg); break;
+        case 'r': recipients = atoi(optarg); break;
+        case 'u': users = atoi(optarg); break;
+        case 'b': bdat = 1; break;
+        default: goto usage;
+        }
+    }
+    if (optind + 2 != argc || connections < 1 || recipients < 1 || users < 1)
+        goto usage;
+    host = argv[optind];
+    port = argv[optind + 1];
+
+    create_message();
+    struct worker *workers = calloc(connections, sizeof(struct worker));
+    double start = bench_now();
+    for (int i = 0; i < connections; i++) {
+        workers[i].id = i;
+        latency_init(&workers[i].lat);
+        pthread_create(&workers[i].thread, NULL, run, &workers[i]);
+    }
+
+    struct latency total;
+    latency_init(&total);
+    for (int i = 0; i < connections; i++) {
+        pthread_join(workers[i].thread, NULL);
+        latency_merge(&total, &workers[i].lat);
+        latency_free(&workers[i].lat);
+        failed += workers[i].failed;
+    }
+    double elapsed = bench_now() - start;
+
+    printf("smtp: %d connections, %d messages of %d bytes, %d recipients\n",
+           connections, connections * messages, message_size, recipients);
+    latency_report("smtp delivery", &total, elapsed, (double)total.count * message_length);
+    if (failed)
+        printf("smtp: %d messages failed\n", failed);
+
+    latency_free(&total);
+    free(workers);
+    free(message);
+    return failed ? 1 : 0;
+
+usage:
+    fprintf(stderr, "Usage: %s [-c connections] [-n messages] [-s size] [-r recipients] "
+                    "[-u users] [-b] host port\n", argv[0]);
+    return 1;
+}
@@ -0,0 +1,112 @@
+/*
+ * Group commit of delivered messages to stable storage.
+ *
+ * A message is only acknowledged once it is on disk: its contents,
+ * the mailbox directory entries created for it and any index updated
+ * with it. Instead of syncing each of those for each message, sessions
+ * that completed a delivery are queued and suspended, and the whole
+ * file system holding the mail store is synced once for the batch
+ * (with syncfs), either when the batch window expires or when the
+ * batch is full. The sessions are then woken to send their replies.
+ *
+ * The file system is synced as a whole because a single delivery
+ * touches several files (the spool, one directory per recipient, the
+ * mailbox indexes or segments), all of them in the same file system.
+ */
+
+#define _GNU_SOURCE  // syncfs
+
+#include "commit.h"
+
+#include "server.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define COMMIT_MAX_BATCH 256  // deliveries synced together at most
+
+struct commit_waiter {
+    int fd;       // socket of the suspended session
+    int *status;  // where the result of the sync is stored
+};
+
+static int commit_fd = -1;  // file system holding the spool and mail store
+static int commit_window;
+static struct commit_waiter waiters[COMMIT_MAX_BATCH];
+static int waiter_count = 0;
+static struct timespec batch_start;  // when the first delivery was queued
+
+/** Prepares group commits, using the file system of the current
+ *  directory (where spool files and the mail store are created).
+ *
+ *  Parameters: window: maximum number of milliseconds a delivery
+ *                      waits for other deliveries to be synced with.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+int commit_init(int window) {
+    commit_window = window;
+    commit_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    return commit_fd < 0 ? -1 : 0;
+}
+
+/** Syncs all deliveries made so far, without waiting for a batch.
+ *  Used when sessions cannot be suspended (in fork mode).
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+int commit_sync(void) {
+    return syncfs(commit_fd);
+}
+
+static long elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/** Queues a completed delivery for the next sync. The session should
+ *  then return SERVER_SUSPEND from resume; it is woken once the sync
+ *  is done. If the batch is full, it is synced right away.
+ *
+ *  Parameters: fd: Socket of the session.
+ *              status: where the result of the sync is stored before
+ *                      the session is woken (0 on success, -1 on
+ *                      error). Must remain valid until then.
+ */
+void commit_add(int fd, int *status) {
+    if (waiter_count == COMMIT_MAX_BATCH)
+        commit_tick();
+    if (!waiter_count)
+        clock_gettime(CLOCK_MONOTONIC, &batch_start);
+
+    waiters[waiter_count].fd = fd;
+    waiters[waiter_count].status = status;
+    waiter_count++;
+}
+
+/** Syncs the queued deliveries if the batch window expired or the
+ *  batch is full, and wakes their sessions. Called by the event loop
+ *  (see the tick callback of server_handler).
+ *
+ *  Returns: milliseconds until the current batch must be synced, or
+ *           -1 if no delivery is queued.
+ */
+int commit_tick(void) {
+    if (!waiter_count)
+        return -1;
+
+    long elapsed = elapsed_ms(&batch_start);
+    if (waiter_count < COMMIT_MAX_BATCH && elapsed < commit_window)
+        return commit_window - elapsed;
+
+    int rv = syncfs(commit_fd);
+    for (int i = 0; i < waiter_count; i++) {
+        *waiters[i].status = rv;
+        server_wake(waiters[i].fd);
+    }
+    waiter_count = 0;
+    return -1;
+}
@@ -0,0 +1,13 @@
+/*
+ * Group commit of delivered messages to stable storage.
+ */
+
+#ifndef _COMMIT_H_
+#define _COMMIT_H_
+
+int commit_init(int window);
+int commit_sync(void);
+void commit_add(int fd, int *status);
+int commit_tick(void);
+
+#endif
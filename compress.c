@@ -0,0 +1,220 @@
+/*
+ * zlib streams for messages stored compressed.
+ *
+ * A message is compressed once, at delivery, as a single zlib stream
+ * written at an offset of the destination file. Streams may be
+ * compressed with a preset dictionary (see deflateSetDictionary),
+ * which must be given again to read them back; zlib records its
+ * checksum in the stream, so a wrong dictionary is detected.
+ *
+ * Both directions keep their zlib state between messages (reset with
+ * deflateReset or inflateReset), since setting up a stream allocates
+ * several hundred kilobytes. Messages are read through a decompressor
+ * object, which inflates into the caller's buffer, normally the
+ * output buffer of the socket, as data is needed.
+ */
+
+#include "compress.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define COMPRESS_LEVEL 6
+#define COMPRESS_BLOCK_SIZE 65536
+
+struct decompressor {
+    z_stream stream;
+    int fd;
+    off_t offset;        // position of the next compressed bytes to read
+    uint64_t remaining;  // compressed bytes not read yet
+    const char *dict;
+    size_t dict_size;
+    int done;
+    char in[COMPRESS_BLOCK_SIZE];
+};
+
+static z_stream deflater;
+static int deflater_ready = 0;
+
+// A decompressor is normally used for a single command, so a single
+// one is kept for the next message
+static struct decompressor *spare = NULL;
+
+/** Internal function that writes a whole buffer at an offset.
+ */
+static int write_at(int fd, const char *buf, size_t size, off_t offset) {
+    while (size) {
+        ssize_t rv = pwrite(fd, buf, size, offset);
+        if (rv < 0 && errno == EINTR)
+            continue;
+        if (rv <= 0)
+            return -1;
+        buf += rv;
+        size -= rv;
+        offset += rv;
+    }
+    return 0;
+}
+
+/** Compresses the start of a file into another file, as a single
+ *  zlib stream. Compression stops as soon as the stream gets as large
+ *  as the data, which is then better stored as it is.
+ *
+ *  Parameters: in_fd: file to be compressed, read from offset 0.
+ *              size: number of bytes to compress.
+ *              out_fd: file the stream is written to.
+ *              out_offset: position of the stream in out_fd.
+ *              dict: preset dictionary, or NULL.
+ *              dict_size: size of the dictionary.
+ *              stored_size: set to the size of the stream.
+ *
+ *  Returns: 0 if the data was compressed, 1 if it did not get
+ *           smaller (the bytes written to out_fd are then garbage),
+ *           or -1 on error.
+ */
+int compress_range(int in_fd, uint64_t size, int out_fd, off_t out_offset, const char *dict,
+                   size_t dict_size, uint64_t *stored_size) {
+    char in[COMPRESS_BLOCK_SIZE], out[COMPRESS_BLOCK_SIZE];
+    uint64_t read_size = 0, written = 0;
+    int flush = Z_NO_FLUSH, rv = Z_OK;
+
+    if (!deflater_ready) {
+        if (deflateInit(&deflater, COMPRESS_LEVEL) != Z_OK)
+            return -1;
+        deflater_ready = 1;
+    } else if (deflateReset(&deflater) != Z_OK) {
+        return -1;
+    }
+    if (dict && deflateSetDictionary(&deflater, (const Bytef *)dict, dict_size) != Z_OK)
+        return -1;
+
+    do {
+        if (!deflater.avail_in && flush == Z_NO_FLUSH) {
+            size_t block = size - read_size < sizeof(in) ? size - read_size : sizeof(in);
+            ssize_t n = block ? pread(in_fd, in, block, read_size) : 0;
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 || (block && !n))
+                return -1;
+            read_size += n;
+            deflater.next_in = (Bytef *)in;
+            deflater.avail_in = n;
+            if (read_size == size)
+                flush = Z_FINISH;
+        }
+
+        deflater.next_out = (Bytef *)out;
+        deflater.avail_out = sizeof(out);
+        rv = deflate(&deflater, flush);
+        if (rv == Z_STREAM_ERROR)
+            return -1;
+
+        size_t produced = sizeof(out) - deflater.avail_out;
+        if (written + produced >= size)
+            return 1;
+        if (write_at(out_fd, out, produced, out_offset + written) < 0)
+            return -1;
+        written += produced;
+    } while (rv != Z_STREAM_END);
+
+    *stored_size = written;
+    return 0;
+}
+
+/** Starts reading a zlib stream written by compress_range.
+ *
+ *  Parameters: fd: file containing the stream. It is read with pread,
+ *                  and must stay open until decompressor_close.
+ *              offset: position of the stream in the file.
+ *              stored_size: size of the stream.
+ *              dict: preset dictionary the stream was compressed with,
+ *                    or NULL. It must stay valid until
+ *                    decompressor_close.
+ *              dict_size: size of the dictionary.
+ *
+ *  Returns: a decompressor_t object, or NULL if out of memory.
+ */
+decompressor_t decompressor_open(int fd, off_t offset, uint64_t stored_size, const char *dict,
+                                 size_t dict_size) {
+    decompressor_t d = spare;
+
+    if (d) {
+        spare = NULL;
+        inflateReset(&d->stream);
+    } else {
+        if (!(d = malloc(sizeof(struct decompressor))))
+            return NULL;
+        memset(&d->stream, 0, sizeof(d->stream));
+        if (inflateInit(&d->stream) != Z_OK) {
+            free(d);
+            return NULL;
+        }
+    }
+
+    d->stream.avail_in = 0;
+    d->fd = fd;
+    d->offset = offset;
+    d->remaining = stored_size;
+    d->dict = dict;
+    d->dict_size = dict_size;
+    d->done = 0;
+    return d;
+}
+
+/** Decompresses the next bytes of a stream.
+ *
+ *  Parameters: d: decompressor created by decompressor_open.
+ *              buf: where the data is stored.
+ *              size: size of buf.
+ *
+ *  Returns: number of bytes stored, 0 at the end of the stream, or -1
+ *           if the stream cannot be read or is corrupt.
+ */
+ssize_t decompressor_read(decompressor_t d, char *buf, size_t size) {
+    d->stream.next_out = (Bytef *)buf;
+    d->stream.avail_out = size;
+
+    while (d->stream.avail_out && !d->done) {
+        if (!d->stream.avail_in) {
+            if (!d->remaining)
+                return -1;  // truncated stream
+            size_t block = d->remaining < sizeof(d->in) ? d->remaining : sizeof(d->in);
+            ssize_t n = pread(d->fd, d->in, block, d->offset);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return -1;
+            d->offset += n;
+            d->remaining -= n;
+            d->stream.next_in = (Bytef *)d->in;
+            d->stream.avail_in = n;
+        }
+
+        int rv = inflate(&d->stream, Z_NO_FLUSH);
+        if (rv == Z_NEED_DICT) {
+            if (!d->dict ||
+                inflateSetDictionary(&d->stream, (const Bytef *)d->dict, d->dict_size) != Z_OK)
+                return -1;
+        } else if (rv == Z_STREAM_END) {
+            d->done = 1;
+        } else if (rv != Z_OK && rv != Z_BUF_ERROR) {
+            return -1;
+        }
+    }
+    return size - d->stream.avail_out;
+}
+
+/** Frees a decompressor, or keeps it for the next stream.
+ *
+ *  Parameters: d: decompressor created by decompressor_open.
+ */
+void decompressor_close(decompressor_t d) {
+    if (!spare) {
+        spare = d;
+        return;
+    }
+    inflateEnd(&d->stream);
+    free(d);
+}
@@ -0,0 +1,22 @@
+/*
+ * zlib streams for messages stored compressed.
+ */
+
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+typedef struct decompressor *decompressor_t;
+
+int compress_range(int in_fd, uint64_t size, int out_fd, off_t out_offset, const char *dict,
+                   size_t dict_size, uint64_t *stored_size);
+
+decompressor_t decompressor_open(int fd, off_t offset, uint64_t stored_size, const char *dict,
+                                 size_t dict_size);
+ssize_t decompressor_read(decompressor_t d, char *buf, size_t size);
+void decompressor_close(decompressor_t d);
+
+#endif
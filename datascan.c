@@ -0,0 +1,333 @@
+/*
+ * Scanner for the contents of a message received with DATA, and
+ * dot-stuffing of the contents of a message received with BDAT.
+ *
+ * Messages are stored exactly as they will be sent by RETR, with their
+ * lines kept dot-stuffed, so the data is stored unchanged. The only
+ * places that need attention are line-feeds followed by a dot (which
+ * may start the <CRLF>.<CRLF> end marker), and bare line-feeds and
+ * carriage returns (not part of a CRLF). Only a CRLF starts a line, so
+ * <LF>.<CRLF> and similar sequences do not end the message; bare ones
+ * are recorded in the flags of the scanner instead, so the message
+ * can be rejected (RFC 5321 2.3.8). The scanner looks for those with
+ * SSE2 or AVX2 instructions when available, and passes everything else
+ * through as a single span per chunk.
+ *
+ * Messages received with BDAT are not dot-stuffed and have no end
+ * marker, so they only need a dot added to lines starting with one
+ * before they are stored. The same instructions look for those lines.
+ *
+ * Define DATASCAN_SCALAR to build only the portable version.
+ */
+
+#include "datascan.h"
+
+#include <stdint.h>
+
+#if defined(__x86_64__) && !defined(DATASCAN_SCALAR)
+#define DATASCAN_X86 1
+#include <immintrin.h>
+#endif
+
+enum data_scan_state {
+    DS_LINE_START,  // at the start of a line
+    DS_TEXT,        // inside a line, previous byte was not CR
+    DS_TEXT_CR,     // inside a line, previous byte was CR
+    DS_DOT,         // a line started with "."
+    DS_DOT_CR,      // a line started with ".\r"
+    DS_DONE         // end marker found
+};
+
+/** Internal function that checks if a line-feed needs attention: it
+ *  is not preceded by CR, or it may be followed by a dot.
+ */
+static inline int is_event(const char *p, size_t i, size_t n, int prev_cr) {
+    return !(i ? p[i - 1] == '\r' : prev_cr) || i + 1 == n || p[i + 1] == '.';
+}
+
+/** Internal function that returns the offset of the first line-feed
+ *  that needs attention, or of the first carriage return followed by
+ *  something else than a line-feed, or n if there is none. A carriage
+ *  return at the end is left to the caller, which sees the next byte.
+ *  prev_cr indicates if the byte before p is a CR.
+ */
+static size_t find_event_scalar(const char *p, size_t n, int prev_cr) {
+    const char *end = p + n;
+    const char *lf = memchr(p, '\n', n), *cr = memchr(p, '\r', n);
+
+    for (;;) {
+        if (cr && (!lf || cr < lf)) {
+            if (cr + 1 < end && cr[1] != '\n')
+                return cr - p;
+            cr = memchr(cr + 1, '\r', end - cr - 1);
+            continue;
+        }
+        if (!lf)
+            return n;
+        if (is_event(p, lf - p, n, prev_cr))
+            return lf - p;
+        lf = memchr(lf + 1, '\n', end - lf - 1);
+    }
+}
+
+#ifdef DATASCAN_X86
+static size_t find_event_sse2(const char *p, size_t n, int prev_cr) {
+    const __m128i lf = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r'), dot = _mm_set1_epi8('.');
+    size_t i;
+
+    if (n && p[0] == '\n' && is_event(p, 0, n, prev_cr))
+        return 0;
+    if (n > 1 && p[0] == '\r' && p[1] != '\n')
+        return 0;
+
+    // each block checks bytes i to i + 15, looking at their neighbours
+    for (i = 1; i + 16 < n; i += 16) {
+        __m128i cur = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i next = _mm_loadu_si128((const __m128i *)(p + i + 1));
+        __m128i v = _mm_cmpeq_epi8(cur, lf), c = _mm_cmpeq_epi8(cur, cr);
+        __m128i prev = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i - 1)), cr);
+        __m128i bare_lf = _mm_andnot_si128(prev, v), dot_lf = _mm_and_si128(v, _mm_cmpeq_epi8(next, dot));
+        __m128i bare_cr = _mm_andnot_si128(_mm_cmpeq_epi8(next, lf), c);
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(bare_lf, dot_lf), bare_cr));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+
+    // remaining bytes, too few for a full block
+    return i < n ? i + find_event_scalar(p + i, n - i, p[i - 1] == '\r') : n;
+}
+
+__attribute__((target("avx2"))) static size_t find_event_avx2(const char *p, size_t n, int prev_cr) {
+    const __m256i lf = _mm256_set1_epi8('\n'), cr = _mm256_set1_epi8('\r'), dot = _mm256_set1_epi8('.');
+    size_t i;
+
+    if (n && p[0] == '\n' && is_event(p, 0, n, prev_cr))
+        return 0;
+    if (n > 1 && p[0] == '\r' && p[1] != '\n')
+        return 0;
+
+    for (i = 1; i + 32 < n; i += 32) {
+        __m256i cur = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i next = _mm256_loadu_si256((const __m256i *)(p + i + 1));
+        __m256i v = _mm256_cmpeq_epi8(cur, lf), c = _mm256_cmpeq_epi8(cur, cr);
+        __m256i prev = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i - 1)), cr);
+        __m256i bare_lf = _mm256_andnot_si256(prev, v), dot_lf = _mm256_and_si256(v, _mm256_cmpeq_epi8(next, dot));
+        __m256i bare_cr = _mm256_andnot_si256(_mm256_cmpeq_epi8(next, lf), c);
+        uint32_t mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(bare_lf, dot_lf), bare_cr));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+
+    // remaining bytes, too few for a full block
+    return i < n ? i + find_event_scalar(p + i, n - i, p[i - 1] == '\r') : n;
+}
+#endif
+
+static size_t (*find_event)(const char *p, size_t n, int prev_cr);
+
+/** Internal function that selects the fastest version of find_event
+ *  for this CPU, the first time it is needed.
+ */
+static void select_find_event(void) {
+    if (!find_event) {
+#ifdef DATASCAN_X86
+        find_event = __builtin_cpu_supports("avx2") ? find_event_avx2 : find_event_sse2;
+#else
+        find_event = find_event_scalar;
+#endif
+    }
+}
+
+/** Prepares a scanner for a new message. The first byte is expected
+ *  to be at the start of a line (right after the DATA command).
+ *
+ *  Parameters: ds: scanner to be initialized.
+ */
+void data_scan_init(struct data_scanner *ds) {
+    ds->state = DS_LINE_START;
+    ds->held = 0;
+    ds->flags = 0;
+    select_find_event();
+}
+
+/** Scans a chunk of message contents, calling emit with the spans to
+ *  be stored, until the end marker is found or the chunk is over.
+ *  A possible end marker at the end of the chunk is kept until the
+ *  next chunk shows whether it is part of the contents.
+ *
+ *  Parameters: ds: scanner with the state from previous chunks.
+ *              data: chunk of data received from the client.
+ *              size: number of bytes in data.
+ *              emit: function called with each span to be stored.
+ *              arg: first parameter passed to emit.
+ *
+ *  Returns: the number of bytes consumed. It is smaller than size only
+ *           if the end marker was found, in which case the remaining
+ *           bytes are the commands sent after the message.
+ */
+size_t data_scan(struct data_scanner *ds, const char *data, size_t size, data_emit_t emit, void *arg) {
+    size_t pos = 0, i;
+
+    while (pos < size && ds->state != DS_DONE) {
+        switch (ds->state) {
+        case DS_LINE_START:
+            if (data[pos] == '.') {
+                ds->state = DS_DOT;
+                pos++;
+            } else {
+                ds->state = DS_TEXT;
+            }
+            break;
+
+        case DS_DOT:
+        case DS_DOT_CR:
+            if (data[pos] == (ds->state == DS_DOT ? '\r' : '\n')) {
+                ds->state++;
+                pos++;
+                if (ds->state == DS_DONE && pos > 3 - (size_t)ds->held)
+                    emit(arg, data, pos - (3 - ds->held));
+                break;
+            }
+
+            // not the end marker, the bytes kept from previous chunks
+            // are part of the contents
+            if (ds->held)
+                emit(arg, ".\r", ds->held);
+            ds->held = 0;
+            if (ds->state == DS_DOT_CR)
+                ds->flags |= DATA_BARE_CR;
+            ds->state = DS_TEXT;
+            break;
+
+        case DS_TEXT:
+        case DS_TEXT_CR:
+            // a CR ending the previous chunk
+            if (ds->state == DS_TEXT_CR && data[pos] != '\n')
+                ds->flags |= DATA_BARE_CR;
+            i = pos + find_event(data + pos, size - pos, ds->state == DS_TEXT_CR);
+            if (i == size) {
+                ds->state = data[size - 1] == '\r' ? DS_TEXT_CR : DS_TEXT;
+                pos = size;
+                break;
+            }
+
+            // only a CRLF ends a line, and may be followed by the marker
+            if (data[i] == '\r') {
+                ds->flags |= DATA_BARE_CR;
+                ds->state = DS_TEXT;
+            } else if (!(i > pos ? data[i - 1] == '\r' : ds->state == DS_TEXT_CR)) {
+                ds->flags |= DATA_BARE_LF;
+                ds->state = DS_TEXT;
+            } else {
+                ds->state = DS_LINE_START;
+            }
+            pos = i + 1;
+            break;
+        }
+    }
+
+    if (ds->state != DS_DONE) {
+        // keep the start of a possible end marker out of the span
+        int marker = ds->state == DS_DOT ? 1 : ds->state == DS_DOT_CR ? 2 : 0;
+        size_t end = size - (marker - ds->held);
+        if (end)
+            emit(arg, data, end);
+        ds->held = marker;
+    }
+    return pos;
+}
+
+/** Checks if the end marker of the message was found.
+ *
+ *  Parameters: ds: scanner to be checked.
+ *
+ *  Returns: non-zero if the message is complete, zero otherwise.
+ */
+int data_scan_done(const struct data_scanner *ds) {
+    return ds->state == DS_DONE;
+}
+
+/** Returns the bare line-feeds and carriage returns found in the
+ *  contents so far.
+ *
+ *  Parameters: ds: scanner to be checked.
+ *
+ *  Returns: DATA_BARE_LF and DATA_BARE_CR, if any of them was found.
+ */
+int data_scan_flags(const struct data_scanner *ds) {
+    return ds->flags;
+}
+
+/** Prepares a stuffer for a new message received with BDAT.
+ *
+ *  Parameters: st: stuffer to be initialized.
+ */
+void data_stuff_init(struct data_stuffer *st) {
+    st->size = 0;
+    st->tail[0] = st->tail[1] = '\0';
+    select_find_event();
+}
+
+/** Internal function that checks if the data stored so far ends a
+ *  line, so the next byte starts one.
+ */
+static int at_line_start(const struct data_stuffer *st) {
+    return !st->size || (st->tail[0] == '\r' && st->tail[1] == '\n');
+}
+
+/** Stores a chunk of a message received with BDAT, calling emit with
+ *  the spans to be stored, in order. The chunk is stored unchanged,
+ *  except that lines (ending in CRLF) that start with a dot get an
+ *  extra one, as they are sent by RETR.
+ *
+ *  Parameters: st: stuffer with the state from previous chunks.
+ *              data: chunk of the message.
+ *              size: number of bytes in data.
+ *              emit: function called with each span to be stored.
+ *              arg: first parameter passed to emit.
+ */
+void data_stuff(struct data_stuffer *st, const char *data, size_t size, data_emit_t emit, void *arg) {
+    size_t span = 0, pos = 0;
+
+    if (!size)
+        return;
+    if (data[0] == '.' && at_line_start(st))
+        emit(arg, ".", 1);
+
+    // events are line-feeds followed by a dot, line-feeds without a
+    // CR before them and CRs without a line-feed after them (both left
+    // as they are), or at the end of the chunk
+    for (;;) {
+        pos += find_event(data + pos, size - pos, pos ? data[pos - 1] == '\r' : st->tail[1] == '\r');
+        if (pos + 1 >= size)
+            break;
+        int crlf = data[pos] == '\n' && (pos ? data[pos - 1] == '\r' : st->tail[1] == '\r');
+        if (crlf && data[pos + 1] == '.') {
+            emit(arg, data + span, pos + 1 - span);
+            emit(arg, ".", 1);
+            span = pos + 1;
+        }
+        pos++;
+    }
+    emit(arg, data + span, size - span);
+
+    st->tail[0] = size > 1 ? data[size - 2] : st->tail[1];
+    st->tail[1] = data[size - 1];
+    st->size += size;
+}
+
+/** Ends a message received with BDAT, so that it ends with a line
+ *  terminator, like every message sent by RETR.
+ *
+ *  Parameters: st: stuffer with the state from all chunks.
+ *              emit: function called with the span to be stored, if any.
+ *              arg: first parameter passed to emit.
+ */
+void data_stuff_finish(struct data_stuffer *st, data_emit_t emit, void *arg) {
+    if (at_line_start(st))
+        return;
+    if (st->tail[1] == '\r')
+        emit(arg, "\n", 1);
+    else
+        emit(arg, "\r\n", 2);
+}
@@ -0,0 +1,45 @@
+/*
+ * Scanner for the contents of a message received with DATA, and
+ * dot-stuffing of the contents of a message received with BDAT.
+ */
+
+#ifndef _DATA_SCAN_H_
+#define _DATA_SCAN_H_
+
+#include <string.h>
+
+/** Function called with each span of message contents that should be
+ *  stored, in order.
+ */
+typedef void (*data_emit_t)(void *arg, const char *data, size_t size);
+
+#define DATA_BARE_LF 1  // a line-feed without a carriage return before it
+#define DATA_BARE_CR 2  // a carriage return without a line-feed after it
+
+/** State of a scanner between chunks of data. Must be initialized
+ *  with data_scan_init before the first chunk of a message.
+ */
+struct data_scanner {
+    int state;
+    int held;   // bytes of a possible end marker kept from previous chunks
+    int flags;  // DATA_BARE_LF and DATA_BARE_CR found so far
+};
+
+/** State of a stuffer between chunks of data. Must be initialized
+ *  with data_stuff_init before the first chunk of a message.
+ */
+struct data_stuffer {
+    size_t size;   // bytes received so far
+    char tail[2];  // last two bytes received
+};
+
+void data_scan_init(struct data_scanner *ds);
+size_t data_scan(struct data_scanner *ds, const char *data, size_t size, data_emit_t emit, void *arg);
+int data_scan_done(const struct data_scanner *ds);
+int data_scan_flags(const struct data_scanner *ds);
+
+void data_stuff_init(struct data_stuffer *st);
+void data_stuff(struct data_stuffer *st, const char *data, size_t size, data_emit_t emit, void *arg);
+void data_stuff_finish(struct data_stuffer *st, data_emit_t emit, void *arg);
+
+#endif
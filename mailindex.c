@@ -0,0 +1,277 @@
+/*
+ * Persistent index of the messages in a mailbox directory.
+ *
+ * The index is stored in a file inside the mailbox directory, with a
+ * header followed by one fixed-size record per message. The header
+ * records the modification time of the directory when the index was
+ * last updated: if the directory changed since then (e.g., a file
+ * was added or removed by some other means), the index is considered
+ * stale and must be rebuilt from the directory contents. Every change
+ * made through this module updates that time, so the index stays
+ * current as long as the mailbox is only changed while holding the
+ * exclusive lock of its index.
+ */
+
+#include "mailindex.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define MAIL_INDEX_FILE_NAME ".index"
+#define MAIL_INDEX_MAGIC 0x5844494du  // "MIDX"
+#define MAIL_INDEX_VERSION 2
+
+struct mail_index_header {
+    uint32_t magic;
+    uint32_t version;
+    int64_t dir_mtime_sec;
+    int64_t dir_mtime_nsec;
+};
+
+struct mail_index {
+    int fd;
+    void *map;
+    size_t map_size;
+    char dir[PATH_MAX];
+};
+
+/** Opens and locks the index of a mailbox directory. A shared lock
+ *  allows the index to be read; an exclusive lock is needed to change
+ *  the index or the directory itself, and creates the index file if
+ *  it doesn't exist yet.
+ *
+ *  Parameters: dir: Path of the mailbox directory.
+ *              exclusive: non-zero to lock the index for writing.
+ *
+ *  Returns: A mail_index_t object, or NULL if the index cannot be
+ *           opened (e.g., the directory or the index don't exist).
+ */
+mail_index_t mail_index_open(const char *dir, int exclusive) {
+    char filename[PATH_MAX];
+    snprintf(filename, sizeof(filename), "%s/" MAIL_INDEX_FILE_NAME, dir);
+
+    int fd = open(filename, exclusive ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0666);
+    if (fd < 0) return NULL;
+
+    if (flock(fd, exclusive ? LOCK_EX : LOCK_SH) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    mail_index_t idx = malloc(sizeof(struct mail_index));
+    idx->fd = fd;
+    idx->map = NULL;
+    idx->map_size = 0;
+    snprintf(idx->dir, sizeof(idx->dir), "%s", dir);
+    return idx;
+}
+
+/** Releases the lock of an index and frees all memory used by it.
+ *  Records returned by mail_index_records are no longer valid.
+ *
+ *  Parameters: idx: index to be closed.
+ */
+void mail_index_close(mail_index_t idx) {
+    if (idx->map)
+        munmap(idx->map, idx->map_size);
+    close(idx->fd);
+    free(idx);
+}
+
+/** Internal function that writes a valid header for the index, using
+ *  the current modification time of the directory.
+ */
+static int write_header(mail_index_t idx) {
+    struct stat dir_stat;
+    struct mail_index_header header = {
+        .magic = MAIL_INDEX_MAGIC,
+        .version = MAIL_INDEX_VERSION,
+    };
+
+    if (stat(idx->dir, &dir_stat) < 0)
+        return -1;
+    header.dir_mtime_sec = dir_stat.st_mtim.tv_sec;
+    header.dir_mtime_nsec = dir_stat.st_mtim.tv_nsec;
+
+    return pwrite(idx->fd, &header, sizeof(header), 0) == sizeof(header) ? 0 : -1;
+}
+
+/** Internal function that marks the index as stale, so it will be
+ *  rebuilt the next time it is loaded.
+ */
+static void invalidate(mail_index_t idx) {
+    ftruncate(idx->fd, 0);
+}
+
+/** Checks if the index matches the current contents of the directory.
+ *
+ *  Parameters: idx: index to be checked.
+ *
+ *  Returns: non-zero if the index is current, zero if it is stale.
+ */
+int mail_index_is_current(mail_index_t idx) {
+    struct mail_index_header header;
+    struct stat file_stat, dir_stat;
+
+    if (fstat(idx->fd, &file_stat) < 0 || stat(idx->dir, &dir_stat) < 0)
+        return 0;
+    if ((size_t)file_stat.st_size < sizeof(header) ||
+        (file_stat.st_size - sizeof(header)) % sizeof(struct mail_index_record))
+        return 0;
+    if (pread(idx->fd, &header, sizeof(header), 0) != sizeof(header))
+        return 0;
+
+    return header.magic == MAIL_INDEX_MAGIC && header.version == MAIL_INDEX_VERSION &&
+           header.dir_mtime_sec == dir_stat.st_mtim.tv_sec &&
+           header.dir_mtime_nsec == dir_stat.st_mtim.tv_nsec;
+}
+
+/** Maps the records of a current index into memory.
+ *
+ *  Parameters: idx: index to be read.
+ *              count: address where the number of records is stored.
+ *
+ *  Returns: the array of records, valid until the index is closed, or
+ *           NULL if the index is stale.
+ */
+const struct mail_index_record *mail_index_records(mail_index_t idx, size_t *count) {
+    struct stat file_stat;
+
+    if (!mail_index_is_current(idx) || fstat(idx->fd, &file_stat) < 0)
+        return NULL;
+
+    *count = (file_stat.st_size - sizeof(struct mail_index_header)) / sizeof(struct mail_index_record);
+    if (!*count) {
+        static const struct mail_index_record empty;
+        return &empty;
+    }
+
+    void *map = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, idx->fd, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    if (idx->map)
+        munmap(idx->map, idx->map_size);
+    idx->map = map;
+    idx->map_size = file_stat.st_size;
+    return (const struct mail_index_record *)((char *)map + sizeof(struct mail_index_header));
+}
+
+/** Internal function that fills a record, if the name fits in it.
+ */
+static int fill_record(struct mail_index_record *record, const char *name, uint64_t size) {
+    size_t len = strlen(name);
+    if (len >= MAIL_INDEX_NAME_SIZE)
+        return -1;
+
+    memset(record, 0, sizeof(*record));
+    memcpy(record->name, name, len);
+    record->size = size;
+    return 0;
+}
+
+/** Adds a message to the index, after it was added to the directory.
+ *  Must only be called with an exclusive lock, if the index was
+ *  current before the message was added.
+ *
+ *  Parameters: idx: index to be changed.
+ *              name: file name of the new message.
+ *              size: size of the new message.
+ *
+ *  Returns: 0 on success, -1 on error (the index is then left stale).
+ */
+int mail_index_append(mail_index_t idx, const char *name, uint64_t size) {
+    struct mail_index_record record;
+    struct stat file_stat;
+
+    if (fill_record(&record, name, size) < 0 || fstat(idx->fd, &file_stat) < 0 ||
+        pwrite(idx->fd, &record, sizeof(record), file_stat.st_size) != sizeof(record) ||
+        write_header(idx) < 0) {
+        invalidate(idx);
+        return -1;
+    }
+    return 0;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+/** Removes messages from the index, after they were removed from the
+ *  directory, compacting the remaining records. Must only be called
+ *  with an exclusive lock, if the index was current before the
+ *  messages were removed.
+ *
+ *  Parameters: idx: index to be changed.
+ *              names: file names of the removed messages. This array
+ *                     is sorted by this function.
+ *              count: number of names.
+ *
+ *  Returns: 0 on success, -1 on error (the index is then left stale).
+ */
+int mail_index_remove(mail_index_t idx, const char **names, size_t count) {
+    struct stat file_stat;
+
+    if (fstat(idx->fd, &file_stat) < 0) {
+        invalidate(idx);
+        return -1;
+    }
+
+    size_t size = file_stat.st_size - sizeof(struct mail_index_header);
+    size_t total = size / sizeof(struct mail_index_record), kept = 0;
+    struct mail_index_record *records = malloc(size + 1);
+
+    if (pread(idx->fd, records, size, sizeof(struct mail_index_header)) != (ssize_t)size) {
+        free(records);
+        invalidate(idx);
+        return -1;
+    }
+
+    qsort(names, count, sizeof(char *), compare_names);
+    for (size_t i = 0; i < total; i++) {
+        const char *name = records[i].name;
+        if (!bsearch(&name, names, count, sizeof(char *), compare_names))
+            records[kept++] = records[i];
+    }
+
+    size = kept * sizeof(struct mail_index_record);
+    int rv = pwrite(idx->fd, records, size, sizeof(struct mail_index_header)) == (ssize_t)size &&
+                     ftruncate(idx->fd, sizeof(struct mail_index_header) + size) == 0 &&
+                     write_header(idx) == 0
+                 ? 0
+                 : -1;
+    free(records);
+    if (rv < 0)
+        invalidate(idx);
+    return rv;
+}
+
+/** Replaces the contents of the index with a new list of records,
+ *  typically obtained by scanning the directory. Must only be called
+ *  with an exclusive lock.
+ *
+ *  Parameters: idx: index to be changed.
+ *              records: new list of records.
+ *              count: number of records.
+ *
+ *  Returns: 0 on success, -1 on error (the index is then left stale).
+ */
+int mail_index_rebuild(mail_index_t idx, const struct mail_index_record *records, size_t count) {
+    size_t size = count * sizeof(struct mail_index_record);
+
+    if (ftruncate(idx->fd, sizeof(struct mail_index_header) + size) < 0 ||
+        pwrite(idx->fd, records, size, sizeof(struct mail_index_header)) != (ssize_t)size ||
+        write_header(idx) < 0) {
+        invalidate(idx);
+        return -1;
+    }
+    return 0;
+}
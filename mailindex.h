@@ -0,0 +1,33 @@
+/*
+ * Persistent index of the messages in a mailbox directory.
+ */
+
+#ifndef _MAIL_INDEX_H_
+#define _MAIL_INDEX_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#define MAIL_INDEX_NAME_SIZE 64
+
+/** Entry for a message in the index. The name is the file name of the
+ *  message in the mailbox directory, which is also its unique ID.
+ */
+struct mail_index_record {
+    uint64_t size;
+    char name[MAIL_INDEX_NAME_SIZE];
+};
+
+typedef struct mail_index *mail_index_t;
+
+mail_index_t mail_index_open(const char *dir, int exclusive);
+void mail_index_close(mail_index_t idx);
+
+int mail_index_is_current(mail_index_t idx);
+const struct mail_index_record *mail_index_records(mail_index_t idx, size_t *count);
+
+int mail_index_append(mail_index_t idx, const char *name, uint64_t size);
+int mail_index_remove(mail_index_t idx, const char **names, size_t count);
+int mail_index_rebuild(mail_index_t idx, const struct mail_index_record *records, size_t count);
+
+#endif
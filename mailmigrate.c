@@ -0,0 +1,85 @@
+/*
+ * Moves the mailboxes in the flat layout (mail.store/<user>) to the
+ * hashed layout (mail.store/ab/cd/<user>), while the servers keep
+ * running. The servers find mailboxes in either layout; they should be
+ * restarted with -l hashed so new mailboxes are created in it.
+ *
+ * Usage: ./mailmigrate [-s files|segments|compressed]
+ */
+
+#include "user.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/** Checks if a directory entry is a shard of the hashed layout (two
+ *  hex digits), rather than a mailbox.
+ */
+static int is_shard(const char* name) {
+    return strlen(name) == 2 && isxdigit((unsigned char)name[0]) &&
+           isxdigit((unsigned char)name[1]);
+}
+
+int main(int argc, char* argv[]) {
+    const char* storage = "files";
+    int opt, moved = 0, failed = 0;
+
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        switch (opt) {
+        case 's':
+            storage = optarg;
+            break;
+        default:
+            fprintf(stderr, "Invalid arguments. Expected: %s [-s files|segments|compressed]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    if (set_mail_storage(storage) == -1) {
+        fprintf(stderr, "Unknown mail storage: %s\n", storage);
+        return 1;
+    }
+
+    DIR* dir = opendir(MAIL_BASE_DIRECTORY);
+    if (!dir) {
+        perror(MAIL_BASE_DIRECTORY);
+        return 1;
+    }
+
+    // renaming mailboxes while reading the directory may return them
+    // again or skip others, so the names are read first
+    char** names = NULL;
+    size_t count = 0, capacity = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_type != DT_DIR || entry->d_name[0] == '.' || is_shard(entry->d_name))
+            continue;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            names = realloc(names, capacity * sizeof(char*));
+        }
+        names[count++] = strdup(entry->d_name);
+    }
+    closedir(dir);
+
+    for (size_t i = 0; i < count; i++) {
+        int rv = migrate_user_mail(names[i]);
+        if (rv < 0) {
+            fprintf(stderr, "Could not move mailbox of %s: ", names[i]);
+            perror(NULL);
+            failed++;
+        } else {
+            moved += rv;
+        }
+        free(names[i]);
+    }
+    free(names);
+
+    printf("%d mailboxes moved, %d failed\n", moved, failed);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,267 @@
+/*
+ * Summaries of the mailboxes (number of messages and total size),
+ * shared by all processes using the mail store.
+ *
+ * The summaries are kept in a file of the mail store, mapped into
+ * memory by every process that delivers or deletes messages, so an
+ * unchanged mailbox can be counted without reading its index. Each
+ * mailbox has one slot, found from a 64-bit hash of its name and of the
+ * storage; a mailbox whose slot is taken by another one (or was never
+ * recorded) simply has no summary, and is loaded as usual.
+ *
+ * A summary is only recorded or changed while holding the lock of its
+ * mailbox, from a list just loaded or by the messages just saved or
+ * deleted, so it always matches the mailbox as long as all changes go
+ * through this module. Slots are read without any lock: writers bump a
+ * sequence number around each change (odd while it is in progress),
+ * and readers retry if it changed. Writers of the same slot (mailboxes
+ * sharing it) are serialized by a record lock on the slot, which the
+ * kernel releases if the process dies.
+ *
+ * Summaries changed just before a crash may not match what reached
+ * the disk, so the file records the boot it was created in (from
+ * /proc/sys/kernel/random/boot_id) and is cleared after a reboot.
+ */
+
+#include "mailsummary.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define MAIL_SUMMARY_MAGIC 0x4d55534du  // "MSUM"
+#define MAIL_SUMMARY_VERSION 1
+#define MAIL_SUMMARY_SLOTS 65536          // power of two
+#define MAIL_SUMMARY_BOOT_ID_SIZE 40
+#define MAIL_SUMMARY_READ_TRIES 4
+
+struct mail_summary_header {
+    uint32_t magic;
+    uint32_t version;
+    char boot_id[MAIL_SUMMARY_BOOT_ID_SIZE];  // boot the summaries are valid for
+    uint8_t padding[16];
+};
+
+struct mail_summary_slot {
+    uint32_t sequence;  // odd while the slot is being changed
+    uint32_t count;
+    uint64_t key;       // hash of the mailbox, zero if the slot is empty
+    uint64_t size;
+};
+
+static int summary_fd = -1;
+static struct mail_summary_slot *slots = NULL;
+
+/** Internal function that computes the key of a mailbox (FNV-1a of
+ *  the storage and the name), never zero.
+ */
+static uint64_t summary_key(const char *name, int storage) {
+    uint64_t hash = 14695981039346656037ULL;
+    hash = (hash ^ (unsigned char)storage) * 1099511628211ULL;
+    for (; *name; name++)
+        hash = (hash ^ (unsigned char)*name) * 1099511628211ULL;
+    return hash ? hash : 1;
+}
+
+/** Internal function that takes or releases the record lock of a part
+ *  of the file, waiting for it if needed.
+ */
+static int lock_range(off_t offset, off_t length, short type) {
+    struct flock lock = {.l_type = type, .l_whence = SEEK_SET, .l_start = offset, .l_len = length};
+    int rv;
+    while ((rv = fcntl(summary_fd, F_SETLKW, &lock)) < 0 && errno == EINTR)
+        ;
+    return rv;
+}
+
+/** Internal function that reads the identifier of the current boot.
+ */
+static int read_boot_id(char boot_id[MAIL_SUMMARY_BOOT_ID_SIZE]) {
+    FILE *f = fopen("/proc/sys/kernel/random/boot_id", "r");
+    if (!f) return -1;
+    memset(boot_id, 0, MAIL_SUMMARY_BOOT_ID_SIZE);
+    int rv = fgets(boot_id, MAIL_SUMMARY_BOOT_ID_SIZE, f) ? 0 : -1;
+    fclose(f);
+    return rv;
+}
+
+/** Opens the summaries of the mail store, creating the file if needed
+ *  and clearing it if it was created before the last reboot. Must be
+ *  called before any mailbox is changed, and before the process forks
+ *  its workers (which share the mapping). Until then, and if this
+ *  fails, summaries are never found and changes are ignored.
+ *
+ *  Parameters: path: file of the summaries, in the mail store.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+int mail_summary_open(const char *path) {
+    struct mail_summary_header header, current = {
+        .magic = MAIL_SUMMARY_MAGIC,
+        .version = MAIL_SUMMARY_VERSION,
+    };
+    const size_t size = sizeof(header) + MAIL_SUMMARY_SLOTS * sizeof(struct mail_summary_slot);
+    struct stat file_stat;
+
+    if (slots)
+        return 0;
+    if (read_boot_id(current.boot_id) < 0)
+        return -1;
+    if ((summary_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666)) < 0)
+        return -1;
+
+    // the first process of a boot clears the file while holding the
+    // lock of the header, so others wait to map it
+    void *map = MAP_FAILED;
+    if (lock_range(0, sizeof(header), F_WRLCK) == 0 && fstat(summary_fd, &file_stat) == 0) {
+        if ((size_t)file_stat.st_size != size ||
+            pread(summary_fd, &header, sizeof(header), 0) != sizeof(header) ||
+            memcmp(&header, &current, sizeof(header))) {
+            if (ftruncate(summary_fd, 0) == 0 && ftruncate(summary_fd, size) == 0 &&
+                pwrite(summary_fd, &current, sizeof(current), 0) == sizeof(current))
+                map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, summary_fd, 0);
+        } else {
+            map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, summary_fd, 0);
+        }
+        lock_range(0, sizeof(header), F_UNLCK);
+    }
+
+    if (map == MAP_FAILED) {
+        close(summary_fd);
+        summary_fd = -1;
+        return -1;
+    }
+    slots = (struct mail_summary_slot *)((char *)map + sizeof(header));
+    return 0;
+}
+
+/** Internal function that returns the slot of a key.
+ */
+static struct mail_summary_slot *find_slot(uint64_t key) {
+    return &slots[key & (MAIL_SUMMARY_SLOTS - 1)];
+}
+
+/** Internal function that locks a slot for writing (or unlocks it).
+ */
+static void lock_slot(struct mail_summary_slot *slot, short type) {
+    off_t offset = sizeof(struct mail_summary_header) + (slot - slots) * sizeof(*slot);
+    lock_range(offset, sizeof(*slot), type);
+}
+
+/** Internal function that changes a slot, which must be locked. A
+ *  writer that died during a change left the sequence odd, and it
+ *  stays odd until this change is complete.
+ */
+static void write_slot(struct mail_summary_slot *slot, uint64_t key, uint32_t count, uint64_t size) {
+    uint32_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) | 1;
+
+    __atomic_store_n(&slot->sequence, sequence, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&slot->key, key, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->count, count, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->size, size, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->sequence, sequence + 1, __ATOMIC_RELEASE);
+}
+
+/** Finds the summary of a mailbox, without any lock or system call.
+ *
+ *  Parameters: name: user name of the mailbox.
+ *              storage: storage of the mailbox (MAIL_STORAGE_*).
+ *              count: address where the number of messages is stored.
+ *              size: address where their total size is stored.
+ *
+ *  Returns: 0 if the mailbox has a summary, -1 otherwise.
+ */
+int mail_summary_get(const char *name, int storage, unsigned int *count, size_t *size) {
+    if (!slots) return -1;
+
+    uint64_t key = summary_key(name, storage);
+    struct mail_summary_slot *slot = find_slot(key);
+
+    for (int i = 0; i < MAIL_SUMMARY_READ_TRIES; i++) {
+        uint32_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        if (sequence & 1)
+            continue;
+        uint64_t slot_key = __atomic_load_n(&slot->key, __ATOMIC_RELAXED);
+        uint32_t slot_count = __atomic_load_n(&slot->count, __ATOMIC_RELAXED);
+        uint64_t slot_size = __atomic_load_n(&slot->size, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != sequence)
+            continue;
+
+        if (slot_key != key)
+            return -1;
+        *count = slot_count;
+        *size = slot_size;
+        return 0;
+    }
+    return -1;  // changing all along, or left incomplete
+}
+
+/** Records the summary of a mailbox, replacing the one sharing its
+ *  slot. Must be called while holding the lock of the mailbox, with
+ *  the totals of a list loaded under this lock.
+ *
+ *  Parameters: name: user name of the mailbox.
+ *              storage: storage of the mailbox (MAIL_STORAGE_*).
+ *              count: number of messages.
+ *              size: total size of the messages.
+ */
+void mail_summary_set(const char *name, int storage, unsigned int count, size_t size) {
+    if (!slots) return;
+
+    uint64_t key = summary_key(name, storage);
+    struct mail_summary_slot *slot = find_slot(key);
+    lock_slot(slot, F_WRLCK);
+    write_slot(slot, key, count, size);
+    lock_slot(slot, F_UNLCK);
+}
+
+/** Updates the summary of a mailbox, if it has one, after messages
+ *  were saved into it or deleted from it. Must be called while holding
+ *  the exclusive lock of the mailbox.
+ *
+ *  Parameters: name: user name of the mailbox.
+ *              storage: storage of the mailbox (MAIL_STORAGE_*).
+ *              count: number of messages added (negative if deleted).
+ *              size: total size of the messages added (or deleted).
+ */
+void mail_summary_add(const char *name, int storage, int64_t count, int64_t size) {
+    if (!slots || (!count && !size)) return;
+
+    uint64_t key = summary_key(name, storage);
+    struct mail_summary_slot *slot = find_slot(key);
+    lock_slot(slot, F_WRLCK);
+    if (slot->key == key && !(slot->sequence & 1)) {
+        // a summary that no longer adds up is dropped
+        int64_t new_count = slot->count + count, new_size = slot->size + size;
+        if (new_count < 0 || new_count > UINT32_MAX || new_size < 0)
+            write_slot(slot, 0, 0, 0);
+        else
+            write_slot(slot, key, new_count, new_size);
+    }
+    lock_slot(slot, F_UNLCK);
+}
+
+/** Removes the summary of a mailbox, after it was changed in a way that
+ *  cannot be accounted for (e.g., its index was stale), so it is loaded
+ *  again the next time.
+ *
+ *  Parameters: name: user name of the mailbox.
+ *              storage: storage of the mailbox (MAIL_STORAGE_*).
+ */
+void mail_summary_invalidate(const char *name, int storage) {
+    if (!slots) return;
+
+    uint64_t key = summary_key(name, storage);
+    struct mail_summary_slot *slot = find_slot(key);
+    lock_slot(slot, F_WRLCK);
+    if (slot->key == key || (slot->sequence & 1))
+        write_slot(slot, 0, 0, 0);
+    lock_slot(slot, F_UNLCK);
+}
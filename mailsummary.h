@@ -0,0 +1,19 @@
+/*
+ * Summaries of the mailboxes (number of messages and total size),
+ * shared by all processes using the mail store.
+ */
+
+#ifndef _MAIL_SUMMARY_H_
+#define _MAIL_SUMMARY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+int mail_summary_open(const char *path);
+
+int mail_summary_get(const char *name, int storage, unsigned int *count, size_t *size);
+void mail_summary_set(const char *name, int storage, unsigned int count, size_t size);
+void mail_summary_add(const char *name, int storage, int64_t count, int64_t size);
+void mail_summary_invalidate(const char *name, int storage);
+
+#endif
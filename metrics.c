@@ -0,0 +1,262 @@
+/*
+ * Counters and latency histograms shared by all worker processes.
+ *
+ * Counters and histograms are registered by name before the server
+ * starts, and identified by the number returned at registration. The
+ * values live in shared memory created before the workers are forked,
+ * with a separate slot for each worker, so workers never write to the
+ * same cache lines. Sessions forked by a worker (in fork mode) update
+ * the slot of their worker, so all updates are relaxed atomic adds.
+ *
+ * Histograms count durations in buckets of powers of two microseconds
+ * (bucket b counts durations below 2^b us), which is precise enough for
+ * percentiles and makes recording a value a couple of instructions.
+ * The totals of all slots are written by metrics_dump.
+ *
+ * Gauges hold a level rather than a count (such as the length of a
+ * queue), so they are set instead of added, and have a single value
+ * shared by all workers: the last one set.
+ */
+
+#include "metrics.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define METRICS_MAX 64      // counters and histograms registered at most
+#define METRICS_BUCKETS 40  // last bucket counts durations of 2^38 us and more
+
+struct histogram {
+    uint64_t count;
+    uint64_t sum;  // in microseconds
+    uint64_t buckets[METRICS_BUCKETS];
+};
+
+/** Values updated by one worker process.
+ */
+struct metrics_slot {
+    uint64_t counters[METRICS_MAX];
+    struct histogram histograms[METRICS_MAX];
+} __attribute__((aligned(64)));
+
+static const char *counter_names[METRICS_MAX];
+static const char *histogram_names[METRICS_MAX];
+static const char *gauge_names[METRICS_MAX];
+static int counter_count = 0, histogram_count = 0, gauge_count = 0;
+
+static struct metrics_slot *slots = NULL;  // shared by all workers
+static int slot_count = 0;
+static struct metrics_slot *slot = NULL;   // slot of the current worker
+static uint64_t *gauges = NULL;            // after the slots, shared by all workers
+
+/** Registers a counter. Must be called before metrics_init.
+ *
+ *  Parameters: name: name of the counter in the dump, not copied.
+ *
+ *  Returns: identifier of the counter, or -1 if too many were
+ *           registered (updates are then ignored).
+ */
+int metrics_counter(const char *name) {
+    if (slots || counter_count == METRICS_MAX)
+        return -1;
+    counter_names[counter_count] = name;
+    return counter_count++;
+}
+
+/** Registers a latency histogram. Must be called before metrics_init.
+ *
+ *  Parameters: name: name of the histogram in the dump, not copied.
+ *
+ *  Returns: identifier of the histogram, or -1 if too many were
+ *           registered (measurements are then ignored).
+ */
+int metrics_histogram(const char *name) {
+    if (slots || histogram_count == METRICS_MAX)
+        return -1;
+    histogram_names[histogram_count] = name;
+    return histogram_count++;
+}
+
+/** Registers a gauge. Must be called before metrics_init.
+ *
+ *  Parameters: name: name of the gauge in the dump, not copied.
+ *
+ *  Returns: identifier of the gauge, or -1 if too many were registered
+ *           (updates are then ignored).
+ */
+int metrics_gauge(const char *name) {
+    if (slots || gauge_count == METRICS_MAX)
+        return -1;
+    gauge_names[gauge_count] = name;
+    return gauge_count++;
+}
+
+/** Registers one histogram for each command of a protocol, named
+ *  prefix.VERB, followed by prefix.other for unknown commands.
+ *
+ *  Parameters: prefix: name of the protocol.
+ *              verbs: NULL-terminated list of commands.
+ *
+ *  Returns: identifier of the first histogram, to be passed to
+ *           metrics_verb, or -1 if there is no room for all of them.
+ */
+int metrics_verbs(const char *prefix, const char *const *verbs) {
+    int count = 0;
+    while (verbs[count])
+        count++;
+    if (slots || histogram_count + count + 1 > METRICS_MAX)
+        return -1;
+
+    int first = histogram_count;
+    for (int i = 0; i <= count; i++) {
+        const char *verb = verbs[i] ? verbs[i] : "other";
+        char *name = malloc(strlen(prefix) + strlen(verb) + 2);
+        sprintf(name, "%s.%s", prefix, verb);
+        histogram_names[histogram_count++] = name;
+    }
+    return first;
+}
+
+/** Creates the shared memory for the values. Called once, before the
+ *  workers are forked. Until then, and if this fails, updates are
+ *  ignored.
+ *
+ *  Parameters: workers: number of worker processes.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+int metrics_init(int workers) {
+    void *mem = mmap(NULL, workers * sizeof(struct metrics_slot) + METRICS_MAX * sizeof(uint64_t),
+                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return -1;
+
+    slots = mem;
+    slot_count = workers;
+    slot = slots;
+    gauges = (uint64_t *)(slots + workers);
+    return 0;
+}
+
+/** Selects the slot updated by the current process. Called in each
+ *  worker after it is forked.
+ *
+ *  Parameters: id: index of the worker, from 0 to workers - 1.
+ */
+void metrics_set_worker(int id) {
+    if (slots && id < slot_count)
+        slot = slots + id;
+}
+
+/** Adds a value to a counter.
+ *
+ *  Parameters: counter: identifier returned by metrics_counter.
+ *              value: amount added.
+ */
+void metrics_add(int counter, uint64_t value) {
+    if (slot && counter >= 0)
+        __atomic_fetch_add(&slot->counters[counter], value, __ATOMIC_RELAXED);
+}
+
+/** Sets the value of a gauge.
+ *
+ *  Parameters: gauge: identifier returned by metrics_gauge.
+ *              value: new value.
+ */
+void metrics_set(int gauge, uint64_t value) {
+    if (gauges && gauge >= 0)
+        __atomic_store_n(&gauges[gauge], value, __ATOMIC_RELAXED);
+}
+
+/** Records the time elapsed since the start of a measurement.
+ *
+ *  Parameters: histogram: identifier returned by metrics_histogram.
+ *              start: value of metrics_now at the start.
+ */
+void metrics_record(int histogram, uint64_t start) {
+    if (!slot || histogram < 0)
+        return;
+
+    uint64_t us = (metrics_now() - start) / 1000;
+    int bucket = us ? 64 - __builtin_clzll(us) : 0;
+    if (bucket >= METRICS_BUCKETS)
+        bucket = METRICS_BUCKETS - 1;
+
+    struct histogram *h = &slot->histograms[histogram];
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, us, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->buckets[bucket], 1, __ATOMIC_RELAXED);
+}
+
+/** Returns the histogram of a command.
+ *
+ *  Parameters: first: identifier returned by metrics_verbs.
+ *              verb: index of the command in the list passed to
+ *                    metrics_verbs, or the number of commands in that
+ *                    list for unknown ones (see protocol_parse).
+ *
+ *  Returns: identifier of the histogram for the command.
+ */
+int metrics_verb(int first, int verb) {
+    return first < 0 ? -1 : first + verb;
+}
+
+/** Internal function that returns the upper bound, in microseconds,
+ *  of the bucket holding a percentile of the values in a histogram.
+ */
+static uint64_t percentile(const struct histogram *h, double p) {
+    uint64_t rank = (uint64_t)(h->count * p), seen = 0;
+    for (int b = 0; b < METRICS_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen > rank)
+            return (uint64_t)1 << b;
+    }
+    return (uint64_t)1 << (METRICS_BUCKETS - 1);
+}
+
+/** Writes the totals of all workers, one line per counter, per gauge
+ *  and per histogram that recorded any value. Percentiles are the
+ *  upper bound of their bucket.
+ *
+ *  Parameters: out: stream where the values are written.
+ */
+void metrics_dump(FILE *out) {
+    struct histogram total;
+    int i, w, b;
+
+    if (!slots)
+        return;
+
+    fprintf(out, "metrics: %d workers\n", slot_count);
+    for (i = 0; i < counter_count; i++) {
+        uint64_t value = 0;
+        for (w = 0; w < slot_count; w++)
+            value += __atomic_load_n(&slots[w].counters[i], __ATOMIC_RELAXED);
+        fprintf(out, "%s %llu\n", counter_names[i], (unsigned long long)value);
+    }
+    for (i = 0; i < gauge_count; i++)
+        fprintf(out, "%s %llu\n", gauge_names[i],
+                (unsigned long long)__atomic_load_n(&gauges[i], __ATOMIC_RELAXED));
+
+    for (i = 0; i < histogram_count; i++) {
+        memset(&total, 0, sizeof(total));
+        for (w = 0; w < slot_count; w++) {
+            const struct histogram *h = &slots[w].histograms[i];
+            total.count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+            total.sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+            for (b = 0; b < METRICS_BUCKETS; b++)
+                total.buckets[b] += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+        }
+        if (!total.count)
+            continue;
+
+        fprintf(out, "%s count %llu total_us %llu mean_us %llu p50_us %llu p99_us %llu p999_us %llu\n",
+                histogram_names[i], (unsigned long long)total.count,
+                (unsigned long long)total.sum, (unsigned long long)(total.sum / total.count),
+                (unsigned long long)percentile(&total, 0.5),
+                (unsigned long long)percentile(&total, 0.99),
+                (unsigned long long)percentile(&total, 0.999));
+    }
+    fflush(out);
+}
@@ -0,0 +1,36 @@
+/*
+ * Counters and latency histograms shared by all worker processes.
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+int metrics_counter(const char *name);
+int metrics_histogram(const char *name);
+int metrics_gauge(const char *name);
+int metrics_verbs(const char *prefix, const char *const *verbs);
+
+int metrics_init(int workers);
+void metrics_set_worker(int id);
+
+/** Returns the current time in nanoseconds, to be passed as the start
+ *  of a measurement to metrics_record.
+ */
+static inline uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void metrics_add(int counter, uint64_t value);
+void metrics_set(int gauge, uint64_t value);
+void metrics_record(int histogram, uint64_t start);
+int metrics_verb(int first, int verb);
+
+void metrics_dump(FILE *out);
+
+#endif
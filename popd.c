@@ -1,9 +1,13 @@
+#include "arena.h"
+#include "metrics.h"
+#include "protocol.h"
 #include "server.h"
 #include "socketbuffer.h"
 #include "user.h"
 
-#include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
@@ -12,364 +16,819 @@
 #include <unistd.h>
 
 #define MAX_LINE_LENGTH 1024
-
-static void handle_client(int fd);
+#define SESSION_ARENA_EXTRA 4096  // room for the list of a small mailbox
+
+// Seconds before a session is closed: the autologout timer of RFC 1939
+// (at least 10 minutes without a command) once logged in, and a limit on
+// the whole login, so clients that never authenticate do not keep slots
+#define AUTHORIZATION_TIMEOUT 60
+#define TRANSACTION_TIMEOUT 600
+
+static void* pop_open(int fd);
+static int pop_resume(void* session);
+static void pop_close(void* session);
+
+static const struct server_handler pop_handler = {
+    .open = pop_open,
+    .resume = pop_resume,
+    .close = pop_close,
+    .busy = "-ERR Too many connections, try again later\r\n",
+    .timeout = "-ERR Timeout waiting for input, closing connection\r\n",
+};
+
+// Commands, with their own latency histogram
+enum pop_verb {
+    VERB_USER, VERB_PASS, VERB_CAPA, VERB_STAT, VERB_LIST, VERB_RETR,
+    VERB_TOP, VERB_UIDL, VERB_DELE, VERB_NOOP, VERB_RSET, VERB_QUIT, VERB_STLS,
+    VERB_COUNT  // unknown commands
+};
+static const char* const pop_verbs[] = {
+    [VERB_USER] = "USER", [VERB_PASS] = "PASS", [VERB_CAPA] = "CAPA", [VERB_STAT] = "STAT",
+    [VERB_LIST] = "LIST", [VERB_RETR] = "RETR", [VERB_TOP] = "TOP", [VERB_UIDL] = "UIDL",
+    [VERB_DELE] = "DELE", [VERB_NOOP] = "NOOP", [VERB_RSET] = "RSET", [VERB_QUIT] = "QUIT",
+    [VERB_STLS] = "STLS", [VERB_COUNT] = NULL
+};
+static struct protocol pop_protocol;
+static int verb_metrics, load_metric, summary_metric, received_metric, retr_metric;
+
+// Fixed replies, sent as is
+static const struct sb_string reply_welcome = SB_STRING("+OK POP3 Server Ready\r\n");
+static const struct sb_string reply_positive = SB_STRING("+OK\r\n");
+static const struct sb_string reply_negative = SB_STRING("-ERR\r\n");
+static const struct sb_string reply_capabilities = SB_STRING("+OK\r\nUSER\r\nPIPELINING\r\nTOP\r\nUIDL\r\n.\r\n");
+static const struct sb_string reply_capabilities_stls =
+    SB_STRING("+OK\r\nUSER\r\nPIPELINING\r\nTOP\r\nUIDL\r\nSTLS\r\n.\r\n");
+static const struct sb_string reply_stls = SB_STRING("+OK Begin TLS negotiation\r\n");
+static const struct sb_string reply_end = SB_STRING(".\r\n");
 
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Invalid arguments. Expected: %s <port>\n", argv[0]);
+    struct server_config config;
+    if (server_parse_args(argc, argv, &config) == -1)
+        return 1;
+
+    if (set_mail_storage(config.storage) == -1) {
+        fprintf(stderr, "Unknown mail storage: %s\n", config.storage);
+        return 1;
+    }
+
+    if (set_mail_layout(config.layout) == -1) {
+        fprintf(stderr, "Unknown mail layout: %s\n", config.layout);
         return 1;
     }
 
-    run_server(argv[1], handle_client);
+    protocol_init(&pop_protocol, pop_verbs);
+    verb_metrics = metrics_verbs("pop3", pop_verbs);
+    load_metric = metrics_histogram("pop3.load_user_mail");
+    summary_metric = metrics_counter("pop3.summary_hits");
+    received_metric = metrics_counter("pop3.bytes_received");
+    retr_metric = metrics_counter("pop3.retr_bytes");
+
+    // build the user directory once, before workers are forked
+    if (load_user_directory() == -1)
+        fprintf(stderr, "Could not load users file\n");
+    if (open_mail_summaries() == -1)
+        fprintf(stderr, "Could not open mailbox summaries\n");
+
+    run_server(&config, &pop_handler);
 
     return 0;
 }
 
-/** Sends a welcome message to the given fd
+/** Sends a welcome message to the given connection
  *
- *  Parameters: fd: Socket file descriptor.
+ *  Parameters: sb: Socket buffer of the connection.
  *
  *  Return: number of bytes if successfully sent, -1 if failed
  */
-int sendWelcome(int fd) {
-    return send_string(fd, "+OK POP3 Server Ready\r\n");
+int sendWelcome(socket_buffer_t sb) {
+    return sb_write_string(sb, &reply_welcome);
 }
 
-/** Sends a positive message to the given fd
+/** Sends a positive message to the given connection
  *
- *  Parameters: fd: Socket file descriptor.
+ *  Parameters: sb: Socket buffer of the connection.
  *
  *  Return: number of bytes if successfully sent, -1 if failed
  */
-int sendPositive(int fd) {
-    return send_string(fd, "+OK\r\n");
+int sendPositive(socket_buffer_t sb) {
+    return sb_write_string(sb, &reply_positive);
 }
 
-/** Sends a negative message to the given fd
+/** Sends a negative message to the given connection
  *
- *  Parameters: fd: Socket file descriptor.
+ *  Parameters: sb: Socket buffer of the connection.
  *
  *  Return: number of bytes if successfully sent, -1 if failed
  */
-int sendNegative(int fd) {
-    return send_string(fd, "-ERR\r\n");
+int sendNegative(socket_buffer_t sb) {
+    return sb_write_string(sb, &reply_negative);
 }
 
-/** Sends a message with +OK and mailCount and mailListSize to the given fd
+/** Sends a message with mailCount and mailListSize to the given connection
  *
- *  Parameters: fd: Socket file descriptor.
+ *  Parameters: sb: Socket buffer of the connection.
  *
  *  Return: number of bytes if successfully sent, -1 if failed
  */
-int sendCountPositive(int fd, unsigned int mailCount, size_t size) {
-    char count[MAX_LINE_LENGTH + 1] = "";
-    sprintf(count, "+OK %d %d\r\n", mailCount, (int)size);
-    return send_all(fd, count, strlen(count));
+int sendCount(socket_buffer_t sb, unsigned int mailCount, size_t size) {
+    if (sb_write_uint(sb, mailCount) == -1 || sb_write(sb, " ", 1) == -1 ||
+        sb_write_uint(sb, size) == -1)
+        return -1;
+    return sb_write(sb, "\r\n", 2);
 }
 
-/** Sends a message with mailCount and mailListSize to the given fd
+/** Sends a message with +OK and mailCount and mailListSize to the given connection
  *
- *  Parameters: fd: Socket file descriptor.
+ *  Parameters: sb: Socket buffer of the connection.
  *
  *  Return: number of bytes if successfully sent, -1 if failed
  */
-int sendCount(int fd, unsigned int mailCount, size_t size) {
-    char count[MAX_LINE_LENGTH + 1] = "";
-    sprintf(count, "%d %d\r\n", mailCount, (int)size);
-    return send_all(fd, count, strlen(count));
+int sendCountPositive(socket_buffer_t sb, unsigned int mailCount, size_t size) {
+    if (sb_write(sb, "+OK ", 4) == -1)
+        return -1;
+    return sendCount(sb, mailCount, size);
 }
 
-/** Returns the arguments of given string. String is modified.
+/** Sends the reply to CAPA to the given connection, listing the
+ *  supported extensions (RFC 2449). STLS is only listed until TLS is
+ *  started.
  *
- *  Parameters: str: String containing arguments
+ *  Parameters: sb: Socket buffer of the connection.
+ *              stls: non-zero to list STLS.
  *
- *  Return: the starting char of arguments, or NULL if argument syntax is incorrect.
+ *  Return: number of bytes if successfully sent, -1 if failed
  */
-char* retrieveArgs(char* str) {
-    // returns the next char after "<"
-    char* ret = strchr(str, ' ');
-    if (ret)
-        return strtok(++ret, "\r");
-    return ret;
+int sendCapabilities(socket_buffer_t sb, int stls) {
+    return sb_write_string(sb, stls ? &reply_capabilities_stls : &reply_capabilities);
 }
 
-/** Check if given string only contains numbers.
+/** Sends the unique ID of a message to the given connection, as a
+ *  line of the UIDL response.
  *
- *  Parameters: str: String to be check
+ *  Parameters: sb: Socket buffer of the connection.
+ *              prefix: "+OK " for a single message, "" in a listing.
+ *              pos: Number of the message, starting at 1.
+ *              mail: Message to be listed.
  *
- *  Return: 1 if number, 0 otherwise
+ *  Return: number of bytes if successfully sent, -1 if failed
  */
-int numbers_only(char* s) {
-    while (*s)
-        if (isdigit(*s++) == 0) return 0;
-    return 1;
+int sendUid(socket_buffer_t sb, const char* prefix, unsigned int pos, mail_item_t mail) {
+    size_t length;
+    const char* uid = get_mail_item_uid(mail, &length);
+    if (sb_write(sb, prefix, strlen(prefix)) == -1 || sb_write_uint(sb, pos) == -1 ||
+        sb_write(sb, " ", 1) == -1 || sb_write(sb, uid, length) == -1)
+        return -1;
+    return sb_write(sb, "\r\n", 2);
 }
 
-/** Checks if given string ends with CRLF, or contains any trailing spaces, or only contains CRLF
+/** Compressed message being sent by readCompressedEmail, kept in the
+ *  session while the client has not read the part sent so far.
+ */
+struct pop_reading {
+    decompressor_t decompressor;  // NULL if no message is being sent
+    size_t header_size;           // for TOP, headers sent whole
+    size_t sent;
+    int top;
+    unsigned long lines;  // for TOP, body lines still to be sent
+};
+
+/** Continues sending a message started by readCompressedEmail, until
+ *  it is sent or the socket stops taking the output (see
+ *  server_wait_sent).
  *
- *  Parameters: str: Socket file descriptor.
- *              size: Size of string
+ *  Parameters: sb: Socket buffer of the connection.
+ *              fd: Socket file descriptor.
+ *              reading: message being sent.
  *
- *  Return: 1 if CRLF is at the end, with at least another char in the string,
- *             and string has no trailing spaces, 0 otherwise
+ *  Return: number of bytes if successfully sent, SERVER_SUSPEND if the
+ *          rest waits for the client, -1 if failed
  */
-int checkCRLF(char* str, int size) {
-    // contains only CRLF
-    if (size == 2 && str[size - 2] == 0xd && str[size - 1] == 0xa)
-        return 0;
+int continueCompressedEmail(socket_buffer_t sb, int fd, struct pop_reading* reading) {
+    size_t space;
+    int send_status = 0, done = 0;
+
+    while (!done) {
+        if (server_wait_sent(fd))
+            return SERVER_SUSPEND;
+        char* out = sb_reserve(sb, &space);
+        ssize_t rv = out ? decompressor_read(reading->decompressor, out, space) : -1;
+        if (rv <= 0) {
+            send_status = rv;
+            break;
+        }
 
-    // if ending with CRLF, and the character before CRLF is not a space
-    if (size > 3 && str[size - 2] == 0xd && str[size - 1] == 0xa) {
-        if (!isspace(str[size - 3]))
-            return 1;
+        // for TOP, the headers are sent whole, then lines are counted
+        size_t size = rv;
+        if (reading->top) {
+            size_t pos = reading->sent < reading->header_size ? reading->header_size - reading->sent : 0;
+            if (pos < size) {
+                const char* lf;
+                while (reading->lines && (lf = memchr(out + pos, '\n', size - pos))) {
+                    pos = lf - out + 1;
+                    reading->lines--;
+                }
+                if (!reading->lines) {
+                    size = pos;
+                    done = 1;
+                }
+            }
+        }
+        sb_commit(sb, size);
+        reading->sent += size;
     }
+    decompressor_close(reading->decompressor);
+    reading->decompressor = NULL;
 
-    return 0;
+    if (send_status != -1) {
+        if (!reading->top)
+            metrics_add(retr_metric, reading->sent);
+        send_status = sb_write_string(sb, &reply_end);
+    }
+    return send_status;
 }
 
-/** Checks if given string ends with CRLF.
+/** Sends an email stored compressed to the client, decompressing it
+ *  straight into the output buffer of the connection. For TOP, only
+ *  the headers and the first lines of the body are decompressed and
+ *  sent. An error once the reply has started ends the session, since
+ *  the client cannot be told about it anymore.
+ *
+ *  In the event loops, decompression stops whenever the client has
+ *  not read the output yet: this returns SERVER_SUSPEND, and the
+ *  caller continues with continueCompressedEmail once woken.
  *
- *  Parameters: str: String to be checked
- *              size: Size of string
+ *  Parameters: sb: Socket buffer of the connection.
+ *              fd: Socket file descriptor.
+ *              mail: pointer to mail item that needs to be read
+ *              top: non-zero to stop after the given number of lines
+ *              lines: number of body lines to be sent, for TOP
+ *              reading: where the message being sent is kept
  *
- *  Return: 1 if CRLF is at the end, 0 otherwise
+ *  Return: number of bytes if successfully sent, SERVER_SUSPEND if the
+ *          rest waits for the client, -1 if failed
  */
-int checkCRLFSimple(char* str, int size) {
-    if (size > 1 && str[size - 2] == 0xd && str[size - 1] == 0xa)
-        return 1;
-    return 0;
+int readCompressedEmail(socket_buffer_t sb, int fd, mail_item_t mail, int top, unsigned long lines,
+                        struct pop_reading* reading) {
+    decompressor_t d = open_mail_item_decompressor(mail);
+
+    if (!d)
+        return sendNegative(sb);
+    if (sendPositive(sb) == -1) {
+        decompressor_close(d);
+        return -1;
+    }
+
+    reading->decompressor = d;
+    reading->header_size = top ? get_mail_item_header_size(mail) : 0;
+    reading->sent = 0;
+    reading->top = top;
+    reading->lines = lines;
+    return continueCompressedEmail(sb, fd, reading);
 }
 
-/** Read given email.
+/** Sends given email to the client. Messages are stored already
+ *  dot-stuffed and with CRLF line endings, so the file is sent as is,
+ *  followed by the termination line. Pending replies are sent before
+ *  the file, which is copied directly from the file to the socket.
  *
- *  Parameters: fd: String to be checked
+ *  In the event loops, the file is sent without blocking the session
+ *  (see send_file_async): this returns SERVER_SUSPEND, and the
+ *  termination line is sent by the caller once the session is woken.
+ *  Compressed messages are always sent by readCompressedEmail.
+ *
+ *  Parameters: sb: Socket buffer of the connection.
+ *              fd: Socket file descriptor.
  *              mail: pointer to mail item that needs to be read
+ *              transfer_status: set once an asynchronous transfer is done
+ *              reading: where a compressed message being sent is kept
  *
- *  Return: 1 if CRLF is at the end, 0 otherwise
+ *  Return: number of bytes if successfully sent, SERVER_SUSPEND if the
+ *          file is being sent, -1 if failed
  */
-int readEmail(int fd, mail_item_t mail) {
+int readEmail(socket_buffer_t sb, int fd, mail_item_t mail, int* transfer_status, struct pop_reading* reading) {
     int send_status;
-    int readfd = open(get_mail_item_filename(mail), O_RDONLY);
+    off_t offset;
 
-    if (readfd > 0) {
-        // no open error
-        char* content = malloc((MAX_LINE_LENGTH * sizeof(char)) + 1);
-        send_status = sendPositive(fd);
-        int i = 0;
-
-        // read the file one character at a time
-        while (read(readfd, &content[i], 1) == 1) {
-            // we keep reading until we see a '\n'
-            if (content[i] == '\n') {
-                // at end of line, we should now send this line
-                // we add a null terminator
-                content[i + 1] = '\0';
-                send_all(fd, content, strlen(content));
-                i = 0;
-                continue;
-            }
-            i++;  // we did not reach the end of the line, so we keep going!
-        }
+    if (is_mail_item_compressed(mail))
+        return readCompressedEmail(sb, fd, mail, 0, 0, reading);
+
+    int readfd = open_mail_item(mail, &offset);
 
-        // entire message has been read
-        send_status = send_string(fd, ".\r\n");
+    if (readfd >= 0) {
+        // no open error
+        send_status = sendPositive(sb);
+        if (send_status != -1)
+            send_status = sb_flush(sb);
+        if (send_status != -1 &&
+            send_file_async(fd, readfd, offset, get_mail_item_size(mail), transfer_status) == 0)
+            return SERVER_SUSPEND;
+        if (send_status != -1)
+            send_status = send_file(fd, readfd, offset, get_mail_item_size(mail));
+        if (send_status != -1)
+            metrics_add(retr_metric, get_mail_item_size(mail));
+
+        // entire message has been sent
+        if (send_status != -1)
+            send_status = sb_write_string(sb, &reply_end);
         close(readfd);
-        free(content);
 
     } else {
-        send_status = sendNegative(fd);
+        send_status = sendNegative(sb);
     }
     return send_status;
 }
 
-void handle_client(int fd) {
-    // State variables
-    int authorization = 1;
-    int transaction = 0;
-    int accepted_user = 0;
+/** Sends the headers of given email and the first lines of its body
+ *  to the client. The size of the headers was recorded at delivery,
+ *  so only the requested body lines are read from the file to find
+ *  where they end; then the whole range is sent as in readEmail,
+ *  including without blocking the session in the event loops.
+ *
+ *  Parameters: sb: Socket buffer of the connection.
+ *              fd: Socket file descriptor.
+ *              mail: pointer to mail item that needs to be read
+ *              lines: number of body lines to be sent
+ *              transfer_status: set once an asynchronous transfer is done
+ *              reading: where a compressed message being sent is kept
+ *
+ *  Return: number of bytes if successfully sent, SERVER_SUSPEND if the
+ *          file is being sent, -1 if failed
+ */
+int readEmailTop(socket_buffer_t sb, int fd, mail_item_t mail, unsigned long lines, int* transfer_status,
+                 struct pop_reading* reading) {
+    if (is_mail_item_compressed(mail))
+        return readCompressedEmail(sb, fd, mail, 1, lines, reading);
 
-    // other variables
-    int reply_size;
-    int send_status = 1;
-    char command[41];
-    char reply[MAX_LINE_LENGTH + 1];
+    int send_status;
+    size_t size = get_mail_item_size(mail);
+    size_t end = get_mail_item_header_size(mail);
+    off_t offset;
+    int readfd = open_mail_item(mail, &offset);
+
+    if (readfd < 0)
+        return sendNegative(sb);
+
+    char buf[4096];
+    ssize_t rv;
+    while (lines && end < size && (rv = pread(readfd, buf, sizeof(buf), offset + end)) > 0) {
+        const char *pos = buf, *lf;
+        while (lines && (lf = memchr(pos, '\n', rv - (pos - buf)))) {
+            pos = lf + 1;
+            lines--;
+        }
+        end += pos - buf;
+        if (lines)
+            end += rv - (pos - buf);
+    }
+    if (end > size)
+        end = size;
+
+    send_status = sendPositive(sb);
+    if (send_status != -1)
+        send_status = sb_flush(sb);
+    if (send_status != -1 && send_file_async(fd, readfd, offset, end, transfer_status) == 0)
+        return SERVER_SUSPEND;
+    if (send_status != -1)
+        send_status = send_file(fd, readfd, offset, end);
+    if (send_status != -1)
+        send_status = sb_write_string(sb, &reply_end);
+    close(readfd);
+    return send_status;
+}
+
+/** States of a POP3 session, as defined in RFC 1939.
+ */
+enum pop_state {
+    POP_AUTHORIZATION,  // waiting for USER/PASS
+    POP_TRANSACTION     // user authenticated, mailbox loaded
+};
+
+struct pop_session {
+    int fd;
+    arena_t arena;  // holds the session, its buffer and its mailbox list
+    socket_buffer_t buffer;
+    enum pop_state state;
+    int accepted_user;
     char username[MAX_USERNAME_SIZE + 1];
     char password[MAX_USERNAME_SIZE + 1];
-    socket_buffer_t buffer = sb_create(fd, MAX_LINE_LENGTH);
+    mail_list_t mailList;
+    int mailLoaded;         // mailList was loaded (it is NULL for an empty mailbox)
+    unsigned int mailCount;
+    size_t mailSize;        // total size of the messages, until mailList is loaded
+    int handshaking;        // STLS accepted, waiting for the TLS handshake to complete
+    int transferring;       // RETR or TOP waiting for its message to be sent
+    int transfer_verb;
+    int transfer_status;    // result of send_file_async
+    size_t transfer_size;   // bytes counted as retrieved once sent
+    uint64_t transfer_start;  // start of the command, for its metric
+    struct pop_reading reading;  // compressed message being sent
+};
+
+/** Creates a new POP3 session for a connection and sends the welcome
+ *  message.
+ *
+ *  The session, its socket buffer and the list of messages loaded by
+ *  PASS are allocated from an arena, destroyed with the session, so
+ *  sessions reuse the memory of earlier ones instead of calling malloc.
+ *
+ *  Parameters: fd: Socket file descriptor.
+ *
+ *  Return: the new session, or NULL if the welcome message could not be sent
+ */
+static void* pop_open(int fd) {
+    arena_t arena = arena_create(sizeof(struct pop_session) + sb_memory_size(MAX_LINE_LENGTH) +
+                                 SESSION_ARENA_EXTRA);
+    if (!arena)
+        return NULL;
+    struct pop_session* session = arena_alloc(arena, sizeof(struct pop_session));
+    session->fd = fd;
+    session->arena = arena;
+    session->buffer = sb_create(fd, MAX_LINE_LENGTH, arena);
+    session->state = POP_AUTHORIZATION;
+    session->accepted_user = 0;
+    session->mailList = NULL;
+    session->mailLoaded = 0;
+    session->mailCount = 0;
+    session->mailSize = 0;
+    session->handshaking = 0;
+    session->transferring = 0;
+    session->reading.decompressor = NULL;
+
+    // initial message, sent right away since the client waits for it
+    if (sendWelcome(session->buffer) == -1 || sb_flush(session->buffer) == -1) {
+        arena_destroy(arena);
+        return NULL;
+    }
+    server_set_timeout(fd, AUTHORIZATION_TIMEOUT);
+    return session;
+}
+
+/** Sends any pending replies and frees all memory used by a POP3
+ *  session. If the session ended without a QUIT, messages marked as
+ *  deleted are kept, as required by RFC 1939.
+ *
+ *  Parameters: arg: Session to be freed.
+ */
+static void pop_close(void* arg) {
+    struct pop_session* session = arg;
+    sb_flush(session->buffer);
+    metrics_add(received_metric, sb_received(session->buffer));
+    if (session->reading.decompressor)
+        decompressor_close(session->reading.decompressor);
+    if (session->mailList) {
+        reset_mail_list_deleted_flag(session->mailList);
+        destroy_mail_list(session->mailList);
+    }
+    sb_destroy(session->buffer);
+    arena_destroy(session->arena);
+}
+
+/** Function handling a command accepted in the current state. Returns
+ *  -1 if the session is finished, and any other value otherwise.
+ */
+typedef int (*pop_command_t)(struct pop_session* session, const struct protocol_command* cmd);
+
+/** Returns the list of messages of an authenticated session, loading
+ *  it the first time it is needed if PASS found the summary of the
+ *  mailbox instead. Messages delivered since PASS are left out, so
+ *  they keep the numbers given by STAT until the next session.
+ *
+ *  If the start of the loaded list does not match the summary, the
+ *  summary was stale: it is removed, and the whole list is used, since
+ *  its first messages are not the ones the summary counted.
+ *
+ *  Parameters: session: POP3 session in the transaction state.
+ *
+ *  Return: the list, or NULL if the mailbox is empty
+ */
+static mail_list_t pop_mail_list(struct pop_session* session) {
+    if (!session->mailLoaded) {
+        uint64_t start = metrics_now();
+        session->mailList = load_user_mail(session->username, session->arena);
+        metrics_record(load_metric, start);
+        if (session->mailCount != UINT_MAX &&
+            truncate_mail_list(session->mailList, session->mailCount, session->mailSize) == -1)
+            invalidate_mail_summary(session->username);
+        session->mailCount = get_mail_count(session->mailList);
+        session->mailLoaded = 1;
+    }
+    return session->mailList;
+}
+
+/** Sends the number of messages not marked as deleted and their total
+ *  size, from the summary of the mailbox until its list is loaded.
+ *
+ *  Parameters: session: POP3 session in the transaction state.
+ *
+ *  Return: number of bytes if successfully sent, -1 if failed
+ */
+static int pop_send_count(struct pop_session* session) {
+    if (!session->mailLoaded)
+        return sendCountPositive(session->buffer, session->mailCount, session->mailSize);
+    return sendCountPositive(session->buffer, get_mail_count(session->mailList),
+                             get_mail_list_size(session->mailList));
+}
+
+/** Finds the message with the number given as argument of a command.
+ *
+ *  Parameters: session: POP3 session in the transaction state.
+ *              arg: Number of the message, starting at 1.
+ *              index: Set to the number of the message.
+ *
+ *  Return: the message, or NULL if the argument is not a valid number
+ *          or there is no such message
+ */
+static mail_item_t pop_find_mail(struct pop_session* session, struct protocol_span arg,
+                                 unsigned long* index) {
+    mail_list_t mailList = pop_mail_list(session);
+    if (protocol_number(arg, index) == -1 || *index < 1 || *index > session->mailCount)
+        return NULL;
+    return get_mail_item(mailList, *index - 1);
+}
+
+static int pop_user(struct pop_session* session, const struct protocol_command* cmd) {
+    // stores argument into username string
+    if (!cmd->has_args || protocol_copy(cmd->args, session->username, sizeof(session->username)) == -1 ||
+        !is_valid_user(session->username, NULL))
+        return sendNegative(session->buffer);
+
+    session->accepted_user = 1;
+    return sendPositive(session->buffer);
+}
+
+static int pop_pass(struct pop_session* session, const struct protocol_command* cmd) {
+    // stores arguments into password string
+    if (!session->accepted_user || !cmd->has_args ||
+        protocol_copy(cmd->args, session->password, sizeof(session->password)) == -1 ||
+        !is_valid_user(session->username, session->password)) {
+        // invalid user
+        session->accepted_user = 0;
+        return sendNegative(session->buffer);
+    }
+
+    // valid user: the mailbox is only loaded once a command needs its
+    // messages, unless it has no summary
+    session->state = POP_TRANSACTION;
+    if (get_mail_summary(session->username, &session->mailCount, &session->mailSize) == 0) {
+        metrics_add(summary_metric, 1);
+        return sendPositive(session->buffer);
+    }
+    session->mailCount = UINT_MAX;  // nothing to leave out
+    pop_mail_list(session);
+    return sendPositive(session->buffer);
+}
+
+static int pop_capa(struct pop_session* session, const struct protocol_command* cmd) {
+    if (cmd->has_args)
+        return sendNegative(session->buffer);
+    return sendCapabilities(session->buffer, server_tls_available() && !server_tls_active(session->fd) &&
+                                                 session->state == POP_AUTHORIZATION);
+}
 
+static int pop_stls(struct pop_session* session, const struct protocol_command* cmd) {
+    if (cmd->has_args || !server_tls_available() || server_tls_active(session->fd))
+        return sendNegative(session->buffer);
+
+    // the reply must be the last data sent in the clear
+    if (sb_write_string(session->buffer, &reply_stls) == -1 || sb_flush(session->buffer) == -1 ||
+        server_start_tls(session->fd) == -1)
+        return -1;
+
+    // commands sent along with STLS are discarded, and so is a USER
+    // sent before it (RFC 2595)
+    sb_discard(session->buffer);
+    session->accepted_user = 0;
+    session->handshaking = 1;
+    return 0;
+}
+
+static int pop_quit(struct pop_session* session, const struct protocol_command* cmd) {
+    if (cmd->has_args)
+        return sendNegative(session->buffer);
+
+    // messages marked as deleted are removed with the list
+    if (session->mailList) {
+        destroy_mail_list(session->mailList);
+        session->mailList = NULL;
+    }
+    sendPositive(session->buffer);
+    return -1;
+}
+
+static int pop_stat(struct pop_session* session, const struct protocol_command* cmd) {
+    if (cmd->has_args)
+        return sendNegative(session->buffer);
+    return pop_send_count(session);
+}
+
+static int pop_list(struct pop_session* session, const struct protocol_command* cmd) {
+    socket_buffer_t sb = session->buffer;
+    mail_list_t mailList = pop_mail_list(session);
     mail_item_t mail;
-    mail_list_t mailList;
-    unsigned int mailCount = 0;
-
-    // initial message
-    send_status = sendWelcome(fd);
-
-    while (1) {
-        reply_size = sb_read_line(buffer, reply);
-
-        if (reply_size == 0 || reply_size == -1 || send_status == -1) break;
-
-        sscanf(reply, "%s", command);
-
-        // check line ends with CRLF, and does not contain any trailing whitespaces. This can
-        //       also detect if line is too long
-        if (checkCRLF(reply, reply_size)) {
-            // STATE: AUTHORIZATION
-            if (authorization) {
-                if (strcasecmp(command, "USER") == 0) {
-                    // if size == 6, no arguments was received
-                    if (reply_size != 6) {
-                        // stores argument into username string
-                        strcpy(username, retrieveArgs(reply));
-
-                        if (is_valid_user(username, NULL)) {
-                            accepted_user = 1;
-                            send_status = sendPositive(fd);
-
-                        } else {
-                            send_status = sendNegative(fd);
-                        }
-
-                    } else {
-                        send_status = sendNegative(fd);
-                    }
-
-                } else if (strcasecmp(command, "PASS") == 0) {
-                    // if size == 6, no arguments was received
-                    if (accepted_user && reply_size != 6) {
-                        // stores arguments into password string
-                        strcpy(password, retrieveArgs(reply));
-
-                        if (is_valid_user(username, password)) {
-                            // valid user
-                            authorization = 0;
-                            transaction = 1;
-                            mailList = load_user_mail(username);
-                            mailCount = get_mail_count(mailList);
-                            send_status = sendPositive(fd);
-
-                        } else {
-                            // invalid user
-                            accepted_user = 0;
-                            send_status = sendNegative(fd);
-                        }
-
-                    } else {
-                        accepted_user = 0;
-                        send_status = sendNegative(fd);
-                    }
-
-                } else if (strcasecmp(command, "QUIT") == 0 && reply_size == 6) {
-                    send_status = sendPositive(fd);
-                    break;
-
-                } else {
-                    send_status = sendNegative(fd);
-                }
-            }
+    unsigned long index;
+    int send_status;
 
-            // STATE: TRANSACTION
-            else if (transaction) {
-                if (strcasecmp(command, "STAT") == 0 && reply_size == 6) {
-                    send_status = sendCountPositive(fd, get_mail_count(mailList), get_mail_list_size(mailList));
-
-                } else if (strcasecmp(command, "LIST") == 0) {
-                    if (reply_size == 6) {
-                        // no arguments
-                        send_status = sendCountPositive(fd, get_mail_count(mailList), get_mail_list_size(mailList));
-
-                        for (unsigned int i = 0; i < mailCount; i++) {
-                            if ((mail = get_mail_item(mailList, i)))
-                                send_status = sendCount(fd, i + 1, get_mail_item_size(mail));
-                        }
-                        send_status = send_string(fd, ".\r\n");
-
-                    } else {
-                        // contains arguments
-                        char* arg = retrieveArgs(reply);
-
-                        // check if arguments only contain numbers
-                        if (arg && numbers_only(arg)) {
-                            unsigned int index = (int)strtol(arg, NULL, 10);
-
-                            if ((mail = get_mail_item(mailList, index - 1)))
-                                send_status = sendCountPositive(fd, index, get_mail_item_size(mail));
-                            else
-                                send_status = sendNegative(fd);
-
-                        } else {
-                            send_status = sendNegative(fd);
-                        }
-                    }
-
-                } else if (strcasecmp(command, "RETR") == 0) {
-                    char* arg = retrieveArgs(reply);
-
-                    if (arg && numbers_only(arg)) {
-                        unsigned int index = (int)strtol(arg, NULL, 10);
-
-                        if ((mail = get_mail_item(mailList, index - 1))) {
-                            // call helper to read the email
-                            send_status = readEmail(fd, mail);
-
-                        } else {
-                            send_status = sendNegative(fd);
-                        }
-
-                    } else {
-                        send_status = sendNegative(fd);
-                    }
-
-                } else if (strcasecmp(command, "DELE") == 0) {
-                    char* arg = retrieveArgs(reply);
-
-                    // check if arguments only contain numbers
-                    if (arg && numbers_only(arg)) {
-                        unsigned int index = (int)strtol(arg, NULL, 10);
-
-                        if ((mail = get_mail_item(mailList, index - 1))) {
-                            mark_mail_item_deleted(mail);
-                            send_status = sendPositive(fd);
-                        } else {
-                            send_status = sendNegative(fd);
-                        }
-
-                    } else {
-                        send_status = sendNegative(fd);
-                    }
-
-                } else if (strcasecmp(command, "NOOP") == 0) {
-                    send_status = sendPositive(fd);
-
-                } else if (strcasecmp(command, "RSET") == 0 && reply_size == 6) {
-                    reset_mail_list_deleted_flag(mailList);
-                    send_status = sendCountPositive(fd, get_mail_count(mailList), get_mail_list_size(mailList));
-
-                } else if (strcasecmp(command, "QUIT") == 0 && reply_size == 6) {
-                    destroy_mail_list(mailList);
-                    send_status = sendPositive(fd);
-                    break;
-
-                } else {
-                    send_status = sendNegative(fd);
-                }
-            }
+    if (cmd->has_args) {
+        if ((mail = pop_find_mail(session, cmd->args, &index)))
+            return sendCountPositive(sb, index, get_mail_item_size(mail));
+        return sendNegative(sb);
+    }
 
-            else {
-                // Should not ever reach this block
-                send_status = sendNegative(fd);
-            }
+    send_status = pop_send_count(session);
+    for (unsigned int i = 0; i < session->mailCount; i++) {
+        if ((mail = get_mail_item(mailList, i)))
+            send_status = sendCount(sb, i + 1, get_mail_item_size(mail));
+    }
+    if (send_status != -1)
+        send_status = sb_write_string(sb, &reply_end);
+    return send_status;
+}
+
+static int pop_retr(struct pop_session* session, const struct protocol_command* cmd) {
+    mail_item_t mail;
+    unsigned long index;
+
+    if (!cmd->has_args || !(mail = pop_find_mail(session, cmd->args, &index)))
+        return sendNegative(session->buffer);
+
+    // call helper to read the email
+    int send_status = readEmail(session->buffer, session->fd, mail, &session->transfer_status,
+                                &session->reading);
+    if (send_status == SERVER_SUSPEND) {
+        // compressed messages count what they sent themselves
+        session->transferring = 1;
+        session->transfer_verb = VERB_RETR;
+        session->transfer_size = session->reading.decompressor ? 0 : get_mail_item_size(mail);
+        return 0;
+    }
+    return send_status;
+}
+
+static int pop_top(struct pop_session* session, const struct protocol_command* cmd) {
+    struct protocol_span args = cmd->args, number;
+    unsigned long index, lines;
+    mail_item_t mail;
 
-        } else {
-            // reply did not terminate with CRLF, or contained trailing spaces
-            send_status = sendNegative(fd);
+    // two arguments, message number and number of lines
+    if (!cmd->has_args || protocol_split(&args, &number) == -1 ||
+        protocol_number(args, &lines) == -1 || !(mail = pop_find_mail(session, number, &index)))
+        return sendNegative(session->buffer);
+
+    int send_status = readEmailTop(session->buffer, session->fd, mail, lines, &session->transfer_status,
+                                   &session->reading);
+    if (send_status == SERVER_SUSPEND) {
+        session->transferring = 1;
+        session->transfer_verb = VERB_TOP;
+        session->transfer_size = 0;
+        return 0;
+    }
+    return send_status;
+}
+
+static int pop_uidl(struct pop_session* session, const struct protocol_command* cmd) {
+    socket_buffer_t sb = session->buffer;
+    mail_list_t mailList = pop_mail_list(session);
+    mail_item_t mail;
+    unsigned long index;
+    int send_status;
+
+    if (cmd->has_args) {
+        if ((mail = pop_find_mail(session, cmd->args, &index)))
+            return sendUid(sb, "+OK ", index, mail);
+        return sendNegative(sb);
+    }
+
+    send_status = sendPositive(sb);
+    for (unsigned int i = 0; i < session->mailCount; i++) {
+        if ((mail = get_mail_item(mailList, i)))
+            send_status = sendUid(sb, "", i + 1, mail);
+    }
+    if (send_status != -1)
+        send_status = sb_write_string(sb, &reply_end);
+    return send_status;
+}
+
+static int pop_dele(struct pop_session* session, const struct protocol_command* cmd) {
+    mail_item_t mail;
+    unsigned long index;
+
+    if (!cmd->has_args || !(mail = pop_find_mail(session, cmd->args, &index)))
+        return sendNegative(session->buffer);
+    mark_mail_item_deleted(mail);
+    return sendPositive(session->buffer);
+}
+
+static int pop_noop(struct pop_session* session, const struct protocol_command* cmd) {
+    return sendPositive(session->buffer);
+}
+
+static int pop_rset(struct pop_session* session, const struct protocol_command* cmd) {
+    if (cmd->has_args)
+        return sendNegative(session->buffer);
+    reset_mail_list_deleted_flag(session->mailList);
+    return pop_send_count(session);
+}
+
+/** Handler of each command in each state, as defined in RFC 1939;
+ *  commands without one get a negative reply.
+ */
+static const pop_command_t pop_commands[][VERB_COUNT + 1] = {
+    [POP_AUTHORIZATION] = {
+        [VERB_USER] = pop_user, [VERB_PASS] = pop_pass, [VERB_CAPA] = pop_capa, [VERB_QUIT] = pop_quit,
+        [VERB_STLS] = pop_stls,
+    },
+    [POP_TRANSACTION] = {
+        [VERB_STAT] = pop_stat, [VERB_LIST] = pop_list, [VERB_RETR] = pop_retr, [VERB_TOP] = pop_top,
+        [VERB_UIDL] = pop_uidl, [VERB_DELE] = pop_dele, [VERB_NOOP] = pop_noop, [VERB_CAPA] = pop_capa,
+        [VERB_RSET] = pop_rset, [VERB_QUIT] = pop_quit,
+    },
+};
+
+/** Handles a single command received from the client, according to
+ *  the current state of the session.
+ *
+ *  Parameters: session: POP3 session receiving the command.
+ *              cmd: Command line, split by protocol_parse.
+ *
+ *  Return: 0 if the session should continue, SERVER_SUSPEND if it waits
+ *          for a message being sent, -1 if it is finished
+ */
+static int pop_process_line(struct pop_session* session, const struct protocol_command* cmd) {
+    pop_command_t command = NULL;
+
+    // lines that do not end with CRLF (including lines too long) or
+    // contain trailing whitespace get a negative reply
+    if (cmd->terminated)
+        command = pop_commands[session->state][cmd->verb];
+
+    int send_status = command ? command(session, cmd) : sendNegative(session->buffer);
+
+    // could not send message, closing connection
+    if (send_status == -1)
+        return -1;
+    return session->transferring ? SERVER_SUSPEND : 0;
+}
+
+/** Handles all lines currently available from the client. In fork
+ *  mode the socket is blocking, so this only returns once the session
+ *  is finished.
+ *
+ *  Parameters: arg: POP3 session to be resumed.
+ *
+ *  Return: 0 if waiting for more input, SERVER_SUSPEND while a message
+ *          is being sent, -1 if the session is finished
+ */
+static int pop_resume(void* arg) {
+    struct pop_session* session = arg;
+    struct protocol_command cmd;
+    const char* line;
+    int reply_size;
+
+    if (session->transferring) {
+        // woken once the message of the last RETR or TOP was sent, or
+        // once the client read the part of a compressed one sent so far
+        int rv;
+        if (session->reading.decompressor)
+            rv = continueCompressedEmail(session->buffer, session->fd, &session->reading);
+        else
+            rv = session->transfer_status == -1 ? -1 : sb_write_string(session->buffer, &reply_end);
+        if (rv == SERVER_SUSPEND)
+            return SERVER_SUSPEND;
+        session->transferring = 0;
+        if (rv == -1)
+            return -1;
+        metrics_add(retr_metric, session->transfer_size);
+        metrics_record(metrics_verb(verb_metrics, session->transfer_verb), session->transfer_start);
+        server_set_timeout(session->fd, TRANSACTION_TIMEOUT);
+    }
+
+    for (;;) {
+        if (session->handshaking) {
+            // 0 while waiting for more of the handshake from the client
+            int rv = server_tls_handshake(session->fd);
+            if (rv <= 0)
+                return rv;
+            session->handshaking = 0;
         }
 
-        // could not send message, closing connection
-        if (send_status == -1) break;
+        // lines are parsed in place, in the input buffer
+        if ((reply_size = sb_next_line(session->buffer, &line)) <= 0)
+            break;
+        uint64_t start = metrics_now();
+        protocol_parse(&pop_protocol, line, reply_size, &cmd);
+        int rv = pop_process_line(session, &cmd);
+        if (rv == SERVER_SUSPEND) {
+            session->transfer_start = start;
+            return SERVER_SUSPEND;
+        }
+        metrics_record(metrics_verb(verb_metrics, cmd.verb), start);
+        if (rv == -1)
+            return -1;
+        if (session->state == POP_TRANSACTION)
+            server_set_timeout(session->fd, TRANSACTION_TIMEOUT);
     }
 
-    // free allocated socketbuffer
-    sb_destroy(buffer);
+    if (reply_size == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+    return -1;
 }
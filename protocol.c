@@ -0,0 +1,172 @@
+/*
+ * Parser for the command lines of the text protocols (SMTP and POP3).
+ *
+ * Each line is scanned once. The verb, which has at most eight letters
+ * in both protocols (STARTTLS), is packed into a 64-bit opcode with its
+ * letters upper-cased (clearing bit 5 of each byte), so finding the
+ * command is one integer comparison per known verb, instead of copying
+ * the verb and comparing strings. The arguments are returned as a span
+ * of the line, to be checked in place by the command.
+ */
+
+#include "protocol.h"
+
+#include <ctype.h>
+#include <limits.h>
+#include <strings.h>
+
+#define OPCODE_FOLD 0xdfdfdfdfdfdfdfdfull  // clears bit 5 of each byte: a-z to A-Z
+#define OPCODE_MAX_LENGTH 8
+
+/** Internal function that returns the number of bytes in the verb at
+ *  the start of a line.
+ */
+static size_t verb_length(const char *line, size_t size) {
+    size_t i = 0;
+    while (i < size && line[i] != ' ' && line[i] != '\t' && line[i] != '\r' &&
+           line[i] != '\n' && line[i] != '\0')
+        i++;
+    return i;
+}
+
+/** Internal function that packs a verb of at most eight bytes, one
+ *  byte per 8 bits, case-folded.
+ */
+static uint64_t pack_opcode(const char *verb, size_t length) {
+    uint64_t opcode = 0;
+    for (size_t i = 0; i < length; i++)
+        opcode |= (uint64_t)(unsigned char)verb[i] << (8 * i);
+    return opcode & OPCODE_FOLD;
+}
+
+/** Builds the opcodes of the commands of a protocol.
+ *
+ *  Parameters: p: protocol to be initialized.
+ *              verbs: NULL-terminated list of verbs, of one to eight
+ *                     letters. The index of a verb in this list is the
+ *                     one returned by protocol_parse.
+ *
+ *  Returns: 0 on success, -1 if a verb is not valid or there are more
+ *           than PROTOCOL_MAX_VERBS.
+ */
+int protocol_init(struct protocol *p, const char *const *verbs) {
+    for (p->count = 0; verbs[p->count]; p->count++) {
+        size_t length = strlen(verbs[p->count]);
+        if (p->count == PROTOCOL_MAX_VERBS || length < 1 || length > OPCODE_MAX_LENGTH)
+            return -1;
+        p->opcodes[p->count] = pack_opcode(verbs[p->count], length);
+    }
+    return 0;
+}
+
+/** Splits a command line into its verb and arguments.
+ *
+ *  A line is terminated if it ends with CRLF, has something before it
+ *  and no space right before it; only then are the arguments set. They
+ *  start after the first space following the verb, so they may start
+ *  with more spaces, and they end before the CRLF.
+ *
+ *  Parameters: p: protocol initialized by protocol_init.
+ *              line: command line, including its terminator.
+ *              size: number of bytes in the line.
+ *              cmd: set to the parts of the line.
+ */
+void protocol_parse(const struct protocol *p, const char *line, size_t size,
+                    struct protocol_command *cmd) {
+    size_t start = 0, length;
+
+    // leading spaces are ignored, as with scanf
+    while (start < size && (line[start] == ' ' || line[start] == '\t'))
+        start++;
+    length = verb_length(line + start, size - start);
+
+    cmd->verb = p->count;
+    if (length >= 1 && length <= OPCODE_MAX_LENGTH) {
+        uint64_t opcode = pack_opcode(line + start, length);
+        for (int i = 0; i < p->count; i++) {
+            if (p->opcodes[i] == opcode) {
+                cmd->verb = i;
+                break;
+            }
+        }
+    }
+
+    cmd->terminated = size > 3 && line[size - 2] == '\r' && line[size - 1] == '\n' &&
+                      !isspace((unsigned char)line[size - 3]);
+    cmd->has_args = 0;
+    cmd->args.data = line + size;
+    cmd->args.size = 0;
+
+    size_t end = start + length;
+    if (cmd->terminated && end < size - 2 && line[end] == ' ') {
+        cmd->has_args = 1;
+        cmd->args.data = line + end + 1;
+        cmd->args.size = size - 2 - (end + 1);
+    }
+}
+
+/** Checks if a span starts with a string, ignoring case.
+ *
+ *  Returns: 1 if it does, 0 otherwise.
+ */
+int protocol_prefix(struct protocol_span span, const char *prefix) {
+    size_t length = strlen(prefix);
+    return span.size >= length && strncasecmp(span.data, prefix, length) == 0;
+}
+
+/** Removes the first word from a span, up to the first space.
+ *
+ *  Parameters: span: span to be split, set to the bytes after the space.
+ *              word: set to the bytes before the space.
+ *
+ *  Returns: 0 if the span had a space, -1 otherwise (span unchanged).
+ */
+int protocol_split(struct protocol_span *span, struct protocol_span *word) {
+    const char *space = memchr(span->data, ' ', span->size);
+    if (!space)
+        return -1;
+    word->data = span->data;
+    word->size = space - span->data;
+    span->size -= word->size + 1;
+    span->data = space + 1;
+    return 0;
+}
+
+/** Parses a span made only of decimal digits.
+ *
+ *  Parameters: span: digits to be parsed.
+ *              value: set to the number.
+ *
+ *  Returns: 0 on success, -1 if the span is empty, has other characters
+ *           or the number is too large.
+ */
+int protocol_number(struct protocol_span span, unsigned long *value) {
+    unsigned long n = 0;
+
+    if (!span.size)
+        return -1;
+    for (size_t i = 0; i < span.size; i++) {
+        unsigned digit = (unsigned char)span.data[i] - '0';
+        if (digit > 9 || n > (ULONG_MAX - digit) / 10)
+            return -1;
+        n = n * 10 + digit;
+    }
+    *value = n;
+    return 0;
+}
+
+/** Copies a span into a null-terminated string.
+ *
+ *  Parameters: span: span to be copied.
+ *              out: where the string is stored.
+ *              size: size of out, including the null byte.
+ *
+ *  Returns: 0 on success, -1 if the span does not fit.
+ */
+int protocol_copy(struct protocol_span span, char *out, size_t size) {
+    if (span.size >= size)
+        return -1;
+    memcpy(out, span.data, span.size);
+    out[span.size] = '\0';
+    return 0;
+}
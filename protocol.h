@@ -0,0 +1,47 @@
+/*
+ * Parser for the command lines of the text protocols (SMTP and POP3).
+ */
+
+#ifndef _PROTOCOL_H_
+#define _PROTOCOL_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROTOCOL_MAX_VERBS 32
+
+/** Part of a command line, pointing into the line, which is not
+ *  modified or copied. Not null-terminated.
+ */
+struct protocol_span {
+    const char *data;
+    size_t size;
+};
+
+/** Commands of a protocol, with their verbs packed as opcodes.
+ *  Initialized once with protocol_init.
+ */
+struct protocol {
+    int count;
+    uint64_t opcodes[PROTOCOL_MAX_VERBS];
+};
+
+/** A command line split by protocol_parse.
+ */
+struct protocol_command {
+    int verb;  // index in the list of verbs, or the number of verbs if unknown
+    int terminated;  // ends with CRLF, with no trailing space
+    int has_args;    // the verb is followed by a space and arguments
+    struct protocol_span args;  // after the space, without the line terminator
+};
+
+int protocol_init(struct protocol *p, const char *const *verbs);
+void protocol_parse(const struct protocol *p, const char *line, size_t size,
+                    struct protocol_command *cmd);
+
+int protocol_prefix(struct protocol_span span, const char *prefix);
+int protocol_split(struct protocol_span *span, struct protocol_span *word);
+int protocol_number(struct protocol_span span, unsigned long *value);
+int protocol_copy(struct protocol_span span, char *out, size_t size);
+
+#endif
@@ -0,0 +1,491 @@
+/*
+ * Durable queue of accepted messages, delivered to the mailboxes of
+ * their recipients by background processes.
+ *
+ * A queued message is a pair of files in the queue directory, in the
+ * same file system as the spool and the mail store: the message
+ * itself (a hard link to the spool file, so it is not copied) and a
+ * control file listing the recipients it still has to be delivered
+ * to. The control file is renamed into place last, so an entry is
+ * only seen once it is complete, and its modification time is the
+ * time of the next attempt, so entries waiting for a retry are
+ * skipped without being read.
+ *
+ * Delivery workers are woken through a pipe shared by all processes
+ * when a message is queued, and also scan the queue periodically. A
+ * worker claims up to a batch of entries by locking their control
+ * files, and saves the messages of the batch for each mailbox at once
+ * (see save_mailbox_mail), so a mailbox receiving many messages is
+ * locked once per batch instead of once per message. Recipients that
+ * failed are kept in the entry and retried later, with the delay
+ * doubling after each attempt.
+ *
+ * Messages are delivered at least once: if a worker stops between
+ * saving a message and removing its entry, the message is saved again
+ * by the next attempt.
+ */
+
+#define _GNU_SOURCE  // pipe2
+
+#include "queue.h"
+
+#include "commit.h"
+#include "metrics.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define QUEUE_DIRECTORY "queue"
+#define QUEUE_MESSAGE_SUFFIX ".msg"
+#define QUEUE_CONTROL_SUFFIX ".ctl"
+#define QUEUE_TEMP_SUFFIX ".tmp"
+#define QUEUE_ID_SIZE 64
+#define QUEUE_PATH_SIZE (sizeof(QUEUE_DIRECTORY) + QUEUE_ID_SIZE + 8)
+#define QUEUE_BATCH 64            // entries delivered together at most
+#define QUEUE_SCAN_INTERVAL 1000  // milliseconds between scans when not woken
+#define QUEUE_RETRY_DELAY 1       // seconds before the first retry, doubled after each one
+#define QUEUE_RETRY_MAX_DELAY 3600
+#define QUEUE_MAX_ATTEMPTS 16     // a recipient is given up after this many attempts
+#define QUEUE_PRIORITY 10         // nice value of the delivery workers
+
+/** An entry claimed by a delivery worker.
+ */
+struct queue_entry {
+    char id[QUEUE_ID_SIZE];
+    int fd;              // control file, locked while the entry is claimed
+    size_t header_size;
+    int attempts;        // failed attempts so far
+    char *data;          // contents of the control file, holding the recipients
+    char **recipients;
+    int *status;         // result of the delivery to each recipient
+    int rcpt_count;
+};
+
+/** A delivery of a batch: a recipient of one of the entries.
+ */
+struct queue_delivery {
+    const char *recipient;
+    int entry;
+    int rcpt;
+};
+
+static int wake_pipe[2] = {-1, -1};
+static int sync_deliveries = 0;
+static int depth_metric, save_metric, delivered_metric, retry_metric, failed_metric;
+
+/** Prepares the queue: creates its directory and the pipe waking the
+ *  delivery workers, and registers its metrics. Called once, before
+ *  the server starts.
+ *
+ *  Parameters: sync: non-zero if deliveries are synced to disk before
+ *                    their entries are removed, so that a delivery
+ *                    acknowledged to the client is never lost (see
+ *                    commit.c).
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+int queue_init(int sync) {
+    sync_deliveries = sync;
+    if (mkdir(QUEUE_DIRECTORY, 0777) < 0 && errno != EEXIST)
+        return -1;
+    if (pipe2(wake_pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+        return -1;
+
+    depth_metric = metrics_gauge("queue.depth");
+    save_metric = metrics_histogram("queue.save_mailbox_mail");
+    delivered_metric = metrics_counter("queue.messages_delivered");
+    retry_metric = metrics_counter("queue.retries");
+    failed_metric = metrics_counter("queue.messages_failed");
+    return 0;
+}
+
+/** Internal function that wakes a delivery worker. If the pipe is
+ *  full, workers have wakeups pending already.
+ */
+static void queue_wake(void) {
+    char c = 0;
+    if (write(wake_pipe[1], &c, 1) < 0 && errno != EAGAIN)
+        perror("queue: write");
+}
+
+/** Internal function that builds the path of one of the files of an
+ *  entry.
+ */
+static void entry_path(char path[QUEUE_PATH_SIZE], const char *id, const char *suffix) {
+    snprintf(path, QUEUE_PATH_SIZE, QUEUE_DIRECTORY "/%.*s%s", QUEUE_ID_SIZE - 1, id, suffix);
+}
+
+/** Internal function that starts writing a control file, under a
+ *  temporary name. The recipients are then written one per line.
+ *
+ *  Returns: the file, or NULL on error.
+ */
+static FILE *create_control(const char *id, size_t header_size, int attempts) {
+    char temp[QUEUE_PATH_SIZE];
+
+    entry_path(temp, id, QUEUE_TEMP_SUFFIX);
+    FILE *f = fopen(temp, "w");
+    if (f)
+        fprintf(f, "%zu %d\n", header_size, attempts);
+    return f;
+}
+
+/** Internal function that finishes writing a control file and renames
+ *  it into place, replacing the current one.
+ *
+ *  Parameters: f: file returned by create_control.
+ *              id: name of the entry.
+ *              next_attempt: time when the entry is due, or 0 for now.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+static int commit_control(FILE *f, const char *id, time_t next_attempt) {
+    char temp[QUEUE_PATH_SIZE], path[QUEUE_PATH_SIZE];
+    struct timespec times[2] = {{.tv_nsec = UTIME_OMIT}, {.tv_sec = next_attempt}};
+
+    entry_path(temp, id, QUEUE_TEMP_SUFFIX);
+    entry_path(path, id, QUEUE_CONTROL_SUFFIX);
+    int rv = fflush(f) == 0 && (!next_attempt || futimens(fileno(f), times) == 0) ? 0 : -1;
+    if (fclose(f) != 0 || rv < 0 || rename(temp, path) < 0) {
+        unlink(temp);
+        return -1;
+    }
+    return 0;
+}
+
+/** Queues a received message for delivery, then wakes a delivery
+ *  worker. The message is only linked into the queue, so the spool
+ *  can be destroyed afterwards as usual.
+ *
+ *  Parameters: spool: Finished spool file containing the message.
+ *              recipients: List of recipients of the message.
+ *
+ *  Returns: 0 if the message was queued, -1 on error.
+ */
+int queue_add(spool_t spool, user_list_t recipients) {
+    static unsigned int counter = 0;
+    char id[QUEUE_ID_SIZE], path[QUEUE_PATH_SIZE];
+    struct timespec now;
+    int rv;
+
+    // unique like the names of mail files, see save_user_mail
+    do {
+        clock_gettime(CLOCK_REALTIME, &now);
+        snprintf(id, sizeof(id), "%ld.M%06ldP%dQ%u", (long)now.tv_sec, now.tv_nsec / 1000,
+                 (int)getpid(), counter++);
+        entry_path(path, id, QUEUE_MESSAGE_SUFFIX);
+    } while ((rv = link(spool_filename(spool), path)) < 0 && errno == EEXIST);
+    if (rv < 0)
+        return -1;
+
+    FILE *f = create_control(id, spool_header_size(spool), 0);
+    if (f)
+        for (user_list_t user = recipients; user; user = get_user_list_next(user))
+            fprintf(f, "%s\n", get_user_list_name(user));
+    if (!f || commit_control(f, id, 0) < 0) {
+        unlink(path);
+        return -1;
+    }
+
+    queue_wake();
+    return 0;
+}
+
+/** Internal function that claims an entry and reads its control file.
+ *  Entries claimed by another worker, or already finished, are
+ *  skipped.
+ *
+ *  Returns: 0 if the entry was claimed, -1 otherwise.
+ */
+static int claim_entry(int dir_fd, const char *name, struct queue_entry *entry) {
+    struct stat file_stat;
+    size_t length = strlen(name) - strlen(QUEUE_CONTROL_SUFFIX);
+    ssize_t size = 0;
+
+    if (length >= sizeof(entry->id))
+        return -1;
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0 || fstat(fd, &file_stat) < 0 || !file_stat.st_nlink ||
+        !(entry->data = malloc(file_stat.st_size + 1))) {
+        close(fd);
+        return -1;
+    }
+    while (size < file_stat.st_size) {
+        ssize_t rv = read(fd, entry->data + size, file_stat.st_size - size);
+        if (rv <= 0)
+            break;
+        size += rv;
+    }
+    entry->data[size] = '\0';
+
+    // the first line holds the header size and the attempts, then one
+    // recipient per line
+    char *line = strchr(entry->data, '\n');
+    int count = 0;
+    if (size != file_stat.st_size || !line ||
+        sscanf(entry->data, "%zu %d", &entry->header_size, &entry->attempts) != 2) {
+        fprintf(stderr, "queue: invalid entry %s\n", name);
+        free(entry->data);
+        close(fd);
+        return -1;
+    }
+    for (char *p = line + 1; *p; p++)
+        count += *p == '\n';
+    entry->recipients = malloc(count * sizeof(char *) + 1);
+    entry->status = malloc(count * sizeof(int) + 1);
+    if (!entry->recipients || !entry->status) {
+        free(entry->recipients);
+        free(entry->status);
+        free(entry->data);
+        close(fd);
+        return -1;
+    }
+    // a last line without a newline is incomplete and ignored
+    entry->rcpt_count = 0;
+    for (char *p = line + 1; (line = strchr(p, '\n')); p = line + 1) {
+        *line = '\0';
+        entry->recipients[entry->rcpt_count++] = p;
+    }
+
+    memcpy(entry->id, name, length);
+    entry->id[length] = '\0';
+    entry->fd = fd;
+    return 0;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/** Internal function that claims the oldest entries due for delivery.
+ *  Also updates the depth of the queue.
+ *
+ *  Parameters: batch: where the claimed entries are stored, up to
+ *                     QUEUE_BATCH.
+ *              timeout: set to the milliseconds until the next entry
+ *                       is due, if sooner than its current value.
+ *
+ *  Returns: number of entries claimed.
+ */
+static int claim_entries(struct queue_entry *batch, int *timeout) {
+    const size_t suflen = strlen(QUEUE_CONTROL_SUFFIX);
+    char **names = NULL;
+    size_t count = 0, capacity = 0, depth = 0;
+    time_t now = time(NULL), next = 0;
+    struct dirent *dir_entry;
+    struct stat file_stat;
+    int claimed = 0;
+
+    DIR *dir = opendir(QUEUE_DIRECTORY);
+    if (!dir)
+        return 0;
+
+    while ((dir_entry = readdir(dir)) != NULL) {
+        size_t namelen = strlen(dir_entry->d_name);
+        if (namelen <= suflen || strcmp(dir_entry->d_name + namelen - suflen, QUEUE_CONTROL_SUFFIX))
+            continue;
+        depth++;
+        if (fstatat(dirfd(dir), dir_entry->d_name, &file_stat, 0) < 0)
+            continue;
+        if (file_stat.st_mtime > now) {
+            if (!next || file_stat.st_mtime < next)
+                next = file_stat.st_mtime;
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            char **grown = realloc(names, capacity * sizeof(char *));
+            if (!grown)
+                break;
+            names = grown;
+        }
+        names[count++] = strdup(dir_entry->d_name);
+    }
+    metrics_set(depth_metric, depth);
+
+    // names start with the time they were queued
+    qsort(names, count, sizeof(char *), compare_names);
+    size_t i;
+    for (i = 0; i < count && claimed < QUEUE_BATCH; i++)
+        if (claim_entry(dirfd(dir), names[i], &batch[claimed]) == 0)
+            claimed++;
+    // more entries are due: another worker can take them
+    if (i < count)
+        queue_wake();
+
+    if (next && (next - now) * 1000 < *timeout)
+        *timeout = (next - now) * 1000;
+
+    for (i = 0; i < count; i++)
+        free(names[i]);
+    free(names);
+    closedir(dir);
+    return claimed;
+}
+
+static int compare_deliveries(const void *a, const void *b) {
+    const struct queue_delivery *x = a, *y = b;
+    int rv = strcmp(x->recipient, y->recipient);
+    return rv ? rv : x->entry - y->entry;
+}
+
+/** Internal function that saves the messages of a batch, taking the
+ *  lock of each mailbox once, and sets the status of each recipient.
+ */
+static void deliver_batch(struct queue_entry *batch, int count) {
+    struct mail_delivery messages[QUEUE_BATCH];
+    char paths[QUEUE_BATCH][QUEUE_PATH_SIZE];
+    struct queue_delivery *deliveries;
+    int total = 0;
+
+    for (int i = 0; i < count; i++)
+        total += batch[i].rcpt_count;
+    if (!(deliveries = malloc(total * sizeof(*deliveries) + 1))) {
+        for (int i = 0; i < count; i++)
+            for (int j = 0; j < batch[i].rcpt_count; j++)
+                batch[i].status[j] = ENOMEM;
+        return;
+    }
+
+    total = 0;
+    for (int i = 0; i < count; i++) {
+        entry_path(paths[i], batch[i].id, QUEUE_MESSAGE_SUFFIX);
+        for (int j = 0; j < batch[i].rcpt_count; j++)
+            deliveries[total++] = (struct queue_delivery){batch[i].recipients[j], i, j};
+    }
+
+    // deliveries to the same mailbox are grouped, in the order queued
+    qsort(deliveries, total, sizeof(*deliveries), compare_deliveries);
+    for (int first = 0, last; first < total; first = last) {
+        int n = 0;
+        for (last = first; last < total && !strcmp(deliveries[last].recipient, deliveries[first].recipient);
+             last++) {
+            const struct queue_entry *entry = &batch[deliveries[last].entry];
+            messages[n].filename = paths[deliveries[last].entry];
+            messages[n++].header_size = entry->header_size;
+        }
+
+        uint64_t start = metrics_now();
+        save_mailbox_mail(deliveries[first].recipient, messages, n);
+        metrics_record(save_metric, start);
+
+        for (int i = 0; i < n; i++) {
+            const struct queue_delivery *d = &deliveries[first + i];
+            batch[d->entry].status[d->rcpt] = messages[i].status;
+        }
+    }
+    free(deliveries);
+
+    if (sync_deliveries && commit_sync() < 0) {
+        // nothing is known to be on disk: everything is retried
+        for (int i = 0; i < count; i++)
+            for (int j = 0; j < batch[i].rcpt_count; j++)
+                if (!batch[i].status[j])
+                    batch[i].status[j] = errno;
+    }
+}
+
+/** Internal function that removes a delivered entry, or records the
+ *  recipients that failed for a later attempt, and releases it.
+ */
+static void finish_entry(struct queue_entry *entry) {
+    char path[QUEUE_PATH_SIZE];
+    int failed = 0;
+
+    for (int i = 0; i < entry->rcpt_count; i++)
+        failed += entry->status[i] != 0;
+    metrics_add(delivered_metric, entry->rcpt_count - failed);
+
+    int attempts = entry->attempts + 1, delay = QUEUE_RETRY_DELAY;
+    for (int i = 1; i < attempts && delay < QUEUE_RETRY_MAX_DELAY; i++)
+        delay *= 2;
+    if (delay > QUEUE_RETRY_MAX_DELAY)
+        delay = QUEUE_RETRY_MAX_DELAY;
+
+    for (int i = 0; i < entry->rcpt_count; i++) {
+        if (!entry->status[i])
+            continue;
+        if (attempts < QUEUE_MAX_ATTEMPTS)
+            fprintf(stderr, "queue: could not deliver to %s: %s, retrying in %ds\n",
+                    entry->recipients[i], strerror(entry->status[i]), delay);
+        else
+            fprintf(stderr, "queue: could not deliver to %s: %s, giving up\n",
+                    entry->recipients[i], strerror(entry->status[i]));
+    }
+
+    if (failed && attempts < QUEUE_MAX_ATTEMPTS) {
+        metrics_add(retry_metric, 1);
+        FILE *f = create_control(entry->id, entry->header_size, attempts);
+        if (f)
+            for (int i = 0; i < entry->rcpt_count; i++)
+                if (entry->status[i])
+                    fprintf(f, "%s\n", entry->recipients[i]);
+        if (!f || commit_control(f, entry->id, time(NULL) + delay) < 0)
+            perror("queue: could not update entry");
+    } else {
+        if (failed)
+            metrics_add(failed_metric, 1);
+        // the control file goes first, so no entry is left without its message
+        entry_path(path, entry->id, QUEUE_CONTROL_SUFFIX);
+        unlink(path);
+        entry_path(path, entry->id, QUEUE_MESSAGE_SUFFIX);
+        unlink(path);
+    }
+
+    close(entry->fd);
+    free(entry->data);
+    free(entry->recipients);
+    free(entry->status);
+}
+
+/** Internal function that waits until a message is queued, or for at
+ *  most a timeout, and consumes the pending wakeups.
+ */
+static void wait_wakeup(int timeout) {
+    struct pollfd pfd = {.fd = wake_pipe[0], .events = POLLIN};
+    char buf[256];
+
+    if (poll(&pfd, 1, timeout) > 0)
+        while (read(wake_pipe[0], buf, sizeof(buf)) > 0)
+            ;
+}
+
+/** Runs a delivery worker: delivers the queued messages as they come,
+ *  including the ones left by a previous run. Does not return.
+ *
+ *  Parameters: id: index of the worker, from 0.
+ */
+void queue_run(int id) {
+    struct queue_entry batch[QUEUE_BATCH];
+
+    // deliveries yield to the sessions accepting messages when they
+    // share a core
+    if (setpriority(PRIO_PROCESS, 0, QUEUE_PRIORITY) < 0)
+        perror("queue: setpriority");
+
+    for (;;) {
+        int timeout = QUEUE_SCAN_INTERVAL;
+        int count = claim_entries(batch, &timeout);
+        if (!count) {
+            wait_wakeup(timeout);
+            continue;
+        }
+
+        deliver_batch(batch, count);
+        for (int i = 0; i < count; i++)
+            finish_entry(&batch[i]);
+    }
+}
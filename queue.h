@@ -0,0 +1,16 @@
+/*
+ * Durable queue of accepted messages, delivered to the mailboxes of
+ * their recipients by background processes.
+ */
+
+#ifndef _QUEUE_H_
+#define _QUEUE_H_
+
+#include "spool.h"
+#include "user.h"
+
+int queue_init(int sync);
+int queue_add(spool_t spool, user_list_t recipients);
+void queue_run(int id);
+
+#endif
@@ -0,0 +1,507 @@
+/*
+ * Mailbox stored as a single append-only segment file with an index.
+ *
+ * Messages are appended to a segment file inside the mailbox
+ * directory, and described by fixed-size records in an index file.
+ * The index header is only updated once a message and its record are
+ * completely written, so a failed delivery leaves the mailbox as it
+ * was. Deleted messages become tombstones in the index; once enough
+ * of the segment is used by deleted messages, the live ones are
+ * copied to a new segment file (with the next generation number) and
+ * a new index replaces the old one with a rename.
+ *
+ * The mailbox directory itself is locked with flock: a shared lock to
+ * read the index, an exclusive lock for any change. Open segment
+ * files stay valid after a compaction, so lists loaded before it can
+ * still read their messages.
+ *
+ * Messages may be stored compressed, each as a zlib stream, with a
+ * dictionary shared by the whole mailbox: the start of the first
+ * message compressed in it, which holds the headers most messages
+ * repeat. The dictionary is kept in its own file, written once and
+ * never changed, since all streams depend on it.
+ *
+ * Indexes of version 1, whose records have no stored size or flags,
+ * are still read; they are converted the first time the mailbox is
+ * changed.
+ */
+
+#define _GNU_SOURCE  // copy_file_range
+
+#include "segment.h"
+
+#include "compress.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define SEGMENT_INDEX_FILE_NAME "segment.idx"
+#define SEGMENT_NEW_INDEX_FILE_NAME "segment.idx.new"
+#define SEGMENT_DATA_FILE_FORMAT "segment.%u"  // followed by the generation
+#define SEGMENT_MAGIC 0x4745534du              // "MSEG"
+#define SEGMENT_DICT_FILE_NAME "segment.dict"
+#define SEGMENT_NEW_DICT_FILE_NAME "segment.dict.new"
+#define SEGMENT_VERSION 2
+#define SEGMENT_DICT_SIZE 16384  // bytes of the first compressed message kept as dictionary
+#define SEGMENT_COMPACT_MIN_SIZE (1 << 20)
+#define COPY_BLOCK_SIZE 65536
+
+struct segment_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t generation;  // suffix of the current segment file
+    uint32_t reserved;
+    uint64_t count;       // number of records, including tombstones
+    uint64_t next_uid;
+    uint64_t data_size;   // bytes used in the segment file
+    uint64_t dead_size;   // bytes used by deleted messages
+};
+
+// Record of a version 1 index
+struct segment_record_v1 {
+    uint64_t uid;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t header_size;
+    uint64_t deleted;
+};
+
+struct segment {
+    int dir_fd;  // holds the lock
+    int index_fd;
+    int data_fd;  // -1 if the mailbox is empty and opened for reading
+    struct segment_header header;
+    void *map;
+    size_t map_size;
+    struct segment_record *converted;  // records of a version 1 index
+    char *dict;                        // dictionary, once read
+    size_t dict_size;
+};
+
+/** Internal function that opens the segment file of a generation.
+ */
+static int open_data_file(int dir_fd, uint32_t generation, int flags) {
+    char name[32];
+    snprintf(name, sizeof(name), SEGMENT_DATA_FILE_FORMAT, generation);
+    return openat(dir_fd, name, flags | O_CLOEXEC, 0666);
+}
+
+/** Opens and locks the segment of a mailbox directory. A shared lock
+ *  allows the messages to be read; an exclusive lock is needed to
+ *  change them, and creates the segment if it doesn't exist yet.
+ *
+ *  Parameters: dir: Path of the mailbox directory, which must exist.
+ *              exclusive: non-zero to lock the segment for writing.
+ *
+ *  Returns: A segment_t object, or NULL if the segment cannot be
+ *           opened (e.g., the directory doesn't exist).
+ */
+segment_t segment_open(const char *dir, int exclusive) {
+    int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) return NULL;
+
+    if (flock(dir_fd, exclusive ? LOCK_EX : LOCK_SH) < 0) {
+        close(dir_fd);
+        return NULL;
+    }
+
+    segment_t seg = malloc(sizeof(struct segment));
+    seg->dir_fd = dir_fd;
+    seg->data_fd = -1;
+    seg->map = NULL;
+    seg->map_size = 0;
+    seg->converted = NULL;
+    seg->dict = NULL;
+    seg->dict_size = 0;
+    memset(&seg->header, 0, sizeof(seg->header));
+    seg->index_fd = openat(dir_fd, SEGMENT_INDEX_FILE_NAME,
+                           exclusive ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0666);
+
+    if (seg->index_fd >= 0 &&
+        pread(seg->index_fd, &seg->header, sizeof(seg->header), 0) == sizeof(seg->header)) {
+        if (seg->header.magic != SEGMENT_MAGIC ||
+            (seg->header.version != SEGMENT_VERSION && seg->header.version != 1))
+            goto error;
+    } else if (seg->index_fd >= 0 || !exclusive) {
+        // new mailbox, the header is only written with the first message
+        seg->header.magic = SEGMENT_MAGIC;
+        seg->header.version = SEGMENT_VERSION;
+        seg->header.next_uid = 1;
+    } else {
+        goto error;
+    }
+
+    seg->data_fd = open_data_file(dir_fd, seg->header.generation, exclusive ? O_RDWR | O_CREAT : O_RDONLY);
+    if (seg->data_fd < 0 && (exclusive || seg->header.count))
+        goto error;
+    // changes are only written in the current version
+    if (exclusive && seg->header.version != SEGMENT_VERSION && segment_compact(seg) < 0)
+        goto error;
+    return seg;
+
+error:
+    segment_close(seg);
+    return NULL;
+}
+
+/** Releases the lock of a segment and frees all memory used by it.
+ *  Records returned by segment_records are no longer valid.
+ *
+ *  Parameters: seg: segment to be closed.
+ */
+void segment_close(segment_t seg) {
+    if (seg->map)
+        munmap(seg->map, seg->map_size);
+    if (seg->data_fd >= 0)
+        close(seg->data_fd);
+    if (seg->index_fd >= 0)
+        close(seg->index_fd);
+    close(seg->dir_fd);
+    free(seg->converted);
+    free(seg->dict);
+    free(seg);
+}
+
+/** Maps the records of a segment into memory, including tombstones.
+ *  Records are sorted by unique ID.
+ *
+ *  Parameters: seg: segment to be read.
+ *              count: address where the number of records is stored.
+ *
+ *  Returns: the array of records, valid until the segment is changed
+ *           or closed, or NULL on error.
+ */
+const struct segment_record *segment_records(segment_t seg, size_t *count) {
+    static const struct segment_record empty;
+    int v1 = seg->header.version == 1;
+    size_t record_size = v1 ? sizeof(struct segment_record_v1) : sizeof(struct segment_record);
+    size_t size = sizeof(struct segment_header) + seg->header.count * record_size;
+
+    *count = seg->header.count;
+    if (!*count)
+        return &empty;
+
+    if (!seg->map || seg->map_size != size) {
+        void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, seg->index_fd, 0);
+        if (map == MAP_FAILED)
+            return NULL;
+        if (seg->map)
+            munmap(seg->map, seg->map_size);
+        seg->map = map;
+        seg->map_size = size;
+        free(seg->converted);
+        seg->converted = NULL;
+    }
+    if (!v1)
+        return (const struct segment_record *)((char *)seg->map + sizeof(struct segment_header));
+
+    if (!seg->converted) {
+        const struct segment_record_v1 *old =
+            (const struct segment_record_v1 *)((char *)seg->map + sizeof(struct segment_header));
+        if (!(seg->converted = malloc(*count * sizeof(struct segment_record))))
+            return NULL;
+        for (size_t i = 0; i < *count; i++) {
+            struct segment_record record = {
+                .uid = old[i].uid,
+                .offset = old[i].offset,
+                .size = old[i].size,
+                .header_size = old[i].header_size,
+                .deleted = old[i].deleted,
+                .stored_size = old[i].size,
+            };
+            seg->converted[i] = record;
+        }
+    }
+    return seg->converted;
+}
+
+/** Returns the file descriptor of the segment file, where messages
+ *  are found at the offsets in their records.
+ *
+ *  Parameters: seg: segment to be read.
+ *
+ *  Returns: the file descriptor, valid until the segment is closed,
+ *           or -1 if the mailbox is empty.
+ */
+int segment_data_fd(segment_t seg) {
+    return seg->data_fd;
+}
+
+/** Returns the dictionary messages of the segment are compressed
+ *  with, reading it the first time.
+ *
+ *  Parameters: seg: segment to be read.
+ *              size: address where the size of the dictionary is stored.
+ *
+ *  Returns: the dictionary, valid until the segment is closed, or NULL
+ *           if the mailbox has none (no compressed message yet).
+ */
+const char *segment_dictionary(segment_t seg, size_t *size) {
+    if (!seg->dict) {
+        int fd = openat(seg->dir_fd, SEGMENT_DICT_FILE_NAME, O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0 && st.st_size <= SEGMENT_DICT_SIZE &&
+            (seg->dict = malloc(st.st_size))) {
+            if (pread(fd, seg->dict, st.st_size, 0) == st.st_size) {
+                seg->dict_size = st.st_size;
+            } else {
+                free(seg->dict);
+                seg->dict = NULL;
+            }
+        }
+        if (fd >= 0)
+            close(fd);
+    }
+    *size = seg->dict_size;
+    return seg->dict;
+}
+
+/** Internal function that creates the dictionary of the segment from
+ *  the start of a message. The file is complete before it appears
+ *  under its name. Must only be called with an exclusive lock.
+ */
+static int create_dictionary(segment_t seg, int fd, uint64_t size) {
+    char buf[SEGMENT_DICT_SIZE];
+    size_t dict_size = size < sizeof(buf) ? size : sizeof(buf);
+
+    if (!dict_size || pread(fd, buf, dict_size, 0) != (ssize_t)dict_size)
+        return -1;
+    int dict_fd = openat(seg->dir_fd, SEGMENT_NEW_DICT_FILE_NAME,
+                         O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (dict_fd < 0)
+        return -1;
+    int rv = pwrite(dict_fd, buf, dict_size, 0) == (ssize_t)dict_size ? 0 : -1;
+    close(dict_fd);
+    if (rv == 0)
+        rv = renameat(seg->dir_fd, SEGMENT_NEW_DICT_FILE_NAME, seg->dir_fd, SEGMENT_DICT_FILE_NAME);
+    if (rv < 0)
+        unlinkat(seg->dir_fd, SEGMENT_NEW_DICT_FILE_NAME, 0);
+    return rv;
+}
+
+/** Internal function that copies a range of bytes between files. The
+ *  copy is done by the kernel when possible.
+ */
+static int copy_range(int in_fd, off_t in_offset, int out_fd, off_t out_offset, uint64_t size) {
+    char buf[COPY_BLOCK_SIZE];
+
+    while (size) {
+        ssize_t rv = copy_file_range(in_fd, &in_offset, out_fd, &out_offset, size, 0);
+        if (rv < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+            // not supported for these files, copy through user space
+            rv = pread(in_fd, buf, size < sizeof(buf) ? size : sizeof(buf), in_offset);
+            if (rv > 0 && pwrite(out_fd, buf, rv, out_offset) != rv)
+                rv = -1;
+            if (rv > 0) {
+                in_offset += rv;
+                out_offset += rv;
+            }
+        }
+        if (rv < 0 && errno == EINTR)
+            continue;
+        if (rv <= 0)
+            return -1;
+        size -= rv;
+    }
+    return 0;
+}
+
+/** Internal function that writes the header of the index.
+ */
+static int write_header(int fd, const struct segment_header *header) {
+    return pwrite(fd, header, sizeof(*header), 0) == sizeof(*header) ? 0 : -1;
+}
+
+/** Appends a message to the segment. Must only be called with an
+ *  exclusive lock.
+ *
+ *  Parameters: seg: segment to be changed.
+ *              fd: file containing the message, starting at offset 0.
+ *              size: size of the message.
+ *              header_size: bytes up to the start of the message body.
+ *              compress: non-zero to store the message compressed,
+ *                        if that makes it smaller. The first message
+ *                        compressed in the mailbox also creates its
+ *                        dictionary.
+ *
+ *  Returns: 0 on success, -1 on error (the segment is then unchanged).
+ */
+int segment_append(segment_t seg, int fd, uint64_t size, uint64_t header_size, int compress) {
+    struct segment_header header = seg->header;
+    struct segment_record record = {
+        .uid = header.next_uid,
+        .offset = header.data_size,
+        .size = size,
+        .header_size = header_size,
+        .stored_size = size,
+    };
+
+    if (compress) {
+        size_t dict_size;
+        const char *dict = segment_dictionary(seg, &dict_size);
+        if (!dict && create_dictionary(seg, fd, size) == 0)
+            dict = segment_dictionary(seg, &dict_size);
+
+        int rv = compress_range(fd, size, seg->data_fd, record.offset, dict, dict_size,
+                                &record.stored_size);
+        if (rv < 0)
+            return -1;
+        if (rv == 0)
+            record.flags = SEGMENT_COMPRESSED;
+    }
+
+    header.count++;
+    header.next_uid++;
+    header.data_size += record.stored_size;
+
+    if ((!(record.flags & SEGMENT_COMPRESSED) && copy_range(fd, 0, seg->data_fd, record.offset, size) < 0) ||
+        pwrite(seg->index_fd, &record, sizeof(record),
+               sizeof(struct segment_header) + seg->header.count * sizeof(record)) != sizeof(record) ||
+        write_header(seg->index_fd, &header) < 0)
+        return -1;
+
+    seg->header = header;
+    return 0;
+}
+
+static int compare_uids(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = ((const struct segment_record *)b)->uid;
+    return x < y ? -1 : x > y;
+}
+
+/** Marks messages as deleted. Must only be called with an exclusive
+ *  lock. Messages that no longer exist are ignored.
+ *
+ *  Parameters: seg: segment to be changed.
+ *              uids: unique IDs of the deleted messages.
+ *              count: number of IDs.
+ *              size: address where the total size of the messages
+ *                    deleted is stored.
+ *
+ *  Returns: number of messages deleted, or -1 on error.
+ */
+int segment_delete(segment_t seg, const uint64_t *uids, size_t count, uint64_t *size) {
+    static const uint64_t deleted = 1;
+    struct segment_header header = seg->header;
+    size_t total;
+    int removed = 0;
+    const struct segment_record *records = segment_records(seg, &total);
+
+    *size = 0;
+
+    if (!records)
+        return -1;
+
+    for (size_t i = 0; i < count; i++) {
+        const struct segment_record *record =
+            bsearch(&uids[i], records, total, sizeof(struct segment_record), compare_uids);
+        if (!record || record->deleted)
+            continue;
+
+        off_t offset = (const char *)&record->deleted - (const char *)seg->map;
+        if (pwrite(seg->index_fd, &deleted, sizeof(deleted), offset) != sizeof(deleted))
+            return -1;
+        header.dead_size += record->stored_size;
+        *size += record->size;
+        removed++;
+    }
+
+    if (write_header(seg->index_fd, &header) < 0)
+        return -1;
+    seg->header = header;
+    return removed;
+}
+
+/** Checks if enough of the segment is used by deleted messages to
+ *  make a compaction worthwhile: at least half of it, and at least
+ *  SEGMENT_COMPACT_MIN_SIZE bytes.
+ *
+ *  Parameters: seg: segment to be checked.
+ *
+ *  Returns: non-zero if the segment should be compacted.
+ */
+int segment_needs_compaction(segment_t seg) {
+    return seg->header.dead_size >= SEGMENT_COMPACT_MIN_SIZE &&
+           seg->header.dead_size * 2 >= seg->header.data_size;
+}
+
+/** Copies the messages that are not deleted to a new segment file,
+ *  and replaces the index. Must only be called with an exclusive
+ *  lock. The new files are synced before they replace the old ones,
+ *  so the mailbox is never left without a complete index.
+ *
+ *  Parameters: seg: segment to be compacted.
+ *
+ *  Returns: 0 on success, -1 on error (the segment is then unchanged).
+ */
+int segment_compact(segment_t seg) {
+    struct segment_header header = seg->header;
+    size_t total, kept = 0;
+    const struct segment_record *records = segment_records(seg, &total);
+    if (!records)
+        return -1;
+
+    header.version = SEGMENT_VERSION;
+    header.generation++;
+    header.data_size = 0;
+    header.dead_size = 0;
+
+    int data_fd = open_data_file(seg->dir_fd, header.generation, O_RDWR | O_CREAT | O_TRUNC);
+    int index_fd = openat(seg->dir_fd, SEGMENT_NEW_INDEX_FILE_NAME, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    int rv = data_fd >= 0 && index_fd >= 0 ? 0 : -1;
+
+    for (size_t i = 0; i < total && rv == 0; i++) {
+        if (records[i].deleted)
+            continue;
+
+        struct segment_record record = records[i];
+        record.offset = header.data_size;
+        if (copy_range(seg->data_fd, records[i].offset, data_fd, record.offset, record.stored_size) < 0 ||
+            pwrite(index_fd, &record, sizeof(record),
+                   sizeof(struct segment_header) + kept * sizeof(record)) != sizeof(record))
+            rv = -1;
+        header.data_size += record.stored_size;
+        kept++;
+    }
+    header.count = kept;
+
+    if (rv == 0 && (write_header(index_fd, &header) < 0 || fdatasync(data_fd) < 0 ||
+                    fdatasync(index_fd) < 0 ||
+                    renameat(seg->dir_fd, SEGMENT_NEW_INDEX_FILE_NAME, seg->dir_fd, SEGMENT_INDEX_FILE_NAME) < 0))
+        rv = -1;
+
+    if (rv < 0) {
+        char name[32];
+        snprintf(name, sizeof(name), SEGMENT_DATA_FILE_FORMAT, header.generation);
+        unlinkat(seg->dir_fd, name, 0);
+        unlinkat(seg->dir_fd, SEGMENT_NEW_INDEX_FILE_NAME, 0);
+        if (data_fd >= 0) close(data_fd);
+        if (index_fd >= 0) close(index_fd);
+        return -1;
+    }
+
+    // the old segment file is removed, but lists that are still open
+    // keep reading it through their own descriptors
+    char name[32];
+    snprintf(name, sizeof(name), SEGMENT_DATA_FILE_FORMAT, seg->header.generation);
+    unlinkat(seg->dir_fd, name, 0);
+
+    if (seg->map)
+        munmap(seg->map, seg->map_size);
+    seg->map = NULL;
+    seg->map_size = 0;
+    close(seg->data_fd);
+    close(seg->index_fd);
+    seg->data_fd = data_fd;
+    seg->index_fd = index_fd;
+    seg->header = header;
+    return 0;
+}
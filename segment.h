@@ -0,0 +1,40 @@
+/*
+ * Mailbox stored as a single append-only segment file with an index.
+ */
+
+#ifndef _SEGMENT_H_
+#define _SEGMENT_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#define SEGMENT_COMPRESSED 1  // record flag: stored as a zlib stream (see compress.c)
+
+/** Entry for a message in the segment index. Messages keep their
+ *  unique ID when the segment is compacted, but not their offset.
+ */
+struct segment_record {
+    uint64_t uid;
+    uint64_t offset;       // position of the message in the segment file
+    uint64_t size;         // size of the message, once decompressed
+    uint64_t header_size;  // bytes up to the start of the message body
+    uint64_t deleted;      // non-zero for a tombstone
+    uint64_t stored_size;  // bytes used in the segment file
+    uint64_t flags;
+};
+
+typedef struct segment *segment_t;
+
+segment_t segment_open(const char *dir, int exclusive);
+void segment_close(segment_t seg);
+
+const struct segment_record *segment_records(segment_t seg, size_t *count);
+int segment_data_fd(segment_t seg);
+const char *segment_dictionary(segment_t seg, size_t *size);
+
+int segment_append(segment_t seg, int fd, uint64_t size, uint64_t header_size, int compress);
+int segment_delete(segment_t seg, const uint64_t *uids, size_t count, uint64_t *size);
+int segment_compact(segment_t seg);
+int segment_needs_compaction(segment_t seg);
+
+#endif
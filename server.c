@@ -1,14 +1,29 @@
+#define _GNU_SOURCE  // splice
+
 #include "server.h"
 
+#include "metrics.h"
+#include "timer.h"
+#include "tls.h"
+#include "uring.h"
+
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -20,19 +35,139 @@
 #define MSG_NOSIGNAL 0x2000 /* don't raise SIGPIPE */
 #endif
 
-#define BACKLOG 10  // how many pending connections queue will hold
+#define DEFAULT_BACKLOG 511  // how many pending connections queue will hold
+#define DEFAULT_MAX_SESSIONS 1024  // concurrent sessions in all workers
+#define DEFAULT_MAX_PER_IP 128     // concurrent sessions from a single address
+#define MAX_EVENTS 64  // how many epoll events are handled per wait
+#define ACCEPT_BATCH 64  // how many connections are accepted per wakeup
+
+#define ADMISSION_SLOTS 4096  // per-address session counters, see admit_connection
+#define LOG_BUFFER_SIZE 65536
+#define LOG_LINE_MAX 256
+
+#define NS_PER_SECOND 1000000000ULL  // session timeouts are kept in seconds
+
+#define SEND_FILE_BLOCK_SIZE 65536  // block size used when sendfile is not supported
+
+#define URING_ENTRIES 256        // size of the submission queue
+#define URING_BUFFERS 1024       // receive buffers per worker, a power of two
+#define URING_BUFFER_SIZE 16384  // bytes in each receive buffer
+#define URING_GROUP 0            // buffer group of the receive buffers
+#define TRANSFER_BLOCK_SIZE 65536  // bytes moved through the pipe at a time, see send_file_async
+#define OUTPUT_MIN_SIZE 4096  // first allocation for output the socket did not take
+
+/** Session counters of one worker, shared with the other workers to
+ *  limit concurrent sessions. Addresses are counted in slots indexed
+ *  by a hash, so two addresses sharing a slot also share their limit.
+ *  Each worker only changes its own counters (including the sessions
+ *  of its forked children), so the supervisor can zero them when the
+ *  worker dies.
+ */
+struct admission {
+    int sessions;
+    int per_ip[ADMISSION_SLOTS];
+};
+
+static struct admission *admission = NULL;  // one per accepting worker
+static int admission_count = 0, admission_self = 0;
+static int max_sessions, max_per_ip;
+static int rejected_metric = -1;
+
+// Session timeouts, see server_set_timeout
+static int max_timeout = 0;  // cap on all timeouts, 0 for none
+static int timeout_metric = -1;
+static int fork_fd = -1;            // fork mode: socket of the session
+static uint64_t fork_deadline = 0;  // fork mode: when the timeout expires
+static int fork_expired = 0;        // fork mode: the session is being closed by it
+
+/** Session started by the fork loop, released when the child exits.
+ */
+struct child {
+    pid_t pid;
+    int slot;  // admission slot of the client address
+};
+
+// Modified with SIGCHLD blocked, so the handler sees a consistent table
+static struct child *children = NULL;
+static int child_count = 0, child_size = 0;
+
+static void release_connection(int slot);
+static void end_tls(int fd);
+static int wait_writable(int fd);
+static tls_t get_tls(int fd);
 
 /** Signal handler used to destroy zombie children (forked) processes
- *  once they finish executing.
+ *  once they finish executing, and release their sessions.
  */
 static void sigchld_handler(int s) {
     // waitpid() might overwrite errno, so we save and restore it:
     int saved_errno = errno;
-    while (waitpid(-1, NULL, WNOHANG) > 0)
-        ;
+    pid_t pid;
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        for (int i = 0; i < child_count; i++) {
+            if (children[i].pid == pid) {
+                release_connection(children[i].slot);
+                children[i] = children[--child_count];
+                break;
+            }
+        }
+    }
     errno = saved_errno;
 }
 
+// Connection logs, written with a single write per batch of connections
+static char log_buffer[LOG_BUFFER_SIZE];
+static size_t log_used = 0;
+
+/** Writes the buffered connection logs to stdout.
+ */
+static void log_flush(void) {
+    size_t done = 0;
+    while (done < log_used) {
+        ssize_t rv = write(STDOUT_FILENO, log_buffer + done, log_used - done);
+        if (rv <= 0 && errno != EINTR)
+            break;
+        if (rv > 0)
+            done += rv;
+    }
+    log_used = 0;
+}
+
+/** Adds a line to the connection logs. Logs are only written when the
+ *  buffer is full or when the accept loop waits for new connections,
+ *  so a burst of connections does not stall on stdout.
+ */
+__attribute__((format(printf, 1, 2))) static void log_printf(const char *format, ...) {
+    va_list args;
+
+    if (log_used + LOG_LINE_MAX > LOG_BUFFER_SIZE)
+        log_flush();
+    va_start(args, format);
+    int rv = vsnprintf(log_buffer + log_used, LOG_LINE_MAX, format, args);
+    va_end(args);
+    if (rv > 0)
+        log_used += rv < LOG_LINE_MAX ? rv : LOG_LINE_MAX - 1;
+}
+
+static volatile sig_atomic_t dump_requested = 0;
+static int session_metric = -1;
+
+/** Signal handler used to request a dump of the metrics (SIGUSR1).
+ *  The dump is written by the main loop, outside the handler.
+ */
+static void dump_handler(int s) {
+    dump_requested = 1;
+}
+
+/** Writes the metrics to stderr if a dump was requested.
+ */
+static void check_dump(void) {
+    if (dump_requested) {
+        dump_requested = 0;
+        metrics_dump(stderr);
+    }
+}
+
 /** Returns the IPv4 or IPv6 object for a socket address, depending on
  *  the family specified in that address.
  */
@@ -43,27 +178,150 @@ static void *get_in_addr(struct sockaddr *sa) {
         return &(((struct sockaddr_in6 *)sa)->sin6_addr);
 }
 
-/** Creates a server socket at the specified port number, listens for
- *  new connections and accepts them. A new forked process is created
- *  for each new client, calling the provided handler function for
- *  this client.
+/** Prints the usage message shared by all servers.
+ */
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Invalid arguments. Expected: %s [-m fork|epoll|uring] [-w workers] [-b backlog] "
+            "[-c max_sessions] [-i max_per_ip] [-s files|segments|compressed] [-l flat|hashed] [-d commit_window_ms] [-q queue_workers] "
+            "[-t cert.pem] [-k key.pem] [-T max_timeout_s] <port>\n",
+            prog);
+}
+
+/** Parses the command-line options common to all servers.
+ *
+ *  Parameters: argc, argv: Arguments as received by main.
+ *              config: Object to be filled with the parsed options.
+ *
+ *  Returns: 0 if the arguments are valid, or -1 (after printing a
+ *           usage message) otherwise.
+ */
+int server_parse_args(int argc, char *argv[], struct server_config *config) {
+    int opt;
+    long workers;
+
+    config->mode = SERVER_MODE_EPOLL;
+    config->backlog = DEFAULT_BACKLOG;
+    config->max_sessions = DEFAULT_MAX_SESSIONS;
+    config->max_per_ip = DEFAULT_MAX_PER_IP;
+    config->storage = "files";
+    config->layout = "flat";
+    config->commit_window = -1;
+    config->queue_workers = 0;
+    config->tls_cert = config->tls_key = NULL;
+    config->max_timeout = 0;
+    workers = sysconf(_SC_NPROCESSORS_ONLN);
+    config->workers = workers > 0 ? workers : 1;
+
+    while ((opt = getopt(argc, argv, "m:w:b:c:i:s:l:d:q:t:k:T:")) != -1) {
+        switch (opt) {
+        case 'm':
+            if (!strcmp(optarg, "fork"))
+                config->mode = SERVER_MODE_FORK;
+            else if (!strcmp(optarg, "epoll"))
+                config->mode = SERVER_MODE_EPOLL;
+            else if (!strcmp(optarg, "uring"))
+                config->mode = SERVER_MODE_URING;
+            else {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'w':
+            config->workers = atoi(optarg);
+            if (config->workers < 1) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'b':
+            config->backlog = atoi(optarg);
+            if (config->backlog < 1) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'c':
+            config->max_sessions = atoi(optarg);  // 0 disables the limit
+            if (config->max_sessions < 0) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'i':
+            config->max_per_ip = atoi(optarg);  // 0 disables the limit
+            if (config->max_per_ip < 0) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 's':
+            config->storage = optarg;  // checked by the server, see set_mail_storage
+            break;
+        case 'l':
+            config->layout = optarg;  // checked by the server, see set_mail_layout
+            break;
+        case 'd':
+            config->commit_window = atoi(optarg);
+            if (config->commit_window < 0) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'q':
+            config->queue_workers = atoi(optarg);  // 0 delivers in the session
+            if (config->queue_workers < 0) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 't':
+            config->tls_cert = optarg;  // loaded by run_server, see tls_init
+            break;
+        case 'k':
+            config->tls_key = optarg;
+            break;
+        case 'T':
+            config->max_timeout = atoi(optarg);  // 0 keeps the timeouts of the protocol
+            if (config->max_timeout < 0) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    // the key may be in the certificate file
+    if (config->tls_cert && !config->tls_key)
+        config->tls_key = config->tls_cert;
+    if (optind != argc - 1 || (config->tls_key && !config->tls_cert)) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    config->port = argv[optind];
+    return 0;
+}
+
+/** Creates a server socket bound to the specified port number and
+ *  sets it up to listen for new connections. The socket is created
+ *  with SO_REUSEPORT, so each worker can have its own listener on the
+ *  same port and the kernel spreads new connections across them.
  *
  *  Parameters: port: String corresponding to the port number (or
  *                    name) where the server will listen for new
  *                    connections.
- *              handler: Function to be called when a new connection
- *                       is accepted. Will receive, as the only
- *                       parameter, the file descriptor corresponding
- *                       to the newly accepted connection.
+ *              backlog: Maximum number of pending connections.
+ *
+ *  Returns: The listening socket. Exits the program on failure.
  */
-void run_server(const char *port, void (*handler)(int)) {
-    int sockfd, new_fd;  // listen on sock_fd, new connection on new_fd
+static int create_listener(const char *port, int backlog) {
+    int sockfd;
     struct addrinfo hints, *servinfo, *p;
-    struct sockaddr_storage their_addr;  // connector's address information
-    socklen_t sin_size;
-    struct sigaction sa;
     int yes = 1;
-    char s[INET6_ADDRSTRLEN];
     int rv;
 
     memset(&hints, 0, sizeof hints);
@@ -91,6 +349,12 @@ void run_server(const char *port, void (*handler)(int)) {
             exit(1);
         }
 
+        // allow one listener per worker on the same port
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+            perror("setsockopt");
+            exit(1);
+        }
+
         // bind to the specified port number
         if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
             close(sockfd);
@@ -112,11 +376,161 @@ void run_server(const char *port, void (*handler)(int)) {
     }
 
     // sets up a queue of incoming connections to be received by the server
-    if (listen(sockfd, BACKLOG) == -1) {
+    if (listen(sockfd, backlog) == -1) {
         perror("listen");
         exit(1);
     }
 
+    return sockfd;
+}
+
+/** Logs the address of a newly accepted client.
+ */
+static void log_connection(struct sockaddr_storage *their_addr, const char *event) {
+    char s[INET6_ADDRSTRLEN];
+    inet_ntop(their_addr->ss_family, get_in_addr((struct sockaddr *)their_addr),
+              s, sizeof(s));
+    log_printf("server: %s %s\n", event, s);
+}
+
+/** Internal function that returns the admission slot of an address
+ *  (FNV-1a hash of the address bytes).
+ */
+static int admission_slot(struct sockaddr_storage *addr) {
+    const unsigned char *p = get_in_addr((struct sockaddr *)addr);
+    size_t size = addr->ss_family == AF_INET ? sizeof(struct in_addr) : sizeof(struct in6_addr);
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ p[i]) * 16777619u;
+    return hash % ADMISSION_SLOTS;
+}
+
+/** Internal function that counts a session in the counters of this
+ *  worker, unless the sum over all workers would exceed the limit (0
+ *  meaning no limit). The own counter is raised before summing, so
+ *  two workers admitting at once cannot both go over it.
+ *
+ *  Parameters: offset: offset of the counter in struct admission.
+ *              limit: maximum sum of the counter.
+ */
+static int try_acquire(size_t offset, int limit) {
+    int *own = (int *)((char *)&admission[admission_self] + offset);
+    int sum = 0;
+
+    __atomic_add_fetch(own, 1, __ATOMIC_RELAXED);
+    if (!limit)
+        return 0;
+    for (int i = 0; i < admission_count; i++)
+        sum += __atomic_load_n((int *)((char *)&admission[i] + offset), __ATOMIC_RELAXED);
+    if (sum > limit) {
+        __atomic_sub_fetch(own, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return 0;
+}
+
+/** Checks the session limits for a newly accepted connection. If the
+ *  connection is over a limit, the handler's busy reply is sent
+ *  (without waiting, the socket buffer is empty) and the socket is
+ *  closed.
+ *
+ *  Returns: admission slot of the connection, to be passed to
+ *           release_connection when the session ends, or -1 if the
+ *           connection was rejected.
+ */
+static int admit_connection(int fd, struct sockaddr_storage *addr,
+                            const struct server_handler *handler) {
+    int slot = admission_slot(addr);
+
+    if (admission) {
+        struct admission *self = &admission[admission_self];
+        if (try_acquire(offsetof(struct admission, sessions), max_sessions) == 0) {
+            if (try_acquire(offsetof(struct admission, per_ip[slot]), max_per_ip) == 0) {
+                log_connection(addr, "got connection from");
+                return slot;
+            }
+            __atomic_sub_fetch(&self->sessions, 1, __ATOMIC_RELAXED);
+        }
+
+        log_connection(addr, "too many sessions, rejected connection from");
+        metrics_add(rejected_metric, 1);
+        if (handler->busy)
+            send(fd, handler->busy, strlen(handler->busy), MSG_NOSIGNAL | MSG_DONTWAIT);
+        close(fd);
+        return -1;
+    }
+
+    log_connection(addr, "got connection from");
+    return slot;
+}
+
+/** Releases the session of a connection accepted by admit_connection.
+ */
+static void release_connection(int slot) {
+    if (admission) {
+        struct admission *self = &admission[admission_self];
+        __atomic_sub_fetch(&self->sessions, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&self->per_ip[slot], 1, __ATOMIC_RELAXED);
+    }
+}
+
+/** Marks a file descriptor as non-blocking.
+ */
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/** Disables Nagle's algorithm on an accepted socket. Replies are
+ *  already coalesced in the socket buffer, so a small write (such as
+ *  the end of a RETR after the file) should not wait for the ACK of
+ *  the previous one.
+ */
+static void set_nodelay(int fd) {
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+}
+
+/** Internal function that sends the timeout reply of the handler to
+ *  a session whose timeout expired, without waiting for the client to
+ *  read it. The session is closed afterwards.
+ */
+static void send_timeout(int fd, const struct server_handler *handler) {
+    metrics_add(timeout_metric, 1);
+    if (handler->timeout) {
+        set_nonblocking(fd);
+        send_all(fd, (char *)handler->timeout, strlen(handler->timeout));
+    }
+}
+
+/** Internal function that records a forked session, so it is released
+ *  when the child exits. SIGCHLD must be blocked.
+ */
+static void add_child(pid_t pid, int slot) {
+    if (child_count == child_size) {
+        child_size = child_size * 2 + 64;
+        children = realloc(children, child_size * sizeof(struct child));
+    }
+    children[child_count].pid = pid;
+    children[child_count].slot = slot;
+    child_count++;
+}
+
+/** Accepts new connections and creates a new forked process for each
+ *  new client, running the whole session in the child process.
+ *  Pending connections are accepted in batches, and the connection
+ *  logs are written before waiting for more.
+ */
+static void run_fork_loop(int sockfd, const struct server_handler *handler) {
+    int new_fd, slot, i;
+    struct sockaddr_storage their_addr;  // connector's address information
+    socklen_t sin_size;
+    struct sigaction sa;
+    struct pollfd pfd = {.fd = sockfd, .events = POLLIN};
+    sigset_t chld, old;
+
     // set up a signal handler to kill zombie forked processes when they exit
     sa.sa_handler = sigchld_handler;
     sigemptyset(&sa.sa_mask);
@@ -125,35 +539,1500 @@ void run_server(const char *port, void (*handler)(int)) {
         perror("sigaction");
         exit(1);
     }
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
 
-    printf("server: waiting for connections...\n");
+    // the listener is only used once poll reports pending connections
+    set_nonblocking(sockfd);
 
     while (1) {
-        // wait for new client to connect
+        for (i = 0; i < ACCEPT_BATCH; i++) {
+            sin_size = sizeof(their_addr);
+            new_fd = accept4(sockfd, (struct sockaddr *)&their_addr, &sin_size, SOCK_CLOEXEC);
+            if (new_fd == -1) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    perror("accept");
+                break;
+            }
+            if ((slot = admit_connection(new_fd, &their_addr, handler)) == -1)
+                continue;
+            set_nodelay(new_fd);
+
+            // Create a new process to handle the new client; parent process
+            // will wait for another client.
+            sigprocmask(SIG_BLOCK, &chld, &old);
+            pid_t pid = fork();
+            if (!pid) {
+                // this is the child process
+                sigprocmask(SIG_SETMASK, &old, NULL);
+                close(sockfd);  // child doesn't need the listener
+                signal(SIGUSR1, SIG_IGN);
+                uint64_t opened = metrics_now();
+                fork_fd = new_fd;
+                // reads and writes wait in poll, which ends when the
+                // timeout expires (see receive and wait_writable)
+                set_nonblocking(new_fd);
+                void *session = handler->open(new_fd);
+                if (session) {
+                    // so resume only returns 0 if interrupted before
+                    // reading anything, or once the timeout expired
+                    while (handler->resume(session) == 0) {
+                        if (fork_deadline && metrics_now() >= fork_deadline) {
+                            fork_expired = 1;
+                            send_timeout(new_fd, handler);
+                            break;
+                        }
+                    }
+                    handler->close(session);
+                }
+                end_tls(new_fd);
+                close(new_fd);
+                metrics_record(session_metric, opened);
+                exit(0);
+            }
+
+            // Parent proceeds from here. In parent, client socket is not needed.
+            if (pid > 0)
+                add_child(pid, slot);
+            else
+                release_connection(slot);
+            sigprocmask(SIG_SETMASK, &old, NULL);
+            close(new_fd);
+        }
+
+        log_flush();
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+            perror("poll");
+            exit(1);
+        }
+        check_dump();
+    }
+}
+
+/** File being sent by send_file_async. In io_uring mode, it is moved
+ *  from the file to a pipe and from the pipe to the socket by
+ *  alternating splice requests. Otherwise (no pipe), it is copied to
+ *  the socket whenever the socket is writable, with sendfile or
+ *  through the TLS session.
+ */
+struct transfer {
+    struct connection *conn;
+    int file_fd;
+    int pipe[2];       // -1 if the file is copied
+    int submitted;     // a splice request is in the ring
+    off_t offset;      // position of the next byte read from the file
+    size_t remaining;  // bytes not read from the file yet
+    size_t buffered;   // bytes in the pipe, not sent yet
+    size_t size;
+    int *status;  // NULL once the session is closed
+};
+
+/** Per-connection data kept by the event loop.
+ */
+struct connection {
+    int fd;
+    int suspended;  // returned SERVER_SUSPEND, not resumed until woken
+    int slot;       // admission slot of the client address
+    uint64_t opened;  // for the session lifetime metric
+    void *session;
+    struct timer timer;  // armed by server_set_timeout
+    int timeout;         // seconds of the timer, 0 if not armed
+    int expired;         // closed by its timer, so nothing waits for the client
+    // output the socket did not take yet, see send_all
+    char *out;
+    size_t out_start, out_end, out_size;
+    int want_write;    // TLS waits for the socket to be writable
+    int wake_on_sent;  // woken once all output is sent, see server_wait_sent
+    int broken;        // sending failed, so all output fails from then on
+    struct transfer *transfer;  // file being sent by send_file_async
+    // epoll mode only
+    uint32_t events;  // events registered, 0 if not in epoll
+    // io_uring mode only
+    int closed;     // session closed, freed once no request refers to it
+    int polling;    // poll for writability submitted
+    int receiving;  // multishot receive submitted
+    int starved;    // receive stopped for lack of buffers, in the starved list
+    int ready;      // in the ready list, resumed after the completions
+    int eof;        // the client closed the connection
+    int error;      // errno of a failed receive, or 0
+    int head, tail;   // queue of received buffers, -1 if empty
+    unsigned offset;  // bytes of the first buffer already read
+};
+
+// Connections indexed by socket, used to find woken sessions
+static struct connection **connections = NULL;
+static int connections_size = 0;
+
+// Sockets passed to server_wake, resumed after the current batch of events
+static int *woken = NULL;
+static int woken_count = 0, woken_size = 0;
+
+// Timers of the connections, in seconds
+static struct timer_wheel timers;
+
+/** Internal function that returns the current time of the timers.
+ */
+static inline uint64_t timer_seconds(void) {
+    return metrics_now() / NS_PER_SECOND;
+}
+
+/** Sets the timeout of a session: if no input is received from the
+ *  client within the given time, the session is closed, after sending
+ *  the timeout reply of the handler. Called again every time the
+ *  session expects more input, which restarts the timeout. Waiting
+ *  for the client to read the output of the session does not restart
+ *  it, so a client reading slowly is closed once it expires too.
+ *  Other suspended sessions wait for the server, so their timeout is
+ *  restarted if it expires. In the event loops, timeouts are kept in a
+ *  timing wheel, so any number of them is set and cancelled in
+ *  constant time.
+ *
+ *  Timeouts longer than the maximum set in the command line (if any)
+ *  are reduced to it, and sessions without one get the maximum.
+ *
+ *  Parameters: fd: Socket of the session.
+ *              seconds: Timeout, 0 to wait for the client forever.
+ */
+void server_set_timeout(int fd, int seconds) {
+    struct connection *conn;
+
+    if (max_timeout && (!seconds || seconds > max_timeout))
+        seconds = max_timeout;
+
+    if (fd < connections_size && (conn = connections[fd])) {
+        conn->timeout = seconds;
+        if (seconds)
+            timer_add(&timers, &conn->timer, timer_seconds() + seconds);
+        else
+            timer_cancel(&timers, &conn->timer);
+    } else if (fd == fork_fd) {
+        fork_deadline = seconds ? metrics_now() + seconds * NS_PER_SECOND : 0;
+    }
+}
+
+static int closable(const struct connection *conn);
+
+/** Internal function that returns the next connection of the event
+ *  loop whose timeout expired, after sending it the timeout reply.
+ *  The caller closes it. Timeouts of sessions suspended for the server
+ *  are restarted.
+ */
+static struct connection *next_expired(const struct server_handler *handler) {
+    uint64_t now = timer_seconds();
+    struct timer *timer;
+
+    while ((timer = timer_expire(&timers, now))) {
+        struct connection *conn = (struct connection *)((char *)timer - offsetof(struct connection, timer));
+        if (!closable(conn)) {
+            timer_add(&timers, &conn->timer, now + conn->timeout);
+            continue;
+        }
+        conn->expired = 1;
+        send_timeout(conn->fd, handler);
+        return conn;
+    }
+    return NULL;
+}
+
+/** Internal function that shortens the wait of an event loop, so the
+ *  timers are handled as soon as a second has passed.
+ */
+static int timers_wait(int timeout) {
+    if (!timers.count)
+        return timeout;
+    int next = 1000 - (metrics_now() / 1000000) % 1000;
+    return timeout < 0 || next < timeout ? next : timeout;
+}
+
+/** Wakes a session that was suspended by returning SERVER_SUSPEND
+ *  from resume. The session is resumed by the event loop once the
+ *  current batch of events (or tick) is handled, even if no new input
+ *  is available.
+ *
+ *  Parameters: fd: Socket of the suspended session.
+ */
+void server_wake(int fd) {
+    if (woken_count == woken_size) {
+        woken_size = woken_size * 2 + 16;
+        woken = realloc(woken, woken_size * sizeof(int));
+    }
+    woken[woken_count++] = fd;
+}
+
+/** Records a connection in the table indexed by socket.
+ */
+static void add_connection(struct connection *conn) {
+    if (conn->fd >= connections_size) {
+        int size = conn->fd * 2 + 64;
+        connections = realloc(connections, size * sizeof(struct connection *));
+        memset(connections + connections_size, 0, (size - connections_size) * sizeof(struct connection *));
+        connections_size = size;
+    }
+    connections[conn->fd] = conn;
+}
+
+/*
+ * Output of the event loops. Sockets are non-blocking, so whatever
+ * send_all cannot send right away is kept in the connection, and sent
+ * by the loop once the socket is writable; files sent with
+ * send_file_async continue the same way. Sessions with output waiting
+ * are not handed more input (see server_send_blocked), so a client
+ * that does not read cannot make the output grow without bound.
+ */
+
+static void transfer_step(struct transfer *t);
+
+/** Internal function that returns the connection of a socket handled
+ *  by an event loop, or NULL in fork mode.
+ */
+static inline struct connection *find_connection(int fd) {
+    return fd < connections_size ? connections[fd] : NULL;
+}
+
+/** Internal function that returns non-zero if a connection waits for
+ *  its socket to be writable.
+ */
+static int output_blocked(const struct connection *conn) {
+    return conn->out_end > conn->out_start || conn->want_write ||
+           (conn->transfer && conn->transfer->pipe[0] == -1);
+}
+
+/** Internal function that returns non-zero if a connection can be
+ *  closed by the server: its session is not suspended, or only waits
+ *  for its output to be sent. Other suspended sessions are known to
+ *  the code that wakes them, so they are only closed once woken.
+ */
+static int closable(const struct connection *conn) {
+    return !conn->suspended || conn->transfer || conn->wake_on_sent;
+}
+
+/** Internal function that keeps data the socket did not take, to be
+ *  sent after the data kept before it.
+ */
+static int queue_output(struct connection *conn, const char *data, size_t size) {
+    if (conn->out_end + size > conn->out_size) {
+        memmove(conn->out, conn->out + conn->out_start, conn->out_end - conn->out_start);
+        conn->out_end -= conn->out_start;
+        conn->out_start = 0;
+    }
+    if (conn->out_end + size > conn->out_size) {
+        size_t new_size = conn->out_size ? conn->out_size * 2 : OUTPUT_MIN_SIZE;
+        while (new_size < conn->out_end + size)
+            new_size *= 2;
+        char *out = realloc(conn->out, new_size);
+        if (!out)
+            return -1;
+        conn->out = out;
+        conn->out_size = new_size;
+    }
+    memcpy(conn->out + conn->out_end, data, size);
+    conn->out_end += size;
+    return size;
+}
+
+/** Internal function that sends the output kept in a connection, as
+ *  much as the socket takes. If sending fails, the output is dropped.
+ *
+ *  Returns: 1 if all output was sent, 0 if the socket is full, or -1
+ *           on error.
+ */
+static int flush_output(struct connection *conn) {
+    tls_t tls = get_tls(conn->fd);
+
+    if (tls && tls_kernel_send(tls))
+        tls = NULL;
+    while (conn->out_start < conn->out_end) {
+        size_t rem = conn->out_end - conn->out_start;
+        char *buf = conn->out + conn->out_start;
+        ssize_t rv = tls ? tls_write(tls, buf, rem) : send(conn->fd, buf, rem, MSG_NOSIGNAL);
+        if (rv < 0 && errno == EINTR)
+            continue;
+        if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && (!tls || tls_wants_write(tls)))
+            return 0;
+        if (rv <= 0) {
+            conn->out_start = conn->out_end = 0;
+            return -1;
+        }
+        conn->out_start += rv;
+    }
+    conn->out_start = conn->out_end = 0;
+    return 1;
+}
+
+/** Internal function that copies as much of a file transfer without
+ *  pipe as the socket takes.
+ *
+ *  Returns: 1 once the whole file was sent, 0 if the socket is full,
+ *           or -1 on error.
+ */
+static int copy_transfer(struct connection *conn) {
+    struct transfer *t = conn->transfer;
+    tls_t tls = get_tls(conn->fd);
+
+    while (t->remaining) {
+        ssize_t rv;
+        if (!tls || tls_kernel_send(tls)) {
+            rv = sendfile(conn->fd, t->file_fd, &t->offset, t->remaining);
+            if (rv < 0 && errno == EINTR)
+                continue;
+            if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return 0;
+            if (rv <= 0)
+                return -1;
+        } else {
+            // the TLS session encrypts a block at a time, and keeps
+            // what the socket does not take with the other output
+            char buf[TRANSFER_BLOCK_SIZE];
+            rv = pread(t->file_fd, buf, t->remaining < sizeof(buf) ? t->remaining : sizeof(buf), t->offset);
+            if (rv <= 0 || send_all(conn->fd, buf, rv) < 0)
+                return -1;
+            t->offset += rv;
+        }
+        t->remaining -= rv;
+        if (conn->out_end > conn->out_start)
+            return 0;
+    }
+    return 1;
+}
+
+/** Internal function that ends a file transfer without pipe, and wakes
+ *  its session.
+ */
+static void finish_transfer(struct connection *conn, int rv) {
+    struct transfer *t = conn->transfer;
+
+    *t->status = rv > 0 ? (int)t->size : -1;
+    close(t->file_fd);
+    free(t);
+    conn->transfer = NULL;
+    server_wake(conn->fd);
+}
+
+/** Internal function that continues the output of a connection once
+ *  its socket is writable: sends the output kept, then the file being
+ *  transferred, if any. If sending fails, all further output of the
+ *  session fails, and it is woken if it waits for its output.
+ *
+ *  Returns: 0 if the connection still waits for the socket, 1 otherwise.
+ */
+static int handle_writable(struct connection *conn) {
+    struct transfer *t = conn->transfer;
+    int rv;
+
+    conn->want_write = 0;
+    if ((rv = flush_output(conn)) == 0)
+        return 0;
+    if (rv < 0)
+        conn->broken = 1;
+
+    if (t && t->pipe[0] == -1) {
+        if ((rv = conn->broken ? -1 : copy_transfer(conn)) == 0)
+            return 0;
+        finish_transfer(conn, rv);
+    } else if (t && !t->submitted) {
+        // a splice must not overtake the output kept before it, and
+        // one that found the socket full is submitted again
+        transfer_step(t);
+    }
+
+    if (conn->wake_on_sent) {
+        conn->wake_on_sent = 0;
+        server_wake(conn->fd);
+    }
+    return 1;
+}
+
+/** Internal function that frees the output of a connection being
+ *  closed, including a transfer that has no request in the ring.
+ */
+static void discard_output(struct connection *conn) {
+    struct transfer *t = conn->transfer;
+
+    free(conn->out);
+    conn->out = NULL;
+    conn->out_start = conn->out_end = conn->out_size = 0;
+    if (t && (t->pipe[0] == -1 || !t->submitted)) {
+        close(t->file_fd);
+        if (t->pipe[0] != -1) {
+            close(t->pipe[0]);
+            close(t->pipe[1]);
+        }
+        free(t);
+        conn->transfer = NULL;
+    }
+}
+
+/** Returns non-zero if output of a session waits for its socket to be
+ *  writable. In the event loops, reading functions of the socket
+ *  buffer then fail with EAGAIN, and the session is resumed once the
+ *  socket took the output (unless it is suspended). Always 0 in fork
+ *  mode, where sending blocks.
+ *
+ *  Parameters: fd: Socket of the session.
+ */
+int server_send_blocked(int fd) {
+    struct connection *conn = find_connection(fd);
+    return conn && output_blocked(conn);
+}
+
+/** Makes a session wait for its output to be sent before producing
+ *  more, for replies too large to be kept whole (such as a message
+ *  decompressed as it is sent). If the output waits for the socket,
+ *  the session must return SERVER_SUSPEND from resume, and is woken
+ *  with server_wake once the socket took all of it.
+ *
+ *  Parameters: fd: Socket of the session.
+ *
+ *  Returns: 1 if the session must suspend, 0 if no output is waiting
+ *           (always in fork mode).
+ */
+int server_wait_sent(int fd) {
+    struct connection *conn = find_connection(fd);
+
+    if (!conn || !output_blocked(conn))
+        return 0;
+    conn->wake_on_sent = 1;
+    return 1;
+}
+
+/** Internal function that registers a connection in epoll for the
+ *  events it waits for: writability while output waits for the
+ *  socket, otherwise input unless the session is suspended.
+ *
+ *  Returns: 0 on success, -1 if epoll_ctl failed.
+ */
+static int update_events(int epfd, struct connection *conn) {
+    uint32_t events = output_blocked(conn) ? EPOLLOUT : conn->suspended ? 0 : EPOLLIN;
+    struct epoll_event ev = {.events = events, .data.ptr = conn};
+
+    if (events == conn->events)
+        return 0;
+    int op = !conn->events ? EPOLL_CTL_ADD : !events ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+    if (epoll_ctl(epfd, op, conn->fd, &ev) == -1)
+        return -1;
+    conn->events = events;
+    return 0;
+}
+
+/** Closes a connection handled by the event loop, freeing its session.
+ */
+static void close_connection(int epfd, const struct server_handler *handler,
+                             struct connection *conn) {
+    if (conn->events)
+        epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    timer_cancel(&timers, &conn->timer);
+    handler->close(conn->session);
+    discard_output(conn);
+    metrics_record(session_metric, conn->opened);
+    release_connection(conn->slot);
+    connections[conn->fd] = NULL;
+    end_tls(conn->fd);
+    close(conn->fd);
+    free(conn);
+}
+
+/** Resumes the session of a connection, and updates its registration
+ *  in the event loop based on the result. A suspended session with
+ *  pending input would be reported again and again, so its input
+ *  stops being watched.
+ */
+static void resume_connection(int epfd, const struct server_handler *handler,
+                              struct connection *conn) {
+    int rv = handler->resume(conn->session);
+
+    if (rv < 0) {
+        close_connection(epfd, handler, conn);
+        return;
+    }
+    conn->suspended = rv == SERVER_SUSPEND;
+    if (update_events(epfd, conn) == -1) {
+        perror("epoll_ctl");
+        if (closable(conn))
+            close_connection(epfd, handler, conn);
+    }
+}
+
+/** Continues the output of a connection whose socket became writable,
+ *  and resumes its session once all of it was sent, since it may have
+ *  input left that it did not handle while waiting.
+ */
+static void write_connection(int epfd, const struct server_handler *handler,
+                             struct connection *conn) {
+    if (handle_writable(conn) && !conn->suspended) {
+        resume_connection(epfd, handler, conn);
+    } else if (update_events(epfd, conn) == -1) {
+        perror("epoll_ctl");
+        if (closable(conn))
+            close_connection(epfd, handler, conn);
+    }
+}
+
+/** Accepts pending connections on a non-blocking listener, creating
+ *  a session for each and registering it in the event loop. At most
+ *  ACCEPT_BATCH connections are accepted, so sessions with pending
+ *  input are not starved; the listener is reported again if more are
+ *  pending.
+ */
+static void accept_connections(int epfd, int sockfd, const struct server_handler *handler) {
+    struct sockaddr_storage their_addr;
+    socklen_t sin_size;
+    int new_fd, slot;
+
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
         sin_size = sizeof(their_addr);
-        new_fd = accept(sockfd, (struct sockaddr *)&their_addr, &sin_size);
+        new_fd = accept4(sockfd, (struct sockaddr *)&their_addr, &sin_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
         if (new_fd == -1) {
-            perror("accept");
-            continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("accept");
+            return;
         }
 
-        inet_ntop(their_addr.ss_family, get_in_addr((struct sockaddr *)&their_addr),
-                  s, sizeof(s));
-        printf("server: got connection from %s\n", s);
+        if ((slot = admit_connection(new_fd, &their_addr, handler)) == -1)
+            continue;
+        set_nodelay(new_fd);
 
-        // Create a new process to handle the new client; parent process
-        // will wait for another client.
-        if (!fork()) {
-            // this is the child process
-            close(sockfd);  // child doesn't need the listener
-            handler(new_fd);
+        struct connection *conn = calloc(1, sizeof(struct connection));
+        conn->fd = new_fd;
+        conn->slot = slot;
+        conn->opened = metrics_now();
+        // the session may set its timeout while opening
+        add_connection(conn);
+        conn->session = handler->open(new_fd);
+        if (!conn->session) {
+            timer_cancel(&timers, &conn->timer);
+            connections[new_fd] = NULL;
+            release_connection(slot);
             close(new_fd);
-            exit(0);
+            free(conn->out);
+            free(conn);
+            continue;
+        }
+
+        if (update_events(epfd, conn) == -1) {
+            perror("epoll_ctl");
+            close_connection(epfd, handler, conn);
+        }
+    }
+}
+
+/** Handles all connections in a single process, using epoll to wait
+ *  for sockets with available data and resuming the corresponding
+ *  sessions, or for sockets that can take the output waiting for them.
+ */
+static void run_event_loop(int sockfd, const struct server_handler *handler) {
+    struct epoll_event ev, events[MAX_EVENTS];
+    int epfd, n, i, timeout = -1;
+
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    // the listener is identified by a NULL pointer in the event data
+    set_nonblocking(sockfd);
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev) == -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+
+    while (1) {
+        n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        if (n == -1) {
+            if (errno != EINTR) {
+                perror("epoll_wait");
+                exit(1);
+            }
+            n = 0;
+        }
+        check_dump();
+
+        for (i = 0; i < n; i++) {
+            struct connection *conn = events[i].data.ptr;
+            if (!conn)
+                accept_connections(epfd, sockfd, handler);
+            else if (conn->events & EPOLLOUT)
+                write_connection(epfd, handler, conn);
+            else
+                resume_connection(epfd, handler, conn);
         }
 
-        // Parent proceeds from here. In parent, client socket is not needed.
+        struct connection *expired;
+        while ((expired = next_expired(handler)))
+            close_connection(epfd, handler, expired);
+
+        // the tick may wake sessions, and resuming them may queue work
+        // for the next tick, so both are repeated until nothing is woken
+        for (;;) {
+            if (handler->tick)
+                timeout = handler->tick();
+            if (!woken_count)
+                break;
+
+            int count = woken_count, *fds = woken;
+            woken = NULL;
+            woken_count = woken_size = 0;
+            for (i = 0; i < count; i++)
+                if (fds[i] < connections_size && connections[fds[i]])
+                    resume_connection(epfd, handler, connections[fds[i]]);
+            free(fds);
+        }
+        timeout = timers_wait(timeout);
+        log_flush();
+    }
+}
+
+/*
+ * io_uring backend. The worker submits all socket reads and file
+ * transfers to a ring and handles their completions in batches, so the
+ * event loop only makes a system call per batch instead of one per
+ * event. Sockets get a multishot receive, which fills buffers
+ * provided by the worker (see uring_buffers_init) as data arrives;
+ * the data is queued in the connection and copied by server_recv into
+ * the socket buffer of the session. Replies are still sent directly;
+ * what the socket does not take is kept in the connection as in the
+ * epoll loop, and sent once a poll request reports it writable.
+ *
+ * user_data of each request is the connection or transfer pointer,
+ * with the kind of request in its low bits (both are allocated with
+ * malloc, so at least 8-byte aligned).
+ */
+
+enum uring_op { OP_ACCEPT, OP_RECV, OP_TRANSFER, OP_IGNORE, OP_WRITABLE };
+
+#define URING_DATA(ptr, op) ((uint64_t)(uintptr_t)(ptr) | (op))
+#define URING_OP(data) ((int)((data) & 7))
+#define URING_PTR(data) ((void *)(uintptr_t)((data) & ~(uint64_t)7))
+
+/** List of connections, used for the ready and starved ones.
+ */
+struct connection_list {
+    struct connection **items;
+    int count, size;
+};
+
+static struct uring *ring = NULL;  // set in io_uring mode
+static struct uring_buffers buffers;
+static int buffer_next[URING_BUFFERS];  // next buffer in the queue of a connection
+static unsigned buffer_length[URING_BUFFERS];
+static int buffers_free = 0;  // buffers the kernel can still fill
+static struct connection_list ready_list, starved_list;
+
+static void list_push(struct connection_list *list, struct connection *conn) {
+    if (list->count == list->size) {
+        list->size = list->size * 2 + 16;
+        list->items = realloc(list->items, list->size * sizeof(struct connection *));
+    }
+    list->items[list->count++] = conn;
+}
+
+/** Internal function that gets a submission queue entry, exiting if
+ *  the ring is broken.
+ */
+static struct io_uring_sqe *get_sqe(void) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe) {
+        perror("io_uring_enter");
+        exit(1);
+    }
+    return sqe;
+}
+
+static void recycle_buffer(int id) {
+    uring_buffers_recycle(&buffers, id);
+    buffers_free++;
+}
+
+/** Internal function that frees a closed connection once no request
+ *  refers to it any more.
+ */
+static void maybe_free_connection(struct connection *conn) {
+    if (conn->closed && !conn->receiving && !conn->starved && !conn->ready && !conn->transfer &&
+        !conn->polling)
+        free(conn);
+}
+
+/** Starts a multishot receive on a connection.
+ */
+static void arm_receive(struct connection *conn) {
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_GROUP;
+    sqe->user_data = URING_DATA(conn, OP_RECV);
+    conn->receiving = 1;
+}
+
+/** Waits for the socket of a connection to be writable, to continue
+ *  the output waiting for it.
+ */
+static void arm_writable(struct connection *conn) {
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = conn->fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = URING_DATA(conn, OP_WRITABLE);
+    conn->polling = 1;
+}
+
+static void arm_accept(int sockfd) {
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = sockfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    // non-blocking like in the epoll loop, so replies never wait
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = URING_DATA(NULL, OP_ACCEPT);
+}
+
+static void cancel_request(uint64_t data) {
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = data;
+    sqe->user_data = URING_DATA(NULL, OP_IGNORE);
+}
+
+/** Marks a connection to be resumed once all completions are handled.
+ */
+static void mark_ready(struct connection *conn) {
+    if (!conn->ready && !conn->suspended && !conn->closed) {
+        conn->ready = 1;
+        list_push(&ready_list, conn);
+    }
+}
+
+/** Closes a connection handled by the io_uring loop, freeing its
+ *  session. Requests still running are cancelled, and the connection
+ *  itself is freed once they complete.
+ */
+static void close_uring_connection(const struct server_handler *handler,
+                                   struct connection *conn) {
+    timer_cancel(&timers, &conn->timer);
+    handler->close(conn->session);
+    discard_output(conn);
+    metrics_record(session_metric, conn->opened);
+    release_connection(conn->slot);
+    connections[conn->fd] = NULL;
+    conn->closed = 1;
+
+    while (conn->head != -1) {
+        int id = conn->head;
+        conn->head = buffer_next[id];
+        recycle_buffer(id);
+    }
+    if (conn->receiving)
+        cancel_request(URING_DATA(conn, OP_RECV));
+    if (conn->polling)
+        cancel_request(URING_DATA(conn, OP_WRITABLE));
+    if (conn->transfer) {
+        conn->transfer->status = NULL;
+        cancel_request(URING_DATA(conn->transfer, OP_TRANSFER));
+    }
+
+    // queued requests find their files when submitted, so they must be
+    // submitted before the socket number can be reused by an accept
+    if (uring_submit(ring) == -1)
+        perror("io_uring_enter");
+    end_tls(conn->fd);
+    close(conn->fd);
+    maybe_free_connection(conn);
+}
+
+static void resume_uring_connection(const struct server_handler *handler,
+                                    struct connection *conn) {
+    int rv = handler->resume(conn->session);
+    if (rv < 0) {
+        close_uring_connection(handler, conn);
+        return;
+    }
+    conn->suspended = rv == SERVER_SUSPEND;
+    if (output_blocked(conn) && !conn->polling)
+        arm_writable(conn);
+}
+
+/** Handles the completion of a poll for writability: continues the
+ *  output of the connection, and resumes its session once all of it
+ *  was sent, as in the epoll loop.
+ */
+static void handle_writable_poll(struct connection *conn) {
+    conn->polling = 0;
+    if (conn->closed) {
+        maybe_free_connection(conn);
+        return;
+    }
+    if (handle_writable(conn))
+        mark_ready(conn);
+    else
+        arm_writable(conn);
+}
+
+/** Creates a session for a connection accepted by the ring, and starts
+ *  receiving its data.
+ */
+static void open_uring_connection(int new_fd, const struct server_handler *handler) {
+    struct sockaddr_storage their_addr;
+    socklen_t sin_size = sizeof(their_addr);
+    int slot;
+
+    if (getpeername(new_fd, (struct sockaddr *)&their_addr, &sin_size) == -1) {
+        close(new_fd);
+        return;
+    }
+    if ((slot = admit_connection(new_fd, &their_addr, handler)) == -1)
+        return;
+    set_nodelay(new_fd);
+
+    struct connection *conn = calloc(1, sizeof(struct connection));
+    conn->fd = new_fd;
+    conn->slot = slot;
+    conn->head = conn->tail = -1;
+    conn->opened = metrics_now();
+    // the session may read its socket (see server_recv) while opening
+    add_connection(conn);
+    conn->session = handler->open(new_fd);
+    if (!conn->session) {
+        timer_cancel(&timers, &conn->timer);
+        connections[new_fd] = NULL;
+        release_connection(slot);
         close(new_fd);
+        free(conn->out);
+        free(conn);
+        return;
+    }
+    arm_receive(conn);
+    if (output_blocked(conn))
+        arm_writable(conn);
+}
+
+/** Handles the completion of a multishot receive: queues the received
+ *  buffer, or records the end of the connection.
+ */
+static void handle_receive(struct connection *conn, int res, unsigned flags) {
+    if (res > 0 && (flags & IORING_CQE_F_BUFFER)) {
+        int id = flags >> IORING_CQE_BUFFER_SHIFT;
+        buffers_free--;
+        if (conn->closed) {
+            recycle_buffer(id);
+        } else {
+            buffer_length[id] = res;
+            buffer_next[id] = -1;
+            if (conn->tail == -1)
+                conn->head = id;
+            else
+                buffer_next[conn->tail] = id;
+            conn->tail = id;
+        }
+    } else if (res == 0) {
+        conn->eof = 1;
+    } else if (res < 0 && res != -ENOBUFS && res != -ECANCELED) {
+        conn->error = -res;
+    }
+
+    if (!(flags & IORING_CQE_F_MORE)) {
+        conn->receiving = 0;
+        if (conn->closed) {
+            maybe_free_connection(conn);
+            return;
+        }
+        if (res == -ENOBUFS) {
+            // restarted once sessions give buffers back, see run_uring_loop
+            conn->starved = 1;
+            list_push(&starved_list, conn);
+        } else if (!conn->eof && !conn->error) {
+            arm_receive(conn);
+        }
+    }
+    if (res != -ENOBUFS)
+        mark_ready(conn);
+}
+
+/** Submits the next splice of a transfer: from the file to the pipe
+ *  when the pipe is empty, from the pipe to the socket otherwise.
+ */
+static void transfer_step(struct transfer *t) {
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->off = (uint64_t)-1;
+    sqe->user_data = URING_DATA(t, OP_TRANSFER);
+    t->submitted = 1;
+    if (t->buffered) {
+        sqe->splice_fd_in = t->pipe[0];
+        sqe->splice_off_in = (uint64_t)-1;
+        sqe->fd = t->conn->fd;
+        sqe->len = t->buffered;
+        sqe->splice_flags = t->remaining ? SPLICE_F_MORE : 0;
+    } else {
+        sqe->splice_fd_in = t->file_fd;
+        sqe->splice_off_in = t->offset;
+        sqe->fd = t->pipe[1];
+        sqe->len = t->remaining < TRANSFER_BLOCK_SIZE ? t->remaining : TRANSFER_BLOCK_SIZE;
+    }
+}
+
+/** Handles the completion of a splice of a transfer, submitting the
+ *  next one, or waking the session once the whole file is sent.
+ */
+static void handle_transfer(struct transfer *t, int res) {
+    struct connection *conn = t->conn;
+
+    t->submitted = 0;
+    // the socket is non-blocking, so a full one is polled until it
+    // takes more (see handle_writable)
+    if (!conn->closed && res == -EAGAIN && t->buffered) {
+        if (!conn->polling)
+            arm_writable(conn);
+        return;
+    }
+    if (!conn->closed && res > 0) {
+        if (t->buffered) {
+            t->buffered -= res;
+        } else {
+            t->buffered = res;
+            t->offset += res;
+            t->remaining -= res;
+        }
+        if (t->buffered || t->remaining) {
+            transfer_step(t);
+            return;
+        }
+    }
+
+    if (t->status)
+        *t->status = res > 0 ? (int)t->size : -1;
+    close(t->file_fd);
+    close(t->pipe[0]);
+    close(t->pipe[1]);
+    conn->transfer = NULL;
+    free(t);
+    if (conn->closed)
+        maybe_free_connection(conn);
+    else
+        server_wake(conn->fd);
+}
+
+/** Internal function that receives data from a socket, without TLS. In
+ *  io_uring mode, the data was already received by the ring, and is
+ *  copied from the buffers queued in the connection; otherwise, this
+ *  is recv. Also used by the TLS sessions to receive their records.
+ */
+static ssize_t receive(int fd, void *buf, size_t size) {
+    struct connection *conn;
+    size_t done = 0;
+
+    if (!ring || fd >= connections_size || !(conn = connections[fd])) {
+        // in fork mode, a read waits until the timeout expires
+        if (fd == fork_fd) {
+            struct pollfd pfd = {.fd = fd, .events = POLLIN};
+            uint64_t now = metrics_now();
+            int wait = !fork_deadline ? -1 : now < fork_deadline ? (fork_deadline - now + 999999) / 1000000 : 0;
+            int rv = poll(&pfd, 1, wait);
+            if (rv <= 0) {
+                if (!rv || errno == EINTR)
+                    errno = EAGAIN;
+                return -1;
+            }
+        }
+        return recv(fd, buf, size, 0);
+    }
+
+    while (done < size && conn->head != -1) {
+        int id = conn->head;
+        size_t count = buffer_length[id] - conn->offset;
+        if (count > size - done)
+            count = size - done;
+        memcpy((char *)buf + done, uring_buffer(&buffers, id) + conn->offset, count);
+        done += count;
+        conn->offset += count;
+        if (conn->offset == buffer_length[id]) {
+            conn->head = buffer_next[id];
+            if (conn->head == -1)
+                conn->tail = -1;
+            conn->offset = 0;
+            recycle_buffer(id);
+        }
+    }
+
+    if (done)
+        return done;
+    if (conn->error) {
+        errno = conn->error;
+        return -1;
+    }
+    if (conn->eof)
+        return 0;
+    errno = EAGAIN;
+    return -1;
+}
+
+// TLS sessions started with server_start_tls, indexed by socket
+static int tls_available = 0;  // a certificate was loaded
+static tls_t *tls_sessions = NULL;
+static int tls_sessions_size = 0;
+
+/** Internal function that returns the TLS session of a socket, or NULL
+ *  if it has none.
+ */
+static inline tls_t get_tls(int fd) {
+    return fd < tls_sessions_size ? tls_sessions[fd] : NULL;
+}
+
+/** Receives data from a socket. In io_uring mode, the data was already
+ *  received by the ring, and is copied from the buffers queued in the
+ *  connection; otherwise, this is recv. If TLS was started on the
+ *  socket, the data is decrypted.
+ *
+ *  Parameters: fd: Socket file descriptor.
+ *              buf: Buffer where the data is stored.
+ *              size: Maximum number of bytes to store.
+ *
+ *  Returns: The number of bytes stored, 0 if the connection was closed
+ *           by the client, or -1 on error (EAGAIN if no data was
+ *           received yet).
+ */
+ssize_t server_recv(int fd, void *buf, size_t size) {
+    tls_t tls = get_tls(fd);
+    ssize_t rv;
+
+    if (!tls)
+        return receive(fd, buf, size);
+    while ((rv = tls_read(tls, buf, size)) < 0 && errno == EAGAIN && tls_wants_write(tls)) {
+        // the event loops resume the session once the socket is writable
+        struct connection *conn = find_connection(fd);
+        if (conn) {
+            conn->want_write = 1;
+            errno = EAGAIN;
+            return -1;
+        }
+        if (wait_writable(fd) < 0)
+            return -1;
+    }
+    return rv;
+}
+
+/** Returns non-zero if TLS sessions can be started, that is, if a
+ *  certificate was configured (see server_parse_args).
+ */
+int server_tls_available(void) {
+    return tls_available;
+}
+
+/** Starts TLS on a connection, once the reply to STARTTLS (or STLS)
+ *  was flushed. From then on, all data received and sent with server_recv,
+ *  send_all and send_file goes through the TLS session, which ends
+ *  when the connection is closed. The session must then call
+ *  server_tls_handshake until it completes.
+ *
+ *  Parameters: fd: Socket file descriptor.
+ *
+ *  Returns: 0 on success, -1 if TLS is not available, was already
+ *           started, or the session could not be created.
+ */
+int server_start_tls(int fd) {
+    tls_t tls;
+
+    if (get_tls(fd) || !(tls = tls_create(fd, receive)))
+        return -1;
+    if (fd >= tls_sessions_size) {
+        int size = fd * 2 + 64;
+        tls_sessions = realloc(tls_sessions, size * sizeof(tls_t));
+        memset(tls_sessions + tls_sessions_size, 0, (size - tls_sessions_size) * sizeof(tls_t));
+        tls_sessions_size = size;
+    }
+    tls_sessions[fd] = tls;
+    return 0;
+}
+
+/** Runs the TLS handshake of a connection as far as the data received
+ *  so far allows. In fork mode reads and writes wait for the socket,
+ *  so it runs to completion (or until the timeout expires).
+ *
+ *  Parameters: fd: Socket file descriptor, after server_start_tls.
+ *
+ *  Returns: 1 once the handshake is complete, 0 if it waits for more
+ *           data from the client (or, in the event loops, for the
+ *           socket to be writable), or -1 if it failed.
+ */
+int server_tls_handshake(int fd) {
+    tls_t tls = get_tls(fd);
+    struct connection *conn;
+
+    while (tls_handshake(tls) == -1) {
+        if (errno != EAGAIN)
+            return -1;
+        if (!tls_wants_write(tls))
+            return 0;
+        if ((conn = find_connection(fd))) {
+            conn->want_write = 1;
+            return 0;
+        }
+        if (wait_writable(fd) < 0)
+            return -1;
+    }
+    return 1;
+}
+
+/** Returns non-zero if TLS was started on a connection.
+ */
+int server_tls_active(int fd) {
+    return get_tls(fd) != NULL;
+}
+
+/** Internal function that ends the TLS session of a socket, if any,
+ *  before it is closed.
+ */
+static void end_tls(int fd) {
+    tls_t tls = get_tls(fd);
+    if (tls) {
+        tls_destroy(tls);
+        tls_sessions[fd] = NULL;
+    }
+}
+
+/** Starts sending part of a file to a socket without blocking the
+ *  event loop. In io_uring mode, the file is moved through a pipe by
+ *  splice requests of the ring; in epoll mode (and with TLS records
+ *  not encrypted by the kernel), it is copied whenever the socket is
+ *  writable. Data already in the socket buffer must be flushed first;
+ *  output the socket did not take yet is sent before the file.
+ *
+ *  If the transfer is started, the session must return SERVER_SUSPEND
+ *  from resume. It is woken with server_wake once the transfer is
+ *  done, and file_fd is closed by the server.
+ *
+ *  Parameters: fd: Socket file descriptor.
+ *              file_fd: Descriptor of the file to be sent.
+ *              offset: Position in the file of the first byte to send.
+ *              size: Number of bytes to send.
+ *              status: Set to size if the data was sent, or to -1,
+ *                      before the session is woken.
+ *
+ *  Returns: 0 if the transfer was started, or -1 if not available (in
+ *           fork mode, or for an empty range; the caller then uses
+ *           send_file).
+ */
+int send_file_async(int fd, int file_fd, off_t offset, size_t size, int *status) {
+    struct connection *conn = find_connection(fd);
+    tls_t tls = get_tls(fd);
+
+    if (!conn || !size || conn->transfer)
+        return -1;
+
+    struct transfer *t = malloc(sizeof(struct transfer));
+    // splice only works if the kernel encrypts the records
+    if (!ring || (tls && !tls_kernel_send(tls)) || pipe2(t->pipe, O_CLOEXEC) == -1)
+        t->pipe[0] = t->pipe[1] = -1;
+    t->conn = conn;
+    t->file_fd = file_fd;
+    t->submitted = 0;
+    t->offset = offset;
+    t->remaining = t->size = size;
+    t->buffered = 0;
+    t->status = status;
+    conn->transfer = t;
+
+    // otherwise started by handle_writable, after the output kept
+    if (conn->out_end == conn->out_start) {
+        int rv;
+        if (t->pipe[0] != -1)
+            transfer_step(t);
+        else if ((rv = copy_transfer(conn)) != 0)
+            finish_transfer(conn, rv);
+    }
+    return 0;
+}
+
+/** Handles all connections in a single process, using io_uring for
+ *  accepts, receives and file transfers. Sessions are resumed as in
+ *  the epoll loop, after each batch of completions.
+ *
+ *  Returns: -1 if io_uring is not available (the kernel lacks a
+ *           feature used here); otherwise does not return.
+ */
+static int run_uring_loop(int sockfd, const struct server_handler *handler) {
+    static struct uring uring;
+    struct io_uring_cqe *cqe;
+    int i, timeout = -1;
+
+    if (uring_init(&uring, URING_ENTRIES) == -1)
+        return -1;
+    if (uring_buffers_init(&uring, &buffers, URING_BUFFERS, URING_BUFFER_SIZE, URING_GROUP) == -1) {
+        uring_exit(&uring);
+        return -1;
+    }
+    ring = &uring;
+    buffers_free = URING_BUFFERS;
+    arm_accept(sockfd);
+
+    while (1) {
+        if (uring_wait(ring, timeout) == -1 && errno != EINTR) {
+            perror("io_uring_enter");
+            exit(1);
+        }
+        check_dump();
+
+        while ((cqe = uring_peek(ring))) {
+            uint64_t data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            uring_advance(ring);
+
+            switch (URING_OP(data)) {
+            case OP_ACCEPT:
+                if (res >= 0)
+                    open_uring_connection(res, handler);
+                else if (res != -EAGAIN && res != -EINTR && res != -ECONNABORTED)
+                    fprintf(stderr, "accept: %s\n", strerror(-res));
+                if (!(flags & IORING_CQE_F_MORE))
+                    arm_accept(sockfd);
+                break;
+            case OP_RECV:
+                handle_receive(URING_PTR(data), res, flags);
+                break;
+            case OP_TRANSFER:
+                handle_transfer(URING_PTR(data), res);
+                break;
+            case OP_WRITABLE:
+                handle_writable_poll(URING_PTR(data));
+                break;
+            }
+        }
+
+        for (i = 0; i < ready_list.count; i++) {
+            struct connection *conn = ready_list.items[i];
+            conn->ready = 0;
+            if (conn->closed)
+                maybe_free_connection(conn);
+            else
+                resume_uring_connection(handler, conn);
+        }
+        ready_list.count = 0;
+
+        struct connection *expired;
+        while ((expired = next_expired(handler)))
+            close_uring_connection(handler, expired);
+
+        // same as in the epoll loop
+        for (;;) {
+            if (handler->tick)
+                timeout = handler->tick();
+            if (!woken_count)
+                break;
+
+            int count = woken_count, *fds = woken;
+            woken = NULL;
+            woken_count = woken_size = 0;
+            for (i = 0; i < count; i++)
+                if (fds[i] < connections_size && connections[fds[i]])
+                    resume_uring_connection(handler, connections[fds[i]]);
+            free(fds);
+        }
+        timeout = timers_wait(timeout);
+
+        // receives stopped for lack of buffers restart once some are free
+        if (buffers_free > 0 && starved_list.count) {
+            for (i = 0; i < starved_list.count; i++) {
+                struct connection *conn = starved_list.items[i];
+                conn->starved = 0;
+                if (conn->closed)
+                    maybe_free_connection(conn);
+                else
+                    arm_receive(conn);
+            }
+            starved_list.count = 0;
+        }
+        log_flush();
+    }
+}
+
+/** Runs the configured accept loop on a listener. Does not return.
+ */
+static void run_worker(const struct server_config *config, int sockfd,
+                       const struct server_handler *handler) {
+    timer_wheel_init(&timers, timer_seconds());
+    if (config->mode == SERVER_MODE_FORK)
+        run_fork_loop(sockfd, handler);
+
+    if (config->mode == SERVER_MODE_URING && run_uring_loop(sockfd, handler) == -1)
+        fprintf(stderr, "server: io_uring not available (%s), using epoll\n", strerror(errno));
+    run_event_loop(sockfd, handler);
+}
+
+/** Forks a worker process that runs the accept loop on one of the
+ *  listeners. All other listeners are closed in the worker. Workers
+ *  numbered after the last listener are queue workers, which close
+ *  all listeners and run the queue_worker callback instead.
+ *
+ *  Returns: Process ID of the new worker, or -1 on failure.
+ */
+static pid_t start_worker(const struct server_config *config, int *listeners, int id,
+                          const struct server_handler *handler) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        for (int i = 0; i < config->workers; i++)
+            if (i != id)
+                close(listeners[i]);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGUSR1, SIG_IGN);  // the master process writes the dump
+        metrics_set_worker(id);
+        admission_self = id;
+        // workers do not outlive the master process
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (id < config->workers)
+            run_worker(config, listeners[id], handler);
+        handler->queue_worker(id - config->workers);
+        exit(0);
+    }
+    if (pid == -1)
+        perror("fork");
+    return pid;
+}
+
+static volatile sig_atomic_t stop_requested = 0;
+
+/** Signal handler used to stop the master process and its workers.
+ */
+static void stop_handler(int s) {
+    stop_requested = 1;
+}
+
+/** Creates a server socket at the specified port number, listens for
+ *  new connections and accepts them. Depending on the configured
+ *  mode, either a new forked process is created for each new client,
+ *  or all clients are handled by an event loop. In both cases the
+ *  protocol is implemented by the provided handler callbacks.
+ *
+ *  If more than one worker is configured, one listener per worker is
+ *  created (using SO_REUSEPORT) and a worker process is forked for
+ *  each of them. The calling process then only supervises the
+ *  workers, restarting any worker that terminates. The same applies
+ *  to the queue workers, if the handler has them. SIGUSR1 writes the
+ *  metrics of all workers (see metrics.c) to stderr.
+ *
+ *  Parameters: config: Server options, including the port number (or
+ *                      name) where the server will listen for new
+ *                      connections.
+ *              handler: Callbacks used to create, resume and close
+ *                       a session for each accepted connection.
+ */
+void run_server(const struct server_config *config, const struct server_handler *handler) {
+    int queue_workers = handler->queue_worker ? config->queue_workers : 0;
+    int total = config->workers + queue_workers;
+    int *listeners = malloc(config->workers * sizeof(int));
+    pid_t *workers = malloc(total * sizeof(pid_t));
+    struct sigaction sa;
+    int i;
+
+    // all listeners are created upfront, so binding errors are reported
+    // before any worker starts, and a restarted worker reuses the same
+    // queue of pending connections
+    for (i = 0; i < config->workers; i++)
+        listeners[i] = create_listener(config->port, config->backlog);
+
+    // the TLS context is shared by all workers, and so are the keys of
+    // its session tickets
+    if (config->tls_cert) {
+        if (tls_init(config->tls_cert, config->tls_key) == -1) {
+            fprintf(stderr, "server: could not load certificate %s\n", config->tls_cert);
+            exit(1);
+        }
+        tls_available = 1;
+    }
+
+    // metrics of all workers are dumped on SIGUSR1; no SA_RESTART, so
+    // the waiting loops notice the request
+    session_metric = metrics_histogram("session");
+    rejected_metric = metrics_counter("rejected_connections");
+    timeout_metric = metrics_counter("timed_out_sessions");
+    if (metrics_init(total) == -1)
+        perror("metrics_init");
+
+    // session limits apply to all workers together
+    max_sessions = config->max_sessions;
+    max_per_ip = config->max_per_ip;
+    max_timeout = config->max_timeout;
+    admission = mmap(NULL, config->workers * sizeof(struct admission), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (admission == MAP_FAILED) {
+        perror("mmap");
+        admission = NULL;
+    } else {
+        admission_count = config->workers;
+    }
+    sa.sa_handler = dump_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    printf("server: waiting for connections...\n");
+    fflush(stdout);  // connection logs bypass stdio, see log_printf
+
+    if (total == 1)
+        run_worker(config, listeners[0], handler);
+
+    sa.sa_handler = stop_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    for (i = 0; i < total; i++)
+        workers[i] = start_worker(config, listeners, i, handler);
+
+    while (!stop_requested) {
+        pid_t pid = wait(NULL);
+        if (pid == -1) {
+            if (errno != EINTR)
+                break;
+            check_dump();
+            continue;
+        }
+
+        for (i = 0; i < total; i++) {
+            if (workers[i] == pid && !stop_requested) {
+                fprintf(stderr, "server: worker %d exited, restarting\n", i);
+                // its sessions (and those of its children) are gone
+                if (admission && i < admission_count)
+                    memset(&admission[i], 0, sizeof(struct admission));
+                workers[i] = start_worker(config, listeners, i, handler);
+            }
+        }
     }
+
+    for (i = 0; i < total; i++)
+        if (workers[i] > 0)
+            kill(workers[i], SIGTERM);
+    while (wait(NULL) > 0 || errno == EINTR)
+        ;
+    exit(0);
+}
+
+/** Waits until a socket can be written without blocking, in fork
+ *  mode (the event loops keep the output instead, see send_all). The
+ *  wait ends when the timeout of the session (see server_set_timeout)
+ *  expires, so a client reading slowly gets no more time than one not
+ *  reading at all.
+ *
+ *  Returns: 0 if the socket is writable, -1 on error or timeout.
+ */
+static int wait_writable(int fd) {
+    struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+    int rv;
+
+    do {
+        int timeout = -1;
+        if (fd == fork_fd && fork_deadline) {
+            uint64_t now = metrics_now();
+            timeout = fork_expired || now >= fork_deadline ? 0 : (fork_deadline - now + 999999) / 1000000;
+        }
+        rv = poll(&pfd, 1, timeout);
+    } while (rv < 0 && errno == EINTR);
+    if (!rv)
+        errno = ETIMEDOUT;
+    return rv <= 0 ? -1 : 0;
 }
 
 /** Sends a buffer of data, until all data is sent or an error is
@@ -167,17 +2046,52 @@ void run_server(const char *port, void (*handler)(int)) {
  *  the program, this function will be able to return an error that
  *  can be handled by the caller.
  *
+ *  In the event loops, whatever the socket does not take right away
+ *  is kept in the connection, and sent once the socket is writable
+ *  (see server_send_blocked), so the caller never waits. Once the
+ *  timeout of the session expired, nothing is kept any more.
+ *
+ *  If TLS was started on the socket, the data is encrypted, by the
+ *  kernel if it supports it (see tls.c).
+ *
  *  Parameters: fd: Socket file descriptor.
  *              buf: Buffer where data to be sent is stored.
  *              size: Number of bytes to be used in the buffer.
  *
- *  Returns: If the buffer was successfully sent, returns
+ *  Returns: If the buffer was successfully sent (or kept), returns
  *           size. Otherwise, returns -1.
  */
 int send_all(int fd, char buf[], size_t size) {
+    struct connection *conn = find_connection(fd);
+    tls_t tls = get_tls(fd);
     size_t rem = size;
+
+    if (conn) {
+        if (conn->broken || (conn->expired && (output_blocked(conn) || conn->transfer)))
+            return -1;
+        // data must not overtake the output kept before it
+        if (conn->out_end > conn->out_start)
+            return queue_output(conn, buf, size);
+    }
+
+    // records encrypted by the kernel are sent as plain data
+    if (tls && tls_kernel_send(tls))
+        tls = NULL;
     while (rem > 0) {
-        int rv = send(fd, buf, rem, MSG_NOSIGNAL);
+        ssize_t rv = tls ? tls_write(tls, buf, rem) : send(fd, buf, rem, MSG_NOSIGNAL);
+        if (rv < 0 && errno == EINTR)
+            continue;
+        if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (tls && !tls_wants_write(tls))
+                return -1;
+            // non-blocking sockets (event loops) keep the rest, fork
+            // mode waits until the socket can be written again
+            if (conn)
+                return conn->expired || queue_output(conn, buf, rem) < 0 ? -1 : (int)size;
+            if (wait_writable(fd) < 0)
+                return -1;
+            continue;
+        }
         // If there was an error, interrupt sending and returns an error
         if (rv <= 0)
             return rv;
@@ -187,48 +2101,67 @@ int send_all(int fd, char buf[], size_t size) {
     return size;
 }
 
-/** Sends a potentially-formatted string to a socket descriptor. The
- *  string can contain format directives (e.g., %d, %s, %u), which
- *  will be translated using a printf-like behaviour. For example, you
- *  may call it like:
+/** Sends part of a file to a socket (or pipe) descriptor, without
+ *  copying the data through user space. Sockets use sendfile, while
+ *  pipes use splice. If neither is supported for this pair of
+ *  descriptors, or the records of a TLS session on the socket are not
+ *  encrypted by the kernel, falls back to reading the file in large
+ *  blocks.
  *
- *  send_string(fd, "+OK Server ready\r\n");
- *  send_string(fd, "+OK %d messages found\r\n", msg_count);
- *  
- *  Parameters: fd: Socket file descriptor.
- *              str: String to be sent, including potential
- *                   printf-like format directives.
- *              additional parameters based on string format.
+ *  Parameters: fd: Socket (or pipe) file descriptor.
+ *              file_fd: Descriptor of the file to be sent.
+ *              offset: Position in the file of the first byte to send.
+ *              size: Number of bytes to send.
  *
- *  Returns: If the string was successfully sent, returns
- *           the number of bytes sent. Otherwise, returns -1.
+ *  Returns: If the data was successfully sent, returns size.
+ *           Otherwise, returns -1.
  */
-int send_string(int fd, const char *str, ...) {
-    static char *buf = NULL;
-    static int bufsize = 0;
-    va_list args;
-    int strsize;
-
-    // Start with string length, increase later if needed
-    if (bufsize < strlen(str) + 1) {
-        bufsize = strlen(str) + 1;
-        buf = realloc(buf, bufsize);
-    }
+int send_file(int fd, int file_fd, off_t offset, size_t size) {
+    struct stat fd_stat;
+    int use_splice = fstat(fd, &fd_stat) == 0 && S_ISFIFO(fd_stat.st_mode);
+    tls_t tls = get_tls(fd);
+    size_t rem = size;
 
-    while (1) {
-        va_start(args, str);
-        strsize = vsnprintf(buf, bufsize, str, args);
-        va_end(args);
+    // without kTLS, the file must go through the TLS session
+    while (rem > 0 && (!tls || tls_kernel_send(tls))) {
+        ssize_t rv;
+        if (use_splice) {
+            loff_t off = offset;
+            rv = splice(file_fd, &off, fd, NULL, rem, SPLICE_F_MORE);
+        } else {
+            rv = sendfile(fd, file_fd, &offset, rem);
+        }
 
-        if (strsize < 0)
+        if (rv < 0 && errno == EINTR)
+            continue;
+        // the event loops do not wait: the rest goes through send_all,
+        // which keeps it (sessions use send_file_async instead)
+        if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && find_connection(fd))
+            break;
+        if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (wait_writable(fd) < 0)
+                return -1;
+            continue;
+        }
+        if (rv < 0 && (errno == EINVAL || errno == ENOSYS) && rem == size)
+            break;
+        if (rv <= 0)
             return -1;
 
-        // If buffer was enough to fit entire string, send it
-        if (strsize <= bufsize)
-            return send_all(fd, buf, strsize);
+        if (use_splice)
+            offset += rv;
+        rem -= rv;
+    }
 
-        // Try again with more space
-        bufsize = strsize + 1;
-        buf = realloc(buf, bufsize);
+    // descriptors that support neither sendfile nor splice
+    while (rem > 0) {
+        char buf[SEND_FILE_BLOCK_SIZE];
+        ssize_t rv = pread(file_fd, buf, rem < sizeof(buf) ? rem : sizeof(buf), offset);
+        if (rv <= 0 || send_all(fd, buf, rv) < 0)
+            return -1;
+        offset += rv;
+        rem -= rv;
     }
+
+    return size;
 }
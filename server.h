@@ -2,14 +2,90 @@
 #define _SERVER_H_
 
 #include <stdio.h>
+#include <sys/types.h>
 
-void run_server(const char *port, void (*handler)(int));
+#define SERVER_MODE_FORK 0   // one forked process per connection
+#define SERVER_MODE_EPOLL 1  // single event loop, non-blocking sessions
+#define SERVER_MODE_URING 2  // single event loop on io_uring, epoll if unavailable
 
-int send_all(int fd, char buf[], size_t size);
+#define SERVER_SUSPEND 1  // returned by resume to wait for server_wake
+
+/** Command-line options shared by all servers. Filled by
+ *  server_parse_args.
+ */
+struct server_config {
+    const char *port;
+    int mode;
+    int workers;  // number of worker processes, one per core by default
+    int backlog;  // size of the queue of pending connections
+    int max_sessions;  // concurrent sessions in all workers, 0 for no limit
+    int max_per_ip;    // concurrent sessions from one address, 0 for no limit
+    const char *storage;  // name of the mail storage
+    const char *layout;   // name of the layout of the mail directories
+    int commit_window;    // milliseconds between syncs of deliveries, -1 to not sync
+    int queue_workers;    // processes delivering queued messages, 0 to deliver in the session
+    const char *tls_cert;  // PEM certificate chain for STARTTLS, NULL to disable it
+    const char *tls_key;   // PEM private key, the certificate file by default
+    int max_timeout;       // seconds any session waits for its client, 0 for no limit
+};
+
+/** Callbacks implementing a protocol as a resumable session. In fork
+ *  mode, each callback runs in the forked child and reads and writes
+ *  wait for the socket, so resume only returns when the session ends
+ *  (or its timeout expires, see server_set_timeout). In epoll mode,
+ *  the socket is non-blocking and resume is called every time new
+ *  data is available, or once output the socket could not take was
+ *  sent (see server_send_blocked). In io_uring mode, sessions behave
+ *  as in epoll mode, but data is received by the ring and read from
+ *  memory with server_recv.
+ *
+ *  open: Creates the session for a new connection (typically sending
+ *        the greeting). Returns NULL if the connection should be
+ *        closed immediately.
+ *  resume: Consumes all input currently available. Returns 0 if the
+ *          session is waiting for more input, or -1 if it is done. In
+ *          epoll mode, it may also return SERVER_SUSPEND: the session
+ *          is then not resumed, even if input is available, until
+ *          server_wake is called with its socket.
+ *  close: Frees the session. The socket is closed by the server.
+ *  tick: Optional. In the event loops, called after each batch of
+ *        events. Returns the maximum number of milliseconds until it
+ *        should be called again, or -1 if it only needs to be called
+ *        after the next event.
+ *  busy: Optional. Reply sent to connections rejected because of the
+ *        session limits, before closing them.
+ *  timeout: Optional. Reply sent to sessions whose timeout expired
+ *           (see server_set_timeout), before closing them.
+ *  queue_worker: Optional. Body of the background processes started
+ *                along the workers when queue_workers is set, which
+ *                deliver queued messages. Called with the index of the
+ *                process, from 0, and does not return.
+ */
+struct server_handler {
+    void *(*open)(int fd);
+    int (*resume)(void *session);
+    void (*close)(void *session);
+    int (*tick)(void);
+    const char *busy;
+    const char *timeout;
+    void (*queue_worker)(int id);
+};
 
-// The attribute in this function allows gcc to provided useful
-// warnings when compiling the code.
-int send_string(int fd, const char *str, ...)
-    __attribute__((format(printf, 2, 3)));
+int server_parse_args(int argc, char *argv[], struct server_config *config);
+void run_server(const struct server_config *config, const struct server_handler *handler);
+void server_wake(int fd);
+void server_set_timeout(int fd, int seconds);
+ssize_t server_recv(int fd, void *buf, size_t size);
+int server_send_blocked(int fd);
+int server_wait_sent(int fd);
+
+int server_tls_available(void);
+int server_start_tls(int fd);
+int server_tls_handshake(int fd);
+int server_tls_active(int fd);
+
+int send_all(int fd, char buf[], size_t size);
+int send_file(int fd, int file_fd, off_t offset, size_t size);
+int send_file_async(int fd, int file_fd, off_t offset, size_t size, int *status);
 
 #endif
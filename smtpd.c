@@ -1,483 +1,919 @@
+#include "arena.h"
+#include "commit.h"
+#include "datascan.h"
+#include "metrics.h"
+#include "protocol.h"
+#include "queue.h"
 #include "server.h"
 #include "socketbuffer.h"
+#include "spool.h"
 #include "user.h"
 
-#include <ctype.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/utsname.h>
 #include <unistd.h>
 
 #define MAX_LINE_LENGTH 1024
-
-static void handle_client(int fd);
+#define SESSION_ARENA_EXTRA 4096  // room for the recipients of a transaction
+
+// Seconds without input before a session is closed (RFC 5321 4.5.3.2),
+// shorter until HELO, since such a client has sent nothing useful yet
+#define GREETING_TIMEOUT 60  // from the greeting (or the TLS handshake) to HELO
+#define COMMAND_TIMEOUT 300  // for each command after HELO, also while idle
+#define DATA_TIMEOUT 180     // for each block of message contents
+
+static void* smtp_open(int fd);
+static int smtp_resume(void* session);
+static void smtp_close(void* session);
+static void build_replies(void);
+
+static const struct server_handler smtp_handler = {
+    .open = smtp_open,
+    .resume = smtp_resume,
+    .close = smtp_close,
+    .tick = commit_tick,
+    .busy = "421 Too many connections, try again later\r\n",
+    .timeout = "421 Timeout waiting for input, closing connection\r\n",
+    .queue_worker = queue_run,
+};
+
+// How deliveries are synced to disk before they are acknowledged
+enum commit_mode {
+    COMMIT_NONE,   // not synced
+    COMMIT_SYNC,   // synced right away (fork mode)
+    COMMIT_GROUP   // synced in batches (event loops)
+};
+static enum commit_mode commit_mode = COMMIT_NONE;
+static int queue_enabled = 0;  // messages are queued, and delivered by the queue workers
+
+// Commands, with their own latency histogram
+enum smtp_verb {
+    VERB_HELO, VERB_EHLO, VERB_MAIL, VERB_RCPT, VERB_DATA, VERB_BDAT,
+    VERB_RSET, VERB_VRFY, VERB_EXPN, VERB_HELP, VERB_NOOP, VERB_QUIT, VERB_STARTTLS,
+    VERB_COUNT  // unknown commands
+};
+static const char* const smtp_verbs[] = {
+    [VERB_HELO] = "HELO", [VERB_EHLO] = "EHLO", [VERB_MAIL] = "MAIL", [VERB_RCPT] = "RCPT",
+    [VERB_DATA] = "DATA", [VERB_BDAT] = "BDAT", [VERB_RSET] = "RSET", [VERB_VRFY] = "VRFY", [VERB_EXPN] = "EXPN",
+    [VERB_HELP] = "HELP", [VERB_NOOP] = "NOOP", [VERB_QUIT] = "QUIT", [VERB_STARTTLS] = "STARTTLS",
+    [VERB_COUNT] = NULL
+};
+static struct protocol smtp_protocol;
+static int verb_metrics, save_metric, queue_metric, commit_metric, received_metric, delivered_metric;
+
+// Fixed replies, sent as is; the ones naming this server are built by build_replies
+enum smtp_reply {
+    REPLY_WELCOME, REPLY_HELO, REPLY_EHLO, REPLY_EHLO_STARTTLS,
+    REPLY_220_TLS, REPLY_221, REPLY_250, REPLY_354, REPLY_451, REPLY_500, REPLY_501, REPLY_502, REPLY_503,
+    REPLY_554_BARE, REPLY_555, REPLY_555_PARAMS, REPLY_COUNT
+};
+static struct sb_string smtp_replies[REPLY_COUNT] = {
+    [REPLY_220_TLS] = SB_STRING("220 Ready to start TLS\r\n"),
+    [REPLY_221] = SB_STRING("221 OK\r\n"),
+    [REPLY_250] = SB_STRING("250 OK\r\n"),
+    [REPLY_354] = SB_STRING("354 End data with <CRLF>.<CRLF>\r\n"),
+    [REPLY_451] = SB_STRING("451 Requested action aborted: error in processing\r\n"),
+    [REPLY_500] = SB_STRING("500 Syntax error, command unrecognized\r\n"),
+    [REPLY_501] = SB_STRING("501 Syntax error in parameters or arguments\r\n"),
+    [REPLY_502] = SB_STRING("502 Command not implemented\r\n"),
+    [REPLY_503] = SB_STRING("503 Bad sequence of commands\r\n"),
+    [REPLY_554_BARE] = SB_STRING("554 Message contains bare CR or LF characters\r\n"),
+    [REPLY_555] = SB_STRING("555 Recipient not recognized\r\n"),
+    [REPLY_555_PARAMS] = SB_STRING("555 Parameters not recognized\r\n"),
+};
 
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Invalid arguments. Expected: %s <port>\n", argv[0]);
+    struct server_config config;
+    if (server_parse_args(argc, argv, &config) == -1)
+        return 1;
+
+    if (set_mail_storage(config.storage) == -1) {
+        fprintf(stderr, "Unknown mail storage: %s\n", config.storage);
+        return 1;
+    }
+
+    if (set_mail_layout(config.layout) == -1) {
+        fprintf(stderr, "Unknown mail layout: %s\n", config.layout);
+        return 1;
+    }
+
+    if (config.commit_window >= 0) {
+        if (commit_init(config.commit_window) == -1) {
+            perror("commit_init");
+            return 1;
+        }
+        commit_mode = config.mode == SERVER_MODE_FORK ? COMMIT_SYNC : COMMIT_GROUP;
+    }
+
+    if (config.queue_workers > 0) {
+        if (queue_init(config.commit_window >= 0) == -1) {
+            perror("queue_init");
+            return 1;
+        }
+        queue_enabled = 1;
+    }
+
+    protocol_init(&smtp_protocol, smtp_verbs);
+    verb_metrics = metrics_verbs("smtp", smtp_verbs);
+    save_metric = metrics_histogram("smtp.save_user_mail");
+    queue_metric = metrics_histogram("smtp.queue_add");
+    commit_metric = metrics_histogram("smtp.commit");
+    received_metric = metrics_counter("smtp.bytes_received");
+    delivered_metric = metrics_counter("smtp.messages_delivered");
+
+    build_replies();
+
+    // build the user directory once, before workers are forked
+    if (load_user_directory() == -1)
+        fprintf(stderr, "Could not load users file\n");
+
+    // popd counts mailboxes from their summaries, which would go stale
+    // if deliveries did not update them
+    if (open_mail_summaries() == -1) {
+        perror("open_mail_summaries");
         return 1;
     }
 
-    run_server(argv[1], handle_client);
+    run_server(&config, &smtp_handler);
 
     return 0;
 }
 
-/** Sends a welcome message to the given fd
+/** Builds the replies that include the name of this server, once at
+ *  startup, so they are sent like the other fixed replies.
+ */
+static void build_replies(void) {
+    char host[256];
+    static char welcome[300], helo[300], ehlo[340], ehlo_starttls[360];
+
+    if (gethostname(host, sizeof(host)) == -1)
+        strcpy(host, "localhost");
+    host[sizeof(host) - 1] = '\0';
+
+    smtp_replies[REPLY_WELCOME].data = welcome;
+    smtp_replies[REPLY_WELCOME].size = snprintf(welcome, sizeof(welcome), "220 %.200s SMTP Server Ready\r\n", host);
+    smtp_replies[REPLY_HELO].data = helo;
+    smtp_replies[REPLY_HELO].size = snprintf(helo, sizeof(helo), "250 %.200s\r\n", host);
+    smtp_replies[REPLY_EHLO].data = ehlo;
+    smtp_replies[REPLY_EHLO].size = snprintf(ehlo, sizeof(ehlo),
+                                             "250-%.200s\r\n250-PIPELINING\r\n250-8BITMIME\r\n250 CHUNKING\r\n",
+                                             host);
+    smtp_replies[REPLY_EHLO_STARTTLS].data = ehlo_starttls;
+    smtp_replies[REPLY_EHLO_STARTTLS].size =
+        snprintf(ehlo_starttls, sizeof(ehlo_starttls),
+                 "250-%.200s\r\n250-PIPELINING\r\n250-8BITMIME\r\n250-CHUNKING\r\n250 STARTTLS\r\n", host);
+}
+
+/** Sends a welcome message to the given connection
  *
- *  Parameters: fd: Socket file descriptor.
+ *  Parameters: sb: Socket buffer of the connection.
  *
  *  Return: number of bytes if successfully sent, -1 if failed
  */
-int sendWelcome(int fd, char* domainName) {
-    char welcomeMessage[300] = "";
-    strcat(welcomeMessage, "220 ");
-    strcat(welcomeMessage, domainName);
-    strcat(welcomeMessage, " SMTP Server Ready\r\n");
-    return send_all(fd, welcomeMessage, strlen(welcomeMessage));
+int sendWelcome(socket_buffer_t sb) {
+    return sb_write_string(sb, &smtp_replies[REPLY_WELCOME]);
 }
 
-/** Sends a status 221 message to the given fd
+/** Sends the reply to HELO to the given connection.
  *
- *  Parameters: fd: Socket file descriptor.
+ *  Parameters: sb: Socket buffer of the connection.
  *
  *  Return: number of bytes if successfully sent, -1 if failed
  */
-int send221(int fd) {
-    return send_string(fd, "221 OK\r\n");
+int sendHelo(socket_buffer_t sb) {
+    return sb_write_string(sb, &smtp_replies[REPLY_HELO]);
 }
 
-/** Sends a status 250 message to the given fd
+/** Sends the reply to EHLO to the given connection, listing the supported
+ *  extensions. STARTTLS is only listed until TLS is started.
  *
- *  Parameters: fd: Socket file descriptor.
+ *  Parameters: sb: Socket buffer of the connection.
+ *              starttls: non-zero to list STARTTLS.
  *
  *  Return: number of bytes if successfully sent, -1 if failed
  */
-int send250(int fd) {
-    return send_string(fd, "250 OK\r\n");
+int sendEhlo(socket_buffer_t sb, int starttls) {
+    return sb_write_string(sb, &smtp_replies[starttls ? REPLY_EHLO_STARTTLS : REPLY_EHLO]);
 }
 
-/** Sends a status 354 message to the given fd
+/** Sends a status 220 message to the given connection, accepting
+ *  STARTTLS
  *
- *  Parameters: fd: Socket file descriptor.
+ *  Parameters: sb: Socket buffer of the connection.
  *
  *  Return: number of bytes if successfully sent, -1 if failed
  */
-int send354(int fd) {
-    return send_string(fd, "354 End data with <CRLF>.<CRLF>\r\n");
+int send220Tls(socket_buffer_t sb) {
+    return sb_write_string(sb, &smtp_replies[REPLY_220_TLS]);
 }
 
-/** Sends a status 451 message to the given fd
+/** Sends a status 221 message to the given connection
  *
- *  Parameters: fd: Socket file descriptor.
+ *  Parameters: sb: Socket buffer of the connection.
  *
  *  Return: number of bytes if successfully sent, -1 if failed
  */
-int send451(int fd) {
-    return send_string(fd, "451 Requested action aborted: error in processing\r\n");
+int send221(socket_buffer_t sb) {
+    return sb_write_string(sb, &smtp_replies[REPLY_221]);
 }
 
-/** Sends a status 500 message to the given fd
+/** Sends a status 250 message to the given connection
  *
- *  Parameters: fd: Socket file descriptor.
+ *  Parameters: sb: Socket buffer of the connection.
  *
  *  Return: number of bytes if successfully sent, -1 if failed
  */
-int send500(int fd) {
-    return send_string(fd, "500 Syntax error, command unrecognized\r\n");
+int send250(socket_buffer_t sb) {
+    return sb_write_string(sb, &smtp_replies[REPLY_250]);
 }
 
-/** Sends a status 501 message to the given fd
+/** Sends a status 354 message to the given connection
  *
- *  Parameters: fd: Socket file descriptor.
+ *  Parameters: sb: Socket buffer of the connection.
  *
  *  Return: number of bytes if successfully sent, -1 if failed
  */
-int send501(int fd) {
-    return send_string(fd, "501 Syntax error in parameters or arguments\r\n");
+int send354(socket_buffer_t sb) {
+    return sb_write_string(sb, &smtp_replies[REPLY_354]);
 }
 
-/** Sends a status 502 message to the given fd
+/** Sends a status 451 message to the given connection
  *
- *  Parameters: fd: Socket file descriptor.
+ *  Parameters: sb: Socket buffer of the connection.
  *
  *  Return: number of bytes if successfully sent, -1 if failed
  */
-int send502(int fd) {
-    return send_string(fd, "502 Command not implemented\r\n");
+int send451(socket_buffer_t sb) {
+    return sb_write_string(sb, &smtp_replies[REPLY_451]);
 }
 
-/** Sends a status 503 message to the given fd
+/** Sends a status 554 message to the given connection, rejecting a
+ *  message with bare CR or LF characters
  *
- *  Parameters: fd: Socket file descriptor.
+ *  Parameters: sb: Socket buffer of the connection.
  *
  *  Return: number of bytes if successfully sent, -1 if failed
  */
-int send503(int fd) {
-    return send_string(fd, "503 Bad sequence of commands\r\n");
+int send554Bare(socket_buffer_t sb) {
+    return sb_write_string(sb, &smtp_replies[REPLY_554_BARE]);
 }
 
-/** Sends a status 550 message to the given fd
+/** Sends a status 500 message to the given connection
  *
- *  Parameters: fd: Socket file descriptor.
+ *  Parameters: sb: Socket buffer of the connection.
  *
  *  Return: number of bytes if successfully sent, -1 if failed
  */
-int send555(int fd) {
-    return send_string(fd, "555 Recipient not recognized\r\n");
+int send500(socket_buffer_t sb) {
+    return sb_write_string(sb, &smtp_replies[REPLY_500]);
 }
 
-/** Converts a given string to uppercase
+/** Sends a status 501 message to the given connection
  *
- *  Parameters: temp: String to convert.
+ *  Parameters: sb: Socket buffer of the connection.
+ *
+ *  Return: number of bytes if successfully sent, -1 if failed
  */
-void uppercase(char* temp) {
-    char* s = temp;
-    while (*s) {
-        *s = toupper((unsigned char)*s);
-        s++;
-    }
+int send501(socket_buffer_t sb) {
+    return sb_write_string(sb, &smtp_replies[REPLY_501]);
 }
 
-/** Checks if given argument has the correct syntax for a MAIL command
+/** Sends a status 502 message to the given connection
  *
- *  Parameters: str: String to be checked
+ *  Parameters: sb: Socket buffer of the connection.
+ *
+ *  Return: number of bytes if successfully sent, -1 if failed
+ */
+int send502(socket_buffer_t sb) {
+    return sb_write_string(sb, &smtp_replies[REPLY_502]);
+}
+
+/** Sends a status 503 message to the given connection
+ *
+ *  Parameters: sb: Socket buffer of the connection.
+ *
+ *  Return: number of bytes if successfully sent, -1 if failed
+ */
+int send503(socket_buffer_t sb) {
+    return sb_write_string(sb, &smtp_replies[REPLY_503]);
+}
+
+/** Sends a status 550 message to the given connection
+ *
+ *  Parameters: sb: Socket buffer of the connection.
+ *
+ *  Return: number of bytes if successfully sent, -1 if failed
+ */
+int send555(socket_buffer_t sb) {
+    return sb_write_string(sb, &smtp_replies[REPLY_555]);
+}
+
+/** Sends a status 555 message for unknown MAIL or RCPT parameters to
+ *  the given connection
+ *
+ *  Parameters: sb: Socket buffer of the connection.
+ *
+ *  Return: number of bytes if successfully sent, -1 if failed
+ */
+int send555Params(socket_buffer_t sb) {
+    return sb_write_string(sb, &smtp_replies[REPLY_555_PARAMS]);
+}
+
+/** Checks if the arguments of a MAIL or RCPT command have the correct
+ *  syntax: the given prefix, then an address, then a closing bracket,
+ *  then optionally a space and parameters.
+ *
+ *  Parameters: args: Arguments of the command.
+ *              prefix: "FROM:<" or "TO:<".
+ *              path: Set to the address, between the brackets.
+ *              params: Set to the parameters after the space, empty
+ *                      if there are none.
  *
  *  Return: 1 if syntax is correct, 0 otherwise
  */
-int checkMailSyntax(char* str, int size) {
-    char* openBracket;
-    char* closeBracket;
-    openBracket = strchr(str, '<');
-    closeBracket = strrchr(str, '>');
-
-    // check brackets are in order, with at least something in between
-    if (openBracket && closeBracket && (int)(closeBracket - openBracket) > 1) {
-        // check argument begins with FROM:<
-        char from[7];
-        sscanf(str, "%6s", from);
-        if (strcasecmp(from, "FROM:<") == 0) {
-            // check argument ends with >
-            if (str[size - 1] == '>')
-                return 1;
+int checkPathSyntax(struct protocol_span args, const char* prefix, struct protocol_span* path,
+                    struct protocol_span* params) {
+    size_t length = strlen(prefix);
+    const char* end;
+
+    // at least one character between the brackets
+    if (!protocol_prefix(args, prefix) || args.size < length + 2 ||
+        !(end = memchr(args.data + length + 1, '>', args.size - length - 1)))
+        return 0;
+    path->data = args.data + length;
+    path->size = end - path->data;
+
+    params->data = end + 1;
+    params->size = args.data + args.size - params->data;
+    if (params->size && (params->size == 1 || params->data[0] != ' '))
+        return 0;
+    if (params->size) {
+        params->data++;
+        params->size--;
+    }
+    return 1;
+}
+
+/** Checks if all the parameters of a MAIL command are supported. The
+ *  only one is BODY (RFC 6152), since message contents are stored
+ *  unchanged, including 8-bit bytes.
+ *
+ *  Parameters: params: Parameters after the address, separated by
+ *                      spaces.
+ *
+ *  Return: 1 if all parameters are supported, 0 otherwise
+ */
+int checkMailParams(struct protocol_span params) {
+    struct protocol_span param;
+
+    while (params.size) {
+        if (protocol_split(&params, &param) == -1) {
+            param = params;
+            params.size = 0;
         }
+        if (!(param.size == 9 && protocol_prefix(param, "BODY=7BIT")) &&
+            !(param.size == 13 && protocol_prefix(param, "BODY=8BITMIME")))
+            return 0;
     }
-    return 0;
+    return 1;
 }
 
-/** Checks if given argument has the correct syntax for a RCPT command
+/** Saves a received email, already written to a spool file, into the
+ *  mail.store folder of every recipient. The message is written only
+ *  once; each mailbox receives a hard link to the spool file. Failed
+ *  recipients are logged.
  *
- *  Parameters: str: String to be checked
+ *  Parameters: spool: Spool file containing the message.
+ *              recipients: List of recipients of the message.
+ *              rcpt_count: Number of recipients in the list.
  *
- *  Return: 1 if syntax is correct, 0 otherwise
+ *  Return: -1 if the message could not be delivered to any recipient,
+ *          0 otherwise.
  */
-int checkRcptSyntax(char* str, int size) {
-    char* openBracket;
-    char* closeBracket;
-    openBracket = strchr(str, '<');
-    closeBracket = strrchr(str, '>');
-    // check brackets are in order
-    if (openBracket && closeBracket && (int)(closeBracket - openBracket) > 1) {
-        // check argument begins with TO:<
-        char to[5];
-        sscanf(str, "%4s", to);
-        if (strcasecmp(to, "TO:<") == 0) {
-            // check argument ends with >
-            if (str[size - 1] == '>')
-                return 1;
+int saveEmail(spool_t spool, user_list_t recipients, int rcpt_count) {
+    uint64_t start = metrics_now();
+    int failed = save_user_mail(spool_filename(spool), spool_header_size(spool), recipients);
+    metrics_record(save_metric, start);
+    metrics_add(delivered_metric, rcpt_count - failed);
+
+    if (failed) {
+        for (user_list_t user = recipients; user; user = get_user_list_next(user)) {
+            if (get_user_list_status(user))
+                fprintf(stderr, "smtpd: could not deliver to %s: %s\n",
+                        get_user_list_name(user), strerror(get_user_list_status(user)));
         }
     }
-    return 0;
+
+    return failed == rcpt_count ? -1 : 0;
+}
+
+/** Queues a received email, already written to a spool file, for
+ *  delivery to every recipient by the queue workers (see queue.c).
+ *
+ *  Parameters: spool: Spool file containing the message.
+ *              recipients: List of recipients of the message.
+ *
+ *  Return: -1 if the message could not be queued, 0 otherwise.
+ */
+int queueEmail(spool_t spool, user_list_t recipients) {
+    uint64_t start = metrics_now();
+    int rv = queue_add(spool, recipients);
+    metrics_record(queue_metric, start);
+
+    if (rv == -1)
+        perror("smtpd: could not queue message");
+    return rv;
 }
 
-/** Returns the starting char of given email
+/** States of an SMTP session. Each state corresponds to the last
+ *  command that changed the course of the transaction.
+ */
+enum smtp_state {
+    SMTP_INITIAL,  // waiting for HELO
+    SMTP_HELO,     // HELO received, waiting for MAIL
+    SMTP_MAIL,     // MAIL received, waiting for the first RCPT
+    SMTP_RCPT,     // at least one RCPT received, waiting for DATA
+    SMTP_BDAT,     // some BDAT chunks received, waiting for the next one
+    SMTP_DATA,     // receiving message contents
+    SMTP_CHUNK,    // receiving the contents of a BDAT chunk
+    SMTP_TLS,      // STARTTLS accepted, waiting for the handshake to complete
+    SMTP_COMMIT    // message delivered, waiting to be synced to disk
+};
+
+// Timeout of the input expected in each state
+static const int smtp_timeouts[] = {
+    [SMTP_INITIAL] = GREETING_TIMEOUT, [SMTP_HELO] = COMMAND_TIMEOUT,
+    [SMTP_MAIL] = COMMAND_TIMEOUT,     [SMTP_RCPT] = COMMAND_TIMEOUT,
+    [SMTP_BDAT] = COMMAND_TIMEOUT,     [SMTP_DATA] = DATA_TIMEOUT,
+    [SMTP_CHUNK] = DATA_TIMEOUT,       [SMTP_TLS] = GREETING_TIMEOUT,
+    [SMTP_COMMIT] = COMMAND_TIMEOUT,
+};
+
+struct smtp_session {
+    int fd;
+    arena_t arena;                // holds the session, its buffer and its transaction
+    struct arena_mark mark;       // end of the memory kept between transactions
+    socket_buffer_t buffer;
+    enum smtp_state state;
+    int rcpt_count;
+    struct data_scanner scanner;  // state of the message contents received so far (DATA)
+    struct data_stuffer stuffer;  // same, for BDAT
+    size_t chunk_left;            // bytes of the current BDAT chunk not received yet
+    int chunk_last;               // the current chunk ends the message
+    enum smtp_reply chunk_reply;  // sent once the chunk is received, 250 if it is stored
+    enum smtp_state chunk_state;  // state before the chunk, restored if it is rejected
+    int commit_status;            // result of the sync of the last message
+    uint64_t commit_start;        // when the last message was queued for the sync
+    spool_t spool;
+    char fromEmail[MAX_USERNAME_SIZE + 1];
+    user_list_t recipients;
+};
+
+/** Creates a new SMTP session for a connection and sends the welcome
+ *  message.
+ *
+ *  The session, its socket buffer and everything a transaction needs
+ *  (the recipients and the spool object) are allocated from an arena
+ *  sized to hold them. The arena is rewound at the end of each
+ *  transaction, and its memory reused by the next sessions once it is
+ *  destroyed, so sessions don't call malloc once the worker is warm.
+ *
+ *  Parameters: fd: Socket file descriptor.
  *
- *  Parameters: str: String containing email
+ *  Return: the new session, or NULL if the welcome message could not be sent
+ */
+static void* smtp_open(int fd) {
+    arena_t arena = arena_create(sizeof(struct smtp_session) + sb_memory_size(MAX_LINE_LENGTH) +
+                                 spool_memory_size() + SESSION_ARENA_EXTRA);
+    if (!arena)
+        return NULL;
+    struct smtp_session* session = arena_alloc(arena, sizeof(struct smtp_session));
+    session->fd = fd;
+    session->arena = arena;
+    session->buffer = sb_create(fd, MAX_LINE_LENGTH, arena);
+    session->state = SMTP_INITIAL;
+    session->rcpt_count = 0;
+    session->recipients = create_user_list();
+    session->spool = NULL;
+    session->mark = arena_mark(arena);
+
+    // send welcome message right away, since the client waits for it
+    if (sendWelcome(session->buffer) == -1 || sb_flush(session->buffer) == -1) {
+        arena_destroy(arena);
+        return NULL;
+    }
+    server_set_timeout(fd, smtp_timeouts[SMTP_INITIAL]);
+    return session;
+}
+
+/** Sends any pending replies and frees all memory used by an SMTP
+ *  session, discarding any message still being received.
  *
- *  Return: the starting char of given email
+ *  Parameters: arg: Session to be freed.
  */
-char* retrieveEmail(char* str) {
-    // returns the next char after "<"
-    char* ret = strchr(str, '<');
-    char* closeBracket = strrchr(str, '>');
-    *closeBracket = '\0';
-    return ++ret;
+static void smtp_close(void* arg) {
+    struct smtp_session* session = arg;
+    sb_flush(session->buffer);
+    metrics_add(received_metric, sb_received(session->buffer));
+    if (session->spool)
+        spool_destroy(session->spool);
+    destroy_user_list(session->recipients);
+    sb_destroy(session->buffer);
+    arena_destroy(session->arena);
 }
 
-/** Checks if given string ends with CRLF, or contains any trailing spaces, or only contains CRLF
+/** Internal function used to store the spans found by the DATA
+ *  scanner. Write errors are reported once the message is complete.
+ */
+static void spool_emit(void* spool, const char* data, size_t size) {
+    spool_write(spool, data, size);
+}
+
+/** Ends the current transaction, discarding the message being
+ *  received if any, and waits for the next one.
+ */
+static void smtp_reset_transaction(struct smtp_session* session) {
+    if (session->spool)
+        spool_destroy(session->spool);
+    session->spool = NULL;
+    session->state = SMTP_HELO;
+    destroy_user_list(session->recipients);
+    session->recipients = create_user_list();
+    session->rcpt_count = 0;
+    arena_release(session->arena, session->mark);
+}
+
+/** Delivers (or queues) a message once it is completely received, ends
+ *  the transaction and replies, or, if deliveries are synced in
+ *  batches, leaves the session waiting for the sync (SMTP_COMMIT).
  *
- *  Parameters: str: String to be checked
+ *  Parameters: session: SMTP session that received the message.
  *
- *  Return: 1 if CRLF is at the end, with at least another char in the string,
- *             and string has no trailing spaces, 0 otherwise
+ *  Return: -1 if the reply could not be sent, a non-negative value
+ *          otherwise
  */
-int checkCRLF(char* str, int size) {
-    // contains only CRLF
-    if (size == 2 && str[size - 2] == 0xd && str[size - 1] == 0xa)
+static int smtp_finish_message(struct smtp_session* session) {
+    int success = spool_finish(session->spool);
+    if (success != -1 && queue_enabled)
+        success = queueEmail(session->spool, session->recipients);
+    else if (success != -1)
+        success = saveEmail(session->spool, session->recipients, session->rcpt_count);
+    if (success != -1 && commit_mode == COMMIT_SYNC)
+        success = commit_sync();
+
+    smtp_reset_transaction(session);
+
+    if (success != -1 && commit_mode == COMMIT_GROUP) {
+        // the reply is sent once the message is synced to disk
+        commit_add(session->fd, &session->commit_status);
+        session->commit_start = metrics_now();
+        session->state = SMTP_COMMIT;
         return 0;
+    }
+    return success == -1 ? send451(session->buffer) : send250(session->buffer);
+}
 
-    // if ending with CRLF, and the character before CRLF is not a space
-    if (size > 3 && str[size - 2] == 0xd && str[size - 1] == 0xa) {
-        if (!isspace(str[size - 3]))
-            return 1;
+/** Handles a chunk of message contents received during DATA. Messages
+ *  are stored exactly as they will be sent by RETR (see datascan.c),
+ *  and the whole chunk is scanned at once instead of line by line.
+ *
+ *  Parameters: session: SMTP session receiving the message.
+ *              data: Data received from the client.
+ *              size: Number of bytes in data.
+ *
+ *  Return: number of bytes consumed (data after the end of the message
+ *          is left for the next commands), or -1 if the session is
+ *          finished
+ */
+static int smtp_process_data(struct smtp_session* session, const char* data, int size) {
+    int send_status = 1;
+    int consumed = data_scan(&session->scanner, data, size, spool_emit, session->spool);
+
+    // Must be terminated using <CRLF>.<CRLF>, and lines must end in
+    // CRLF (RFC 5321 2.3.8), so the end marker is never ambiguous
+    if (data_scan_done(&session->scanner)) {
+        if (data_scan_flags(&session->scanner)) {
+            smtp_reset_transaction(session);
+            send_status = send554Bare(session->buffer);
+        } else {
+            send_status = smtp_finish_message(session);
+        }
     }
 
-    return 0;
+    return send_status == -1 ? -1 : consumed;
 }
 
-/** Checks if given string ends with CRLF, used during DATA transmissing, where trailing spaces
- *          and empty lines are acceptible.
+/** Handles the end of a BDAT chunk: replies to it, and delivers the
+ *  message if it was the last chunk.
  *
- *  Parameters: str: String to be checked
- *              size: Size of string
+ *  Parameters: session: SMTP session that received the chunk.
  *
- *  Return: 1 if CRLF is at the end, 0 otherwise
+ *  Return: -1 if the reply could not be sent, a non-negative value
+ *          otherwise
  */
-int checkCRLFSimple(char* str, int size) {
-    if (size > 1 && str[size - 2] == 0xd && str[size - 1] == 0xa)
-        return 1;
-    return 0;
+static int smtp_end_chunk(struct smtp_session* session) {
+    if (session->chunk_reply != REPLY_250) {
+        // a rejected chunk leaves the session as it was, except when the
+        // message could not be stored, which ends the transaction
+        if (session->chunk_reply == REPLY_451)
+            smtp_reset_transaction(session);
+        else
+            session->state = session->chunk_state;
+        return sb_write_string(session->buffer, &smtp_replies[session->chunk_reply]);
+    }
+
+    if (!session->chunk_last) {
+        session->state = SMTP_BDAT;
+        return send250(session->buffer);
+    }
+    data_stuff_finish(&session->stuffer, spool_emit, session->spool);
+    return smtp_finish_message(session);
 }
 
-/** Returns the arguments of given string. String is modified.
+/** Handles contents of a BDAT chunk. They are stored unchanged, except
+ *  for dot-stuffing (see data_stuff), without looking for lines or an
+ *  end marker, since the size of the chunk is known.
  *
- *  Parameters: str: String containing arguments
+ *  Parameters: session: SMTP session receiving the chunk.
+ *              data: Data received from the client.
+ *              size: Number of bytes in data.
  *
- *  Return: the starting char of arguments, or NULL if argument syntax is incorrect.
+ *  Return: number of bytes consumed (data after the end of the chunk
+ *          is left for the next commands), or -1 if the session is
+ *          finished
  */
-char* retrieveArgs(char* str) {
-    // returns the next char after "<"
-    char* ret = strchr(str, ' ');
-    if (ret)
-        return strtok(++ret, "\r");
-    return ret;
+static int smtp_process_chunk(struct smtp_session* session, const char* data, int size) {
+    size_t consumed = (size_t)size < session->chunk_left ? (size_t)size : session->chunk_left;
+
+    if (session->chunk_reply == REPLY_250)
+        data_stuff(&session->stuffer, data, consumed, spool_emit, session->spool);
+    session->chunk_left -= consumed;
+    if (!session->chunk_left && smtp_end_chunk(session) == -1)
+        return -1;
+    return consumed;
 }
 
-/** Saves given email as temp file, then saves the temp file into the corresponding
- *    user's mail.store folder.
- *
- *  Return: -1 if error occured, fd of temp file otherwise.
+/** Function handling a command accepted in the current state. Returns
+ *  -1 if the session is finished, and any other value otherwise.
  */
-int saveEmail(char fromEmail[], char toEmail[], char* data) {
-    char template[] = "tmpXXXXXX";
-    int tempfd = mkstemp(template);
-    if (tempfd != -1) {
-        write(tempfd, data, strlen(data));
-        user_list_t list = create_user_list();
-        add_user_to_list(&list, toEmail);
-        save_user_mail(template, list);
-        destroy_user_list(list);
-        unlink(template);
-        close(tempfd);
+typedef int (*smtp_command_t)(struct smtp_session* session, const struct protocol_command* cmd);
+
+static int smtp_helo(struct smtp_session* session, const struct protocol_command* cmd) {
+    session->state = SMTP_HELO;
+    return sendHelo(session->buffer);
+}
+
+static int smtp_ehlo(struct smtp_session* session, const struct protocol_command* cmd) {
+    session->state = SMTP_HELO;
+    return sendEhlo(session->buffer, server_tls_available() && !server_tls_active(session->fd));
+}
+
+static int smtp_mail(struct smtp_session* session, const struct protocol_command* cmd) {
+    struct protocol_span path;
+
+    struct protocol_span params;
+
+    if (!cmd->has_args || !checkPathSyntax(cmd->args, "FROM:<", &path, &params) ||
+        protocol_copy(path, session->fromEmail, sizeof(session->fromEmail)) == -1)
+        return send501(session->buffer);  // Syntax Error
+    if (!checkMailParams(params))
+        return send555Params(session->buffer);
+
+    session->state = SMTP_MAIL;
+    return send250(session->buffer);
+}
+
+static int smtp_rcpt(struct smtp_session* session, const struct protocol_command* cmd) {
+    struct protocol_span path;
+    char email[MAX_USERNAME_SIZE + 1];
+
+    struct protocol_span params;
+
+    if (!cmd->has_args || !checkPathSyntax(cmd->args, "TO:<", &path, &params))
+        return send501(session->buffer);  // Syntax Error
+    if (params.size)
+        return send555Params(session->buffer);  // no RCPT parameters are supported
+    if (protocol_copy(path, email, sizeof(email)) == -1 || !is_valid_user(email, NULL))
+        return send555(session->buffer);  // invalid user
+
+    // valid user, store email, increment rcpt count
+    add_user_to_list(&session->recipients, email, session->arena);
+    session->rcpt_count++;
+    session->state = SMTP_RCPT;
+    return send250(session->buffer);
+}
+
+static int smtp_data(struct smtp_session* session, const struct protocol_command* cmd) {
+    if (cmd->has_args)
+        return send500(session->buffer);
+
+    // message contents are streamed into a spool file,
+    // so there is no limit on the message size
+    if (!(session->spool = spool_create(session->arena)))
+        return send451(session->buffer);
+    session->state = SMTP_DATA;
+    data_scan_init(&session->scanner);
+    return send354(session->buffer);
+}
+
+static int smtp_bdat(struct smtp_session* session, const struct protocol_command* cmd) {
+    struct protocol_span args = cmd->args, size_arg;
+    unsigned long size;
+    int last = 0;
+
+    // BDAT <size> [LAST]
+    if (!cmd->has_args)
+        return send501(session->buffer);
+    if (protocol_split(&args, &size_arg) == -1) {
+        size_arg = args;
+    } else if (args.size == 4 && protocol_prefix(args, "LAST")) {
+        last = 1;
+    } else {
+        return send501(session->buffer);
     }
-    return tempfd;
+    if (protocol_number(size_arg, &size) == -1)
+        return send501(session->buffer);
+
+    // the chunk follows the command without waiting for a reply, so it
+    // is received (and discarded) even if the command is rejected
+    session->chunk_left = size;
+    session->chunk_last = last;
+    session->chunk_reply = REPLY_250;
+    session->chunk_state = session->state;
+    if (session->state == SMTP_RCPT) {
+        // message contents are streamed into a spool file, as with DATA
+        if ((session->spool = spool_create(session->arena)))
+            data_stuff_init(&session->stuffer);
+        else
+            session->chunk_reply = REPLY_451;
+    } else if (session->state != SMTP_BDAT) {
+        session->chunk_reply = REPLY_503;
+    }
+
+    session->state = SMTP_CHUNK;
+    return size ? 0 : smtp_end_chunk(session);
 }
 
-void handle_client(int fd) {
-    // TODO To be implemented
+static int smtp_starttls(struct smtp_session* session, const struct protocol_command* cmd) {
+    if (!server_tls_available())
+        return send502(session->buffer);
+    if (server_tls_active(session->fd))
+        return send503(session->buffer);  // only once per connection
+    if (cmd->has_args)
+        return send501(session->buffer);
+
+    // the reply must be the last data sent in the clear
+    if (send220Tls(session->buffer) == -1 || sb_flush(session->buffer) == -1 ||
+        server_start_tls(session->fd) == -1)
+        return -1;
+
+    // commands sent along with STARTTLS are discarded, and the client
+    // starts over with EHLO once the handshake is done (RFC 3207)
+    sb_discard(session->buffer);
+    session->state = SMTP_TLS;
+    return 0;
+}
 
-    // INIT
-    int reply_size;
-    int send_status = 1;
-    int received_helo = 0;
-    int received_mail = 0;
-    int received_rcpt = 0;
-    int received_data = 0;
-    int rcpt_count = 0;
-    char* data;
-    char fromEmail[MAX_USERNAME_SIZE + 1];
-    char toEmail[30][MAX_USERNAME_SIZE + 1];
-    char command[41];
-    char reply[MAX_LINE_LENGTH + 1];
-    socket_buffer_t buffer = sb_create(fd, MAX_LINE_LENGTH);
-
-    // send welcome message
-    char domainName[201];
-    gethostname(domainName, 200);
-    send_status = sendWelcome(fd, domainName);
-
-    // TODO: If send fails, server should terminate this client connection
-    while (1) {
-        reply_size = sb_read_line(buffer, reply);
-
-        if (reply_size == 0 || reply_size == -1 || send_status == -1) break;
-
-        sscanf(reply, "%s", command);
-
-        // if command ends with CRLF and does not contain trailing whitespace.
-        // if we are in the middle of a DATA transmission, then we only check for ending CRLF
-        if (checkCRLF(reply, reply_size) || (received_data && checkCRLFSimple(reply, reply_size))) {
-            // STATE: DATA received
-            if (received_data) {
-                // Must be terminated using <CRLF>.<CRLF>
-                if (strstr(reply, ".\r\n") == reply && reply_size == 3) {
-                    // marks the completion of a transaction
-                    int success = 0;
-                    for (int i = 0; i < rcpt_count; i++) {
-                        success = saveEmail(fromEmail, toEmail[i], data);
-                    }
-
-                    free(data);
-                    received_data = 0;
-                    rcpt_count = 0;
-
-                    if (success == -1)
-                        send_status = send451(fd);
-                    else
-                        send_status = send250(fd);
-
-                } else {
-                    strcat(data, reply);
-                }
-            }
-
-            // Commands accepted at every state except DATA
-            else if (strcasecmp(command, "NOOP") == 0) {
-                send_status = send250(fd);
-
-            } else if (strcasecmp(command, "QUIT") == 0) {
-                send_status = send221(fd);
-                break;
+static int smtp_noop(struct smtp_session* session, const struct protocol_command* cmd) {
+    return send250(session->buffer);
+}
 
-            } else if (strcasecmp(command, "EHLO") == 0 ||
-                       strcasecmp(command, "RSET") == 0 ||
-                       strcasecmp(command, "VRFY") == 0 ||
-                       strcasecmp(command, "EXPN") == 0 ||
-                       strcasecmp(command, "HELP") == 0) {
-                send_status = send502(fd);  // not implemented
-
-            }
-
-            // STATE: MAIL received
-            else if (received_mail) {
-                if (strcasecmp(command, "RCPT") == 0) {
-                    char* rcptArgs = retrieveArgs(reply);
-
-                    if (rcptArgs && checkRcptSyntax(rcptArgs, (int)strlen(rcptArgs))) {
-                        char* email = retrieveEmail(rcptArgs);
-
-                        if (is_valid_user(email, NULL)) {
-                            // valid user, store email, increment rcpt count
-                            strcpy(toEmail[rcpt_count++], email);
-                            received_rcpt = 1;
-                            received_mail = 0;
-                            send_status = send250(fd);
-
-                        } else {
-                            // invalid user
-                            send_status = send555(fd);
-                        }
-
-                    } else {
-                        send_status = send501(fd);  // Syntax Error
-                    }
-
-                } else if (strcasecmp(command, "HELO") == 0 ||
-                           strcasecmp(command, "MAIL") == 0 ||
-                           strcasecmp(command, "DATA") == 0) {
-                    send_status = send503(fd);
-
-                } else {
-                    send_status = send500(fd);
-                }
-
-            }
-
-            // STATE: RCPT received
-            else if (received_rcpt) {
-                if (strcasecmp(command, "DATA") == 0 && reply_size == 6) {
-                    received_data = 1;
-                    received_rcpt = 0;
-                    // RFC5321 section 4.5.3.1.7. specifies at least 64K octets for message content
-                    data = malloc((64000 * sizeof(char)) + 1);
-                    strcpy(data, "");
-                    send_status = send354(fd);
-
-                } else if (strcasecmp(command, "RCPT") == 0) {
-                    char* rcptArgs = retrieveArgs(reply);
-
-                    if (rcptArgs && checkRcptSyntax(rcptArgs, (int)strlen(rcptArgs))) {
-                        // Correct syntax
-                        char* email = retrieveEmail(rcptArgs);
-
-                        if (is_valid_user(email, NULL)) {
-                            strcpy(toEmail[rcpt_count++], email);
-                            send_status = send250(fd);
-                        } else {
-                            send_status = send555(fd);
-                        }
-
-                    } else {
-                        send_status = send501(fd);  // Syntax Error
-                    }
-
-                } else if (strcasecmp(command, "HELO") == 0 ||
-                           strcasecmp(command, "MAIL") == 0) {
-                    send_status = send503(fd);
-
-                } else {
-                    send_status = send500(fd);
-                }
-
-            }
-
-            // STATE: HELO received
-            else if (received_helo) {
-                if (strcasecmp(command, "MAIL") == 0) {
-                    char* mailArgs = retrieveArgs(reply);
-
-                    if (mailArgs && checkMailSyntax(mailArgs, (int)strlen(mailArgs))) {
-                        received_mail = 1;
-                        char* email = retrieveEmail(mailArgs);
-
-                        // store email
-                        strcpy(fromEmail, email);
-                        send_status = send250(fd);
-
-                    } else {
-                        send_status = send501(fd);  // Syntax Error
-                    }
-
-                } else if (strcasecmp(command, "HELO") == 0 ||
-                           strcasecmp(command, "RCPT") == 0 ||
-                           strcasecmp(command, "DATA") == 0) {
-                    send_status = send503(fd);
-
-                } else {
-                    send_status = send500(fd);
-                }
-
-            }
-
-            // STATE: initial
-            else {
-                if (strcasecmp(command, "HELO") == 0) {
-                    received_helo = 1;
-                    char initialMessage[200] = "";
-                    strcat(initialMessage, "250 ");
-                    strcat(initialMessage, domainName);
-                    strcat(initialMessage, "\r\n");
-                    send_status = send_all(fd, initialMessage, strlen(initialMessage));
-
-                } else if (strcasecmp(command, "MAIL") == 0 ||
-                           strcasecmp(command, "RCPT") == 0 ||
-                           strcasecmp(command, "DATA") == 0) {
-                    send_status = send503(fd);
-
-                } else {
-                    send_status = send500(fd);
-                }
-            }
-        }
+static int smtp_quit(struct smtp_session* session, const struct protocol_command* cmd) {
+    send221(session->buffer);
+    return -1;
+}
+
+static int smtp_not_implemented(struct smtp_session* session, const struct protocol_command* cmd) {
+    return send502(session->buffer);
+}
 
-        // reply does not end with CRLF, also catches line too long errors
-        else {
-            send_status = send500(fd);
+static int smtp_bad_sequence(struct smtp_session* session, const struct protocol_command* cmd) {
+    return send503(session->buffer);
+}
+
+// Commands accepted at every state except DATA; BDAT checks the state
+// itself, since its chunk must be received in any case
+#define SMTP_ANY_STATE                                                     \
+    [VERB_RSET] = smtp_not_implemented, [VERB_VRFY] = smtp_not_implemented, \
+    [VERB_EXPN] = smtp_not_implemented, [VERB_HELP] = smtp_not_implemented, \
+    [VERB_NOOP] = smtp_noop, [VERB_QUIT] = smtp_quit, [VERB_BDAT] = smtp_bdat
+
+/** Handler of each command in each state where commands are read;
+ *  commands without one are unrecognized (500).
+ */
+static const smtp_command_t smtp_commands[SMTP_DATA][VERB_COUNT + 1] = {
+    [SMTP_INITIAL] = {
+        [VERB_HELO] = smtp_helo, [VERB_EHLO] = smtp_ehlo,
+        [VERB_MAIL] = smtp_bad_sequence, [VERB_RCPT] = smtp_bad_sequence, [VERB_DATA] = smtp_bad_sequence,
+        [VERB_STARTTLS] = smtp_starttls, SMTP_ANY_STATE
+    },
+    [SMTP_HELO] = {
+        [VERB_HELO] = smtp_bad_sequence, [VERB_EHLO] = smtp_bad_sequence,
+        [VERB_MAIL] = smtp_mail, [VERB_RCPT] = smtp_bad_sequence, [VERB_DATA] = smtp_bad_sequence,
+        [VERB_STARTTLS] = smtp_starttls, SMTP_ANY_STATE
+    },
+    [SMTP_MAIL] = {
+        [VERB_HELO] = smtp_bad_sequence, [VERB_EHLO] = smtp_bad_sequence,
+        [VERB_MAIL] = smtp_bad_sequence, [VERB_RCPT] = smtp_rcpt, [VERB_DATA] = smtp_bad_sequence,
+        [VERB_STARTTLS] = smtp_bad_sequence, SMTP_ANY_STATE
+    },
+    [SMTP_RCPT] = {
+        [VERB_HELO] = smtp_bad_sequence, [VERB_EHLO] = smtp_bad_sequence,
+        [VERB_MAIL] = smtp_bad_sequence, [VERB_RCPT] = smtp_rcpt, [VERB_DATA] = smtp_data,
+        [VERB_STARTTLS] = smtp_bad_sequence, SMTP_ANY_STATE
+    },
+    [SMTP_BDAT] = {
+        [VERB_HELO] = smtp_bad_sequence, [VERB_EHLO] = smtp_bad_sequence,
+        [VERB_MAIL] = smtp_bad_sequence, [VERB_RCPT] = smtp_bad_sequence, [VERB_DATA] = smtp_bad_sequence,
+        [VERB_STARTTLS] = smtp_bad_sequence, SMTP_ANY_STATE
+    },
+};
+
+/** Handles a single command received from the client, according to
+ *  the current state of the session.
+ *
+ *  Parameters: session: SMTP session receiving the command.
+ *              cmd: Command line, split by protocol_parse.
+ *
+ *  Return: 0 if the session should continue, -1 if it is finished
+ */
+static int smtp_process_line(struct smtp_session* session, const struct protocol_command* cmd) {
+    smtp_command_t command = NULL;
+
+    // lines that do not end with CRLF (including lines too long) or
+    // contain trailing whitespace are not recognized
+    if (cmd->terminated && session->state < SMTP_DATA)
+        command = smtp_commands[session->state][cmd->verb];
+
+    int send_status = command ? command(session, cmd) : send500(session->buffer);
+
+    // could not send message, closing connection
+    return send_status == -1 ? -1 : 0;
+}
+
+/** Handles all lines currently available from the client. In fork
+ *  mode the socket is blocking, so this only returns once the session
+ *  is finished. The timeout of the session restarts with every command
+ *  or block of message contents, so a client sending a line a byte at
+ *  a time is still closed once it expires.
+ *
+ *  Parameters: arg: SMTP session to be resumed.
+ *
+ *  Return: 0 if waiting for more input, -1 if the session is finished
+ */
+static int smtp_resume(void* arg) {
+    struct smtp_session* session = arg;
+    struct protocol_command cmd;
+    const char* line;
+    int reply_size, rv;
+
+    if (session->state == SMTP_COMMIT) {
+        // woken after the last message was synced
+        metrics_record(commit_metric, session->commit_start);
+        session->state = SMTP_HELO;
+        rv = session->commit_status == -1 ? send451(session->buffer) : send250(session->buffer);
+        if (rv == -1)
+            return -1;
+        server_set_timeout(session->fd, smtp_timeouts[SMTP_HELO]);
+    }
+
+    for (;;) {
+        if (session->state == SMTP_TLS) {
+            // 0 while waiting for more of the handshake from the client
+            if ((rv = server_tls_handshake(session->fd)) <= 0)
+                return rv;
+            session->state = SMTP_INITIAL;
+            server_set_timeout(session->fd, smtp_timeouts[SMTP_INITIAL]);
         }
 
-        // could not send message, closing connection
-        if (send_status == -1) break;
+        // message contents are handled in place, in chunks as large as
+        // received, and so are commands
+        if (session->state == SMTP_DATA || session->state == SMTP_CHUNK) {
+            if ((reply_size = sb_peek_data(session->buffer, &line)) <= 0)
+                break;
+            rv = session->state == SMTP_DATA ? smtp_process_data(session, line, reply_size)
+                                             : smtp_process_chunk(session, line, reply_size);
+            if (rv >= 0)
+                sb_consume(session->buffer, rv);
+        } else {
+            if ((reply_size = sb_next_line(session->buffer, &line)) <= 0)
+                break;
+            uint64_t start = metrics_now();
+            protocol_parse(&smtp_protocol, line, reply_size, &cmd);
+            rv = smtp_process_line(session, &cmd);
+            metrics_record(metrics_verb(verb_metrics, cmd.verb), start);
+        }
+        if (rv == -1)
+            return -1;
+        server_set_timeout(session->fd, smtp_timeouts[session->state]);
+        if (session->state == SMTP_COMMIT)
+            return SERVER_SUSPEND;  // BDAT 0 LAST ends a message without data
     }
 
-    sb_destroy(buffer);
+    if (reply_size == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+    return -1;
 }
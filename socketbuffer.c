@@ -1,18 +1,33 @@
 /*
- * Creates a buffer for receiving data from a socket and reading individual lines.
+ * Creates a buffer for receiving data from a socket and reading
+ * individual lines, and for coalescing replies sent to the socket.
  */
 
 #include "socketbuffer.h"
 
+#include "server.h"
+
+#include <errno.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
+#define SB_OUTPUT_BUFFER_SIZE 16384
+#define SB_RECV_SIZE 65536
+
 struct socket_buffer {
     int fd;
     size_t max_bytes;
-    size_t avail_data;
+    size_t size;      // capacity of the input buffer
+    size_t start;     // offset of the first byte not returned yet
+    size_t end;       // offset right after the last byte received
+    size_t scanned;   // offset up to which no line-feed was found
+    size_t out_used;  // bytes waiting in the output buffer
+    size_t received;  // bytes received from the socket so far
+    int in_arena;     // allocated from an arena, so not freed by sb_destroy
+    char *out;        // output buffer, allocated right after the input buffer
     // Buffer set as size zero, but since it's the last member of the
     // struct, any additional memory allocated after this struct can be
     // used as part of the buffer.
@@ -25,80 +40,400 @@ struct socket_buffer {
  *  correspond to the maximum number of bytes other functions (like
  *  sb_read_line) can return at a time, so it is advisable to make
  *  this size at least as big as the maximum line size for the
- *  protocol handled in this socket.
+ *  protocol handled in this socket. Data is received in chunks of
+ *  up to 64KB regardless of this size, so many lines can be read
+ *  from a single call to server_recv.
  *  
  *  Parameters: fd: Socket file descriptor.
- *              max_buffer_size: Maximum number of bytes to be stored
- *                               locally for a connection. 
+ *              max_buffer_size: Maximum number of bytes returned at
+ *                               a time as a single line.
+ *              arena: arena the buffer is allocated from, so it is
+ *                     freed with the arena, or NULL to use malloc.
  *
  *  Returns: A socket_buffer_t object that can be used in other functions
- *           to read buffered data.
+ *           to read buffered data, or NULL if out of memory.
  */
-socket_buffer_t sb_create(int fd, size_t max_buffer_size) {
-    socket_buffer_t sb = malloc(sizeof(struct socket_buffer) + max_buffer_size);
+socket_buffer_t sb_create(int fd, size_t max_buffer_size, arena_t arena) {
+    size_t size = max_buffer_size > SB_RECV_SIZE ? max_buffer_size : SB_RECV_SIZE;
+    size_t total = sb_memory_size(max_buffer_size);
+    socket_buffer_t sb = arena ? arena_alloc(arena, total) : malloc(total);
+    if (!sb)
+        return NULL;
     sb->fd = fd;
+    sb->in_arena = arena != NULL;
     sb->max_bytes = max_buffer_size;
-    sb->avail_data = 0;
+    sb->size = size;
+    sb->start = sb->end = sb->scanned = 0;
+    sb->out_used = 0;
+    sb->received = 0;
+    sb->out = sb->buf + size;
     return sb;
 }
 
-/** Frees all memory used by a socket_buffer_t object.
+/** Frees all memory used by a socket_buffer_t object. Data still in
+ *  the output buffer is discarded; call sb_flush first to send it.
  *  
  *  Parameters: sb: buffer object to be freed.
  */
 void sb_destroy(socket_buffer_t sb) {
-    free(sb);
+    if (!sb->in_arena)
+        free(sb);
+}
+
+/** Returns the number of bytes sb_create allocates for a buffer, to
+ *  size the arena it is allocated from.
+ *
+ *  Parameters: max_buffer_size: same as in sb_create.
+ */
+size_t sb_memory_size(size_t max_buffer_size) {
+    size_t size = max_buffer_size > SB_RECV_SIZE ? max_buffer_size : SB_RECV_SIZE;
+    return sizeof(struct socket_buffer) + size + SB_OUTPUT_BUFFER_SIZE;
 }
 
-/** Reads a single line from the socket/buffer. If the socket returns
- *  more than one line in a single call to recv, returns a single line
- *  and caches the remaining data for the next call. The returned
- *  string will also include a null byte, which allows the out buffer
- *  to the handled as a regular string.
+/** Returns the next line from the socket/buffer without copying it.
+ *  The returned pointer refers to the internal buffer, and is only
+ *  valid until the next call to a reading function on the same
+ *  buffer. The line is not null-terminated.
+ *
+ *  Data is only moved inside the buffer when a partial line reaches
+ *  the end of the buffer and more data must be received; returning
+ *  a line only advances an offset.
  *
  *  If a line with more than max_buffer_size bytes is read, then
- *  return the first max_buffer_size bytes (with a terminating null
- *  byte). It is the responsibility of the caller to check if the last
- *  character in the string is a line-feed (\n) character.
+ *  return the first max_buffer_size bytes. It is the responsibility
+ *  of the caller to check if the last character in the line is a
+ *  line-feed (\n) character.
  *
- *  This function does not check for null bytes found in the middle of
- *  the string.
+ *  Before waiting for more data from the socket, any data in the
+ *  output buffer is sent, so replies to commands that were received
+ *  together are sent together, and only once all of them are handled.
+ *
+ *  If the socket is non-blocking and no complete line is available,
+ *  returns -1 with errno set to EAGAIN (or EWOULDBLOCK). Any partial
+ *  line is kept in the buffer, so the call can be repeated once more
+ *  data arrives. The same happens while earlier output still waits for
+ *  the socket (see server_send_blocked), so a client that does not
+ *  read the replies cannot make them pile up.
  *
  *  Parameter: sb: buffer object where socket and cache data are stored.
- *             out: array of bytes where the read line will be
- *                  stored. It must have space for at least
- *                  max_buffer_size bytes (from sb_create function)
- *                  plus one (for terminating null byte).
+ *             line: address where a pointer to the line is stored.
  *
  *  Returns: If the connection was terminated properly, returns 0. If
  *           the connection was terminated abruptly or another unknown
  *           error is found, returns -1. Otherwise, returns the number
- *           of bytes in the read line.
+ *           of bytes in the line.
  */
-int sb_read_line(socket_buffer_t sb, char out[]) {
+int sb_next_line(socket_buffer_t sb, const char **line) {
     char *eos;
+    size_t limit;
     int rv;
-    while ((eos = memchr(sb->buf, '\n', sb->avail_data)) == NULL) {
-        if (sb->avail_data < sb->max_bytes) {
-            rv = recv(sb->fd, sb->buf + sb->avail_data, sb->max_bytes - sb->avail_data, 0);
-            if (rv < 0)
-                return rv;
-            if (rv == 0) {
-                eos = sb->buf + sb->avail_data - 1;
-                break;
-            }
-            sb->avail_data += rv;
-        } else {
-            eos = sb->buf + sb->max_bytes - 1;
+
+    if (server_send_blocked(sb->fd)) {
+        errno = EAGAIN;
+        return -1;
+    }
+    for (;;) {
+        limit = sb->end - sb->start > sb->max_bytes ? sb->start + sb->max_bytes : sb->end;
+        if ((eos = memchr(sb->buf + sb->scanned, '\n', limit - sb->scanned)) != NULL)
+            break;
+        sb->scanned = limit;
+
+        if (limit - sb->start == sb->max_bytes) {
+            eos = sb->buf + limit - 1;
+            break;
+        }
+
+        // partial line at the end of the buffer, move it to the front
+        if (sb->end == sb->size) {
+            memmove(sb->buf, sb->buf + sb->start, sb->end - sb->start);
+            sb->end -= sb->start;
+            sb->scanned -= sb->start;
+            sb->start = 0;
+        }
+
+        if (sb_flush(sb) < 0)
+            return -1;
+        rv = server_recv(sb->fd, sb->buf + sb->end, sb->size - sb->end);
+        if (rv < 0)
+            return rv;
+        sb->received += rv;
+        if (rv == 0) {
+            if (sb->end == sb->start)
+                return 0;
+            eos = sb->buf + sb->end - 1;
             break;
         }
+        sb->end += rv;
+    }
+
+    rv = eos - (sb->buf + sb->start) + 1;
+    *line = sb->buf + sb->start;
+    sb->start += rv;
+    sb->scanned = sb->start;
+    if (sb->start == sb->end)
+        sb->start = sb->end = sb->scanned = 0;
+    return rv;
+}
+
+/** Reads a single line from the socket/buffer into an array. Behaves
+ *  like sb_next_line, but the line is copied, and includes a
+ *  terminating null byte, which allows the out buffer to the handled
+ *  as a regular string.
+ *
+ *  This function does not check for null bytes found in the middle of
+ *  the string.
+ *
+ *  Parameter: sb: buffer object where socket and cache data are stored.
+ *             out: array of bytes where the read line will be
+ *                  stored. It must have space for at least
+ *                  max_buffer_size bytes (from sb_create function)
+ *                  plus one (for terminating null byte).
+ *
+ *  Returns: same as sb_next_line.
+ */
+int sb_read_line(socket_buffer_t sb, char out[]) {
+    const char *line;
+    int rv = sb_next_line(sb, &line);
+    if (rv > 0) {
+        memcpy(out, line, rv);
+        out[rv] = 0;
+    }
+    return rv;
+}
+
+/** Returns all data currently in the buffer without copying it,
+ *  receiving more from the socket if the buffer is empty. The data is
+ *  kept in the buffer until it is removed with sb_consume, and the
+ *  returned pointer is only valid until the next call to another
+ *  function on the same buffer.
+ *
+ *  As in sb_next_line, any data in the output buffer is sent before
+ *  waiting for more data, and no data is returned while earlier
+ *  output waits for the socket.
+ *
+ *  Parameter: sb: buffer object where socket and cache data are stored.
+ *             data: address where a pointer to the data is stored.
+ *
+ *  Returns: the number of bytes available, 0 if the connection was
+ *           terminated properly, or -1 on error (including EAGAIN, if
+ *           the socket is non-blocking and no data is available).
+ */
+int sb_peek_data(socket_buffer_t sb, const char **data) {
+    if (server_send_blocked(sb->fd)) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (sb->start == sb->end) {
+        if (sb_flush(sb) < 0)
+            return -1;
+        int rv = server_recv(sb->fd, sb->buf, sb->size);
+        if (rv <= 0)
+            return rv;
+        sb->received += rv;
+        sb->start = sb->scanned = 0;
+        sb->end = rv;
+    }
+
+    *data = sb->buf + sb->start;
+    return sb->end - sb->start;
+}
+
+/** Removes data returned by sb_peek_data from the buffer.
+ *
+ *  Parameter: sb: buffer object where socket and cache data are stored.
+ *             size: number of bytes to remove, at most the number
+ *                   returned by sb_peek_data.
+ */
+void sb_consume(socket_buffer_t sb, size_t size) {
+    sb->start += size;
+    if (sb->scanned < sb->start)
+        sb->scanned = sb->start;
+    if (sb->start == sb->end)
+        sb->start = sb->end = sb->scanned = 0;
+}
+
+/** Removes all data received and not returned yet from the buffer.
+ *  Used when TLS is started, since commands sent by the client along
+ *  with STARTTLS were not encrypted and must not be handled.
+ *
+ *  Parameter: sb: buffer object where socket and cache data are stored.
+ */
+void sb_discard(socket_buffer_t sb) {
+    sb->start = sb->end = sb->scanned = 0;
+}
+
+/** Adds data to the output buffer. The data is only sent when the
+ *  buffer is full, when sb_flush is called, or when sb_read_line needs
+ *  to wait for more data from the client.
+ *
+ *  Parameters: sb: buffer object where socket and output data are stored.
+ *              data: bytes to be sent.
+ *              size: number of bytes in data.
+ *
+ *  Returns: If the data was successfully buffered or sent, returns
+ *           size. Otherwise, returns -1.
+ */
+int sb_write(socket_buffer_t sb, const char *data, size_t size) {
+    if (sb->out_used + size > SB_OUTPUT_BUFFER_SIZE) {
+        if (sb_flush(sb) < 0)
+            return -1;
+        // data that doesn't fit in the buffer at all is sent right away
+        if (size > SB_OUTPUT_BUFFER_SIZE)
+            return send_all(sb->fd, (char *)data, size);
     }
 
-    rv = eos - sb->buf + 1;
-    memcpy(out, sb->buf, rv);
-    out[rv] = 0;
-    sb->avail_data -= rv;
-    if (sb->avail_data)
-        memmove(sb->buf, eos + 1, sb->avail_data);
+    memcpy(sb->out + sb->out_used, data, size);
+    sb->out_used += size;
+    return size;
+}
+
+/** Adds a constant string to the output buffer, see sb_write.
+ *
+ *  Parameters: sb: buffer object where socket and output data are stored.
+ *              str: string and its length, usually built with SB_STRING.
+ *
+ *  Returns: If the string was successfully buffered or sent, returns
+ *           its length. Otherwise, returns -1.
+ */
+int sb_write_string(socket_buffer_t sb, const struct sb_string *str) {
+    return sb_write(sb, str->data, str->size);
+}
+
+/** Returns the free space of the output buffer, so data can be
+ *  produced directly into it (e.g., decompressed) instead of being
+ *  copied with sb_write. The buffer is flushed first if less than a
+ *  quarter of it is free. The data is added with sb_commit.
+ *
+ *  Parameters: sb: buffer object where socket and output data are stored.
+ *              size: address where the size of the free space is stored.
+ *
+ *  Returns: Start of the free space, or NULL if the buffer could not
+ *           be flushed.
+ */
+char *sb_reserve(socket_buffer_t sb, size_t *size) {
+    if (SB_OUTPUT_BUFFER_SIZE - sb->out_used < SB_OUTPUT_BUFFER_SIZE / 4 && sb_flush(sb) < 0)
+        return NULL;
+    *size = SB_OUTPUT_BUFFER_SIZE - sb->out_used;
+    return sb->out + sb->out_used;
+}
+
+/** Adds data stored in the space returned by sb_reserve to the output
+ *  buffer.
+ *
+ *  Parameters: sb: buffer object where socket and output data are stored.
+ *              size: number of bytes stored, at most the size of the
+ *                    free space.
+ */
+void sb_commit(socket_buffer_t sb, size_t size) {
+    sb->out_used += size;
+}
+
+static const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/** Adds the decimal representation of a number to the output buffer,
+ *  without going through printf. Digits are produced two at a time,
+ *  from the end of a small buffer on the stack.
+ *
+ *  Parameters: sb: buffer object where socket and output data are stored.
+ *              value: number to be written.
+ *
+ *  Returns: If the number was successfully buffered or sent, returns
+ *           the number of digits. Otherwise, returns -1.
+ */
+int sb_write_uint(socket_buffer_t sb, unsigned long long value) {
+    char digits[20];
+    char *p = digits + sizeof(digits);
+
+    while (value >= 100) {
+        p -= 2;
+        memcpy(p, digit_pairs + (value % 100) * 2, 2);
+        value /= 100;
+    }
+    if (value >= 10) {
+        p -= 2;
+        memcpy(p, digit_pairs + value * 2, 2);
+    } else {
+        *--p = '0' + value;
+    }
+    return sb_write(sb, p, digits + sizeof(digits) - p);
+}
+
+/** Formats a potentially-formatted string directly into the output
+ *  buffer, using a printf-like behaviour. For example, you may call
+ *  it like:
+ *
+ *  sb_printf(sb, "250 OK\r\n");
+ *  sb_printf(sb, "+OK %d messages found\r\n", msg_count);
+ *
+ *  Parameters: sb: buffer object where socket and output data are stored.
+ *              str: String to be sent, including potential
+ *                   printf-like format directives.
+ *              additional parameters based on string format.
+ *
+ *  Returns: If the string was successfully buffered or sent, returns
+ *           its length. Otherwise, returns -1.
+ */
+int sb_printf(socket_buffer_t sb, const char *str, ...) {
+    va_list args;
+    size_t avail = SB_OUTPUT_BUFFER_SIZE - sb->out_used;
+    int strsize;
+
+    va_start(args, str);
+    strsize = vsnprintf(sb->out + sb->out_used, avail, str, args);
+    va_end(args);
+
+    if (strsize < 0)
+        return -1;
+
+    // If buffer had enough space, the string is already in place
+    if ((size_t)strsize < avail) {
+        sb->out_used += strsize;
+        return strsize;
+    }
+
+    // Try again with an empty buffer
+    if (sb_flush(sb) < 0)
+        return -1;
+    if (strsize < SB_OUTPUT_BUFFER_SIZE) {
+        va_start(args, str);
+        vsnprintf(sb->out, SB_OUTPUT_BUFFER_SIZE, str, args);
+        va_end(args);
+        sb->out_used = strsize;
+        return strsize;
+    }
+
+    // String is larger than the buffer itself
+    char *buf = malloc(strsize + 1);
+    va_start(args, str);
+    vsnprintf(buf, strsize + 1, str, args);
+    va_end(args);
+    int rv = send_all(sb->fd, buf, strsize);
+    free(buf);
     return rv;
 }
+
+/** Sends all data in the output buffer.
+ *
+ *  Parameters: sb: buffer object where socket and output data are stored.
+ *
+ *  Returns: 0 if all data was sent, -1 on error.
+ */
+int sb_flush(socket_buffer_t sb) {
+    if (!sb->out_used)
+        return 0;
+
+    int rv = send_all(sb->fd, sb->out, sb->out_used);
+    sb->out_used = 0;
+    return rv < 0 ? -1 : 0;
+}
+
+/** Returns the number of bytes received from the socket so far.
+ *
+ *  Parameters: sb: buffer object where socket and cache data are stored.
+ */
+size_t sb_received(socket_buffer_t sb) {
+    return sb->received;
+}
@@ -1,16 +1,45 @@
 /*
- * Creates a buffer for receiving data from a socket and reading individual lines.
+ * Creates a buffer for receiving data from a socket and reading
+ * individual lines, and for coalescing replies sent to the socket.
  */
 
 #ifndef _SOCKET_BUFFER_H_
 #define _SOCKET_BUFFER_H_
 
+#include "arena.h"
+
 #include <string.h>
 
 typedef struct socket_buffer *socket_buffer_t;
 
-socket_buffer_t sb_create(int fd, size_t max_buffer_size);
+/** Constant string stored with its length, so it can be sent without
+ *  strlen or formatting. SB_STRING builds one from a string literal.
+ */
+struct sb_string {
+    const char *data;
+    size_t size;
+};
+#define SB_STRING(s) { s, sizeof(s) - 1 }
+
+socket_buffer_t sb_create(int fd, size_t max_buffer_size, arena_t arena);
+size_t sb_memory_size(size_t max_buffer_size);
 void sb_destroy(socket_buffer_t sb);
+int sb_next_line(socket_buffer_t sb, const char **line);
 int sb_read_line(socket_buffer_t sb, char out[]);
+int sb_peek_data(socket_buffer_t sb, const char **data);
+void sb_consume(socket_buffer_t sb, size_t size);
+void sb_discard(socket_buffer_t sb);
+size_t sb_received(socket_buffer_t sb);
+
+int sb_write(socket_buffer_t sb, const char *data, size_t size);
+int sb_write_string(socket_buffer_t sb, const struct sb_string *str);
+int sb_write_uint(socket_buffer_t sb, unsigned long long value);
+char *sb_reserve(socket_buffer_t sb, size_t *size);
+void sb_commit(socket_buffer_t sb, size_t size);
+// The attribute in this function allows gcc to provided useful
+// warnings when compiling the code.
+int sb_printf(socket_buffer_t sb, const char *str, ...)
+    __attribute__((format(printf, 2, 3)));
+int sb_flush(socket_buffer_t sb);
 
 #endif
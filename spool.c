@@ -0,0 +1,210 @@
+/*
+ * Writes incoming message contents into a temporary spool file.
+ */
+
+#include "spool.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define SPOOL_TEMPLATE "tmpXXXXXX"
+#define SPOOL_BUFFER_SIZE 65536
+
+struct spool {
+    int fd;
+    int error;
+    size_t used;
+    size_t size;         // bytes written so far, including buffered data
+    size_t header_size;  // bytes up to the end of the headers, 0 if not found yet
+    int header_match;    // bytes of the empty line after the headers seen so far
+    int in_arena;        // allocated from an arena, so not freed by spool_destroy
+    char filename[sizeof(SPOOL_TEMPLATE)];
+    char buf[SPOOL_BUFFER_SIZE];
+};
+
+/** Creates a new temporary spool file in the current directory. The
+ *  file is in the same file system as the mail storage, so it can be
+ *  hard-linked into mailboxes by save_user_mail.
+ *
+ *  Parameters: arena: arena the spool object is allocated from, or
+ *                     NULL to use malloc.
+ *
+ *  Returns: A spool_t object, or NULL if the file cannot be created.
+ */
+spool_t spool_create(arena_t arena) {
+    struct arena_mark mark;
+    spool_t sp;
+
+    if (arena) {
+        mark = arena_mark(arena);
+        sp = arena_alloc(arena, sizeof(struct spool));
+    } else {
+        sp = malloc(sizeof(struct spool));
+    }
+    if (!sp)
+        return NULL;
+    strcpy(sp->filename, SPOOL_TEMPLATE);
+    sp->fd = mkstemp(sp->filename);
+    if (sp->fd < 0) {
+        if (arena)
+            arena_release(arena, mark);
+        else
+            free(sp);
+        return NULL;
+    }
+    sp->in_arena = arena != NULL;
+    sp->error = 0;
+    sp->used = 0;
+    sp->size = 0;
+    sp->header_size = 0;
+    sp->header_match = 2;  // the message starts at the start of a line
+    return sp;
+}
+
+/** Returns the number of bytes spool_create allocates for a spool
+ *  object, to size the arena it is allocated from.
+ */
+size_t spool_memory_size(void) {
+    return sizeof(struct spool);
+}
+
+/** Closes and removes the spool file, and frees all memory used by
+ *  the spool object. Mailboxes that received a link to the file keep
+ *  their copy.
+ *
+ *  Parameters: sp: spool object to be destroyed.
+ */
+void spool_destroy(spool_t sp) {
+    close(sp->fd);
+    unlink(sp->filename);
+    if (!sp->in_arena)
+        free(sp);
+}
+
+/** Internal function that writes all buffered data, followed by an
+ *  additional block of data, to the file in a single writev call (or
+ *  as few as possible, if the file system accepts only part of it).
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+static int spool_flush(spool_t sp, const char *data, size_t size) {
+    struct iovec iov[2] = {
+        {.iov_base = sp->buf, .iov_len = sp->used},
+        {.iov_base = (char *)data, .iov_len = size},
+    };
+    int first = 0;
+
+    while (first < 2) {
+        ssize_t rv = writev(sp->fd, iov + first, 2 - first);
+        if (rv < 0 && errno == EINTR)
+            continue;
+        if (rv < 0) {
+            sp->error = 1;
+            return -1;
+        }
+        while (first < 2 && (size_t)rv >= iov[first].iov_len) {
+            rv -= iov[first].iov_len;
+            iov[first++].iov_len = 0;
+        }
+        if (first < 2) {
+            iov[first].iov_base = (char *)iov[first].iov_base + rv;
+            iov[first].iov_len -= rv;
+        }
+    }
+
+    sp->used = 0;
+    return 0;
+}
+
+/** Internal function that looks for the empty line that ends the
+ *  headers of the message, which may be split across several writes.
+ */
+static void find_header_end(spool_t sp, const char *data, size_t size) {
+    static const char header_end[] = "\r\n\r\n";
+    size_t i = 0;
+
+    while (i < size) {
+        if (!sp->header_match) {
+            const char *cr = memchr(data + i, '\r', size - i);
+            if (!cr) return;
+            i = cr - data;
+        }
+
+        if (data[i] == header_end[sp->header_match])
+            sp->header_match++;
+        else
+            sp->header_match = data[i] == '\r';
+        i++;
+
+        if (sp->header_match == 4) {
+            sp->header_size = sp->size + i;
+            return;
+        }
+    }
+}
+
+/** Appends data to the spool file. Data is kept in a fixed-size
+ *  buffer and only written to the file once the buffer is full, so
+ *  the memory used is the same for any message size.
+ *
+ *  Parameters: sp: spool object.
+ *              data: bytes to be appended.
+ *              size: number of bytes in data.
+ *
+ *  Returns: 0 on success, -1 if this or a previous write failed.
+ */
+int spool_write(spool_t sp, const char *data, size_t size) {
+    if (sp->error)
+        return -1;
+
+    if (!sp->header_size)
+        find_header_end(sp, data, size);
+    sp->size += size;
+
+    if (sp->used + size <= SPOOL_BUFFER_SIZE) {
+        memcpy(sp->buf + sp->used, data, size);
+        sp->used += size;
+        return 0;
+    }
+
+    return spool_flush(sp, data, size);
+}
+
+/** Writes any buffered data to the spool file. After this call the
+ *  file contains the entire message and can be delivered.
+ *
+ *  Parameters: sp: spool object.
+ *
+ *  Returns: 0 on success, -1 if this or a previous write failed.
+ */
+int spool_finish(spool_t sp) {
+    if (sp->error)
+        return -1;
+    return spool_flush(sp, NULL, 0);
+}
+
+/** Returns the name of the spool file.
+ *
+ *  Parameters: sp: spool object.
+ *
+ *  Returns: Name of the file, valid until the spool is destroyed.
+ */
+const char *spool_filename(spool_t sp) {
+    return sp->filename;
+}
+
+/** Returns the size of the headers of the message, including the
+ *  empty line that separates them from the body. Is only complete
+ *  after the whole message was written.
+ *
+ *  Parameters: sp: spool object.
+ *
+ *  Returns: Offset of the body in the file, or the size of the whole
+ *           message if it has no body.
+ */
+size_t spool_header_size(spool_t sp) {
+    return sp->header_size ? sp->header_size : sp->size;
+}
@@ -0,0 +1,22 @@
+/*
+ * Writes incoming message contents into a temporary spool file.
+ */
+
+#ifndef _SPOOL_H_
+#define _SPOOL_H_
+
+#include "arena.h"
+
+#include <string.h>
+
+typedef struct spool *spool_t;
+
+spool_t spool_create(arena_t arena);
+size_t spool_memory_size(void);
+void spool_destroy(spool_t sp);
+int spool_write(spool_t sp, const char *data, size_t size);
+int spool_finish(spool_t sp);
+const char *spool_filename(spool_t sp);
+size_t spool_header_size(spool_t sp);
+
+#endif
@@ -0,0 +1,130 @@
+/*
+ * Hierarchical timing wheel, for session timeouts.
+ *
+ * Level 0 has one slot per tick, for the timers expiring within the
+ * next TIMER_SLOTS ticks; each slot of level n covers TIMER_SLOTS^n
+ * ticks. A timer is put in the slot of the lowest level whose range
+ * includes its expiry, so arming and cancelling a timer only links
+ * or unlinks it from a list. When level 0 completes a turn, the next
+ * slot of level 1 is emptied into it (and so on up the levels), so
+ * each timer is moved at most TIMER_LEVELS - 1 times before it
+ * expires. Timers further away than the last level can cover expire
+ * at the end of its range instead.
+ */
+
+#include "timer.h"
+
+#define TIMER_MASK (TIMER_SLOTS - 1)
+#define TIMER_RANGE ((uint64_t)1 << (TIMER_LEVELS * TIMER_SLOT_BITS))
+
+/** Creates an empty wheel.
+ *
+ *  Parameters: wheel: wheel to be initialized.
+ *              now: current tick.
+ */
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now) {
+    wheel->now = now;
+    wheel->count = 0;
+    for (int level = 0; level < TIMER_LEVELS; level++)
+        for (int i = 0; i < TIMER_SLOTS; i++)
+            wheel->slots[level][i].next = wheel->slots[level][i].prev = &wheel->slots[level][i];
+}
+
+/** Internal function that links a timer into the slot of its expiry.
+ */
+static void place_timer(struct timer_wheel *wheel, struct timer *timer) {
+    uint64_t delta = timer->expires - wheel->now;
+    int level = 0;
+
+    if (delta >= TIMER_RANGE)
+        timer->expires = wheel->now + TIMER_RANGE - 1;
+    while (level < TIMER_LEVELS - 1 && delta >> ((level + 1) * TIMER_SLOT_BITS))
+        level++;
+
+    struct timer *head = &wheel->slots[level][(timer->expires >> (level * TIMER_SLOT_BITS)) & TIMER_MASK];
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void unlink_timer(struct timer *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+}
+
+/** Arms a timer, or moves it if it is armed already. A timer expiring
+ *  before the current tick expires on the current one.
+ *
+ *  Parameters: wheel: wheel the timer belongs to.
+ *              timer: timer to be armed.
+ *              expires: tick on which it expires.
+ */
+void timer_add(struct timer_wheel *wheel, struct timer *timer, uint64_t expires) {
+    if (timer_pending(timer))
+        unlink_timer(timer);
+    else
+        wheel->count++;
+    timer->expires = expires > wheel->now ? expires : wheel->now;
+    place_timer(wheel, timer);
+}
+
+/** Disarms a timer, if it is armed.
+ *
+ *  Parameters: wheel: wheel the timer belongs to.
+ *              timer: timer to be disarmed.
+ */
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer) {
+    if (timer_pending(timer)) {
+        unlink_timer(timer);
+        wheel->count--;
+    }
+}
+
+/** Internal function that moves to the next tick, emptying the slots
+ *  of the higher levels whose turn comes into the lower ones.
+ */
+static void advance(struct timer_wheel *wheel) {
+    wheel->now++;
+    for (int level = 1; level < TIMER_LEVELS; level++) {
+        if (wheel->now & (((uint64_t)1 << (level * TIMER_SLOT_BITS)) - 1))
+            break;
+
+        struct timer *head = &wheel->slots[level][(wheel->now >> (level * TIMER_SLOT_BITS)) & TIMER_MASK];
+        struct timer *timer = head->next;
+        head->next = head->prev = head;
+        while (timer != head) {
+            struct timer *next = timer->next;
+            place_timer(wheel, timer);
+            timer = next;
+        }
+    }
+}
+
+/** Returns the next timer that expired before a tick, disarmed, so it
+ *  can be armed again by the caller. Called until it returns NULL to
+ *  handle all of them.
+ *
+ *  Parameters: wheel: wheel of the timers.
+ *              now: current tick; timers expiring on it are kept.
+ *
+ *  Returns: An expired timer, or NULL if there are no more.
+ */
+struct timer *timer_expire(struct timer_wheel *wheel, uint64_t now) {
+    while (wheel->count && wheel->now < now) {
+        struct timer *head = &wheel->slots[0][wheel->now & TIMER_MASK];
+        if (head->next != head) {
+            struct timer *timer = head->next;
+            unlink_timer(timer);
+            wheel->count--;
+            return timer;
+        }
+        advance(wheel);
+    }
+
+    // without timers, the turns in between have nothing to move
+    if (wheel->now < now)
+        wheel->now = now;
+    return NULL;
+}
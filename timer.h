@@ -0,0 +1,45 @@
+/*
+ * Hierarchical timing wheel, for session timeouts.
+ */
+
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6  // 64 slots per level
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+
+/** Timer embedded in the object it belongs to, so arming and
+ *  cancelling it never allocates. Times are in ticks, chosen by the
+ *  caller (seconds for the server).
+ */
+struct timer {
+    struct timer *next, *prev;  // list of its slot, NULL if not armed
+    uint64_t expires;
+};
+
+/** Wheel of timers: level 0 has one slot per tick, and each slot of
+ *  the next levels covers a whole turn of the level below, into which
+ *  its timers are moved when its turn comes.
+ */
+struct timer_wheel {
+    uint64_t now;  // next tick to be handled
+    size_t count;  // armed timers
+    struct timer slots[TIMER_LEVELS][TIMER_SLOTS];  // list heads
+};
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now);
+void timer_add(struct timer_wheel *wheel, struct timer *timer, uint64_t expires);
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer);
+struct timer *timer_expire(struct timer_wheel *wheel, uint64_t now);
+
+/** Returns non-zero if a timer is armed.
+ */
+static inline int timer_pending(const struct timer *timer) {
+    return timer->next != NULL;
+}
+
+#endif
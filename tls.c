@@ -0,0 +1,257 @@
+/*
+ * TLS sessions started on established connections (STARTTLS), with
+ * records encrypted by the kernel (kTLS) when it supports it.
+ *
+ * The handshake is done with OpenSSL in user space. Once it completes,
+ * OpenSSL hands the keys of the session to the kernel if it can (the
+ * tls module is loaded and the cipher is supported), and from then on
+ * plain send, sendfile and splice on the socket produce TLS records:
+ * messages are still sent without being copied through the process.
+ * Otherwise, data to be sent is encrypted by tls_write.
+ *
+ * Received records are always decrypted by OpenSSL, reading them with
+ * the function given to tls_create, since in io_uring mode they are
+ * received by the ring and not read from the socket.
+ *
+ * Sessions are resumed with stateless tickets, encrypted with a key
+ * created with the context. tls_init runs before the workers are
+ * forked, so a client gets the short handshake from any worker (and
+ * from any forked process in fork mode) without a shared cache.
+ */
+
+#include "tls.h"
+
+#include "metrics.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#define TLS_TICKETS 1  // tickets sent after each full handshake
+
+struct tls {
+    SSL *ssl;
+    int fd;
+    int kernel_send;  // records sent are encrypted by the kernel
+    int want_write;   // the last call is waiting for the socket to be writable
+    tls_recv_t recv;
+    uint64_t start;   // creation, for the handshake metric
+};
+
+static SSL_CTX *context = NULL;
+static BIO_METHOD *recv_method = NULL;
+static int handshake_metric = -1, resumed_metric = -1, kernel_metric = -1, failed_metric = -1;
+
+/** Internal function that reads records for OpenSSL with the receive
+ *  function of the session.
+ */
+static int recv_bio_read(BIO *bio, char *buf, int size) {
+    struct tls *tls = BIO_get_data(bio);
+    ssize_t rv = tls->recv(tls->fd, buf, size);
+
+    BIO_clear_retry_flags(bio);
+    if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        BIO_set_retry_read(bio);
+    return rv;
+}
+
+/** Internal function answering the controls OpenSSL sends to the read
+ *  side of the session; only flushing is meaningful.
+ */
+static long recv_bio_ctrl(BIO *bio, int cmd, long num, void *ptr) {
+    return cmd == BIO_CTRL_FLUSH;
+}
+
+static int recv_bio_create(BIO *bio) {
+    BIO_set_init(bio, 1);
+    return 1;
+}
+
+/** Creates the context shared by all TLS sessions, loading the
+ *  certificate chain and the private key of the server.
+ *
+ *  Parameters: cert_file: PEM file with the certificate, followed by
+ *                         any intermediate certificates.
+ *              key_file: PEM file with the private key.
+ *
+ *  Returns: 0 on success, -1 on error (printed to stderr).
+ */
+int tls_init(const char *cert_file, const char *key_file) {
+    context = SSL_CTX_new(TLS_server_method());
+    if (!context || !SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION) ||
+        SSL_CTX_use_certificate_chain_file(context, cert_file) != 1 ||
+        SSL_CTX_use_PrivateKey_file(context, key_file, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(context) != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(context);
+        context = NULL;
+        return -1;
+    }
+
+    // renegotiation is disabled, so writes never wait for the client;
+    // a connection closed without close_notify just ends the session
+    SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    SSL_CTX_set_mode(context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_OFF);  // tickets only
+    SSL_CTX_set_num_tickets(context, TLS_TICKETS);
+
+    recv_method = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "server_recv");
+    BIO_meth_set_read(recv_method, recv_bio_read);
+    BIO_meth_set_ctrl(recv_method, recv_bio_ctrl);
+    BIO_meth_set_create(recv_method, recv_bio_create);
+
+    // OpenSSL writes to the socket itself, without MSG_NOSIGNAL
+    signal(SIGPIPE, SIG_IGN);
+
+    handshake_metric = metrics_histogram("tls.handshake");
+    resumed_metric = metrics_counter("tls.resumed");
+    kernel_metric = metrics_counter("tls.kernel_send");
+    failed_metric = metrics_counter("tls.failed");
+    return 0;
+}
+
+/** Creates a TLS session on a connection, to be started with
+ *  tls_handshake.
+ *
+ *  Parameters: fd: Socket file descriptor, written by OpenSSL.
+ *              recv: Function receiving data from the socket.
+ *
+ *  Returns: The new session, or NULL if TLS is not configured or out
+ *           of memory.
+ */
+tls_t tls_create(int fd, tls_recv_t recv) {
+    struct tls *tls;
+    BIO *rbio, *wbio;
+
+    if (!context || !(tls = calloc(1, sizeof(struct tls))))
+        return NULL;
+    tls->fd = fd;
+    tls->recv = recv;
+    tls->start = metrics_now();
+
+    // records are written straight to the socket, so OpenSSL can move
+    // the session to the kernel once the keys are known
+    if (!(tls->ssl = SSL_new(context)) || !(rbio = BIO_new(recv_method))) {
+        SSL_free(tls->ssl);
+        free(tls);
+        ERR_clear_error();
+        return NULL;
+    }
+    if (!(wbio = BIO_new_socket(fd, BIO_NOCLOSE))) {
+        BIO_free(rbio);
+        SSL_free(tls->ssl);
+        free(tls);
+        ERR_clear_error();
+        return NULL;
+    }
+    BIO_set_data(rbio, tls);
+    SSL_set_bio(tls->ssl, rbio, wbio);
+    SSL_set_accept_state(tls->ssl);
+    return tls;
+}
+
+/** Ends a TLS session, sending close_notify if the socket can take it
+ *  without blocking, and frees it. The socket is not closed.
+ *
+ *  Parameters: tls: Session to be freed.
+ */
+void tls_destroy(tls_t tls) {
+    if (SSL_is_init_finished(tls->ssl))
+        SSL_shutdown(tls->ssl);
+    SSL_free(tls->ssl);
+    ERR_clear_error();
+    free(tls);
+}
+
+/** Internal function that turns the result of an OpenSSL call into the
+ *  convention of recv and send.
+ */
+static ssize_t tls_result(tls_t tls, int rv) {
+    int error = SSL_get_error(tls->ssl, rv);
+
+    tls->want_write = error == SSL_ERROR_WANT_WRITE;
+    switch (error) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        if (!errno)
+            errno = ECONNRESET;
+        break;
+    default:
+        errno = EPROTO;
+    }
+    ERR_clear_error();
+    return -1;
+}
+
+/** Runs the handshake of a session as far as the data received so far
+ *  allows. On a blocking socket, runs it to completion.
+ *
+ *  Parameters: tls: Session created by tls_create.
+ *
+ *  Returns: 1 once the handshake is complete, or -1 on error, with
+ *           errno set to EAGAIN if it must be called again once the
+ *           socket is readable (or writable, see tls_wants_write).
+ */
+int tls_handshake(tls_t tls) {
+    int rv = SSL_do_handshake(tls->ssl);
+
+    if (rv != 1) {
+        if (tls_result(tls, rv) == -1 && errno != EAGAIN)
+            metrics_add(failed_metric, 1);
+        return -1;
+    }
+
+    tls->kernel_send = BIO_get_ktls_send(SSL_get_wbio(tls->ssl)) > 0;
+    metrics_record(handshake_metric, tls->start);
+    if (SSL_session_reused(tls->ssl))
+        metrics_add(resumed_metric, 1);
+    if (tls->kernel_send)
+        metrics_add(kernel_metric, 1);
+    return 1;
+}
+
+/** Returns non-zero if the records of a session are encrypted by the
+ *  kernel, so data can be sent with send, sendfile or splice on the
+ *  socket instead of tls_write.
+ */
+int tls_kernel_send(tls_t tls) {
+    return tls->kernel_send;
+}
+
+/** Returns non-zero if the last call that failed with EAGAIN waits for
+ *  the socket to be writable, rather than for data from the client.
+ */
+int tls_wants_write(tls_t tls) {
+    return tls->want_write;
+}
+
+/** Receives and decrypts data from a session, as recv.
+ *
+ *  Returns: The number of bytes stored, 0 if the session was closed
+ *           by the client, or -1 on error (EAGAIN if no complete
+ *           record was received yet).
+ */
+ssize_t tls_read(tls_t tls, void *buf, size_t size) {
+    int rv = SSL_read(tls->ssl, buf, size > INT_MAX ? INT_MAX : size);
+    return rv > 0 ? rv : tls_result(tls, rv);
+}
+
+/** Encrypts and sends data on a session, as send. May send only part
+ *  of the data, in whole records.
+ *
+ *  Returns: The number of bytes sent, or -1 on error (EAGAIN if the
+ *           socket is full).
+ */
+ssize_t tls_write(tls_t tls, const void *buf, size_t size) {
+    int rv = SSL_write(tls->ssl, buf, size > INT_MAX ? INT_MAX : size);
+    return rv > 0 ? rv : tls_result(tls, rv);
+}
@@ -0,0 +1,28 @@
+/*
+ * TLS sessions started on established connections (STARTTLS), with
+ * records encrypted by the kernel (kTLS) when it supports it.
+ */
+
+#ifndef _TLS_H_
+#define _TLS_H_
+
+#include <sys/types.h>
+
+typedef struct tls *tls_t;
+
+/** Function used to receive the records of a session (server_recv
+ *  without TLS), so they can come from the io_uring buffers.
+ */
+typedef ssize_t (*tls_recv_t)(int fd, void *buf, size_t size);
+
+int tls_init(const char *cert_file, const char *key_file);
+tls_t tls_create(int fd, tls_recv_t recv);
+void tls_destroy(tls_t tls);
+
+int tls_handshake(tls_t tls);
+int tls_kernel_send(tls_t tls);
+int tls_wants_write(tls_t tls);
+ssize_t tls_read(tls_t tls, void *buf, size_t size);
+ssize_t tls_write(tls_t tls, const void *buf, size_t size);
+
+#endif
@@ -0,0 +1,267 @@
+/*
+ * Minimal io_uring interface on top of the raw system calls, so the
+ * servers don't depend on liburing. Covers what the io_uring backend of
+ * server.c needs: one ring with its submission and completion queues
+ * mapped in a single region, and rings of provided receive buffers.
+ *
+ * The ring is used by a single thread. Entries obtained with
+ * uring_get_sqe are queued until uring_submit or uring_wait gives them
+ * to the kernel.
+ */
+
+#define _GNU_SOURCE
+#include "uring.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags, void *arg,
+                     size_t size) {
+    return syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, size);
+}
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned count) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+/** Creates a ring and maps its queues.
+ *
+ *  Parameters: ring: ring to initialize.
+ *              entries: size of the submission queue, a power of two.
+ *
+ *  Returns: 0 on success, -1 if the kernel has no io_uring or lacks a
+ *           feature used by the servers.
+ */
+int uring_init(struct uring *ring, unsigned entries) {
+    struct io_uring_params p;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+    // the completion queue gets room for many multishot completions;
+    // completions are only handled by the thread waiting for them,
+    // which also requires the kernel (6.1) to have multishot receives
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = entries * 8;
+
+    ring->fd = sys_setup(entries, &p);
+    if (ring->fd == -1)
+        return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG) ||
+        !(p.features & IORING_FEAT_NODROP)) {
+        close(ring->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (ring->cq_ring_size > ring->sq_ring_size)
+        ring->sq_ring_size = ring->cq_ring_size;
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    ring->cq_ring = ring->sq_ring;
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    char *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // entry i of the array always points to entry i of the queue
+    for (unsigned i = 0; i < p.sq_entries; i++)
+        ring->sq_array[i] = i;
+    return 0;
+}
+
+/** Unmaps the queues and closes a ring. Requests still running are
+ *  cancelled by the kernel.
+ *
+ *  Parameters: ring: ring created by uring_init.
+ */
+void uring_exit(struct uring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+/** Gets an entry of the submission queue, cleared, to be filled by the
+ *  caller. Submits the queued entries first when the queue is full.
+ *
+ *  Parameters: ring: ring created by uring_init.
+ *
+ *  Returns: the entry, or NULL if the queue is full and could not be
+ *           submitted.
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+    if (ring->sq_queued == ring->sq_entries && uring_submit(ring) == -1)
+        return NULL;
+
+    unsigned tail = *ring->sq_tail + ring->sq_queued++;
+    struct io_uring_sqe *sqe = &ring->sqes[tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/** Internal function that makes the queued entries visible to the
+ *  kernel, and returns their number.
+ */
+static unsigned publish(struct uring *ring) {
+    unsigned queued = ring->sq_queued;
+    if (queued)
+        __atomic_store_n(ring->sq_tail, *ring->sq_tail + queued, __ATOMIC_RELEASE);
+    ring->sq_queued = 0;
+    return queued;
+}
+
+/** Submits the queued entries without waiting for completions.
+ *
+ *  Parameters: ring: ring created by uring_init.
+ *
+ *  Returns: 0 on success, -1 on error.
+ */
+int uring_submit(struct uring *ring) {
+    unsigned queued = publish(ring);
+    while (queued) {
+        int rv = sys_enter(ring->fd, queued, 0, 0, NULL, 0);
+        if (rv == -1 && errno != EINTR)
+            return -1;
+        if (rv > 0)
+            queued -= rv;
+    }
+    return 0;
+}
+
+/** Submits the queued entries and waits until there is a completion.
+ *
+ *  Parameters: ring: ring created by uring_init.
+ *              timeout: maximum time to wait in milliseconds, or -1 to
+ *                       wait for ever.
+ *
+ *  Returns: 0 when there is a completion or the timeout expired, -1 on
+ *           error (EINTR when a signal was caught).
+ */
+int uring_wait(struct uring *ring, int timeout) {
+    struct __kernel_timespec ts = { timeout / 1000, (timeout % 1000) * 1000000L };
+    struct io_uring_getevents_arg arg;
+
+    memset(&arg, 0, sizeof(arg));
+    if (timeout >= 0)
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+
+    unsigned queued = publish(ring);
+    unsigned wait = uring_peek(ring) ? 0 : 1;
+    int rv = sys_enter(ring->fd, queued, wait, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                       &arg, sizeof(arg));
+    if (rv == -1 && errno == ETIME)
+        return 0;
+    return rv == -1 ? -1 : 0;
+}
+
+/** Returns the next completion, or NULL if there is none. The entry
+ *  stays in the queue until uring_advance.
+ *
+ *  Parameters: ring: ring created by uring_init.
+ */
+struct io_uring_cqe *uring_peek(struct uring *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+/** Removes the completion returned by uring_peek from the queue.
+ *
+ *  Parameters: ring: ring created by uring_init.
+ */
+void uring_advance(struct uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/** Allocates receive buffers and registers them as a buffer ring, from
+ *  which requests with IOSQE_BUFFER_SELECT and the group pick one when
+ *  data arrives.
+ *
+ *  Parameters: ring: ring created by uring_init.
+ *              bufs: buffers to initialize.
+ *              count: number of buffers, a power of two.
+ *              size: size of each buffer.
+ *              group: buffer group ID.
+ *
+ *  Returns: 0 on success, -1 on error (for kernels without buffer
+ *           rings).
+ */
+int uring_buffers_init(struct uring *ring, struct uring_buffers *bufs, unsigned count,
+                       unsigned size, uint16_t group) {
+    struct io_uring_buf_reg reg;
+    size_t ring_size = count * sizeof(struct io_uring_buf);
+
+    bufs->ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bufs->ring == MAP_FAILED)
+        return -1;
+    bufs->memory = malloc((size_t)count * size);
+    if (!bufs->memory) {
+        munmap(bufs->ring, ring_size);
+        return -1;
+    }
+    bufs->count = count;
+    bufs->size = size;
+    bufs->group = group;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)bufs->ring;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (sys_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        free(bufs->memory);
+        munmap(bufs->ring, ring_size);
+        return -1;
+    }
+
+    bufs->ring->tail = 0;
+    for (unsigned id = 0; id < count; id++)
+        uring_buffers_recycle(bufs, id);
+    return 0;
+}
+
+/** Gives a buffer back to the kernel once its data was consumed.
+ *
+ *  Parameters: bufs: buffers created by uring_buffers_init.
+ *              id: buffer ID from a completion.
+ */
+void uring_buffers_recycle(struct uring_buffers *bufs, unsigned id) {
+    // the tail shares its place with the reserved field of the first entry
+    uint16_t tail = bufs->ring->tail;
+    struct io_uring_buf *buf = &bufs->ring->bufs[tail & (bufs->count - 1)];
+
+    buf->addr = (uint64_t)(uintptr_t)uring_buffer(bufs, id);
+    buf->len = bufs->size;
+    buf->bid = id;
+    __atomic_store_n(&bufs->ring->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+}
@@ -0,0 +1,56 @@
+/*
+ * Minimal io_uring interface on top of the raw system calls.
+ */
+
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct uring {
+    int fd;
+    // submission queue, shared with the kernel
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_entries;
+    unsigned sq_queued;  // entries filled but not submitted yet
+    // completion queue, shared with the kernel
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+};
+
+/** Receive buffers provided to the kernel, picked by each completion
+ *  of a request with IOSQE_BUFFER_SELECT.
+ */
+struct uring_buffers {
+    struct io_uring_buf_ring *ring;
+    char *memory;
+    unsigned count;
+    unsigned size;  // bytes in each buffer
+    uint16_t group;
+};
+
+int uring_init(struct uring *ring, unsigned entries);
+void uring_exit(struct uring *ring);
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+int uring_submit(struct uring *ring);
+int uring_wait(struct uring *ring, int timeout);
+struct io_uring_cqe *uring_peek(struct uring *ring);
+void uring_advance(struct uring *ring);
+
+int uring_buffers_init(struct uring *ring, struct uring_buffers *bufs, unsigned count,
+                       unsigned size, uint16_t group);
+void uring_buffers_recycle(struct uring_buffers *bufs, unsigned id);
+
+/** Returns the memory of a provided buffer, from the buffer ID of a
+ *  completion.
+ */
+static inline char *uring_buffer(struct uring_buffers *bufs, unsigned id) {
+    return bufs->memory + (size_t)id * bufs->size;
+}
+
+#endif
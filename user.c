@@ -4,53 +4,275 @@
 
 #include "user.h"
 
+#include "mailindex.h"
+#include "mailsummary.h"
+#include "segment.h"
+
+#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #define USER_FILE_NAME "users.txt"
-#define MAIL_BASE_DIRECTORY "mail.store"
 #define MAIL_FILE_SUFFIX ".mail"
+#define MAIL_SUMMARY_FILE_NAME ".summaries"
+#define MAIL_HEADER_INFO ",H="  // header size, recorded in the file name at delivery
+#define MAIL_HEADER_UNKNOWN SIZE_MAX
+#define MAIL_BUCKET_SIZE 9  // "YYYYMMDD" and the null byte
 
 struct user_list {
     char *user;
+    int status;  // result of the last delivery to this user (0 or errno value)
+    int in_arena;  // node and name allocated from an arena, not freed on their own
     struct user_list *next;
 };
 
 struct mail_item {
-    char file_name[NAME_MAX];
-    size_t file_size;
-    unsigned int deleted : 1;
+    size_t file_size;          // size of the message, once decompressed
+    size_t stored_size;        // bytes used in its file
+    int compressed;            // stored as a zlib stream (segments only)
+    size_t header_size;        // MAIL_HEADER_UNKNOWN if not recorded in the file name
+    off_t offset;              // position of the message in its file
+    unsigned int index;        // position of the item in the list
+    unsigned int name_offset;  // position of the file name in the list's name pool
 };
 
+/** A list of emails is a single allocation: the header below,
+ *  followed by the array of items, the bitmap of deleted items, the
+ *  pool of file names (or of unique IDs, if the mailbox is stored in
+ *  a segment) and the dictionary of a compressed segment. Totals for
+ *  non-deleted items are kept up to date as items are deleted and
+ *  recovered.
+ */
 struct mail_list {
-    struct mail_item item;
-    struct mail_list *next;
+    int storage;              // MAIL_STORAGE_FILES or MAIL_STORAGE_SEGMENTS
+    int data_fd;              // segment file the messages are read from (-1 for files)
+    unsigned int count;       // number of items, including deleted ones
+    unsigned int live_count;  // number of non-deleted items
+    size_t live_size;         // total size of non-deleted items
+    size_t total_size;        // total size of all items
+    size_t dir_len;           // length of the mailbox directory, at the start of the name pool
+    int in_arena;             // allocated from an arena, so not freed by destroy_mail_list
+    unsigned char *deleted;   // one bit per item
+    char *names;
+    const char *dict;         // dictionary of compressed items, after the name pool
+    size_t dict_size;
+    struct mail_item items[];
 };
 
-/** Internal function that opens the users file list. If file has been
- *  opened before, rewinds the pointer to beginning of the file.
- * 
- *  Returns: file pointer for users file, or NULL if file cannot be opened.
+// Selected with set_mail_storage, used for all mailboxes
+static int mail_storage = MAIL_STORAGE_FILES;
+static int mail_compression = 0;  // new messages are compressed (segments only)
+static int mail_layout = MAIL_LAYOUT_FLAT;
+
+/** In-memory copy of the users file. The whole directory is a single
+ *  allocation: the header below, followed by the hash table slots and
+ *  by a pool of strings, each entry stored in the pool as the
+ *  lowercased user name followed by the password, both null
+ *  terminated. The table uses open addressing with linear probing.
+ */
+struct user_slot {
+    uint32_t hash;
+    uint32_t offset;  // offset of the entry in the pool, plus one (zero means empty)
+};
+
+struct user_directory {
+    size_t mask;  // number of slots minus one (number of slots is a power of two)
+    size_t count;
+    struct stat file_stat;  // users file information when the directory was loaded
+    char *pool;
+    struct user_slot slots[];
+};
+
+static struct user_directory *user_directory = NULL;
+static time_t user_directory_checked = 0;
+
+/** Internal function that computes the hash of a lowercased user name
+ *  (FNV-1a).
+ */
+static uint32_t user_hash(const char *name, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/** Internal function that finds the slot for a lowercased user name:
+ *  either the slot containing this name, or the empty slot where it
+ *  should be inserted.
+ */
+static struct user_slot *user_directory_find(struct user_directory *dir, const char *name,
+                                             size_t len, uint32_t hash) {
+    size_t pos = hash & dir->mask;
+    while (dir->slots[pos].offset) {
+        struct user_slot *slot = &dir->slots[pos];
+        if (slot->hash == hash && !strcmp(dir->pool + slot->offset - 1, name))
+            return slot;
+        pos = (pos + 1) & dir->mask;
+    }
+    return &dir->slots[pos];
+}
+
+/** Internal function that reads the entire contents of a file into a
+ *  new null-terminated buffer, without using stdio.
+ *
+ *  Returns: the buffer (to be freed by the caller), or NULL on error.
+ */
+static char *read_whole_file(int fd, size_t size) {
+    char *data = malloc(size + 1);
+    size_t pos = 0;
+    while (pos < size) {
+        ssize_t rv = read(fd, data + pos, size - pos);
+        if (rv < 0 && errno == EINTR)
+            continue;
+        if (rv <= 0)
+            break;
+        pos += rv;
+    }
+    data[pos] = 0;
+    return data;
+}
+
+/** Internal function that builds a new user directory from the users
+ *  file. The file contains pairs of user names and passwords,
+ *  separated by white space.
+ *
+ *  Returns: the new directory, or NULL if the file cannot be read.
+ */
+static struct user_directory *build_user_directory(void) {
+    int fd = open(USER_FILE_NAME, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    char *data = read_whole_file(fd, file_stat.st_size);
+    close(fd);
+
+    // count the words in the file (each entry has two), so the table
+    // can be sized to be at most half full
+    size_t words = 0;
+    for (char *p = data; *p; p++)
+        if (!isspace((unsigned char)*p) && (p == data || isspace((unsigned char)p[-1])))
+            words++;
+    size_t slots = 1;
+    while (slots < words + 1)
+        slots <<= 1;
+
+    // all strings fit in the pool, since it is as big as the file itself
+    struct user_directory *dir = calloc(1, sizeof(struct user_directory) +
+                                               slots * sizeof(struct user_slot) +
+                                               file_stat.st_size + 1);
+    dir->mask = slots - 1;
+    dir->file_stat = file_stat;
+    dir->pool = (char *)&dir->slots[slots];
+
+    size_t used = 0;
+    char *p = data;
+    while (1) {
+        // user name and password are the next two words in the file
+        char *user, *pw;
+        size_t user_len, pw_len;
+
+        while (isspace((unsigned char)*p)) p++;
+        user = p;
+        while (*p && !isspace((unsigned char)*p)) p++;
+        user_len = p - user;
+
+        while (isspace((unsigned char)*p)) p++;
+        pw = p;
+        while (*p && !isspace((unsigned char)*p)) p++;
+        pw_len = p - pw;
+
+        if (!user_len || !pw_len) break;
+        if (user_len > MAX_USERNAME_SIZE || pw_len > MAX_PASSWORD_SIZE) continue;
+
+        char *entry = dir->pool + used;
+        for (size_t i = 0; i < user_len; i++)
+            entry[i] = tolower((unsigned char)user[i]);
+        entry[user_len] = 0;
+
+        // as when the file was scanned, only the first entry for a user counts
+        uint32_t hash = user_hash(entry, user_len);
+        struct user_slot *slot = user_directory_find(dir, entry, user_len, hash);
+        if (slot->offset) continue;
+
+        memcpy(entry + user_len + 1, pw, pw_len);
+        entry[user_len + 1 + pw_len] = 0;
+        slot->hash = hash;
+        slot->offset = used + 1;
+        used += user_len + pw_len + 2;
+        dir->count++;
+    }
+
+    free(data);
+    return dir;
+}
+
+/** Loads the users file into memory, replacing any previously loaded
+ *  copy. Servers should call this function before forking workers, so
+ *  the directory is built once and shared by all of them. Lookups
+ *  also load the directory if it hasn't been loaded yet.
+ *
+ *  Returns: the number of users loaded, or -1 if the users file
+ *           cannot be read.
  */
-static FILE *user_file_list(void) {
-    static FILE *file_ptr = NULL;
-    if (!file_ptr)
-        file_ptr = fopen(USER_FILE_NAME, "r+");
-    if (file_ptr)
-        rewind(file_ptr);
-    return file_ptr;
+int load_user_directory(void) {
+    struct user_directory *dir = build_user_directory();
+    if (!dir) return -1;
+
+    free(user_directory);
+    user_directory = dir;
+    user_directory_checked = time(NULL);
+    return dir->count;
+}
+
+/** Internal function that returns the loaded user directory. At most
+ *  once per second, checks if the users file has changed, and if so
+ *  reloads it. A new directory is only swapped in once it is fully
+ *  built, so lookups see either the old or the new contents.
+ *
+ *  Returns: the user directory, or NULL if the file cannot be read.
+ */
+static struct user_directory *get_user_directory(void) {
+    time_t now = time(NULL);
+    struct stat file_stat;
+
+    if (!user_directory) {
+        load_user_directory();
+    } else if (now != user_directory_checked) {
+        user_directory_checked = now;
+        if (stat(USER_FILE_NAME, &file_stat) == 0 &&
+            (file_stat.st_ino != user_directory->file_stat.st_ino ||
+             file_stat.st_size != user_directory->file_stat.st_size ||
+             file_stat.st_mtim.tv_sec != user_directory->file_stat.st_mtim.tv_sec ||
+             file_stat.st_mtim.tv_nsec != user_directory->file_stat.st_mtim.tv_nsec))
+            load_user_directory();
+    }
+
+    return user_directory;
 }
 
 /** Checks if the user name is valid. If password is informed, also
- *  checks if the password matches the user name.
+ *  checks if the password matches the user name. User names are
+ *  compared case-insensitively.
  *  
  *  Parameters: username: Non-NULL name of the user to check.
  *              password: Unencrypted password to check. If NULL, will
@@ -61,18 +283,21 @@ static FILE *user_file_list(void) {
  *           otherwise.
  */
 int is_valid_user(const char *username, const char *password) {
-    FILE *file_ptr = user_file_list();
-    if (!file_ptr) return 0;
+    struct user_directory *dir = get_user_directory();
+    if (!dir) return 0;
 
-    char user_file[MAX_USERNAME_SIZE + 1];
-    char pw_file[MAX_PASSWORD_SIZE + 1];
-
-    while (fscanf(file_ptr, "%s%s", user_file, pw_file) == 2) {
-        if (!strcasecmp(username, user_file))
-            return password == NULL || !strcmp(password, pw_file);
+    char name[MAX_USERNAME_SIZE + 1];
+    size_t len;
+    for (len = 0; username[len]; len++) {
+        if (len == MAX_USERNAME_SIZE) return 0;
+        name[len] = tolower((unsigned char)username[len]);
     }
+    name[len] = 0;
 
-    return 0;
+    struct user_slot *slot = user_directory_find(dir, name, len, user_hash(name, len));
+    if (!slot->offset) return 0;
+
+    return password == NULL || !strcmp(password, dir->pool + slot->offset + len);
 }
 
 /** Creates a new, empty, list of users.
@@ -90,55 +315,741 @@ user_list_t create_user_list(void) {
  *                        be copied to a new buffer, so the caller is
  *                        free to use a string that will be modified
  *                        later.
+ *              arena: arena the entry is allocated from, so it is
+ *                     freed with the arena, or NULL to use malloc.
  */
-void add_user_to_list(user_list_t *list, const char *username) {
-    user_list_t new_list = malloc(sizeof(struct user_list));
-    new_list->user = strdup(username);
+void add_user_to_list(user_list_t *list, const char *username, arena_t arena) {
+    user_list_t new_list;
+    if (arena) {
+        new_list = arena_alloc(arena, sizeof(struct user_list));
+        new_list->user = arena_strdup(arena, username);
+    } else {
+        new_list = malloc(sizeof(struct user_list));
+        new_list->user = strdup(username);
+    }
+    new_list->status = 0;
+    new_list->in_arena = arena != NULL;
     new_list->next = *list;
     *list = new_list;
 }
 
-/** Frees all memory used by a list of users.
+/** Returns the next user in a list of users.
+ *
+ *  Parameters: list: current position in the list of users.
+ *
+ *  Returns: the remainder of the list after the current user, or NULL
+ *           if this is the last user.
+ */
+user_list_t get_user_list_next(user_list_t list) {
+    return list->next;
+}
+
+/** Returns the name of the user in the current position of a list.
+ *
+ *  Parameters: list: current position in the list of users.
+ *
+ *  Returns: Name of the user.
+ */
+const char *get_user_list_name(user_list_t list) {
+    return list->user;
+}
+
+/** Returns the result of the last call to save_user_mail for the user
+ *  in the current position of a list.
+ *
+ *  Parameters: list: current position in the list of users.
+ *
+ *  Returns: 0 if the message was delivered to the user, or an errno
+ *           value describing why it could not be delivered.
+ */
+int get_user_list_status(user_list_t list) {
+    return list->status;
+}
+
+/** Frees all memory used by a list of users. Entries allocated from
+ *  an arena are left to the arena.
  *
  * Parameters: list: list of users to be freed.
  */
 void destroy_user_list(user_list_t list) {
     while (list) {
         user_list_t next = list->next;
-        free(list->user);
-        free(list);
+        if (!list->in_arena) {
+            free(list->user);
+            free(list);
+        }
         list = next;
     }
 }
 
+/** Selects how mailboxes are stored: "files" (the default) keeps
+ *  one file per message, "segments" appends all messages of a mailbox
+ *  to a single segment file (see segment.c), and "compressed" does
+ *  the same with messages compressed at delivery. Compressed and
+ *  uncompressed messages can be read from any segment, but mailboxes
+ *  are not converted between files and segments, so the same kind of
+ *  storage should always be used.
+ *
+ *  Parameters: name: name of the storage.
+ *
+ *  Returns: 0 on success, -1 if the name is unknown.
+ */
+int set_mail_storage(const char *name) {
+    if (!strcmp(name, "files"))
+        mail_storage = MAIL_STORAGE_FILES;
+    else if (!strcmp(name, "segments"))
+        mail_storage = MAIL_STORAGE_SEGMENTS;
+    else if (!strcmp(name, "compressed"))
+        mail_storage = MAIL_STORAGE_SEGMENTS;
+    else
+        return -1;
+    mail_compression = !strcmp(name, "compressed");
+    return 0;
+}
+
+/** Selects where mailboxes are created: "flat" (the default) puts
+ *  every mailbox directly in the mail store, "hashed" spreads them in
+ *  two levels of directories named after a hash of the user name
+ *  (mail.store/ab/cd/<user>), and with file storage puts each message
+ *  in a subdirectory of its mailbox for the day it was delivered.
+ *
+ *  Mailboxes are found in either layout, so both servers keep working
+ *  while mailboxes are moved to the hashed layout by migrate_user_mail
+ *  (see mailmigrate.c), whichever layout they are told to create.
+ *
+ *  Parameters: name: name of the layout.
+ *
+ *  Returns: 0 on success, -1 if the name is unknown.
+ */
+int set_mail_layout(const char *name) {
+    if (!strcmp(name, "flat"))
+        mail_layout = MAIL_LAYOUT_FLAT;
+    else if (!strcmp(name, "hashed"))
+        mail_layout = MAIL_LAYOUT_HASHED;
+    else
+        return -1;
+    return 0;
+}
+
+/** Internal function that builds the path of a mailbox in a layout.
+ */
+static void mailbox_path(const char *username, int layout, char *path, size_t size) {
+    if (layout == MAIL_LAYOUT_HASHED) {
+        uint32_t hash = user_hash(username, strlen(username));
+        snprintf(path, size, MAIL_BASE_DIRECTORY "/%02x/%02x/%s", hash >> 24, (hash >> 16) & 0xff,
+                 username);
+    } else {
+        snprintf(path, size, MAIL_BASE_DIRECTORY "/%s", username);
+    }
+}
+
+/** Internal function that finds the directory of a mailbox: where it
+ *  exists, looking first in the selected layout, or where it should
+ *  be created in the selected layout.
+ */
+static void find_mailbox(const char *username, char *path, size_t size) {
+    struct stat dir_stat;
+
+    mailbox_path(username, mail_layout, path, size);
+    if (stat(path, &dir_stat) == 0)
+        return;
+    mailbox_path(username, !mail_layout, path, size);
+    if (stat(path, &dir_stat) == 0)
+        return;
+    mailbox_path(username, mail_layout, path, size);
+}
+
+/** Internal function that checks if a mailbox is no longer at a path,
+ *  because it was moved to another layout since it was found, and
+ *  then finds it again.
+ *
+ *  Returns: 1 if the mailbox was moved (mail_dir is then its new
+ *           path), 0 otherwise.
+ */
+static int mailbox_moved(const char *username, char *mail_dir, size_t size) {
+    char path[PATH_MAX];
+    int saved_errno = errno;
+
+    find_mailbox(username, path, sizeof(path));
+    errno = saved_errno;
+    if (!strcmp(path, mail_dir))
+        return 0;
+    snprintf(mail_dir, size, "%s", path);
+    return 1;
+}
+
+/** Internal function that returns the last component of a path: the
+ *  user name of a mailbox, or the name of a message without the
+ *  subdirectory of its day.
+ */
+static const char *path_base(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+/** Internal function that creates a mailbox directory, and the
+ *  directories above it, if they don't exist yet.
+ *
+ *  Returns: 0 if the directory exists, -1 otherwise.
+ */
+static int create_mail_dir(const char *mail_dir) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s", mail_dir);
+
+    for (char *slash = strchr(path, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(path, 0777);
+        *slash = '/';
+    }
+    return mkdir(path, 0777) == 0 || errno == EEXIST ? 0 : -1;
+}
+
+/** Opens the summaries of all mailboxes (see mailsummary.c), shared by
+ *  every process using the mail store, creating the mail store if it
+ *  doesn't exist yet. Must be called once, before any mailbox is
+ *  changed and before workers are forked, by every process that
+ *  delivers or deletes messages, so the summaries stay current.
+ *
+ *  Returns: 0 on success, -1 on error (summaries are then not used).
+ */
+int open_mail_summaries(void) {
+    if (create_mail_dir(MAIL_BASE_DIRECTORY) < 0)
+        return -1;
+    return mail_summary_open(MAIL_BASE_DIRECTORY "/" MAIL_SUMMARY_FILE_NAME);
+}
+
+/** Internal function that finds the subdirectory of a message in the
+ *  hashed layout, from the delivery time at the start of its name.
+ *
+ *  Returns: 0 on success, -1 if the name doesn't start with a time.
+ */
+static int mail_bucket(const char *name, char bucket[MAIL_BUCKET_SIZE]) {
+    char *end;
+    struct tm tm;
+    time_t t = strtol(name, &end, 10);
+
+    if (end == name || *end != '.' || !gmtime_r(&t, &tm))
+        return -1;
+    return strftime(bucket, MAIL_BUCKET_SIZE, "%Y%m%d", &tm) ? 0 : -1;
+}
+
+/** Internal function that finds a mailbox and opens its index (see
+ *  mail_index_open). A mailbox moved to another layout while waiting
+ *  for the lock is found again at its new path.
+ *
+ *  Returns: the index, or NULL if the mailbox or its index don't exist.
+ */
+static mail_index_t open_mailbox_index(const char *username, char *mail_dir, size_t size,
+                                       int exclusive) {
+    find_mailbox(username, mail_dir, size);
+    for (;;) {
+        mail_index_t idx = mail_index_open(mail_dir, exclusive);
+        if (idx && access(mail_dir, F_OK) == 0)
+            return idx;
+        if (idx)
+            mail_index_close(idx);
+        else if (!mailbox_moved(username, mail_dir, size))
+            return NULL;
+    }
+}
+
+/** Internal function that saves messages into a mailbox as one file
+ *  each, hard-linked to their temporary files. In the hashed layout,
+ *  a file is in the subdirectory of its day, which is part of the name
+ *  kept in the index.
+ */
+static int save_mailbox_files(const char *username, struct mail_delivery *messages, int count) {
+    static unsigned int counter = 0;
+    int failed = 0;
+    int64_t saved_size = 0;
+    char mail_dir[PATH_MAX];
+    char base_name[NAME_MAX + 1];
+    char mail_name[MAIL_BUCKET_SIZE + NAME_MAX + 1];
+    char mail_file[PATH_MAX + sizeof(mail_name) + 1];
+    char bucket[MAIL_BUCKET_SIZE];
+    struct timespec now;
+    struct stat file_stat;
+
+    // The mailbox is changed while holding the lock of its index, so
+    // that the new messages can be appended to it
+    mail_index_t idx = open_mailbox_index(username, mail_dir, sizeof(mail_dir), 1);
+    int current = idx && mail_index_is_current(idx);
+
+    for (int i = 0; i < count; i++) {
+        struct mail_delivery *message = &messages[i];
+        if (stat(message->filename, &file_stat) < 0)
+            file_stat.st_size = 0;
+
+        // Unique names follow the maildir convention: delivery time, process
+        // ID and a per-process counter, so a single link is normally enough
+        do {
+            clock_gettime(CLOCK_REALTIME, &now);
+            snprintf(base_name, sizeof(base_name), "%ld.M%06ldP%dQ%u" MAIL_HEADER_INFO "%zu" MAIL_FILE_SUFFIX,
+                     (long)now.tv_sec, now.tv_nsec / 1000, (int)getpid(), counter++,
+                     message->header_size);
+            if (mail_layout == MAIL_LAYOUT_HASHED && mail_bucket(base_name, bucket) == 0)
+                snprintf(mail_name, sizeof(mail_name), "%s/%s", bucket, base_name);
+            else
+                snprintf(mail_name, sizeof(mail_name), "%s", base_name);
+            snprintf(mail_file, sizeof(mail_file), "%s/%s", mail_dir, mail_name);
+            message->status = link(message->filename, mail_file) < 0 ? errno : 0;
+
+            if (message->status == ENOENT && access(message->filename, F_OK) == 0) {
+                // creates the mailbox and the subdirectory of the day
+                *strrchr(mail_file, '/') = '\0';
+                if (create_mail_dir(mail_file) == 0)
+                    message->status = EEXIST;  // try again
+            }
+        } while (message->status == EEXIST);
+
+        if (message->status)
+            failed++;
+        else if (current)
+            mail_index_append(idx, mail_name, file_stat.st_size);
+        if (!message->status)
+            saved_size += file_stat.st_size;
+    }
+
+    // a mailbox without a current index may have changed in other
+    // ways, so its summary is dropped rather than updated
+    if (current)
+        mail_summary_add(username, mail_storage, count - failed, saved_size);
+    else if (failed < count)
+        mail_summary_invalidate(username, mail_storage);
+    if (idx)
+        mail_index_close(idx);
+    return failed;
+}
+
+/** Internal function that saves messages by appending a copy of their
+ *  temporary files to the segment of a mailbox.
+ */
+static int save_mailbox_segments(const char *username, struct mail_delivery *messages, int count) {
+    int failed = 0, error = 0, created = 0;
+    int64_t saved_size = 0;
+    char mail_dir[PATH_MAX];
+    struct stat file_stat;
+
+    // a mailbox moved while waiting for the lock is still found
+    // through the directory that was locked
+    find_mailbox(username, mail_dir, sizeof(mail_dir));
+    segment_t seg;
+    while (!(seg = segment_open(mail_dir, 1)) && errno == ENOENT &&
+           mailbox_moved(username, mail_dir, sizeof(mail_dir)))
+        ;
+    if (!seg && errno == ENOENT && create_mail_dir(mail_dir) == 0) {
+        seg = segment_open(mail_dir, 1);
+        created = 1;
+    }
+    if (!seg)
+        error = errno;
+
+    for (int i = 0; i < count; i++) {
+        struct mail_delivery *message = &messages[i];
+        int fd = -1;
+
+        if (!(message->status = error)) {
+            fd = open(message->filename, O_RDONLY);
+            if (fd < 0 || fstat(fd, &file_stat) < 0)
+                message->status = errno;
+        }
+        if (!message->status) {
+            errno = EIO;  // for short writes, which don't set errno
+            if (segment_append(seg, fd, file_stat.st_size, message->header_size, mail_compression) < 0)
+                message->status = errno;
+        }
+
+        if (fd >= 0)
+            close(fd);
+        if (message->status)
+            failed++;
+        else
+            saved_size += file_stat.st_size;
+    }
+
+    if (created)
+        mail_summary_invalidate(username, mail_storage);
+    else
+        mail_summary_add(username, mail_storage, count - failed, saved_size);
+    if (seg)
+        segment_close(seg);
+    return failed;
+}
+
+/** Saves new email messages into the mailbox of a user, taking its
+ *  lock only once for all of them. Messages are stored as described
+ *  in save_user_mail, in the order given.
+ *
+ *  Parameters: username: Name of the user receiving the messages.
+ *              messages: Messages to be saved, each in a temporary
+ *                        file. The status of each is set to 0 if it
+ *                        was saved, or to the cause of the error.
+ *              count: Number of messages.
+ *
+ *  Returns: Number of messages that could not be saved.
+ */
+int save_mailbox_mail(const char *username, struct mail_delivery *messages, int count) {
+    if (mail_storage == MAIL_STORAGE_SEGMENTS)
+        return save_mailbox_segments(username, messages, count);
+    return save_mailbox_files(username, messages, count);
+}
+
 /** Saves a new email message into the mail storage for a list of
- *  users. This function uses hard links to create the files based on
- *  an existing temporary file. It assumes the temporary file is in
- *  the same file system as the newly created files. Typically, saving
- *  the temporary file in a local directory (where the executable is
- *  running) is enough for this to work.
+ *  users. With file storage, this function uses hard links to create
+ *  the files based on an existing temporary file. It assumes the
+ *  temporary file is in the same file system as the newly created
+ *  files. Typically, saving the temporary file in a local directory
+ *  (where the executable is running) is enough for this to work.
+ *  With segment storage, the message is copied into each mailbox,
+ *  and compressed for each of them if enabled (since each mailbox
+ *  has its own dictionary).
+ *
+ *  The result for each user is recorded in the list, and can be
+ *  retrieved with get_user_list_status.
+ *
+ *  The size of the headers is recorded with the message (in the name
+ *  of the file, or in the segment index), so the headers can be sent
+ *  without reading the message.
  *
  *  Parameters: basefile: Name of a temporary file containing the
  *                        contents of the email message.
+ *              header_size: Bytes up to the start of the message body.
  *              users: List of recipient users to the message.
+ *
+ *  Returns: Number of users the message could not be delivered to.
  */
-void save_user_mail(const char *basefile, user_list_t users) {
-    char mail_file[NAME_MAX + 1];
-
-    // Create base directory if it doesn't exist yet (error ignored)
-    mkdir(MAIL_BASE_DIRECTORY, 0777);
+int save_user_mail(const char *basefile, size_t header_size, user_list_t users) {
+    struct mail_delivery message = {.filename = basefile, .header_size = header_size};
+    int failed = 0;
 
     for (; users; users = users->next) {
-        // Create recipient directory if it doesn't exist yet (error ignored)
-        int i = 0;
-        sprintf(mail_file, MAIL_BASE_DIRECTORY "/%s", users->user);
-        mkdir(mail_file, 0777);
+        failed += save_mailbox_mail(users->user, &message, 1);
+        users->status = message.status;
+    }
+    return failed;
+}
 
-        // Tries to create a file called 0.mail, if it exists tries 1.mail, and so on
-        do {
-            sprintf(mail_file, MAIL_BASE_DIRECTORY "/%s/%d" MAIL_FILE_SUFFIX, users->user, i++);
-        } while (link(basefile, mail_file) < 0 && errno == EEXIST);
+/** Internal function that returns the list containing an item, based
+ *  on the position of the item in the list's array.
+ */
+static struct mail_list *mail_item_list(mail_item_t item) {
+    return (struct mail_list *)((char *)(item - item->index) - offsetof(struct mail_list, items));
+}
+
+/** Internal function that checks if the item at a position is marked
+ *  as deleted.
+ */
+static int is_mail_item_deleted(struct mail_list *list, unsigned int pos) {
+    return list->deleted[pos / 8] & (1 << (pos % 8));
+}
+
+/** Internal function that finds the file of a message that is no
+ *  longer where it was listed, because its mailbox was migrated to the
+ *  hashed layout since: the file is looked for in the current
+ *  directory of the mailbox, then in the subdirectory of its day.
+ *
+ *  Returns: the path of the file, stored in path, or NULL if it
+ *           doesn't exist.
+ */
+static const char *find_moved_mail_item(struct mail_list *list, mail_item_t item, char *path,
+                                        size_t size) {
+    char mail_dir[PATH_MAX], bucket[MAIL_BUCKET_SIZE];
+    const char *name = path_base(list->names + item->name_offset);
+
+    find_mailbox(path_base(list->names), mail_dir, sizeof(mail_dir));
+    if ((size_t)snprintf(path, size, "%s/%s", mail_dir, name) < size && access(path, F_OK) == 0)
+        return path;
+    if (mail_bucket(name, bucket) == 0 &&
+        (size_t)snprintf(path, size, "%s/%s/%s", mail_dir, bucket, name) < size &&
+        access(path, F_OK) == 0)
+        return path;
+    return NULL;
+}
+
+/** Internal function that opens the file of a message, with file
+ *  storage, wherever it is now.
+ */
+static int open_mail_file(struct mail_list *list, mail_item_t item) {
+    char path[PATH_MAX];
+    int fd = open(list->names + item->name_offset, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT && find_moved_mail_item(list, item, path, sizeof(path)))
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+    return fd;
+}
+
+/** Internal structure describing a message while a list is being
+ *  built, either from the mailbox index, from the directory or from
+ *  the segment.
+ */
+struct mail_entry {
+    size_t file_size;
+    size_t stored_size;
+    int compressed;
+    size_t header_size;  // MAIL_HEADER_UNKNOWN to take it from the name
+    off_t offset;
+    const char *name;    // file name relative to the mailbox directory, or unique ID
+};
+
+static int compare_mail_entries(const void *a, const void *b) {
+    return strcmp(path_base(((const struct mail_entry *)a)->name),
+                  path_base(((const struct mail_entry *)b)->name));
+}
+
+/** Internal function that creates a list of emails in a single
+ *  allocation. The pool of names starts with the mailbox directory,
+ *  followed by the full path of each message (or the directory and
+ *  the unique ID, for segments), then by the dictionary, if any. The
+ *  allocation is taken from arena unless it is NULL.
+ */
+static struct mail_list *create_mail_list(const char *dir, const struct mail_entry *entries,
+                                          size_t count, const char *dict, size_t dict_size,
+                                          arena_t arena) {
+    size_t dir_len = strlen(dir);
+    size_t names_size = dir_len + 1;
+    for (size_t i = 0; i < count; i++)
+        names_size += dir_len + strlen(entries[i].name) + 2;
+
+    size_t bitmap_size = (count + 7) / 8;
+    size_t size = sizeof(struct mail_list) + count * sizeof(struct mail_item) + bitmap_size +
+                  names_size + dict_size;
+    struct mail_list *list = arena ? arena_alloc(arena, size) : malloc(size);
+    if (!list)
+        return NULL;
+    list->in_arena = arena != NULL;
+    list->storage = MAIL_STORAGE_FILES;
+    list->data_fd = -1;
+    list->count = count;
+    list->live_count = count;
+    list->live_size = 0;
+    list->dir_len = dir_len;
+    list->deleted = (unsigned char *)&list->items[count];
+    list->names = (char *)list->deleted + bitmap_size;
+    memset(list->deleted, 0, bitmap_size);
+    list->dict = dict_size ? memcpy(list->names + names_size, dict, dict_size) : NULL;
+    list->dict_size = dict_size;
+
+    char *p = list->names;
+    memcpy(p, dir, dir_len + 1);
+    p += dir_len + 1;
+
+    for (size_t i = 0; i < count; i++) {
+        const char *info = strstr(entries[i].name, MAIL_HEADER_INFO);
+        list->items[i].file_size = entries[i].file_size;
+        list->items[i].stored_size = entries[i].stored_size;
+        list->items[i].compressed = entries[i].compressed;
+        list->items[i].header_size = entries[i].header_size;
+        if (entries[i].header_size == MAIL_HEADER_UNKNOWN && info)
+            list->items[i].header_size = strtoull(info + strlen(MAIL_HEADER_INFO), NULL, 10);
+        list->items[i].offset = entries[i].offset;
+        list->items[i].index = i;
+        list->items[i].name_offset = p - list->names;
+        list->live_size += entries[i].file_size;
+        p += sprintf(p, "%s/%s", dir, entries[i].name) + 1;
+    }
+    list->total_size = list->live_size;
+
+    return list;
+}
+
+/** Internal function that creates a list of emails from a mailbox
+ *  index.
+ */
+static struct mail_list *create_mail_list_from_index(const char *dir,
+                                                     const struct mail_index_record *records,
+                                                     size_t count, arena_t arena) {
+    struct mail_entry *entries = malloc((count + 1) * sizeof(struct mail_entry));
+    for (size_t i = 0; i < count; i++) {
+        entries[i].file_size = records[i].size;
+        entries[i].stored_size = records[i].size;
+        entries[i].compressed = 0;
+        entries[i].header_size = MAIL_HEADER_UNKNOWN;
+        entries[i].offset = 0;
+        entries[i].name = records[i].name;
+    }
+
+    struct mail_list *list = create_mail_list(dir, entries, count, NULL, 0, arena);
+    free(entries);
+    return list;
+}
+
+/** Internal structure collecting the messages found while scanning a
+ *  mailbox directory. Entries and names are collected in temporary
+ *  arrays, then copied into the list once the number of messages is
+ *  known.
+ */
+struct mail_scan {
+    struct mail_entry *entries;
+    size_t count, entries_size;
+    char *names;
+    size_t names_used, names_size;
+};
+
+/** Internal function that adds the messages of a directory to a scan.
+ *  In the mailbox directory itself (subdir NULL), subdirectories are
+ *  scanned as well, for the messages of the hashed layout.
+ */
+static void scan_mail_dir(struct mail_scan *scan, const char *dirname, const char *subdir) {
+    char path[PATH_MAX + NAME_MAX + 2];
+    char filename[PATH_MAX + 2 * NAME_MAX + 3];
+    struct stat file_stat;
+    struct dirent *dir_entry;
+    const size_t suflen = strlen(MAIL_FILE_SUFFIX);
+
+    if (subdir)
+        snprintf(path, sizeof(path), "%s/%s", dirname, subdir);
+    else
+        snprintf(path, sizeof(path), "%s", dirname);
+    DIR *dir = opendir(path);
+    if (!dir) return;
+
+    while ((dir_entry = readdir(dir)) != NULL) {
+        if (!subdir && dir_entry->d_type == DT_DIR && dir_entry->d_name[0] != '.') {
+            scan_mail_dir(scan, dirname, dir_entry->d_name);
+            continue;
+        }
+
+        size_t namelen = strlen(dir_entry->d_name);
+        if (dir_entry->d_type == DT_REG &&
+            namelen > suflen &&
+            !strcmp(dir_entry->d_name + namelen - suflen, MAIL_FILE_SUFFIX)) {
+            snprintf(filename, sizeof(filename), "%s/%s", path, dir_entry->d_name);
+            if (stat(filename, &file_stat) < 0)
+                continue;
+
+            // names are relative to the mailbox directory
+            size_t prefix = subdir ? strlen(subdir) + 1 : 0;
+            if (scan->names_used + prefix + namelen + 1 > scan->names_size) {
+                scan->names_size = scan->names_size * 2 + prefix + namelen + 1024;
+                scan->names = realloc(scan->names, scan->names_size);
+            }
+            if (scan->count == scan->entries_size) {
+                scan->entries_size = scan->entries_size * 2 + 16;
+                scan->entries = realloc(scan->entries, scan->entries_size * sizeof(struct mail_entry));
+            }
+
+            // the pool may still move, so only the offset is stored for now
+            struct mail_entry *entry = &scan->entries[scan->count++];
+            char *name = scan->names + scan->names_used;
+            if (subdir)
+                name += sprintf(name, "%s/", subdir);
+            memcpy(name, dir_entry->d_name, namelen + 1);
+            entry->file_size = file_stat.st_size;
+            entry->stored_size = file_stat.st_size;
+            entry->compressed = 0;
+            entry->header_size = MAIL_HEADER_UNKNOWN;
+            entry->offset = 0;
+            entry->name = (const char *)scan->names_used;
+            scan->names_used += prefix + namelen + 1;
+        }
+    }
+
+    closedir(dir);
+}
+
+/** Internal function that creates a list of emails by scanning the
+ *  mailbox directory, then rebuilds the mailbox index from this list.
+ *  Must be called with an exclusive lock on the index (if any).
+ */
+static struct mail_list *scan_user_mail(const char *dirname, mail_index_t idx, arena_t arena) {
+    struct mail_scan scan = { NULL, 0, 0, NULL, 0, 0 };
+
+    if (access(dirname, F_OK) < 0)
+        return NULL;
+    scan_mail_dir(&scan, dirname, NULL);
+
+    struct mail_entry *entries = scan.entries;
+    size_t count = scan.count;
+    char *names = scan.names;
+
+    for (size_t i = 0; i < count; i++)
+        entries[i].name = names + (size_t)entries[i].name;
+    qsort(entries, count, sizeof(struct mail_entry), compare_mail_entries);
+
+    struct mail_list *list = create_mail_list(dirname, entries, count, NULL, 0, arena);
+
+    if (idx) {
+        struct mail_index_record *records = calloc(count + 1, sizeof(struct mail_index_record));
+        size_t i;
+        for (i = 0; i < count; i++) {
+            if (strlen(entries[i].name) >= MAIL_INDEX_NAME_SIZE)
+                break;
+            strcpy(records[i].name, entries[i].name);
+            records[i].size = entries[i].file_size;
+        }
+        // names that don't fit in the index keep it stale, so the
+        // directory is always scanned for this mailbox
+        if (i == count)
+            mail_index_rebuild(idx, records, count);
+        free(records);
+    }
+
+    free(entries);
+    free(names);
+    return list;
+}
+
+/** Internal function that records the totals of a list as the
+ *  summary of its mailbox (see get_mail_summary). Must be called while
+ *  the list is still protected by the lock it was loaded with.
+ */
+static void save_mail_summary(const char *username, struct mail_list *list) {
+    if (list)
+        mail_summary_set(username, mail_storage, list->count, list->total_size);
+}
+
+/** Internal function that creates a list of emails from the segment
+ *  of a mailbox, skipping deleted messages. The list keeps its own
+ *  descriptor of the segment file, so it can still read messages
+ *  after the lock is released.
+ */
+static struct mail_list *load_segment_mail(const char *dirname, arena_t arena) {
+    segment_t seg = segment_open(dirname, 0);
+    if (!seg) return NULL;
+
+    size_t total, count = 0;
+    const struct segment_record *records = segment_records(seg, &total);
+    if (!records) {
+        segment_close(seg);
+        return NULL;
+    }
+
+    // unique IDs are at most 20 digits
+    struct mail_entry *entries = malloc((total + 1) * sizeof(struct mail_entry));
+    char *uids = malloc(total * 21 + 1);
+    for (size_t i = 0; i < total; i++) {
+        if (records[i].deleted)
+            continue;
+        entries[count].file_size = records[i].size;
+        entries[count].stored_size = records[i].stored_size;
+        entries[count].compressed = (records[i].flags & SEGMENT_COMPRESSED) != 0;
+        entries[count].header_size = records[i].header_size;
+        entries[count].offset = records[i].offset;
+        entries[count].name = uids + count * 21;
+        sprintf(uids + count * 21, "%llu", (unsigned long long)records[i].uid);
+        count++;
+    }
+
+    // the dictionary is only read if some message needs it
+    size_t dict_size = 0;
+    const char *dict = NULL;
+    for (size_t i = 0; i < count; i++) {
+        if (entries[i].compressed) {
+            dict = segment_dictionary(seg, &dict_size);
+            break;
+        }
+    }
+    struct mail_list *list = create_mail_list(dirname, entries, count, dict, dict_size, arena);
+    if (list) {
+        list->storage = MAIL_STORAGE_SEGMENTS;
+        if (segment_data_fd(seg) >= 0)
+            list->data_fd = fcntl(segment_data_fd(seg), F_DUPFD_CLOEXEC, 0);
+        save_mail_summary(path_base(dirname), list);
     }
+
+    segment_close(seg);
+    free(entries);
+    free(uids);
+    return list;
 }
 
 /** Creates a list of email messages for a username, based on existing
@@ -147,60 +1058,253 @@ void save_user_mail(const char *basefile, user_list_t users) {
  *  themselves are not kept in memory. If the user does not exist or
  *  does not have any messages, an empty list is returned.
  *
+ *  The list is normally read from the mailbox index with a single
+ *  mmap. If the index is missing or stale, the mailbox directory is
+ *  scanned and the index rebuilt; messages are then sorted by file
+ *  name, which corresponds to the delivery order. With segment
+ *  storage, the list is read from the segment index instead. The
+ *  mailbox may be in either layout (see set_mail_layout).
+ *
  *  Parameters: username: Name of the user whose email messages should
  *                        be retrieved.
+ *              arena: arena the list is allocated from, or NULL to use
+ *                     malloc. Temporary memory used while loading the
+ *                     list is always taken from malloc.
  *
  *  Returns: A mail_list_t object containing a list of email messages
  *           available for the provided username.
  */
-mail_list_t load_user_mail(const char *username) {
-    char filename[NAME_MAX + 1];
-    sprintf(filename, MAIL_BASE_DIRECTORY "/%s", username);
+mail_list_t load_user_mail(const char *username, arena_t arena) {
+    char dirname[PATH_MAX];
+    const struct mail_index_record *records;
+    struct mail_list *list;
+    size_t count;
 
-    DIR *dir = opendir(filename);
-    if (!dir) return NULL;
+    if (mail_storage == MAIL_STORAGE_SEGMENTS) {
+        find_mailbox(username, dirname, sizeof(dirname));
+        do {
+            if ((list = load_segment_mail(dirname, arena)))
+                return list;
+        } while (errno == ENOENT && mailbox_moved(username, dirname, sizeof(dirname)));
+        return NULL;
+    }
 
-    struct stat file_stat;
-    struct dirent *dir_entry;
+    mail_index_t idx = open_mailbox_index(username, dirname, sizeof(dirname), 0);
+    if (idx && (records = mail_index_records(idx, &count))) {
+        list = create_mail_list_from_index(dirname, records, count, arena);
+        save_mail_summary(username, list);
+        mail_index_close(idx);
+        return list;
+    }
+    if (idx)
+        mail_index_close(idx);
+
+    // The index needs to be rebuilt. Another process may have done it
+    // while waiting for the exclusive lock.
+    idx = open_mailbox_index(username, dirname, sizeof(dirname), 1);
+    if (idx && (records = mail_index_records(idx, &count)))
+        list = create_mail_list_from_index(dirname, records, count, arena);
+    else
+        list = scan_user_mail(dirname, idx, arena);
+
+    if (idx) {
+        save_mail_summary(username, list);
+        mail_index_close(idx);
+    }
+    return list;
+}
+
+/** Finds the number of messages in the mailbox of a user and their
+ *  total size, as load_user_mail would list them, without reading the
+ *  mailbox: the summary is recorded each time the mailbox is loaded,
+ *  and kept up to date by the functions saving and deleting messages.
+ *
+ *  Parameters: username: Name of the user whose mailbox is counted.
+ *              count: address where the number of messages is stored.
+ *              size: address where the total size is stored.
+ *
+ *  Returns: 0 on success, -1 if the mailbox has no summary (it has
+ *           to be loaded with load_user_mail, which records one).
+ */
+int get_mail_summary(const char *username, unsigned int *count, size_t *size) {
+    return mail_summary_get(username, mail_storage, count, size);
+}
+
+/** Removes the summary of a mailbox found to be stale (e.g., it did not
+ *  match the mailbox once loaded), so the next load_user_mail records
+ *  it again.
+ *
+ *  Parameters: username: Name of the user whose summary is removed.
+ */
+void invalidate_mail_summary(const char *username) {
+    mail_summary_invalidate(username, mail_storage);
+}
+
+/** Moves a mailbox from the flat layout to the hashed layout (see
+ *  set_mail_layout). With file storage, its messages are first moved
+ *  to the subdirectories of their days, and the index is rebuilt.
+ *
+ *  The mailbox is locked as for a delivery while it is moved, so the
+ *  servers can keep running: deliveries wait for the move and then
+ *  find the mailbox at its new path, and lists loaded before the move
+ *  still find their messages (see find_moved_mail_item). The storage
+ *  must be selected with set_mail_storage, as for the servers.
+ *
+ *  Parameters: username: Name of the user whose mailbox is moved.
+ *
+ *  Returns: 1 if the mailbox was moved, 0 if it is not in the flat
+ *           layout, -1 on error.
+ */
+int migrate_user_mail(const char *username) {
+    char flat[PATH_MAX], hashed[PATH_MAX], bucket[MAIL_BUCKET_SIZE];
+    char target[MAIL_BUCKET_SIZE + NAME_MAX + 1];
     const size_t suflen = strlen(MAIL_FILE_SUFFIX);
-    struct mail_list *list = NULL;
+    mail_index_t idx = NULL;
+    int rv = -1;
 
-    while ((dir_entry = readdir(dir)) != NULL) {
-        if (dir_entry->d_type == DT_REG &&
-            strlen(dir_entry->d_name) > suflen &&
-            !strcmp(dir_entry->d_name + strlen(dir_entry->d_name) - suflen, MAIL_FILE_SUFFIX)) {
-            struct mail_list *item = malloc(sizeof(struct mail_list));
-            sprintf(item->item.file_name, MAIL_BASE_DIRECTORY "/%s/%s", username, dir_entry->d_name);
+    mailbox_path(username, MAIL_LAYOUT_FLAT, flat, sizeof(flat));
+    mailbox_path(username, MAIL_LAYOUT_HASHED, hashed, sizeof(hashed));
 
-            if (stat(item->item.file_name, &file_stat) < 0) {
-                free(item);
-                continue;
-            }
+    // deliveries to segments lock the directory, deliveries to files
+    // lock the index
+    int dir_fd = open(flat, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0)
+        return errno == ENOENT || errno == ENOTDIR ? 0 : -1;
+    if (mail_storage == MAIL_STORAGE_SEGMENTS ? flock(dir_fd, LOCK_EX) < 0
+                                              : !(idx = mail_index_open(flat, 1)))
+        goto done;
 
-            item->item.file_size = file_stat.st_size;
-            item->item.deleted = 0;
-            item->next = list;
-            list = item;
+    if (mail_storage == MAIL_STORAGE_FILES) {
+        DIR *dir = fdopendir(dup(dir_fd));
+        struct dirent *dir_entry;
+        if (!dir)
+            goto done;
+        while ((dir_entry = readdir(dir)) != NULL) {
+            size_t namelen = strlen(dir_entry->d_name);
+            if (dir_entry->d_type != DT_REG || namelen <= suflen ||
+                strcmp(dir_entry->d_name + namelen - suflen, MAIL_FILE_SUFFIX) ||
+                mail_bucket(dir_entry->d_name, bucket) < 0)
+                continue;
+            snprintf(target, sizeof(target), "%s/%s", bucket, dir_entry->d_name);
+            if (mkdirat(dir_fd, bucket, 0777) < 0 && errno != EEXIST)
+                break;
+            if (renameat(dir_fd, dir_entry->d_name, dir_fd, target) < 0)
+                break;
         }
+        closedir(dir);
+        if (dir_entry)
+            goto done;
+        destroy_mail_list(scan_user_mail(flat, idx, NULL));
     }
 
-    closedir(dir);
-    return list;
+    *strrchr(hashed, '/') = '\0';
+    if (create_mail_dir(hashed) < 0)
+        goto done;
+    hashed[strlen(hashed)] = '/';
+    rv = rename(flat, hashed) == 0 ? 1 : -1;
+
+done:
+    if (idx)
+        mail_index_close(idx);
+    close(dir_fd);
+    return rv;
+}
+
+/** Internal function that marks the deleted messages of a list as
+ *  tombstones in the segment, and compacts the segment once enough of
+ *  it is used by deleted messages. Compaction only happens when the
+ *  dead space is at least as large as the live data, so its cost is
+ *  proportional to the data deleted since the last one.
+ */
+static void delete_segment_mail(struct mail_list *list) {
+    char mail_dir[PATH_MAX];
+
+    // the mailbox may have been moved to another layout since
+    find_mailbox(path_base(list->names), mail_dir, sizeof(mail_dir));
+    segment_t seg = segment_open(mail_dir, 1);
+    if (!seg) return;
+
+    uint64_t *uids = malloc((list->count - list->live_count) * sizeof(uint64_t));
+    uint64_t deleted_size;
+    size_t removed = 0;
+    for (unsigned int i = 0; i < list->count; i++) {
+        if (is_mail_item_deleted(list, i))
+            uids[removed++] = strtoull(list->names + list->items[i].name_offset + list->dir_len + 1, NULL, 10);
+    }
+
+    // messages already deleted by another session are not counted again
+    int deleted = segment_delete(seg, uids, removed, &deleted_size);
+    if (deleted < 0)
+        mail_summary_invalidate(path_base(list->names), mail_storage);
+    else
+        mail_summary_add(path_base(list->names), mail_storage, -deleted, -(int64_t)deleted_size);
+    if (deleted >= 0 && segment_needs_compaction(seg))
+        segment_compact(seg);
+
+    segment_close(seg);
+    free(uids);
 }
 
-/** Frees all memory used by a list of emails. Also deletes any files
- *  marked to be deleted.
+/** Frees all memory used by a list of emails, unless it was allocated
+ *  from an arena. Also deletes any messages marked to be deleted, and
+ *  removes them from the mailbox index.
  *
  *  Parameters: list: List of emails to be deleted.
  */
 void destroy_mail_list(mail_list_t list) {
-    while (list) {
-        if (list->item.deleted) unlink(list->item.file_name);
+    if (!list) return;
 
-        mail_list_t next = list->next;
-        free(list);
-        list = next;
+    if (list->storage == MAIL_STORAGE_SEGMENTS) {
+        if (list->live_count < list->count)
+            delete_segment_mail(list);
+        if (list->data_fd >= 0)
+            close(list->data_fd);
+
+    } else if (list->live_count < list->count) {
+        char **names = malloc((list->count - list->live_count) * sizeof(char *));
+        char mail_dir[PATH_MAX], path[PATH_MAX];
+        const char *username = path_base(list->names);
+        size_t removed = 0, unlinked = 0;
+        int64_t unlinked_size = 0;
+
+        mail_index_t idx = open_mailbox_index(username, mail_dir, sizeof(mail_dir), 1);
+        int current = idx && mail_index_is_current(idx);
+        size_t dir_len = strlen(mail_dir);
+
+        // names in the index are relative to the current directory of
+        // the mailbox, where the message may have been moved
+        for (unsigned int i = 0; i < list->count; i++) {
+            if (is_mail_item_deleted(list, i)) {
+                const char *filename = list->names + list->items[i].name_offset;
+                int rv = unlink(filename);
+                if (rv < 0 && errno == ENOENT &&
+                    (filename = find_moved_mail_item(list, &list->items[i], path, sizeof(path))))
+                    rv = unlink(filename);
+                if (rv == 0) {
+                    unlinked++;
+                    unlinked_size += list->items[i].file_size;
+                }
+                if (filename && !strncmp(filename, mail_dir, dir_len) && filename[dir_len] == '/')
+                    names[removed++] = strdup(filename + dir_len + 1);
+            }
+        }
+
+        // messages already deleted by another session are not counted again
+        if (current) {
+            mail_index_remove(idx, (const char **)names, removed);
+            mail_summary_add(username, mail_storage, -(int64_t)unlinked, -unlinked_size);
+        } else {
+            mail_summary_invalidate(username, mail_storage);
+        }
+        if (idx)
+            mail_index_close(idx);
+        for (size_t i = 0; i < removed; i++)
+            free(names[i]);
+        free(names);
     }
+
+    if (!list->in_arena)
+        free(list);
 }
 
 /** Returns the number of email messages available in a list of
@@ -211,12 +1315,7 @@ void destroy_mail_list(mail_list_t list) {
  *  Returns: Number of non-deleted messages in list.
  */
 unsigned int get_mail_count(mail_list_t list) {
-    unsigned int rv = 0;
-    while (list) {
-        if (!list->item.deleted) rv++;
-        list = list->next;
-    }
-    return rv;
+    return list ? list->live_count : 0;
 }
 
 /** Returns the email message object at a specific position in a list
@@ -238,13 +1337,9 @@ unsigned int get_mail_count(mail_list_t list) {
  *           deleted.
  */
 mail_item_t get_mail_item(mail_list_t list, unsigned int pos) {
-    while (list) {
-        if (!pos--)
-            return list->item.deleted ? NULL : &list->item;
-        list = list->next;
-    }
-
-    return NULL;
+    if (!list || pos >= list->count || is_mail_item_deleted(list, pos))
+        return NULL;
+    return &list->items[pos];
 }
 
 /** Returns the total amount of bytes in all email messages in a list
@@ -255,36 +1350,130 @@ mail_item_t get_mail_item(mail_list_t list, unsigned int pos) {
  *  Returns: Total size for all non-deleted messages in list.
  */
 size_t get_mail_list_size(mail_list_t list) {
-    size_t rv = 0;
-    while (list) {
-        rv += list->item.deleted ? 0 : list->item.file_size;
-        list = list->next;
-    }
-    return rv;
+    return list ? list->live_size : 0;
 }
 
 /** Returns the total amount of bytes in an email message.
  *
  *  Parameters: item: Email message to be assessed.
  *
- *  Returns: Size, in bytes, of an email message.
+ *  Returns: Size, in bytes, of an email message (once decompressed,
+ *           if it is stored compressed).
  */
 size_t get_mail_item_size(mail_item_t item) {
     return item->file_size;
 }
 
-/** Returns the name of the file containing the contents of an email
- *  message. The name is returned as a string that should not be
- *  modified by the caller, as it is used in the internal
- *  representation of the email item. It will remain valid and
- *  unmodified until the list of emails containing it is destroyed.
+/** Opens the contents of an email message for reading. The message
+ *  is found in the returned file at the given offset, with the size
+ *  returned by get_mail_item_size; the file may contain other
+ *  messages (with segment storage), so it should only be read with
+ *  functions that take an offset, like pread or send_file.
+ *
+ *  Parameters: item: Email message to be read.
+ *              offset: address where the position of the message in
+ *                      the file is stored.
+ *
+ *  Returns: A file descriptor, to be closed by the caller, or -1 if
+ *           the message cannot be opened.
+ */
+int open_mail_item(mail_item_t item, off_t *offset) {
+    struct mail_list *list = mail_item_list(item);
+    *offset = item->offset;
+    if (list->storage == MAIL_STORAGE_SEGMENTS)
+        return list->data_fd >= 0 ? fcntl(list->data_fd, F_DUPFD_CLOEXEC, 0) : -1;
+    return open_mail_file(list, item);
+}
+
+/** Checks if an email message is stored compressed. Such messages
+ *  cannot be read from the file returned by open_mail_item, but with
+ *  open_mail_item_decompressor.
+ *
+ *  Parameters: item: Email message to be assessed.
+ *
+ *  Returns: non-zero if the message is compressed.
+ */
+int is_mail_item_compressed(mail_item_t item) {
+    return item->compressed;
+}
+
+/** Starts reading the contents of an email message stored compressed,
+ *  which are decompressed as they are read (see decompressor_read).
+ *  The size returned by get_mail_item_size is the size of the
+ *  decompressed message.
+ *
+ *  Parameters: item: Email message to be read, which must stay in
+ *                    its list until the decompressor is closed.
+ *
+ *  Returns: A decompressor_t object, to be closed by the caller
+ *           with decompressor_close, or NULL on error.
+ */
+decompressor_t open_mail_item_decompressor(mail_item_t item) {
+    struct mail_list *list = mail_item_list(item);
+    if (!item->compressed || list->data_fd < 0)
+        return NULL;
+    return decompressor_open(list->data_fd, item->offset, item->stored_size, list->dict,
+                             list->dict_size);
+}
+
+/** Returns the unique ID of an email message, assigned when it was
+ *  delivered. The ID is the file name without the directory, the
+ *  header information and the suffix (or the ID of the message in
+ *  its segment), and does not change while the message exists, even
+ *  if it is moved to the subdirectory of its day (as needed by the
+ *  POP3 UIDL command).
  *
  *  Parameters: item: Email message to be assessed.
+ *              length: address where the length of the ID is stored.
  *
- *  Returns: Name of the file containing the email contents.
+ *  Returns: Start of the ID, which is not null-terminated.
  */
-const char *get_mail_item_filename(mail_item_t item) {
-    return item->file_name;
+const char *get_mail_item_uid(mail_item_t item, size_t *length) {
+    struct mail_list *list = mail_item_list(item);
+    const char *uid = path_base(list->names + item->name_offset);
+    const char *info = strchr(uid, ',');
+    if (list->storage == MAIL_STORAGE_SEGMENTS)
+        *length = strlen(uid);
+    else
+        *length = info ? (size_t)(info - uid) : strlen(uid) - strlen(MAIL_FILE_SUFFIX);
+    return uid;
+}
+
+/** Returns the size of the headers of an email message, including
+ *  the empty line that separates them from the body. For messages
+ *  delivered before the size was recorded in the file name, the
+ *  headers are read from the file the first time (the size is always
+ *  recorded with segment storage).
+ *
+ *  Parameters: item: Email message to be assessed.
+ *
+ *  Returns: Offset of the body in the file, or the size of the whole
+ *           message if it has no body.
+ */
+size_t get_mail_item_header_size(mail_item_t item) {
+    if (item->header_size == MAIL_HEADER_UNKNOWN) {
+        char buf[4096];
+        size_t offset = 0;
+        int match = 2, fd = open_mail_file(mail_item_list(item), item);
+        ssize_t rv;
+
+        item->header_size = item->file_size;
+        while (fd >= 0 && (rv = pread(fd, buf, sizeof(buf), offset)) > 0) {
+            // same search as the spool does at delivery
+            for (ssize_t i = 0; i < rv; i++) {
+                match = buf[i] == (match % 2 ? '\n' : '\r') ? match + 1 : buf[i] == '\r';
+                if (match == 4) {
+                    item->header_size = offset + i + 1;
+                    break;
+                }
+            }
+            if (match == 4) break;
+            offset += rv;
+        }
+        if (fd >= 0)
+            close(fd);
+    }
+    return item->header_size;
 }
 
 /** Marks a message as deleted in the internal email list. Does not
@@ -295,7 +1484,13 @@ const char *get_mail_item_filename(mail_item_t item) {
  *  Parameters: item: Email message to be marked as deleted.
  */
 void mark_mail_item_deleted(mail_item_t item) {
-    item->deleted = 1;
+    struct mail_list *list = mail_item_list(item);
+    if (is_mail_item_deleted(list, item->index))
+        return;
+
+    list->deleted[item->index / 8] |= 1 << (item->index % 8);
+    list->live_count--;
+    list->live_size -= item->file_size;
 }
 
 /** Marks all deleted messages in a list as no longer deleted.
@@ -305,13 +1500,51 @@ void mark_mail_item_deleted(mail_item_t item) {
  *  Returns: Number of recovered messages.
  */
 unsigned int reset_mail_list_deleted_flag(mail_list_t list) {
-    unsigned int rv = 0;
+    if (!list) return 0;
 
-    while (list) {
-        rv += list->item.deleted;
-        list->item.deleted = 0;
-        list = list->next;
-    }
+    unsigned int rv = list->count - list->live_count;
 
+    memset(list->deleted, 0, (list->count + 7) / 8);
+    list->live_count = list->count;
+    list->live_size = list->total_size;
     return rv;
 }
+
+/** Removes the last messages of a list, so that it only holds the
+ *  ones it had when an earlier count was taken (see get_mail_summary);
+ *  messages delivered since are left in the mailbox. Only messages kept
+ *  in the list can be deleted when it is destroyed.
+ *
+ *  The messages kept must add up to the size taken with the count.
+ *  If they do not (or the list has fewer messages), the count did not
+ *  describe the start of this list, and the list is left unchanged.
+ *
+ *  Parameters: list: Email list to be truncated.
+ *              count: Number of messages kept, from the start.
+ *              size: Total size of the messages kept.
+ *
+ *  Returns: 0 on success, -1 if the count and size do not match the
+ *           list.
+ */
+int truncate_mail_list(mail_list_t list, unsigned int count, size_t size) {
+    size_t prefix = 0;
+
+    if (!list)
+        return count == 0 && size == 0 ? 0 : -1;
+    if (count > list->count)
+        return -1;
+    for (unsigned int i = 0; i < count; i++)
+        prefix += list->items[i].file_size;
+    if (prefix != size)
+        return -1;
+
+    for (unsigned int i = count; i < list->count; i++) {
+        list->total_size -= list->items[i].file_size;
+        if (!is_mail_item_deleted(list, i)) {
+            list->live_count--;
+            list->live_size -= list->items[i].file_size;
+        }
+    }
+    list->count = count;
+    return 0;
+}
@@ -5,32 +5,68 @@
 #ifndef _USER_H_
 #define _USER_H_
 
+#include "arena.h"
+#include "compress.h"
+
 #include <stdio.h>
+#include <sys/types.h>
 
 #define MAX_USERNAME_SIZE 255
 #define MAX_PASSWORD_SIZE 255
 
+#define MAIL_BASE_DIRECTORY "mail.store"
+
+#define MAIL_STORAGE_FILES 0     // one file per message
+#define MAIL_STORAGE_SEGMENTS 1  // one append-only segment per mailbox (possibly compressed)
+
+#define MAIL_LAYOUT_FLAT 0    // mail.store/<user>
+#define MAIL_LAYOUT_HASHED 1  // mail.store/ab/cd/<user>, messages in daily subdirectories
+
+/** A message to be saved by save_mailbox_mail, with the result.
+ */
+struct mail_delivery {
+    const char *filename;  // temporary file containing the message
+    size_t header_size;    // bytes up to the start of the body
+    int status;            // set to 0 if saved, or to the cause of the error
+};
+
 typedef struct user_list *user_list_t;
 typedef struct mail_item *mail_item_t;
 typedef struct mail_list *mail_list_t;
 
+int load_user_directory(void);
 int is_valid_user(const char *username, const char *password);
 
 user_list_t create_user_list(void);
-void add_user_to_list(user_list_t *list, const char *username);
+void add_user_to_list(user_list_t *list, const char *username, arena_t arena);
 void destroy_user_list(user_list_t list);
+user_list_t get_user_list_next(user_list_t list);
+const char *get_user_list_name(user_list_t list);
+int get_user_list_status(user_list_t list);
 
-void save_user_mail(const char *basefile, user_list_t users);
-mail_list_t load_user_mail(const char *username);
+int set_mail_storage(const char *name);
+int set_mail_layout(const char *name);
+int open_mail_summaries(void);
+int migrate_user_mail(const char *username);
+int save_user_mail(const char *basefile, size_t header_size, user_list_t users);
+int save_mailbox_mail(const char *username, struct mail_delivery *messages, int count);
+mail_list_t load_user_mail(const char *username, arena_t arena);
+int get_mail_summary(const char *username, unsigned int *count, size_t *size);
+void invalidate_mail_summary(const char *username);
 
 void destroy_mail_list(mail_list_t list);
 unsigned int get_mail_count(mail_list_t list);
 mail_item_t get_mail_item(mail_list_t list, unsigned int pos);
 size_t get_mail_list_size(mail_list_t list);
 unsigned int reset_mail_list_deleted_flag(mail_list_t list);
+int truncate_mail_list(mail_list_t list, unsigned int count, size_t size);
 
 size_t get_mail_item_size(mail_item_t item);
-const char *get_mail_item_filename(mail_item_t item);
+int open_mail_item(mail_item_t item, off_t *offset);
+int is_mail_item_compressed(mail_item_t item);
+decompressor_t open_mail_item_decompressor(mail_item_t item);
+const char *get_mail_item_uid(mail_item_t item, size_t *length);
+size_t get_mail_item_header_size(mail_item_t item);
 void mark_mail_item_deleted(mail_item_t item);
 
 #endif